@@ -1,17 +1,27 @@
 #include "common.hlsl"
 
+// Features, set by the renderer per variant:
+// ALBEDO_TEXTURE: samples the material's albedo texture, left out for materials without one.
+
+// RDPackedVertex, see vertex_format.h.
 struct Vertex {
-    float3 pos;
-    float3 norm;
-    float2 uv;
+    uint position_xy;
+    uint position_z;
+    uint normal;
+    uint uv;
+};
+
+struct Instance {
+    float4x4 transform;
+    float4 position_offset;
+    float4 position_scale;
 };
 
 cbuffer Constants : register(b0, space0)
 {
     uint camera_addr;
     uint vbuffer_addr;
-    uint ibuffer_addr;
-    uint transform_addr;
+    uint instance_addr;
     uint material_addr;
 }
 
@@ -21,20 +31,38 @@ struct VSOut {
     float2 uv : UV;
 };
 
+float3 decode_octahedral(uint packed) {
+    float2 e = float2(int(packed << 16) >> 16, int(packed) >> 16) / 32767.0f;
+    e = max(e, -1.0f);
+
+    float3 v = float3(e, 1.0f - abs(e.x) - abs(e.y));
+    float t = saturate(-v.z);
+    v.x += v.x >= 0.0f ? -t : t;
+    v.y += v.y >= 0.0f ? -t : t;
+
+    return normalize(v);
+}
+
 VSOut vs_main(uint vertex_id : SV_VertexID) {
     ConstantBuffer<Matrix> camera = ResourceDescriptorHeap[camera_addr];
     StructuredBuffer<Vertex> vbuffer = ResourceDescriptorHeap[vbuffer_addr];
-    StructuredBuffer<uint> ibuffer = ResourceDescriptorHeap[ibuffer_addr];
-    ConstantBuffer<Matrix> transform = ResourceDescriptorHeap[transform_addr];
+    ConstantBuffer<Instance> instance = ResourceDescriptorHeap[instance_addr];
+
+    // Indexed draw, so vertex_id is the index buffer value.
+    Vertex vertex = vbuffer[vertex_id];
 
-    Vertex vertex = vbuffer[ibuffer[vertex_id]];
+    float3 quantized_pos = float3(vertex.position_xy & 0xffff, vertex.position_xy >> 16, vertex.position_z & 0xffff);
+    float3 pos = quantized_pos * instance.position_scale.xyz + instance.position_offset.xyz;
 
-    float4 world_space_pos = mul(transform.m, float4(vertex.pos, 1.0f));
+    float3 normal = decode_octahedral(vertex.normal);
+    float2 uv = float2(f16tof32(vertex.uv), f16tof32(vertex.uv >> 16));
+
+    float4 world_space_pos = mul(instance.transform, float4(pos, 1.0f));
 
     VSOut vso;
     vso.sv_pos = mul(camera.m, world_space_pos);
-    vso.normal = normalize(mul((float3x3)transform.m, vertex.norm));
-    vso.uv = vertex.uv;
+    vso.normal = normalize(mul((float3x3)instance.transform, normal));
+    vso.uv = uv;
 
     return vso;
 }
@@ -52,8 +80,13 @@ struct PSOut {
 PSOut ps_main(VSOut surface)
 {
 	ConstantBuffer<Material> material = ResourceDescriptorHeap[material_addr];
+
+#if ALBEDO_TEXTURE
 	Texture2D<float3> albedo_texture = ResourceDescriptorHeap[material.albedo_texture_addr];
 	float3 albedo = material.albedo_factor * pow(albedo_texture.Sample(linear_wrap_sampler, surface.uv), 2.0f);
+#else
+	float3 albedo = material.albedo_factor;
+#endif
 
     PSOut pso;
     pso.albedo = float4(albedo, 0.0f);
@@ -1,5 +1,9 @@
 #include "common.hlsl"
 
+// Features, set by the renderer per variant:
+// POINT_LIGHTS: shades with the clustered point lights.
+// DIRECTIONAL_LIGHTS: shades with the directional lights.
+
 cbuffer RootConstants : register(b0, space0)
 {
     uint albedo_texture_addr;
@@ -20,11 +24,28 @@ struct PointLight {
 	float3 intensity;
 };
 
+struct ClusterRange {
+	uint offset;
+	uint count;
+};
+
+// Point lights are binned on the CPU into a froxel grid: screen tiles, split in depth by exponential slices.
 struct LightsInfo {
 	uint num_point_lights;
 	uint num_directional_lights;
 	uint point_lights_addr;
 	uint directional_lights_addr;
+
+	uint cluster_ranges_addr;
+	uint cluster_light_indices_addr;
+	float slice_scale;
+	float slice_bias;
+
+	float4 depth_plane;
+
+	uint cluster_count_x;
+	uint cluster_count_y;
+	uint cluster_count_z;
 };
 
 float3 ACESFilm(float3 x)
@@ -54,6 +75,8 @@ void cs_main(uint3 thread_id : SV_DispatchThreadID)
         ConstantBuffer<LightsInfo> lights_info = ResourceDescriptorHeap[lights_info_addr];
         StructuredBuffer<PointLight> point_lights = ResourceDescriptorHeap[lights_info.point_lights_addr];
         StructuredBuffer<DirectionalLight> directional_lights = ResourceDescriptorHeap[lights_info.directional_lights_addr];
+        StructuredBuffer<ClusterRange> cluster_ranges = ResourceDescriptorHeap[lights_info.cluster_ranges_addr];
+        StructuredBuffer<uint> cluster_light_indices = ResourceDescriptorHeap[lights_info.cluster_light_indices_addr];
 
         float3 albedo = albedo_texture[thread_id.xy];
         float depth = depth_texture[thread_id.xy];
@@ -74,8 +97,19 @@ void cs_main(uint3 thread_id : SV_DispatchThreadID)
 
         float3 diffuse_light = 0.0f.xxx;
 
-        for (uint i = 0; i < lights_info.num_point_lights; ++i) {
-            PointLight light = point_lights[i];
+#if POINT_LIGHTS
+        // max() also catches the NaN positions of background pixels.
+        float view_depth = max(dot(lights_info.depth_plane.xyz, position_world_space.xyz) + lights_info.depth_plane.w, 1e-4f);
+        int slice = (int)floor(log(view_depth) * lights_info.slice_scale + lights_info.slice_bias);
+
+        uint cluster_x = min(thread_id.x * lights_info.cluster_count_x / output_width, lights_info.cluster_count_x - 1);
+        uint cluster_y = min(thread_id.y * lights_info.cluster_count_y / output_height, lights_info.cluster_count_y - 1);
+        uint cluster_z = (uint)clamp(slice, 0, (int)lights_info.cluster_count_z - 1);
+
+        ClusterRange cluster = cluster_ranges[(cluster_z * lights_info.cluster_count_y + cluster_y) * lights_info.cluster_count_x + cluster_x];
+
+        for (uint i = 0; i < cluster.count; ++i) {
+            PointLight light = point_lights[cluster_light_indices[cluster.offset + i]];
 
             float3 to_light = light.position - position_world_space.xyz;		
             float distance = length(to_light);
@@ -88,12 +122,15 @@ void cs_main(uint3 thread_id : SV_DispatchThreadID)
                 diffuse_light += max(dot(light_dir, normal), 0.0f) * light.intensity * attenuation;
             }
         }
+#endif
 
-        for (i = 0; i < lights_info.num_directional_lights; ++i) {
-            DirectionalLight light = directional_lights[i];
+#if DIRECTIONAL_LIGHTS
+        for (uint j = 0; j < lights_info.num_directional_lights; ++j) {
+            DirectionalLight light = directional_lights[j];
             float3 light_dir = normalize(light.direction);		
             diffuse_light += max(dot(light_dir, normal), 0.0f) * light.intensity;
         }
+#endif
 
         float3 ambient_light = 0.01f.xxx;
         float3 hdr = albedo * (diffuse_light + ambient_light);
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+
+#include "batching.h"
+#include "vertex_format.h"
+#include "profiler.h"
+
+struct BatchKey {
+    u32 material;
+    i32 cell[3];
+    u32 instance;
+};
+
+static int compare_batch_keys(const void* a, const void* b) {
+    BatchKey* x = (BatchKey*)a;
+    BatchKey* y = (BatchKey*)b;
+
+    if (x->material != y->material) {
+        return x->material < y->material ? -1 : 1;
+    }
+
+    for (u32 k = 0; k < 3; ++k) {
+        if (x->cell[k] != y->cell[k]) {
+            return x->cell[k] < y->cell[k] ? -1 : 1;
+        }
+    }
+
+    // Keeps instances in scene order within a cell, so batches come out the same on every load.
+    return x->instance < y->instance ? -1 : (x->instance > y->instance ? 1 : 0);
+}
+
+static bool same_group(BatchKey* a, BatchKey* b) {
+    return a->material == b->material && a->cell[0] == b->cell[0] && a->cell[1] == b->cell[1] && a->cell[2] == b->cell[2];
+}
+
+static void merge_batch(Arena* arena, BatchSource* sources, BatchInstance* instances, BatchKey* keys, u32 key_count, StaticBatch* batch) {
+    Scratch scratch = get_scratch(arena);
+
+    u32 vertex_count = 0;
+    u32 index_count = 0;
+
+    for (u32 i = 0; i < key_count; ++i) {
+        BatchSource* source = &sources[instances[keys[i].instance].source];
+        vertex_count += source->vertex_count;
+        index_count += source->index_count;
+    }
+
+    batch->material = keys[0].material;
+    batch->instance_count = key_count;
+    batch->vertex_count = vertex_count;
+    batch->index_count = index_count;
+    batch->vertices = arena->push_array<RDPackedVertex>(vertex_count);
+    batch->indices = arena->push_array<u32>(index_count);
+
+    XMFLOAT3* positions = scratch->push_array<XMFLOAT3>(vertex_count);
+    XMVECTOR aabb_min = XMVectorReplicate(FLT_MAX);
+    XMVECTOR aabb_max = XMVectorReplicate(-FLT_MAX);
+
+    u32 vertex_offset = 0;
+    u32 index_offset = 0;
+
+    for (u32 i = 0; i < key_count; ++i) {
+        BatchInstance* instance = &instances[keys[i].instance];
+        BatchSource* source = &sources[instance->source];
+
+        // Normals go through the inverse transpose so they stay perpendicular under non-uniform scale.
+        XMMATRIX normal_transform = XMMatrixTranspose(XMMatrixInverse(0, instance->transform));
+
+        for (u32 v = 0; v < source->vertex_count; ++v) {
+            RDPackedVertex* in = &source->vertices[v];
+            RDPackedVertex* out = &batch->vertices[vertex_offset + v];
+
+            XMFLOAT3 local_position = unpack_position(in, &source->quantization);
+            XMVECTOR position = XMVector3Transform(XMLoadFloat3(&local_position), instance->transform);
+            XMStoreFloat3(&positions[vertex_offset + v], position);
+
+            aabb_min = XMVectorMin(aabb_min, position);
+            aabb_max = XMVectorMax(aabb_max, position);
+
+            XMFLOAT3 local_normal = unpack_normal(in);
+            XMFLOAT3 normal;
+            XMStoreFloat3(&normal, XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&local_normal), normal_transform)));
+            pack_normal(out, normal);
+
+            out->uv[0] = in->uv[0];
+            out->uv[1] = in->uv[1];
+        }
+
+        // A mirroring transform turns triangles inside out, so their winding is flipped back.
+        bool flip = XMVectorGetX(XMMatrixDeterminant(instance->transform)) < 0.0f;
+
+        for (u32 j = 0; j < source->index_count; j += 3) {
+            u32* out = &batch->indices[index_offset + j];
+            out[0] = vertex_offset + source->indices[j + 0];
+            out[1] = vertex_offset + source->indices[j + (flip ? 2 : 1)];
+            out[2] = vertex_offset + source->indices[j + (flip ? 1 : 2)];
+        }
+
+        vertex_offset += source->vertex_count;
+        index_offset += source->index_count;
+    }
+
+    XMFLOAT3 batch_min, batch_max;
+    XMStoreFloat3(&batch_min, aabb_min);
+    XMStoreFloat3(&batch_max, aabb_max);
+
+    batch->quantization = quantization_from_bounds(batch_min, batch_max);
+    pack_positions(batch->vertices, vertex_count, positions, sizeof(XMFLOAT3), &batch->quantization);
+}
+
+u32 build_static_batches(Arena* arena, BatchSource* sources, u32 instance_count, BatchInstance* instances, bool* batched, StaticBatch* batches) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(arena);
+
+    BatchKey* keys = scratch->push_array<BatchKey>(instance_count);
+    u32 key_count = 0;
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        BatchInstance* instance = &instances[i];
+        BatchSource* source = &sources[instance->source];
+
+        batched[i] = false;
+
+        if (source->index_count == 0 || source->index_count / 3 > BATCH_MAX_SOURCE_TRIANGLES || source->vertex_count > BATCH_MAX_VERTICES) {
+            continue;
+        }
+
+        // Center of the quantized box, which is the mesh's bounding box.
+        RDMeshQuantization* q = &source->quantization;
+        XMVECTOR local_center = XMLoadFloat3(&q->position_offset) + XMLoadFloat3(&q->position_scale) * 32767.5f;
+        XMVECTOR cell = XMVectorFloor(XMVector3Transform(local_center, instance->transform) / BATCH_CELL_SIZE);
+
+        BatchKey* key = &keys[key_count++];
+        key->material = instance->material;
+        key->cell[0] = (i32)XMVectorGetX(cell);
+        key->cell[1] = (i32)XMVectorGetY(cell);
+        key->cell[2] = (i32)XMVectorGetZ(cell);
+        key->instance = i;
+    }
+
+    qsort(keys, key_count, sizeof(BatchKey), compare_batch_keys);
+
+    u32 batch_count = 0;
+    u32 begin = 0;
+
+    while (begin < key_count) {
+        // Take instances from the group until the next one would overflow the vertex budget.
+        u32 end = begin;
+        u32 vertex_count = 0;
+
+        while (end < key_count && same_group(&keys[begin], &keys[end])) {
+            u32 source_vertex_count = sources[instances[keys[end].instance].source].vertex_count;
+
+            if (vertex_count + source_vertex_count > BATCH_MAX_VERTICES) {
+                break;
+            }
+
+            vertex_count += source_vertex_count;
+            end++;
+        }
+
+        if (end - begin >= 2) {
+            merge_batch(arena, sources, instances, &keys[begin], end - begin, &batches[batch_count++]);
+
+            for (u32 i = begin; i < end; ++i) {
+                batched[keys[i].instance] = true;
+            }
+        }
+
+        begin = end;
+    }
+
+    return batch_count;
+}
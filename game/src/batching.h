@@ -0,0 +1,48 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "renderer.h"
+
+// Static instances are merged with others of the same material whose bounds center falls in the same cube of this size.
+#define BATCH_CELL_SIZE 16.0f
+
+// Bigger meshes keep their own instance, where they still get occluder geometry and their draw is worth its overhead.
+#define BATCH_MAX_SOURCE_TRIANGLES 1024
+
+// Keeps merged meshes on 16 bit indices. A cell that needs more is split into several batches.
+#define BATCH_MAX_VERTICES 65536
+
+// A mesh as loaded, before it is placed anywhere.
+struct BatchSource {
+    RDPackedVertex* vertices;
+    u32 vertex_count;
+    RDMeshQuantization quantization;
+    u32* indices;
+    u32 index_count;
+};
+
+// source indexes the sources. Only instances with the same material are merged.
+struct BatchInstance {
+    u32 source;
+    u32 material;
+    XMMATRIX transform;
+};
+
+// Geometry of several instances with their transforms baked in, quantized over the batch's own bounds.
+struct StaticBatch {
+    u32 material;
+    u32 instance_count;
+    RDPackedVertex* vertices;
+    u32 vertex_count;
+    RDMeshQuantization quantization;
+    u32* indices;
+    u32 index_count;
+};
+
+// Groups instances by material and cell, and merges every group of two or more. batched is set for the instances that
+// went into a batch, the rest should be drawn as they are. batches needs room for instance_count / 2. Returns how many
+// were written. Their vertices and indices are pushed to arena.
+u32 build_static_batches(Arena* arena, BatchSource* sources, u32 instance_count, BatchInstance* instances, bool* batched, StaticBatch* batches);
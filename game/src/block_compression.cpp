@@ -0,0 +1,815 @@
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include "block_compression.h"
+#include "platform.h"
+#include "jobs.h"
+#include "profiler.h"
+
+// One 4x4 block, channel by channel so four pixels fit a register.
+struct BlockPixels {
+    alignas(16) f32 c[4][16];
+};
+
+// BC7 interpolation weights for 4 bit indices, out of 64.
+static const u32 bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// The index whose weight is nearest each position out of 64.
+static const u8 bc7_nearest_index[65] = {
+    0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 6, 7, 7, 7, 7,
+    8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 14, 15, 15,
+};
+
+bool bc_format(RDFormat format) {
+    return format == RD_FORMAT_BC1_UNORM || format == RD_FORMAT_BC3_UNORM || format == RD_FORMAT_BC5_UNORM || format == RD_FORMAT_BC7_UNORM;
+}
+
+u32 bc_block_bytes(RDFormat format) {
+    return format == RD_FORMAT_BC1_UNORM ? 8 : 16;
+}
+
+u64 bc_level_size(RDFormat format, u32 width, u32 height) {
+    return (u64)((width + 3) / 4) * ((height + 3) / 4) * bc_block_bytes(format);
+}
+
+u64 bc_chain_size(RDFormat format, u32 width, u32 height, u32 levels) {
+    u64 size = 0;
+
+    for (u32 i = 0; i < levels; ++i) {
+        size += bc_level_size(format, width, height);
+        width = max(width >> 1, 1u);
+        height = max(height >> 1, 1u);
+    }
+
+    return size;
+}
+
+RDFormat bc_color_format(bool has_alpha, BCQuality quality) {
+    if (!has_alpha) {
+        return RD_FORMAT_BC1_UNORM;
+    }
+
+    return quality == BC_QUALITY_FAST ? RD_FORMAT_BC3_UNORM : RD_FORMAT_BC7_UNORM;
+}
+
+// Blocks hanging over the edge of a small level repeat its last row and column.
+static void load_block(u8* rgba, u32 width, u32 height, u32 bx, u32 by, BlockPixels* block) {
+    for (u32 y = 0; y < 4; ++y) {
+        u32 py = min(by * 4 + y, height - 1);
+
+        for (u32 x = 0; x < 4; ++x) {
+            u32 px = min(bx * 4 + x, width - 1);
+            u8* texel = rgba + ((u64)py * width + px) * 4;
+
+            for (u32 c = 0; c < 4; ++c) {
+                block->c[c][y * 4 + x] = (f32)texel[c];
+            }
+        }
+    }
+}
+
+static f32 horizontal_sum(__m128 v) {
+    __m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuffled));
+}
+
+// Fits a line through the block's colors in the first channel_count channels, from the mean along the direction of
+// greatest variance, and returns the ends of the colors' spread along it.
+static void fit_line(BlockPixels* block, u32 channel_count, f32* lo, f32* hi) {
+    f32 mean[4] = {};
+
+    for (u32 c = 0; c < channel_count; ++c) {
+        __m128 sum = _mm_setzero_ps();
+        for (u32 i = 0; i < 16; i += 4) {
+            sum = _mm_add_ps(sum, _mm_load_ps(&block->c[c][i]));
+        }
+        mean[c] = horizontal_sum(sum) / 16.0f;
+    }
+
+    f32 covariance[4][4] = {};
+
+    for (u32 a = 0; a < channel_count; ++a) {
+        for (u32 b = a; b < channel_count; ++b) {
+            __m128 mean_a = _mm_set1_ps(mean[a]);
+            __m128 mean_b = _mm_set1_ps(mean[b]);
+            __m128 sum = _mm_setzero_ps();
+
+            for (u32 i = 0; i < 16; i += 4) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&block->c[a][i]), mean_a), _mm_sub_ps(_mm_load_ps(&block->c[b][i]), mean_b)));
+            }
+
+            covariance[a][b] = covariance[b][a] = horizontal_sum(sum);
+        }
+    }
+
+    // Power iteration, starting from the channel that varies most.
+    f32 axis[4] = {};
+    u32 widest = 0;
+
+    for (u32 c = 1; c < channel_count; ++c) {
+        if (covariance[c][c] > covariance[widest][widest]) {
+            widest = c;
+        }
+    }
+
+    for (u32 c = 0; c < channel_count; ++c) {
+        axis[c] = covariance[widest][c];
+    }
+
+    for (u32 iteration = 0; iteration < 8; ++iteration) {
+        f32 next[4] = {};
+        f32 length_sq = 0.0f;
+
+        for (u32 a = 0; a < channel_count; ++a) {
+            for (u32 b = 0; b < channel_count; ++b) {
+                next[a] += covariance[a][b] * axis[b];
+            }
+            length_sq += next[a] * next[a];
+        }
+
+        if (length_sq < 1e-12f) {
+            break;
+        }
+
+        f32 inv_length = 1.0f / sqrtf(length_sq);
+
+        for (u32 c = 0; c < channel_count; ++c) {
+            axis[c] = next[c] * inv_length;
+        }
+    }
+
+    __m128 t_min = _mm_set1_ps(FLT_MAX);
+    __m128 t_max = _mm_set1_ps(-FLT_MAX);
+
+    for (u32 i = 0; i < 16; i += 4) {
+        __m128 t = _mm_setzero_ps();
+
+        for (u32 c = 0; c < channel_count; ++c) {
+            t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&block->c[c][i]), _mm_set1_ps(mean[c])), _mm_set1_ps(axis[c])));
+        }
+
+        t_min = _mm_min_ps(t_min, t);
+        t_max = _mm_max_ps(t_max, t);
+    }
+
+    alignas(16) f32 mins[4], maxs[4];
+    _mm_store_ps(mins, t_min);
+    _mm_store_ps(maxs, t_max);
+
+    f32 lo_t = min(min(mins[0], mins[1]), min(mins[2], mins[3]));
+    f32 hi_t = max(max(maxs[0], maxs[1]), max(maxs[2], maxs[3]));
+
+    for (u32 c = 0; c < channel_count; ++c) {
+        lo[c] = min(max(mean[c] + axis[c] * lo_t, 0.0f), 255.0f);
+        hi[c] = min(max(mean[c] + axis[c] * hi_t, 0.0f), 255.0f);
+    }
+}
+
+// Where each pixel falls on the line from e0 to e1, rounded to a step out of step_count.
+static void project_indices(BlockPixels* block, u32 first_channel, u32 channel_count, f32* e0, f32* e1, u32 step_count, i32* steps) {
+    f32 axis[4] = {};
+    f32 length_sq = 0.0f;
+
+    for (u32 c = 0; c < channel_count; ++c) {
+        axis[c] = e1[c] - e0[c];
+        length_sq += axis[c] * axis[c];
+    }
+
+    if (length_sq < 1e-6f) {
+        memset(steps, 0, 16 * sizeof(i32));
+        return;
+    }
+
+    __m128 scale = _mm_set1_ps((f32)step_count / length_sq);
+    __m128 top = _mm_set1_ps((f32)step_count);
+
+    for (u32 i = 0; i < 16; i += 4) {
+        __m128 t = _mm_setzero_ps();
+
+        for (u32 c = 0; c < channel_count; ++c) {
+            __m128 offset = _mm_sub_ps(_mm_load_ps(&block->c[first_channel + c][i]), _mm_set1_ps(e0[c]));
+            t = _mm_add_ps(t, _mm_mul_ps(offset, _mm_set1_ps(axis[c])));
+        }
+
+        t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(t, scale), _mm_setzero_ps()), top);
+        _mm_storeu_si128((__m128i*)&steps[i], _mm_cvtps_epi32(t));
+    }
+}
+
+// Least squares endpoints for pixels that sit weights[i] of the way from e0 to e1. Fails when every pixel has the same
+// weight, which leaves the endpoints undetermined.
+static bool refit_endpoints(BlockPixels* block, u32 first_channel, u32 channel_count, f32* weights, f32* e0, f32* e1) {
+    f32 aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    f32 ax[4] = {}, bx[4] = {};
+
+    for (u32 i = 0; i < 16; ++i) {
+        f32 b = weights[i];
+        f32 a = 1.0f - b;
+
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+
+        for (u32 c = 0; c < channel_count; ++c) {
+            ax[c] += a * block->c[first_channel + c][i];
+            bx[c] += b * block->c[first_channel + c][i];
+        }
+    }
+
+    f32 determinant = aa * bb - ab * ab;
+
+    if (fabsf(determinant) < 1e-6f) {
+        return false;
+    }
+
+    f32 inv_determinant = 1.0f / determinant;
+
+    for (u32 c = 0; c < channel_count; ++c) {
+        e0[c] = min(max((bb * ax[c] - ab * bx[c]) * inv_determinant, 0.0f), 255.0f);
+        e1[c] = min(max((aa * bx[c] - ab * ax[c]) * inv_determinant, 0.0f), 255.0f);
+    }
+
+    return true;
+}
+
+static u32 iteration_count(BCQuality quality) {
+    switch (quality) {
+        default:
+        case BC_QUALITY_FAST: return 1;
+        case BC_QUALITY_NORMAL: return 2;
+        case BC_QUALITY_HIGH: return 4;
+    }
+}
+
+static u16 pack_565(f32* color) {
+    u32 r = (u32)(color[0] * (31.0f / 255.0f) + 0.5f);
+    u32 g = (u32)(color[1] * (63.0f / 255.0f) + 0.5f);
+    u32 b = (u32)(color[2] * (31.0f / 255.0f) + 0.5f);
+    return (u16)((r << 11) | (g << 5) | b);
+}
+
+static void unpack_565(u16 packed, u32* color) {
+    u32 r = (packed >> 11) & 31;
+    u32 g = (packed >> 5) & 63;
+    u32 b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+static void encode_bc1(BlockPixels* block, BCQuality quality, u8* out) {
+    f32 hi[3], lo[3];
+    fit_line(block, 3, lo, hi);
+
+    f32 best_error = FLT_MAX;
+    u32 iterations = iteration_count(quality);
+
+    for (u32 iteration = 0; iteration < iterations; ++iteration) {
+        u16 c0 = pack_565(hi);
+        u16 c1 = pack_565(lo);
+
+        u32 q0[3], q1[3];
+        unpack_565(c0, q0);
+        unpack_565(c1, q1);
+
+        f32 e0[3] = { (f32)q0[0], (f32)q0[1], (f32)q0[2] };
+        f32 e1[3] = { (f32)q1[0], (f32)q1[1], (f32)q1[2] };
+
+        i32 steps[16];
+        project_indices(block, 0, 3, e0, e1, 3, steps);
+
+        f32 error = 0.0f;
+
+        for (u32 i = 0; i < 16; ++i) {
+            f32 t = (f32)steps[i] / 3.0f;
+            for (u32 c = 0; c < 3; ++c) {
+                f32 d = e0[c] + (e1[c] - e0[c]) * t - block->c[c][i];
+                error += d * d;
+            }
+        }
+
+        if (error < best_error) {
+            best_error = error;
+
+            // Four color mode needs c0 > c1. Equal endpoints leave every index on c0.
+            bool swap = c0 < c1;
+            static const u32 step_to_index[4] = { 0, 2, 3, 1 };
+
+            u32 indices = 0;
+
+            for (u32 i = 0; i < 16; ++i) {
+                u32 step = c0 == c1 ? 0 : (swap ? 3 - steps[i] : steps[i]);
+                indices |= step_to_index[step] << (i * 2);
+            }
+
+            u16 first = swap ? c1 : c0;
+            u16 second = swap ? c0 : c1;
+
+            memcpy(out + 0, &first, 2);
+            memcpy(out + 2, &second, 2);
+            memcpy(out + 4, &indices, 4);
+        }
+
+        if (iteration + 1 < iterations) {
+            f32 weights[16];
+            for (u32 i = 0; i < 16; ++i) {
+                weights[i] = (f32)steps[i] / 3.0f;
+            }
+
+            if (!refit_endpoints(block, 0, 3, weights, hi, lo)) {
+                break;
+            }
+        }
+    }
+}
+
+// One channel as 8 levels between two 8 bit endpoints. Also the alpha of BC3 and each channel of BC5.
+static void encode_bc4(BlockPixels* block, u32 channel, BCQuality quality, u8* out) {
+    __m128 v_min = _mm_load_ps(&block->c[channel][0]);
+    __m128 v_max = v_min;
+
+    for (u32 i = 4; i < 16; i += 4) {
+        v_min = _mm_min_ps(v_min, _mm_load_ps(&block->c[channel][i]));
+        v_max = _mm_max_ps(v_max, _mm_load_ps(&block->c[channel][i]));
+    }
+
+    alignas(16) f32 mins[4], maxs[4];
+    _mm_store_ps(mins, v_min);
+    _mm_store_ps(maxs, v_max);
+
+    f32 lo = min(min(mins[0], mins[1]), min(mins[2], mins[3]));
+    f32 hi = max(max(maxs[0], maxs[1]), max(maxs[2], maxs[3]));
+
+    f32 best_error = FLT_MAX;
+    u32 iterations = iteration_count(quality);
+
+    for (u32 iteration = 0; iteration < iterations; ++iteration) {
+        u8 a0 = (u8)(max(hi, lo) + 0.5f);
+        u8 a1 = (u8)(min(hi, lo) + 0.5f);
+
+        f32 e0 = (f32)a0;
+        f32 e1 = (f32)a1;
+
+        i32 steps[16];
+        project_indices(block, channel, 1, &e0, &e1, 7, steps);
+
+        f32 error = 0.0f;
+
+        for (u32 i = 0; i < 16; ++i) {
+            f32 d = e0 + (e1 - e0) * (f32)steps[i] / 7.0f - block->c[channel][i];
+            error += d * d;
+        }
+
+        if (error < best_error) {
+            best_error = error;
+
+            // Eight level mode needs a0 > a1, with the six levels between them after both endpoints.
+            u64 indices = 0;
+
+            for (u32 i = 0; i < 16; ++i) {
+                u32 step = a0 == a1 ? 0 : steps[i];
+                u64 index = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+                indices |= index << (i * 3);
+            }
+
+            out[0] = a0;
+            out[1] = a1;
+
+            for (u32 i = 0; i < 6; ++i) {
+                out[2 + i] = (u8)(indices >> (i * 8));
+            }
+        }
+
+        if (iteration + 1 < iterations) {
+            f32 weights[16];
+            for (u32 i = 0; i < 16; ++i) {
+                weights[i] = (f32)steps[i] / 7.0f;
+            }
+
+            if (!refit_endpoints(block, channel, 1, weights, &hi, &lo)) {
+                break;
+            }
+        }
+    }
+}
+
+static void put_bits(u8* out, u32* position, u32 value, u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        u32 bit = *position + i;
+        out[bit >> 3] |= (u8)(((value >> i) & 1) << (bit & 7));
+    }
+    *position += count;
+}
+
+static u32 get_bits(u8* in, u32* position, u32 count) {
+    u32 value = 0;
+    for (u32 i = 0; i < count; ++i) {
+        u32 bit = *position + i;
+        value |= (u32)((in[bit >> 3] >> (bit & 7)) & 1) << i;
+    }
+    *position += count;
+    return value;
+}
+
+// An endpoint channel as 7 bits plus the shared p-bit.
+static u32 quantize_bc7(f32 value, u32 p_bit) {
+    i32 q = (i32)((value - (f32)p_bit) * 0.5f + 0.5f);
+    return (u32)min(max(q, 0), 127);
+}
+
+struct BC7Candidate {
+    u32 endpoints[2][4];
+    u32 p_bits[2];
+    u32 indices[16];
+    f32 error;
+};
+
+static void evaluate_bc7(BlockPixels* block, f32* hi, f32* lo, u32 p0, u32 p1, BC7Candidate* candidate) {
+    f32 e0[4], e1[4];
+
+    for (u32 c = 0; c < 4; ++c) {
+        candidate->endpoints[0][c] = quantize_bc7(hi[c], p0);
+        candidate->endpoints[1][c] = quantize_bc7(lo[c], p1);
+        e0[c] = (f32)((candidate->endpoints[0][c] << 1) | p0);
+        e1[c] = (f32)((candidate->endpoints[1][c] << 1) | p1);
+    }
+
+    candidate->p_bits[0] = p0;
+    candidate->p_bits[1] = p1;
+
+    i32 steps[16];
+    project_indices(block, 0, 4, e0, e1, 64, steps);
+
+    f32 error = 0.0f;
+
+    for (u32 i = 0; i < 16; ++i) {
+        u32 index = bc7_nearest_index[steps[i]];
+        u32 w = bc7_weights[index];
+        candidate->indices[i] = index;
+
+        for (u32 c = 0; c < 4; ++c) {
+            u32 value = ((64 - w) * (u32)e0[c] + w * (u32)e1[c] + 32) >> 6;
+            f32 d = (f32)value - block->c[c][i];
+            error += d * d;
+        }
+    }
+
+    candidate->error = error;
+}
+
+static void encode_bc7(BlockPixels* block, BCQuality quality, u8* out) {
+    f32 hi[4], lo[4];
+    fit_line(block, 4, lo, hi);
+
+    BC7Candidate best = {};
+    best.error = FLT_MAX;
+
+    u32 iterations = iteration_count(quality);
+
+    for (u32 iteration = 0; iteration < iterations; ++iteration) {
+        BC7Candidate candidate;
+        BC7Candidate iteration_best = {};
+        iteration_best.error = FLT_MAX;
+
+        if (quality == BC_QUALITY_HIGH) {
+            for (u32 p = 0; p < 4; ++p) {
+                evaluate_bc7(block, hi, lo, p & 1, p >> 1, &candidate);
+                if (candidate.error < iteration_best.error) {
+                    iteration_best = candidate;
+                }
+            }
+        }
+        else {
+            // The p-bit whose rounding strays least from each endpoint, over all channels.
+            u32 p_bits[2];
+            f32* endpoints[2] = { hi, lo };
+
+            for (u32 e = 0; e < 2; ++e) {
+                f32 error[2] = {};
+                for (u32 p = 0; p < 2; ++p) {
+                    for (u32 c = 0; c < 4; ++c) {
+                        f32 d = (f32)((quantize_bc7(endpoints[e][c], p) << 1) | p) - endpoints[e][c];
+                        error[p] += d * d;
+                    }
+                }
+                p_bits[e] = error[1] < error[0] ? 1 : 0;
+            }
+
+            evaluate_bc7(block, hi, lo, p_bits[0], p_bits[1], &iteration_best);
+        }
+
+        if (iteration_best.error < best.error) {
+            best = iteration_best;
+        }
+
+        if (iteration + 1 < iterations) {
+            f32 weights[16];
+            for (u32 i = 0; i < 16; ++i) {
+                weights[i] = (f32)bc7_weights[iteration_best.indices[i]] / 64.0f;
+            }
+
+            if (!refit_endpoints(block, 0, 4, weights, hi, lo)) {
+                break;
+            }
+        }
+    }
+
+    // The first index drops its top bit, so it has to be under 8. Swapping the endpoints mirrors every index.
+    if (best.indices[0] >= 8) {
+        for (u32 c = 0; c < 4; ++c) {
+            u32 t = best.endpoints[0][c];
+            best.endpoints[0][c] = best.endpoints[1][c];
+            best.endpoints[1][c] = t;
+        }
+
+        u32 t = best.p_bits[0];
+        best.p_bits[0] = best.p_bits[1];
+        best.p_bits[1] = t;
+
+        for (u32 i = 0; i < 16; ++i) {
+            best.indices[i] = 15 - best.indices[i];
+        }
+    }
+
+    memset(out, 0, 16);
+    u32 position = 0;
+
+    put_bits(out, &position, 1 << 6, 7);
+
+    for (u32 c = 0; c < 4; ++c) {
+        put_bits(out, &position, best.endpoints[0][c], 7);
+        put_bits(out, &position, best.endpoints[1][c], 7);
+    }
+
+    put_bits(out, &position, best.p_bits[0], 1);
+    put_bits(out, &position, best.p_bits[1], 1);
+
+    for (u32 i = 0; i < 16; ++i) {
+        put_bits(out, &position, best.indices[i], i == 0 ? 3 : 4);
+    }
+}
+
+static void encode_block(RDFormat format, BCQuality quality, BlockPixels* block, u8* out) {
+    switch (format) {
+        default:
+            assert(false);
+
+        case RD_FORMAT_BC1_UNORM:
+            encode_bc1(block, quality, out);
+            break;
+
+        case RD_FORMAT_BC3_UNORM:
+            encode_bc4(block, 3, quality, out);
+            encode_bc1(block, quality, out + 8);
+            break;
+
+        case RD_FORMAT_BC5_UNORM:
+            encode_bc4(block, 0, quality, out);
+            encode_bc4(block, 1, quality, out + 8);
+            break;
+
+        case RD_FORMAT_BC7_UNORM:
+            encode_bc7(block, quality, out);
+            break;
+    }
+}
+
+static void compress_level(RDFormat format, BCQuality quality, u8* rgba, u32 width, u32 height, u8* out) {
+    u32 blocks_x = (width + 3) / 4;
+    u32 blocks_y = (height + 3) / 4;
+    u32 block_bytes = bc_block_bytes(format);
+
+    parallel_for(blocks_y, BC_JOB_ROWS, [&](u32 begin, u32 end) {
+        for (u32 by = begin; by < end; ++by) {
+            for (u32 bx = 0; bx < blocks_x; ++bx) {
+                BlockPixels block;
+                load_block(rgba, width, height, bx, by, &block);
+                encode_block(format, quality, &block, out + ((u64)by * blocks_x + bx) * block_bytes);
+            }
+        }
+    });
+}
+
+void bc_compress_chain(RDFormat format, BCQuality quality, u8* chain, u32 width, u32 height, u32 levels, u8* out) {
+    PROFILE_FUNCTION();
+
+    for (u32 i = 0; i < levels; ++i) {
+        compress_level(format, quality, chain, width, height, out);
+
+        chain += (u64)width * height * 4;
+        out += bc_level_size(format, width, height);
+        width = max(width >> 1, 1u);
+        height = max(height >> 1, 1u);
+    }
+}
+
+static void decode_bc1(u8* in, u8 texels[16][4]) {
+    u16 c0, c1;
+    u32 indices;
+    memcpy(&c0, in + 0, 2);
+    memcpy(&c1, in + 2, 2);
+    memcpy(&indices, in + 4, 4);
+
+    u32 palette[4][4];
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    palette[0][3] = palette[1][3] = 255;
+
+    for (u32 c = 0; c < 3; ++c) {
+        if (c0 > c1) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+
+    palette[2][3] = 255;
+    palette[3][3] = c0 > c1 ? 255 : 0;
+
+    for (u32 i = 0; i < 16; ++i) {
+        u32* color = palette[(indices >> (i * 2)) & 3];
+        for (u32 c = 0; c < 4; ++c) {
+            texels[i][c] = (u8)color[c];
+        }
+    }
+}
+
+static void decode_bc4(u8* in, u8 texels[16][4], u32 channel) {
+    u32 a0 = in[0];
+    u32 a1 = in[1];
+
+    u32 palette[8] = { a0, a1 };
+
+    if (a0 > a1) {
+        for (u32 i = 1; i < 7; ++i) {
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+        }
+    }
+    else {
+        for (u32 i = 1; i < 5; ++i) {
+            palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    u64 indices = 0;
+    for (u32 i = 0; i < 6; ++i) {
+        indices |= (u64)in[2 + i] << (i * 8);
+    }
+
+    for (u32 i = 0; i < 16; ++i) {
+        texels[i][channel] = (u8)palette[(indices >> (i * 3)) & 7];
+    }
+}
+
+static void decode_bc7(u8* in, u8 texels[16][4]) {
+    u32 position = 0;
+    u32 mode = get_bits(in, &position, 7);
+    assert(mode == 1 << 6 && "only BC7 mode 6 is decoded");
+    (void)mode;
+
+    u32 endpoints[2][4];
+
+    for (u32 c = 0; c < 4; ++c) {
+        endpoints[0][c] = get_bits(in, &position, 7);
+        endpoints[1][c] = get_bits(in, &position, 7);
+    }
+
+    u32 p0 = get_bits(in, &position, 1);
+    u32 p1 = get_bits(in, &position, 1);
+
+    for (u32 c = 0; c < 4; ++c) {
+        endpoints[0][c] = (endpoints[0][c] << 1) | p0;
+        endpoints[1][c] = (endpoints[1][c] << 1) | p1;
+    }
+
+    for (u32 i = 0; i < 16; ++i) {
+        u32 w = bc7_weights[get_bits(in, &position, i == 0 ? 3 : 4)];
+
+        for (u32 c = 0; c < 4; ++c) {
+            texels[i][c] = (u8)(((64 - w) * endpoints[0][c] + w * endpoints[1][c] + 32) >> 6);
+        }
+    }
+}
+
+void bc_decompress(RDFormat format, u8* blocks, u32 width, u32 height, u8* out) {
+    u32 blocks_x = (width + 3) / 4;
+    u32 blocks_y = (height + 3) / 4;
+    u32 block_bytes = bc_block_bytes(format);
+
+    for (u32 by = 0; by < blocks_y; ++by) {
+        for (u32 bx = 0; bx < blocks_x; ++bx) {
+            u8* in = blocks + ((u64)by * blocks_x + bx) * block_bytes;
+            u8 texels[16][4];
+
+            switch (format) {
+                default:
+                    assert(false);
+
+                case RD_FORMAT_BC1_UNORM:
+                    decode_bc1(in, texels);
+                    break;
+
+                case RD_FORMAT_BC3_UNORM:
+                    decode_bc1(in + 8, texels);
+                    decode_bc4(in, texels, 3);
+                    break;
+
+                case RD_FORMAT_BC5_UNORM:
+                    decode_bc4(in, texels, 0);
+                    decode_bc4(in + 8, texels, 1);
+                    for (u32 i = 0; i < 16; ++i) {
+                        texels[i][2] = 0;
+                        texels[i][3] = 255;
+                    }
+                    break;
+
+                case RD_FORMAT_BC7_UNORM:
+                    decode_bc7(in, texels);
+                    break;
+            }
+
+            for (u32 y = 0; y < 4 && by * 4 + y < height; ++y) {
+                for (u32 x = 0; x < 4 && bx * 4 + x < width; ++x) {
+                    memcpy(out + ((u64)(by * 4 + y) * width + bx * 4 + x) * 4, texels[y * 4 + x], 4);
+                }
+            }
+        }
+    }
+}
+
+void bc_benchmark(const char* name, u8* rgba, u32 width, u32 height) {
+    Scratch scratch = get_scratch(0);
+
+    if (!rgba) {
+        rgba = scratch->push_array<u8>((u64)width * height * 4);
+
+        u32 seed = 0x1b873593;
+        auto random_u32 = [&]() {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed;
+        };
+
+        // Smooth gradients with light grain, hard edged stripes, and an alpha ramp.
+        for (u32 y = 0; y < height; ++y) {
+            for (u32 x = 0; x < width; ++x) {
+                u8* texel = rgba + ((u64)y * width + x) * 4;
+                u32 noise = random_u32() & 15;
+                bool stripe = ((x / 37 + y / 53) & 3) == 0;
+
+                texel[0] = (u8)min(x * 255 / width + noise, 255u);
+                texel[1] = (u8)min(y * 255 / height + noise, 255u);
+                texel[2] = stripe ? 230 : (u8)(128 + noise);
+                texel[3] = (u8)((x + y) * 255 / (width + height));
+            }
+        }
+    }
+
+    static const RDFormat formats[] = { RD_FORMAT_BC1_UNORM, RD_FORMAT_BC3_UNORM, RD_FORMAT_BC5_UNORM, RD_FORMAT_BC7_UNORM };
+    static const char* format_names[] = { "BC1", "BC3", "BC5", "BC7" };
+    static const char* quality_names[] = { "fast", "normal", "high" };
+
+    // Channels each format keeps, for PSNR.
+    static const u32 format_channels[] = { 3, 4, 2, 4 };
+
+    u8* blocks = scratch->push_array<u8>(bc_level_size(RD_FORMAT_BC7_UNORM, width, height));
+    u8* decoded = scratch->push_array<u8>((u64)width * height * 4);
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    for (u32 f = 0; f < ARRAY_LEN(formats); ++f) {
+        for (u32 q = BC_QUALITY_FAST; q <= BC_QUALITY_HIGH; ++q) {
+            u64 start = pf_ticks();
+            bc_compress_chain(formats[f], (BCQuality)q, rgba, width, height, 1, blocks);
+            f64 ms = (f64)(pf_ticks() - start) * ms_per_tick;
+
+            bc_decompress(formats[f], blocks, width, height, decoded);
+
+            f64 squared_error = 0.0;
+            for (u64 i = 0; i < (u64)width * height; ++i) {
+                for (u32 c = 0; c < format_channels[f]; ++c) {
+                    f64 d = (f64)decoded[i * 4 + c] - (f64)rgba[i * 4 + c];
+                    squared_error += d * d;
+                }
+            }
+
+            f64 mse = squared_error / ((f64)width * height * format_channels[f]);
+            f64 psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+
+            assert(psnr > 20.0 && "block compression is far off its source");
+
+            pf_debug_log("block_compression: %s %ux%u %s %-6s %8.2fms %7.1f MP/s on %u threads, PSNR %.2f dB\n",
+                name, width, height, format_names[f], quality_names[q], ms, (f64)width * height / 1e6 / (ms / 1000.0), jobs_thread_count(), psnr);
+        }
+    }
+}
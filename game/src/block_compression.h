@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "renderer.h"
+
+// Block rows per job when compressing a level.
+#define BC_JOB_ROWS 8
+
+enum BCQuality {
+    // Endpoints from the principal axis of each block's colors.
+    BC_QUALITY_FAST,
+    // Endpoints refit by least squares to the indices they produce.
+    BC_QUALITY_NORMAL,
+    // More refits, and every BC7 p-bit combination is tried.
+    BC_QUALITY_HIGH,
+};
+
+bool bc_format(RDFormat format);
+u32 bc_block_bytes(RDFormat format);
+
+// Bytes of one level, in rows of 4x4 blocks.
+u64 bc_level_size(RDFormat format, u32 width, u32 height);
+u64 bc_chain_size(RDFormat format, u32 width, u32 height, u32 levels);
+
+// BC1 for opaque color. With alpha, BC3 when speed matters more than quality, otherwise BC7.
+RDFormat bc_color_format(bool has_alpha, BCQuality quality);
+
+// Compresses every level of a tightly packed RGBA8 chain, as made by generate_mips, into out, which needs
+// bc_chain_size bytes. Block rows are split across the job threads. BC5 keeps red and green, for normal maps.
+// Only BC7 mode 6 is written, one subset with 16 index levels for color and alpha together.
+void bc_compress_chain(RDFormat format, BCQuality quality, u8* chain, u32 width, u32 height, u32 levels, u8* out);
+
+// Decodes one level back to RGBA8. BC5 comes back with blue 0 and alpha 255.
+void bc_decompress(RDFormat format, u8* blocks, u32 width, u32 height, u8* out);
+
+// Compresses an image with every format and quality, and logs throughput in megapixels per second and PSNR against it.
+// With no pixels, a width x height image of gradients, edges and noise is made up.
+void bc_benchmark(const char* name, u8* rgba, u32 width, u32 height);
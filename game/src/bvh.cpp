@@ -0,0 +1,984 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "platform.h"
+#include "profiler.h"
+
+#define BVH_BIN_COUNT 16
+// Ranges at least this big have their bins filled across the job threads.
+#define BVH_PARALLEL_BIN_SIZE (64 * 1024)
+// The top of the tree is split serially until ranges are this small, then the subtrees are built in parallel.
+#define BVH_SUBTREE_SIZE 4096
+// Past this depth ranges are halved by count so degenerate inputs can't blow the stack.
+#define BVH_MAX_SAH_DEPTH 48
+
+static AABB aabb_empty() {
+    return { {FLT_MAX, FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX, -FLT_MAX} };
+}
+
+static void aabb_grow(AABB* a, AABB b) {
+    a->aabb_min = { min(a->aabb_min.x, b.aabb_min.x), min(a->aabb_min.y, b.aabb_min.y), min(a->aabb_min.z, b.aabb_min.z) };
+    a->aabb_max = { max(a->aabb_max.x, b.aabb_max.x), max(a->aabb_max.y, b.aabb_max.y), max(a->aabb_max.z, b.aabb_max.z) };
+}
+
+static void aabb_grow(AABB* a, XMFLOAT3 p) {
+    aabb_grow(a, AABB{ p, p });
+}
+
+static AABB aabb_union(AABB a, AABB b) {
+    aabb_grow(&a, b);
+    return a;
+}
+
+static f32 aabb_area(AABB a) {
+    f32 dx = a.aabb_max.x - a.aabb_min.x;
+    f32 dy = a.aabb_max.y - a.aabb_min.y;
+    f32 dz = a.aabb_max.z - a.aabb_min.z;
+
+    if (dx < 0.0f || dy < 0.0f || dz < 0.0f) {
+        return 0.0f;
+    }
+
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static bool aabb_overlaps(AABB a, AABB b) {
+    return a.aabb_min.x <= b.aabb_max.x && a.aabb_max.x >= b.aabb_min.x &&
+           a.aabb_min.y <= b.aabb_max.y && a.aabb_max.y >= b.aabb_min.y &&
+           a.aabb_min.z <= b.aabb_max.z && a.aabb_max.z >= b.aabb_min.z;
+}
+
+static f32 axis(XMFLOAT3 v, u32 a) {
+    return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+AABB aabb_transform(XMFLOAT3 aabb_min, XMFLOAT3 aabb_max, XMMATRIX transform) {
+    // Arvo's method: each output extent is the sum of the per-axis extremes of the matrix times the box.
+    XMFLOAT4X4 m;
+    XMStoreFloat4x4(&m, transform);
+
+    f32 in_min[3] = { aabb_min.x, aabb_min.y, aabb_min.z };
+    f32 in_max[3] = { aabb_max.x, aabb_max.y, aabb_max.z };
+    f32 out_min[3] = { m.m[3][0], m.m[3][1], m.m[3][2] };
+    f32 out_max[3] = { m.m[3][0], m.m[3][1], m.m[3][2] };
+
+    for (int j = 0; j < 3; ++j) {
+        for (int i = 0; i < 3; ++i) {
+            f32 a = m.m[i][j] * in_min[i];
+            f32 b = m.m[i][j] * in_max[i];
+            out_min[j] += min(a, b);
+            out_max[j] += max(a, b);
+        }
+    }
+
+    return { {out_min[0], out_min[1], out_min[2]}, {out_max[0], out_max[1], out_max[2]} };
+}
+
+static bool is_leaf(BVHNode* node) {
+    return node->left == BVH_NONE;
+}
+
+// Build
+
+struct BVHBin {
+    AABB bounds;
+    u32 count;
+};
+
+struct BVHBins {
+    BVHBin bins[3][BVH_BIN_COUNT];
+};
+
+struct BVHBuilder {
+    BVH* bvh;
+    AABB* bounds;
+    XMFLOAT3* centroids;
+    u32* items;
+};
+
+struct BVHRange {
+    u32 begin;
+    u32 end;
+    AABB centroid_bounds;
+};
+
+static AABB centroid_bounds_of(BVHBuilder* b, u32 begin, u32 end) {
+    AABB result = aabb_empty();
+
+    for (u32 i = begin; i < end; ++i) {
+        aabb_grow(&result, b->centroids[b->items[i]]);
+    }
+
+    return result;
+}
+
+static void bins_clear(BVHBins* bins) {
+    for (u32 a = 0; a < 3; ++a) {
+        for (u32 i = 0; i < BVH_BIN_COUNT; ++i) {
+            bins->bins[a][i] = { aabb_empty(), 0 };
+        }
+    }
+}
+
+static u32 bin_index(f32 c, f32 lo, f32 scale) {
+    i32 bin = (i32)((c - lo) * scale);
+    return (u32)(bin < 0 ? 0 : (bin >= BVH_BIN_COUNT ? BVH_BIN_COUNT - 1 : bin));
+}
+
+static void bins_fill(BVHBuilder* b, u32 begin, u32 end, AABB centroid_bounds, f32 scale[3], BVHBins* bins) {
+    for (u32 i = begin; i < end; ++i) {
+        u32 item = b->items[i];
+        XMFLOAT3 c = b->centroids[item];
+
+        for (u32 a = 0; a < 3; ++a) {
+            BVHBin* bin = &bins->bins[a][bin_index(axis(c, a), axis(centroid_bounds.aabb_min, a), scale[a])];
+            aabb_grow(&bin->bounds, b->bounds[item]);
+            bin->count++;
+        }
+    }
+}
+
+// Partitions the range with the cheapest binned SAH split and returns the first index of the right half.
+static u32 split_range(BVHBuilder* b, BVHRange* range, u32 depth) {
+    u32 begin = range->begin;
+    u32 end = range->end;
+    u32 median = begin + (end - begin) / 2;
+
+    AABB cb = range->centroid_bounds;
+    f32 extent[3] = { cb.aabb_max.x - cb.aabb_min.x, cb.aabb_max.y - cb.aabb_min.y, cb.aabb_max.z - cb.aabb_min.z };
+
+    // Every centroid in the same place, nothing to split on.
+    if ((extent[0] <= 0.0f && extent[1] <= 0.0f && extent[2] <= 0.0f) || depth >= BVH_MAX_SAH_DEPTH) {
+        return median;
+    }
+
+    f32 scale[3];
+    for (u32 a = 0; a < 3; ++a) {
+        scale[a] = extent[a] > 0.0f ? (f32)BVH_BIN_COUNT / extent[a] : 0.0f;
+    }
+
+    BVHBins bins;
+    bins_clear(&bins);
+
+    u32 count = end - begin;
+
+    if (count >= BVH_PARALLEL_BIN_SIZE) {
+        Scratch scratch = get_scratch(0);
+
+        u32 chunk_count = (count + BVH_PARALLEL_BIN_SIZE / 4 - 1) / (BVH_PARALLEL_BIN_SIZE / 4);
+        BVHBins* chunk_bins = scratch->push_array<BVHBins>(chunk_count);
+
+        parallel_for(chunk_count, 1, [&](u32 first, u32 last) {
+            for (u32 chunk = first; chunk < last; ++chunk) {
+                u32 chunk_begin = begin + chunk * (BVH_PARALLEL_BIN_SIZE / 4);
+                u32 chunk_end = min(chunk_begin + BVH_PARALLEL_BIN_SIZE / 4, end);
+                bins_clear(&chunk_bins[chunk]);
+                bins_fill(b, chunk_begin, chunk_end, cb, scale, &chunk_bins[chunk]);
+            }
+        });
+
+        for (u32 chunk = 0; chunk < chunk_count; ++chunk) {
+            for (u32 a = 0; a < 3; ++a) {
+                for (u32 i = 0; i < BVH_BIN_COUNT; ++i) {
+                    aabb_grow(&bins.bins[a][i].bounds, chunk_bins[chunk].bins[a][i].bounds);
+                    bins.bins[a][i].count += chunk_bins[chunk].bins[a][i].count;
+                }
+            }
+        }
+    }
+    else {
+        bins_fill(b, begin, end, cb, scale, &bins);
+    }
+
+    f32 best_cost = FLT_MAX;
+    u32 best_axis = 0;
+    u32 best_bin = 0;
+
+    for (u32 a = 0; a < 3; ++a) {
+        if (extent[a] <= 0.0f) {
+            continue;
+        }
+
+        // right_cost[i] is the cost of bins i+1.. on the right.
+        f32 right_cost[BVH_BIN_COUNT];
+        AABB right = aabb_empty();
+        u32 right_count = 0;
+
+        for (u32 i = BVH_BIN_COUNT - 1; i > 0; --i) {
+            aabb_grow(&right, bins.bins[a][i].bounds);
+            right_count += bins.bins[a][i].count;
+            right_cost[i - 1] = aabb_area(right) * (f32)right_count;
+        }
+
+        AABB left = aabb_empty();
+        u32 left_count = 0;
+
+        for (u32 i = 0; i < BVH_BIN_COUNT - 1; ++i) {
+            aabb_grow(&left, bins.bins[a][i].bounds);
+            left_count += bins.bins[a][i].count;
+
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+
+            f32 cost = aabb_area(left) * (f32)left_count + right_cost[i];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = i;
+            }
+        }
+    }
+
+    if (best_cost == FLT_MAX) {
+        // Fall back to halving along the widest axis.
+        best_axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : (extent[1] >= extent[2] ? 1 : 2);
+        best_bin = BVH_BIN_COUNT / 2 - 1;
+    }
+
+    f32 lo = axis(cb.aabb_min, best_axis);
+    f32 s = scale[best_axis];
+
+    u32 i = begin;
+    u32 j = end;
+
+    while (i < j) {
+        if (bin_index(axis(b->centroids[b->items[i]], best_axis), lo, s) <= best_bin) {
+            i++;
+        }
+        else {
+            j--;
+            u32 temp = b->items[i];
+            b->items[i] = b->items[j];
+            b->items[j] = temp;
+        }
+    }
+
+    if (i == begin || i == end) {
+        return median;
+    }
+
+    return i;
+}
+
+static void init_internal(BVHBuilder* b, u32 node, u32 parent, u32 left, u32 right) {
+    BVHNode* n = &b->bvh->nodes[node];
+    n->parent = parent;
+    n->left = left;
+    n->right = right;
+    n->item = BVH_NONE;
+}
+
+// A subtree over n items occupies 2n-1 consecutive nodes: the node itself, then the left subtree, then the right.
+static void build_subtree(BVHBuilder* b, u32 node, u32 parent, u32 begin, u32 end, u32 depth) {
+    BVHNode* n = &b->bvh->nodes[node];
+
+    if (end - begin == 1) {
+        u32 item = b->items[begin];
+        n->bounds = b->bounds[item];
+        n->parent = parent;
+        n->left = BVH_NONE;
+        n->right = BVH_NONE;
+        n->item = item;
+        b->bvh->item_leaves[item] = node;
+        return;
+    }
+
+    BVHRange range = { begin, end, centroid_bounds_of(b, begin, end) };
+    u32 mid = split_range(b, &range, depth);
+
+    u32 left = node + 1;
+    u32 right = node + 2 * (mid - begin);
+    init_internal(b, node, parent, left, right);
+
+    build_subtree(b, left, node, begin, mid, depth + 1);
+    build_subtree(b, right, node, mid, end, depth + 1);
+
+    BVHNode* nodes = b->bvh->nodes.mem;
+    nodes[node].bounds = aabb_union(nodes[left].bounds, nodes[right].bounds);
+}
+
+struct BVHBuildTask {
+    u32 node;
+    u32 parent;
+    u32 begin;
+    u32 end;
+    u32 depth;
+};
+
+void BVH::build(u32 count, AABB* bounds) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    nodes.clear();
+    free_nodes.clear();
+    item_leaves.clear();
+    root = BVH_NONE;
+    refit_order_dirty = true;
+
+    item_leaves.resize(count);
+
+    if (count == 0) {
+        return;
+    }
+
+    nodes.resize(2 * count - 1);
+
+    BVHBuilder b = {};
+    b.bvh = this;
+    b.bounds = bounds;
+    b.centroids = scratch->push_array<XMFLOAT3>(count);
+    b.items = scratch->push_array<u32>(count);
+
+    parallel_for(count, 4096, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            AABB box = bounds[i];
+            b.centroids[i] = { (box.aabb_min.x + box.aabb_max.x) * 0.5f, (box.aabb_min.y + box.aabb_max.y) * 0.5f, (box.aabb_min.z + box.aabb_max.z) * 0.5f };
+            b.items[i] = i;
+        }
+    });
+
+    root = 0;
+
+    // Split the top levels one at a time, largest range first, until there is enough work to go around.
+    ArenaVec<BVHBuildTask> tasks = {};
+    tasks.arena = scratch.arena;
+    ArenaVec<u32> top_nodes = {};
+    top_nodes.arena = scratch.arena;
+
+    tasks.push({ 0, BVH_NONE, 0, count, 0 });
+
+    u32 target_task_count = jobs_thread_count() * 4;
+
+    while (tasks.len < target_task_count) {
+        u32 largest = BVH_NONE;
+
+        for (u32 i = 0; i < tasks.len; ++i) {
+            u32 size = tasks[i].end - tasks[i].begin;
+            if (size > BVH_SUBTREE_SIZE && (largest == BVH_NONE || size > tasks[largest].end - tasks[largest].begin)) {
+                largest = i;
+            }
+        }
+
+        if (largest == BVH_NONE) {
+            break;
+        }
+
+        BVHBuildTask task = tasks[largest];
+        tasks[largest] = tasks[tasks.len - 1];
+        tasks.len--;
+
+        AABB centroid_bounds = aabb_empty();
+
+        if (task.end - task.begin >= BVH_PARALLEL_BIN_SIZE) {
+            u32 chunk_count = (task.end - task.begin + BVH_PARALLEL_BIN_SIZE / 4 - 1) / (BVH_PARALLEL_BIN_SIZE / 4);
+            AABB* chunk_bounds = scratch->push_array<AABB>(chunk_count);
+
+            parallel_for(chunk_count, 1, [&](u32 first, u32 last) {
+                for (u32 chunk = first; chunk < last; ++chunk) {
+                    u32 chunk_begin = task.begin + chunk * (BVH_PARALLEL_BIN_SIZE / 4);
+                    chunk_bounds[chunk] = centroid_bounds_of(&b, chunk_begin, min(chunk_begin + BVH_PARALLEL_BIN_SIZE / 4, task.end));
+                }
+            });
+
+            for (u32 chunk = 0; chunk < chunk_count; ++chunk) {
+                aabb_grow(&centroid_bounds, chunk_bounds[chunk]);
+            }
+        }
+        else {
+            centroid_bounds = centroid_bounds_of(&b, task.begin, task.end);
+        }
+
+        BVHRange range = { task.begin, task.end, centroid_bounds };
+        u32 mid = split_range(&b, &range, task.depth);
+
+        u32 left = task.node + 1;
+        u32 right = task.node + 2 * (mid - task.begin);
+        init_internal(&b, task.node, task.parent, left, right);
+        top_nodes.push(task.node);
+
+        tasks.push({ left, task.node, task.begin, mid, task.depth + 1 });
+        tasks.push({ right, task.node, mid, task.end, task.depth + 1 });
+    }
+
+    parallel_for(tasks.len, 1, [&](u32 first, u32 last) {
+        for (u32 i = first; i < last; ++i) {
+            BVHBuildTask* task = &tasks[i];
+            build_subtree(&b, task->node, task->parent, task->begin, task->end, task->depth);
+        }
+    });
+
+    // Parents were split before their children, so walking back up finishes children first.
+    for (u32 i = top_nodes.len; i-- > 0;) {
+        BVHNode* n = &nodes[top_nodes[i]];
+        n->bounds = aabb_union(nodes[n->left].bounds, nodes[n->right].bounds);
+    }
+}
+
+// Refit
+
+void BVH::refit(AABB* bounds) {
+    PROFILE_FUNCTION();
+
+    if (root == BVH_NONE) {
+        return;
+    }
+
+    if (refit_order_dirty) {
+        // Post order, so every node comes after both of its children.
+        refit_order.clear();
+
+        Scratch scratch = get_scratch(0);
+        ArenaVec<u32> stack = {};
+        stack.arena = scratch.arena;
+        stack.push(root);
+
+        while (stack.len > 0) {
+            u32 index = stack.mem[--stack.len];
+            refit_order.push(index);
+
+            BVHNode* n = &nodes[index];
+            if (!is_leaf(n)) {
+                stack.push(n->left);
+                stack.push(n->right);
+            }
+        }
+
+        // That was pre order with children after parents; reversed, parents come after children.
+        for (u32 i = 0, j = refit_order.len - 1; i < j; ++i, --j) {
+            u32 temp = refit_order[i];
+            refit_order[i] = refit_order[j];
+            refit_order[j] = temp;
+        }
+
+        refit_order_dirty = false;
+    }
+
+    BVHNode* n = nodes.mem;
+
+    for (u32 i = 0; i < refit_order.len; ++i) {
+        BVHNode* node = &n[refit_order[i]];
+
+        if (is_leaf(node)) {
+            node->bounds = bounds[node->item];
+        }
+        else {
+            node->bounds = aabb_union(n[node->left].bounds, n[node->right].bounds);
+        }
+    }
+}
+
+// Incremental updates
+
+static u32 alloc_node(BVH* bvh) {
+    if (bvh->free_nodes.len > 0) {
+        return bvh->free_nodes.pop();
+    }
+
+    bvh->nodes.push({});
+    return bvh->nodes.len - 1;
+}
+
+static void refit_ancestors(BVH* bvh, u32 index) {
+    BVHNode* n = bvh->nodes.mem;
+
+    while (index != BVH_NONE) {
+        n[index].bounds = aabb_union(n[n[index].left].bounds, n[n[index].right].bounds);
+        index = n[index].parent;
+    }
+}
+
+void BVH::insert(u32 item, AABB bounds) {
+    if (item >= item_leaves.len) {
+        u32 old_len = item_leaves.len;
+        item_leaves.resize(item + 1);
+
+        for (u32 i = old_len; i < item_leaves.len; ++i) {
+            item_leaves[i] = BVH_NONE;
+        }
+    }
+
+    assert(item_leaves[item] == BVH_NONE && "item is already in the bvh");
+
+    u32 leaf = alloc_node(this);
+    nodes[leaf] = { bounds, BVH_NONE, BVH_NONE, BVH_NONE, item };
+    item_leaves[item] = leaf;
+    refit_order_dirty = true;
+
+    if (root == BVH_NONE) {
+        root = leaf;
+        return;
+    }
+
+    // Walk down towards the sibling that grows the tree's surface area the least.
+    u32 index = root;
+
+    while (!is_leaf(&nodes[index])) {
+        BVHNode* n = &nodes[index];
+
+        f32 area = aabb_area(n->bounds);
+        f32 combined = aabb_area(aabb_union(n->bounds, bounds));
+
+        // Pairing with this node directly, versus pushing the leaf further down and growing this node on the way.
+        f32 cost_here = 2.0f * combined;
+        f32 inherited = 2.0f * (combined - area);
+
+        auto descend_cost = [&](u32 child) {
+            BVHNode* c = &nodes[child];
+            f32 grown = aabb_area(aabb_union(c->bounds, bounds));
+            return (is_leaf(c) ? grown : grown - aabb_area(c->bounds)) + inherited;
+        };
+
+        f32 cost_left = descend_cost(n->left);
+        f32 cost_right = descend_cost(n->right);
+
+        if (cost_here < cost_left && cost_here < cost_right) {
+            break;
+        }
+
+        index = cost_left < cost_right ? n->left : n->right;
+    }
+
+    u32 sibling = index;
+    u32 old_parent = nodes[sibling].parent;
+    u32 new_parent = alloc_node(this);
+
+    nodes[new_parent] = { aabb_union(nodes[sibling].bounds, bounds), old_parent, sibling, leaf, BVH_NONE };
+    nodes[sibling].parent = new_parent;
+    nodes[leaf].parent = new_parent;
+
+    if (old_parent == BVH_NONE) {
+        root = new_parent;
+    }
+    else {
+        BVHNode* p = &nodes[old_parent];
+        if (p->left == sibling) {
+            p->left = new_parent;
+        }
+        else {
+            p->right = new_parent;
+        }
+
+        refit_ancestors(this, old_parent);
+    }
+}
+
+void BVH::remove(u32 item) {
+    assert(item < item_leaves.len && item_leaves[item] != BVH_NONE && "item is not in the bvh");
+
+    u32 leaf = item_leaves[item];
+    item_leaves[item] = BVH_NONE;
+    refit_order_dirty = true;
+
+    if (leaf == root) {
+        root = BVH_NONE;
+        free_nodes.push(leaf);
+        return;
+    }
+
+    // The parent goes away and the sibling takes its place.
+    u32 parent = nodes[leaf].parent;
+    u32 grandparent = nodes[parent].parent;
+    u32 sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+    nodes[sibling].parent = grandparent;
+
+    if (grandparent == BVH_NONE) {
+        root = sibling;
+    }
+    else {
+        BVHNode* g = &nodes[grandparent];
+        if (g->left == parent) {
+            g->left = sibling;
+        }
+        else {
+            g->right = sibling;
+        }
+
+        refit_ancestors(this, grandparent);
+    }
+
+    free_nodes.push(leaf);
+    free_nodes.push(parent);
+}
+
+// Queries
+
+enum FrustumOverlap {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE,
+};
+
+static FrustumOverlap frustum_overlap(Frustum* frustum, AABB box) {
+    FrustumOverlap result = FRUSTUM_INSIDE;
+
+    for (int p = 0; p < 6; ++p) {
+        XMFLOAT4 plane = frustum->planes[p];
+
+        // The corners furthest along and against the plane normal.
+        f32 far_x = plane.x >= 0.0f ? box.aabb_max.x : box.aabb_min.x;
+        f32 far_y = plane.y >= 0.0f ? box.aabb_max.y : box.aabb_min.y;
+        f32 far_z = plane.z >= 0.0f ? box.aabb_max.z : box.aabb_min.z;
+        f32 near_x = plane.x >= 0.0f ? box.aabb_min.x : box.aabb_max.x;
+        f32 near_y = plane.y >= 0.0f ? box.aabb_min.y : box.aabb_max.y;
+        f32 near_z = plane.z >= 0.0f ? box.aabb_min.z : box.aabb_max.z;
+
+        if (far_x * plane.x + far_y * plane.y + far_z * plane.z + plane.w < 0.0f) {
+            return FRUSTUM_OUTSIDE;
+        }
+
+        if (near_x * plane.x + near_y * plane.y + near_z * plane.z + plane.w < 0.0f) {
+            result = FRUSTUM_INTERSECTS;
+        }
+    }
+
+    return result;
+}
+
+static void collect_subtree(BVH* bvh, u32 index, Vec<u32>* out) {
+    // Incremental inserts don't rebalance, so the depth has no fixed bound and the stack lives on the scratch arena.
+    Scratch scratch = get_scratch(0);
+    ArenaVec<u32> stack = {};
+    stack.arena = scratch.arena;
+    stack.push(index);
+
+    while (stack.len > 0) {
+        BVHNode* n = &bvh->nodes[stack.pop()];
+
+        if (is_leaf(n)) {
+            out->push(n->item);
+        }
+        else {
+            stack.push(n->left);
+            stack.push(n->right);
+        }
+    }
+}
+
+void BVH::query_frustum(Frustum* frustum, Vec<u32>* out) {
+    if (root == BVH_NONE) {
+        return;
+    }
+
+    Scratch scratch = get_scratch(0);
+    ArenaVec<u32> stack = {};
+    stack.arena = scratch.arena;
+    stack.push(root);
+
+    while (stack.len > 0) {
+        u32 index = stack.pop();
+        BVHNode* n = &nodes[index];
+
+        switch (frustum_overlap(frustum, n->bounds)) {
+            case FRUSTUM_OUTSIDE:
+                break;
+            case FRUSTUM_INSIDE:
+                collect_subtree(this, index, out);
+                break;
+            case FRUSTUM_INTERSECTS:
+                if (is_leaf(n)) {
+                    out->push(n->item);
+                }
+                else {
+                    stack.push(n->left);
+                    stack.push(n->right);
+                }
+                break;
+        }
+    }
+}
+
+void BVH::query_sphere(XMVECTOR center, f32 radius, Vec<u32>* out) {
+    if (root == BVH_NONE) {
+        return;
+    }
+
+    XMFLOAT3 c;
+    XMStoreFloat3(&c, center);
+    f32 radius_sq = radius * radius;
+
+    Scratch scratch = get_scratch(0);
+    ArenaVec<u32> stack = {};
+    stack.arena = scratch.arena;
+    stack.push(root);
+
+    while (stack.len > 0) {
+        BVHNode* n = &nodes[stack.pop()];
+
+        f32 dx = max(max(n->bounds.aabb_min.x - c.x, c.x - n->bounds.aabb_max.x), 0.0f);
+        f32 dy = max(max(n->bounds.aabb_min.y - c.y, c.y - n->bounds.aabb_max.y), 0.0f);
+        f32 dz = max(max(n->bounds.aabb_min.z - c.z, c.z - n->bounds.aabb_max.z), 0.0f);
+
+        if (dx * dx + dy * dy + dz * dz > radius_sq) {
+            continue;
+        }
+
+        if (is_leaf(n)) {
+            out->push(n->item);
+        }
+        else {
+            stack.push(n->left);
+            stack.push(n->right);
+        }
+    }
+}
+
+void BVH::query_box(AABB box, Vec<u32>* out) {
+    if (root == BVH_NONE) {
+        return;
+    }
+
+    Scratch scratch = get_scratch(0);
+    ArenaVec<u32> stack = {};
+    stack.arena = scratch.arena;
+    stack.push(root);
+
+    while (stack.len > 0) {
+        BVHNode* n = &nodes[stack.pop()];
+
+        if (!aabb_overlaps(n->bounds, box)) {
+            continue;
+        }
+
+        if (is_leaf(n)) {
+            out->push(n->item);
+        }
+        else {
+            stack.push(n->left);
+            stack.push(n->right);
+        }
+    }
+}
+
+// Slab test. Returns the entry distance, or FLT_MAX on a miss.
+static f32 ray_box(AABB box, XMFLOAT3 origin, XMFLOAT3 inv_dir, f32 max_t) {
+    f32 tx0 = (box.aabb_min.x - origin.x) * inv_dir.x;
+    f32 tx1 = (box.aabb_max.x - origin.x) * inv_dir.x;
+    f32 ty0 = (box.aabb_min.y - origin.y) * inv_dir.y;
+    f32 ty1 = (box.aabb_max.y - origin.y) * inv_dir.y;
+    f32 tz0 = (box.aabb_min.z - origin.z) * inv_dir.z;
+    f32 tz1 = (box.aabb_max.z - origin.z) * inv_dir.z;
+
+    f32 t_enter = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), 0.0f));
+    f32 t_exit = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), max_t));
+
+    return t_enter <= t_exit ? t_enter : FLT_MAX;
+}
+
+bool BVH::raycast(XMVECTOR origin, XMVECTOR direction, f32 max_t, u32* out_item, f32* out_t) {
+    if (root == BVH_NONE) {
+        return false;
+    }
+
+    XMFLOAT3 o, d;
+    XMStoreFloat3(&o, origin);
+    XMStoreFloat3(&d, direction);
+
+    // Division by zero gives infinities, which the slab test handles as long as the origin isn't on a slab plane.
+    XMFLOAT3 inv_dir = { 1.0f / d.x, 1.0f / d.y, 1.0f / d.z };
+
+    f32 best_t = max_t;
+    u32 best_item = BVH_NONE;
+
+    if (ray_box(nodes[root].bounds, o, inv_dir, best_t) == FLT_MAX) {
+        return false;
+    }
+
+    Scratch scratch = get_scratch(0);
+    ArenaVec<u32> stack = {};
+    stack.arena = scratch.arena;
+    stack.push(root);
+
+    while (stack.len > 0) {
+        BVHNode* n = &nodes[stack.pop()];
+
+        if (is_leaf(n)) {
+            f32 t = ray_box(n->bounds, o, inv_dir, best_t);
+            if (t < best_t || (t == best_t && best_item == BVH_NONE)) {
+                best_t = t;
+                best_item = n->item;
+            }
+            continue;
+        }
+
+        f32 t_left = ray_box(nodes[n->left].bounds, o, inv_dir, best_t);
+        f32 t_right = ray_box(nodes[n->right].bounds, o, inv_dir, best_t);
+
+        // Push the far child first so the near one is visited next and can shrink best_t.
+        if (t_left <= t_right) {
+            if (t_right != FLT_MAX) stack.push(n->right);
+            if (t_left != FLT_MAX) stack.push(n->left);
+        }
+        else {
+            if (t_left != FLT_MAX) stack.push(n->left);
+            if (t_right != FLT_MAX) stack.push(n->right);
+        }
+    }
+
+    if (best_item == BVH_NONE) {
+        return false;
+    }
+
+    *out_item = best_item;
+    *out_t = best_t;
+    return true;
+}
+
+void BVH::free() {
+    nodes.free();
+    free_nodes.free();
+    item_leaves.free();
+    refit_order.free();
+    root = BVH_NONE;
+}
+
+// Benchmark
+
+static int compare_u32(const void* a, const void* b) {
+    u32 x = *(u32*)a;
+    u32 y = *(u32*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Both lists as sets. Sorts visible in place; reference is already in index order.
+static bool same_items(Vec<u32>* visible, Vec<u32>* reference) {
+    if (visible->len != reference->len) {
+        return false;
+    }
+
+    qsort(visible->mem, visible->len, sizeof(u32), compare_u32);
+
+    for (u32 i = 0; i < visible->len; ++i) {
+        if ((*visible)[i] != (*reference)[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void bvh_benchmark(u32 instance_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32 seed = 0x2545f491;
+    auto random_f32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (f32)(seed & 0xffffff) / (f32)0x1000000;
+    };
+
+    AABB* bounds = scratch->push_array<AABB>(instance_count);
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        XMFLOAT3 c = { random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f };
+        f32 e = 0.5f + random_f32() * 2.5f;
+        bounds[i] = { {c.x - e, c.y - e, c.z - e}, {c.x + e, c.y + e, c.z + e} };
+    }
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+    auto elapsed_ms = [&](u64 start) { return (f64)(pf_ticks() - start) * ms_per_tick; };
+
+    BVH bvh = {};
+
+    u64 start = pf_ticks();
+    bvh.build(instance_count, bounds);
+    f64 build_ms = elapsed_ms(start);
+
+    // Move everything a little and refit. The first refit also computes the traversal order.
+    for (u32 i = 0; i < instance_count; ++i) {
+        f32 dx = random_f32() - 0.5f;
+        bounds[i].aabb_min.x += dx;
+        bounds[i].aabb_max.x += dx;
+    }
+
+    bvh.refit(bounds);
+
+    start = pf_ticks();
+    bvh.refit(bounds);
+    f64 refit_ms = elapsed_ms(start);
+
+    // Frustum query, checked against testing every box on its own.
+    XMMATRIX view = XMMatrixLookAtRH(XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 1.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+    XMMATRIX projection = XMMatrixPerspectiveFovRH(XM_PIDIV4, 16.0f/9.0f, 1000.0f, 0.1f);
+    Frustum frustum = frustum_from_view_projection(view * projection);
+
+    Vec<u32> visible = {};
+
+    start = pf_ticks();
+    bvh.query_frustum(&frustum, &visible);
+    f64 frustum_ms = elapsed_ms(start);
+
+    Vec<u32> reference = {};
+    reference.reserve(visible.len);
+
+    start = pf_ticks();
+    for (u32 i = 0; i < instance_count; ++i) {
+        if (frustum_overlap(&frustum, bounds[i]) != FRUSTUM_OUTSIDE) {
+            reference.push(i);
+        }
+    }
+    f64 brute_ms = elapsed_ms(start);
+
+    bool frustum_matches = same_items(&visible, &reference);
+    assert(frustum_matches && "bvh frustum query disagrees with brute force");
+
+    // Rays from random points in random directions.
+    const u32 ray_count = 10000;
+    u32 hits = 0;
+
+    start = pf_ticks();
+    for (u32 i = 0; i < ray_count; ++i) {
+        XMVECTOR origin = XMVectorSet(random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, 1.0f);
+        XMVECTOR direction = XMVector3Normalize(XMVectorSet(random_f32() - 0.5f, random_f32() - 0.5f, random_f32() - 0.5f, 0.0f));
+
+        u32 item;
+        f32 t;
+        hits += bvh.raycast(origin, direction, 2000.0f, &item, &t);
+    }
+    f64 ray_ms = elapsed_ms(start);
+
+    const u32 sphere_count = 10000;
+    u64 sphere_results = 0;
+    Vec<u32> found = {};
+
+    start = pf_ticks();
+    for (u32 i = 0; i < sphere_count; ++i) {
+        found.clear();
+        XMVECTOR center = XMVectorSet(random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, 1.0f);
+        bvh.query_sphere(center, 20.0f, &found);
+        sphere_results += found.len;
+    }
+    f64 sphere_ms = elapsed_ms(start);
+
+    // Remove and reinsert a slice of the items.
+    u32 update_count = min(instance_count, 10000u);
+
+    start = pf_ticks();
+    for (u32 i = 0; i < update_count; ++i) {
+        bvh.remove(i);
+        bvh.insert(i, bounds[i]);
+    }
+    f64 update_ms = elapsed_ms(start);
+
+    visible.clear();
+    bvh.query_frustum(&frustum, &visible);
+    bool update_matches = same_items(&visible, &reference);
+    assert(update_matches && "bvh frustum query disagrees with brute force after reinsertion");
+
+    pf_debug_log("bvh: %u instances, build %.2fms, refit %.2fms on %u threads\n", instance_count, build_ms, refit_ms, jobs_thread_count());
+    pf_debug_log("bvh: frustum %.3fms (brute force %.3fms), %u visible, %s\n", frustum_ms, brute_ms, reference.len,
+        frustum_matches && update_matches ? "matches brute force" : "MISMATCH");
+    pf_debug_log("bvh: %u rays %.2fms (%u hits), %u sphere queries %.2fms (%llu results), %u remove+insert %.2fms\n",
+        ray_count, ray_ms, hits, sphere_count, sphere_ms, sphere_results, update_count, update_ms);
+
+    found.free();
+    reference.free();
+    visible.free();
+    bvh.free();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "culling.h"
+
+#define BVH_NONE UINT32_MAX
+
+struct AABB {
+    XMFLOAT3 aabb_min;
+    XMFLOAT3 aabb_max;
+};
+
+// World bounds of a local box under an affine transform.
+AABB aabb_transform(XMFLOAT3 aabb_min, XMFLOAT3 aabb_max, XMMATRIX transform);
+
+// Leaves hold exactly one item. Children of an internal node are always both present.
+struct BVHNode {
+    AABB bounds;
+    u32 parent;
+    u32 left;
+    u32 right;
+    u32 item;
+};
+
+// Bounding volume hierarchy over caller-owned items, identified by index.
+// build() makes a binned SAH tree across the job threads; insert/remove keep it valid incrementally
+// and refit() updates bounds in place when items move without changing the topology.
+struct BVH {
+    Vec<BVHNode> nodes;
+    Vec<u32> free_nodes;
+    Vec<u32> item_leaves;
+    u32 root;
+
+    Vec<u32> refit_order;
+    bool refit_order_dirty;
+
+    void build(u32 count, AABB* bounds);
+    void refit(AABB* bounds);
+
+    void insert(u32 item, AABB bounds);
+    void remove(u32 item);
+
+    // Appends matching items to out.
+    void query_frustum(Frustum* frustum, Vec<u32>* out);
+    void query_sphere(XMVECTOR center, f32 radius, Vec<u32>* out);
+    void query_box(AABB box, Vec<u32>* out);
+
+    // Closest item whose bounds the ray hits within max_t. direction need not be normalized; t is in its units.
+    bool raycast(XMVECTOR origin, XMVECTOR direction, f32 max_t, u32* out_item, f32* out_t);
+
+    void free();
+};
+
+// Builds, refits and queries a BVH over instance_count random boxes and logs the throughput of each.
+void bvh_benchmark(u32 instance_count);
@@ -5,6 +5,12 @@
 #include <memory.h>
 #include <string.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+
 #define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
 
 #define PI32 3.1415926535f 
@@ -22,6 +28,18 @@ typedef int64_t i64;
 typedef float f32;
 typedef double f64;
 
+// Functions rather than macros, so arguments are evaluated once and both sides must have the same type. Windows.h's
+// macros are kept out with NOMINMAX.
+template<typename T>
+inline T min(T a, T b) {
+    return a < b ? a : b;
+}
+
+template<typename T>
+inline T max(T a, T b) {
+    return a > b ? a : b;
+}
+
 inline void sanitise_path(char* str) {
     for (char* c = str; *c; ++c) {
         if (*c == '\\') {
@@ -46,6 +64,19 @@ struct Vec {
         return mem[len-1];
     }
 
+    void reserve(u32 new_cap) {
+        if (new_cap > cap) {
+            cap = new_cap;
+            mem = (T*)realloc(mem, cap * sizeof(T));
+        }
+    }
+
+    // New elements are left uninitialized.
+    void resize(u32 new_len) {
+        reserve(new_len);
+        len = new_len;
+    }
+
     bool empty() {
         return len == 0;
     }
@@ -120,6 +151,12 @@ struct StaticVec {
 
 inline struct Arena arena_init(void* mem, u64 size);
 
+// Pages of reserved memory are committed this many bytes at a time.
+#define ARENA_COMMIT_SIZE (1024 * 1024)
+
+// Commits size bytes of reserved memory at mem, or doesn't return.
+using ArenaCommitProc = void (*)(void* mem, u64 size);
+
 struct Arena {
     u64 size;
     u64 allocated;
@@ -127,18 +164,29 @@ struct Arena {
 
     u64 save_state;
 
+    // Only reserved arenas commit on demand. Everything else is committed up front, so committed is size.
+    u64 committed;
+    ArenaCommitProc commit;
+
     void* push(u64 s) {
         if (s == 0) {
             return 0;
         }
 
-        s = (s + 7) & ~7;
+        // Keeps every push aligned for XMMATRIX and other SSE types.
+        s = (s + 15) & ~15;
 
         assert(size-allocated >= s && "arena out of memory");
 
         void* ptr = (u8*)mem + allocated;
         allocated += s;
 
+        if (allocated > committed) {
+            u64 end = min((allocated + ARENA_COMMIT_SIZE - 1) & ~(u64)(ARENA_COMMIT_SIZE - 1), size);
+            commit((u8*)mem + committed, end - committed);
+            committed = end;
+        }
+
         return ptr;
     }
 
@@ -187,6 +235,45 @@ struct Arena {
     }
 };
 
+// Growable array backed by an arena. Old storage is abandoned on growth, so this suits short-lived (per-frame) arenas.
+template<typename T>
+struct ArenaVec {
+    Arena* arena;
+    T* mem;
+    u32 cap;
+    u32 len;
+
+    T& push(T t) {
+        if (len + 1 > cap) {
+            cap = cap < 8 ? 8 : cap * 2;
+            T* new_mem = (T*)arena->push(cap * sizeof(T));
+            memcpy(new_mem, mem, len * sizeof(T));
+            mem = new_mem;
+        }
+
+        mem[len++] = t;
+        return mem[len-1];
+    }
+
+    T pop() {
+        assert(len > 0);
+        return mem[--len];
+    }
+
+    bool empty() {
+        return len == 0;
+    }
+
+    T& at(u32 i) {
+        assert(i < len);
+        return mem[i];
+    }
+
+    T& operator[](u32 i) {
+        return at(i);
+    }
+};
+
 template<typename T>
 struct PoolAllocator {
     struct Node {
@@ -227,6 +314,16 @@ inline Arena arena_init(void* mem, u64 size) {
     Arena arena = {};
     arena.size = size;
     arena.mem = mem;
+    arena.committed = size;
+    return arena;
+}
+
+// mem is only reserved, and is committed as pushes reach it.
+inline Arena arena_init_reserved(void* mem, u64 size, ArenaCommitProc commit) {
+    Arena arena = {};
+    arena.size = size;
+    arena.mem = mem;
+    arena.commit = commit;
     return arena;
 }
 
@@ -265,3 +362,73 @@ inline void swap(T& a, T& b) {
     a = b;
     b = temp;
 }
+
+inline u32 count_trailing_zeros(u32 x) {
+    assert(x);
+    #ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (u32)index;
+    #else
+    return (u32)__builtin_ctz(x);
+    #endif
+}
+
+inline u32 atomic_add(volatile u32* dst, u32 value) {
+    #ifdef _MSC_VER
+    return (u32)_InterlockedExchangeAdd((volatile long*)dst, (long)value) + value;
+    #else
+    return __atomic_add_fetch(dst, value, __ATOMIC_SEQ_CST);
+    #endif
+}
+
+inline u32 atomic_increment(volatile u32* dst) {
+    return atomic_add(dst, 1);
+}
+
+inline u64 atomic_add_u64(volatile u64* dst, u64 value) {
+    #ifdef _MSC_VER
+    return (u64)_InterlockedExchangeAdd64((volatile long long*)dst, (long long)value) + value;
+    #else
+    return __atomic_add_fetch(dst, value, __ATOMIC_SEQ_CST);
+    #endif
+}
+
+inline u32 atomic_compare_exchange(volatile u32* dst, u32 exchange, u32 comparand) {
+    #ifdef _MSC_VER
+    return (u32)_InterlockedCompareExchange((volatile long*)dst, (long)exchange, (long)comparand);
+    #else
+    __atomic_compare_exchange_n(dst, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+    #endif
+}
+
+inline void atomic_store(volatile u32* dst, u32 value) {
+    #ifdef _MSC_VER
+    *dst = value; // Volatile stores have release semantics under MSVC on x64.
+    #else
+    __atomic_store_n(dst, value, __ATOMIC_RELEASE);
+    #endif
+}
+
+inline u32 atomic_load(volatile u32* src) {
+    #ifdef _MSC_VER
+    return (u32)_InterlockedOr((volatile long*)src, 0);
+    #else
+    return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+    #endif
+}
+
+struct SpinLock {
+    volatile u32 locked;
+
+    void lock() {
+        while (atomic_compare_exchange(&locked, 1, 0) != 0) {
+            _mm_pause();
+        }
+    }
+
+    void unlock() {
+        atomic_compare_exchange(&locked, 0, 1);
+    }
+};
@@ -0,0 +1,77 @@
+#include "gltf.h"
+#include "scene.h"
+#include "cook.h"
+#include "profiler.h"
+
+CookResult cook_scene(DerivedDataCache* ddc, const char* source_path, const char* cooked_path) {
+    PROFILE_FUNCTION();
+
+    CookResult result = {};
+
+    u64 start = pf_ticks();
+    u64 source_key = gltf_source_key(source_path, true);
+
+    FileContents cooked = pf_map_file(cooked_path);
+    SceneCookInfo cooked_info;
+    bool up_to_date = scene_read_cooked_info(cooked, &cooked_info) && cooked_info.source_key == source_key;
+    pf_unmap_file(cooked);
+
+    if (up_to_date) {
+        result.status = COOK_UP_TO_DATE;
+        result.ticks = pf_ticks() - start;
+        result.saved_ticks = cooked_info.cook_microseconds * pf_ticks_per_second() / 1000000;
+        return result;
+    }
+
+    Scratch scratch = get_scratch(0);
+
+    SceneData data = gltf_import(scratch.arena, ddc, source_path, true);
+
+    SceneCookInfo info;
+    info.source_key = source_key;
+    info.cook_microseconds = (pf_ticks() - start) * 1000000 / pf_ticks_per_second();
+
+    result.status = scene_write_cooked(&data, &info, cooked_path) ? COOK_COOKED : COOK_FAILED;
+    result.ticks = pf_ticks() - start;
+    return result;
+}
+
+bool cook_scenes(DerivedDataCache* ddc, u32 path_count, char** paths) {
+    assert(path_count % 2 == 0);
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    u32 counts[3] = {};
+    u64 ticks = 0;
+    u64 saved_ticks = 0;
+
+    for (u32 i = 0; i < path_count; i += 2) {
+        CookResult result = cook_scene(ddc, paths[i], paths[i + 1]);
+
+        counts[result.status]++;
+        ticks += result.ticks;
+
+        switch (result.status) {
+            case COOK_UP_TO_DATE:
+                // Saved the last cook, less the hashing it took to find out.
+                saved_ticks += result.saved_ticks > result.ticks ? result.saved_ticks - result.ticks : 0;
+                pf_debug_log("%s: up to date, checked in %.2fms\n", paths[i + 1], (f64)result.ticks * ms_per_tick);
+                break;
+
+            case COOK_COOKED:
+                pf_debug_log("%s: cooked from %s in %.2fms\n", paths[i + 1], paths[i], (f64)result.ticks * ms_per_tick);
+                break;
+
+            case COOK_FAILED:
+                pf_debug_log("%s: failed to write\n", paths[i + 1]);
+                break;
+        }
+    }
+
+    pf_debug_log("cooked %u scenes in %.2fms, %u up to date, %u failed, up to date scenes saved %.2fms\n",
+        counts[COOK_COOKED], (f64)ticks * ms_per_tick, counts[COOK_UP_TO_DATE], counts[COOK_FAILED], (f64)saved_ticks * ms_per_tick);
+
+    ddc_report(ddc);
+
+    return counts[COOK_FAILED] == 0;
+}
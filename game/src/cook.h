@@ -0,0 +1,25 @@
+#pragma once
+
+#include "derived_data.h"
+
+enum CookStatus {
+    COOK_UP_TO_DATE,
+    COOK_COOKED,
+    COOK_FAILED,
+};
+
+struct CookResult {
+    CookStatus status;
+    u64 ticks;
+    // How long the cooked file took to make the last time, when it was up to date.
+    u64 saved_ticks;
+};
+
+// Imports a .gltf or .glb with static batching and writes it cooked, unless the cooked file was made from the same
+// sources by the same importer with the same settings, which only costs hashing the sources.
+CookResult cook_scene(DerivedDataCache* ddc, const char* source_path, const char* cooked_path);
+
+// paths are pairs of a source and a cooked path. Scenes are cooked one after the other, as each already spreads its
+// images and meshes across the job threads. Logs every scene and what the cache and the up to date scenes saved.
+// Returns false when any scene failed.
+bool cook_scenes(DerivedDataCache* ddc, u32 path_count, char** paths);
@@ -0,0 +1,182 @@
+#include "culling.h"
+#include "jobs.h"
+#include "platform.h"
+
+Frustum frustum_from_view_projection(XMMATRIX view_projection) {
+    // Rows of the transpose are the columns of the matrix, which is what the clip space inequalities combine.
+    XMMATRIX t = XMMatrixTranspose(view_projection);
+
+    XMVECTOR planes[6] = {
+        t.r[3] + t.r[0],
+        t.r[3] - t.r[0],
+        t.r[3] + t.r[1],
+        t.r[3] - t.r[1],
+        t.r[2],
+        t.r[3] - t.r[2],
+    };
+
+    Frustum frustum;
+
+    for (int i = 0; i < 6; ++i) {
+        XMStoreFloat4(&frustum.planes[i], XMPlaneNormalize(planes[i]));
+    }
+
+    return frustum;
+}
+
+CullSpheres push_cull_spheres(Arena* arena, u32 count) {
+    u32 padded = (count + CULL_BATCH_SIZE - 1) & ~(CULL_BATCH_SIZE - 1);
+
+    CullSpheres spheres = {};
+    spheres.count = count;
+    spheres.x = arena->push_array<f32>(padded);
+    spheres.y = arena->push_array<f32>(padded);
+    spheres.z = arena->push_array<f32>(padded);
+    spheres.radius = arena->push_array<f32>(padded);
+
+    return spheres;
+}
+
+// begin must be a multiple of CULL_BATCH_SIZE.
+static u32 frustum_cull_range(Frustum* frustum, CullSpheres* spheres, u32 begin, u32 end, u32* visible) {
+    __m128 px[6], py[6], pz[6], pw[6];
+
+    for (int p = 0; p < 6; ++p) {
+        px[p] = _mm_set1_ps(frustum->planes[p].x);
+        py[p] = _mm_set1_ps(frustum->planes[p].y);
+        pz[p] = _mm_set1_ps(frustum->planes[p].z);
+        pw[p] = _mm_set1_ps(frustum->planes[p].w);
+    }
+
+    __m128 zero = _mm_setzero_ps();
+    u32 count = 0;
+
+    for (u32 i = begin; i < end; i += CULL_BATCH_SIZE) {
+        __m128 x0 = _mm_loadu_ps(spheres->x + i);
+        __m128 x1 = _mm_loadu_ps(spheres->x + i + 4);
+        __m128 y0 = _mm_loadu_ps(spheres->y + i);
+        __m128 y1 = _mm_loadu_ps(spheres->y + i + 4);
+        __m128 z0 = _mm_loadu_ps(spheres->z + i);
+        __m128 z1 = _mm_loadu_ps(spheres->z + i + 4);
+        __m128 neg_r0 = _mm_sub_ps(zero, _mm_loadu_ps(spheres->radius + i));
+        __m128 neg_r1 = _mm_sub_ps(zero, _mm_loadu_ps(spheres->radius + i + 4));
+
+        __m128 inside0 = _mm_cmpeq_ps(zero, zero);
+        __m128 inside1 = inside0;
+
+        for (int p = 0; p < 6; ++p) {
+            __m128 d0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x0, px[p]), _mm_mul_ps(y0, py[p])), _mm_add_ps(_mm_mul_ps(z0, pz[p]), pw[p]));
+            __m128 d1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, px[p]), _mm_mul_ps(y1, py[p])), _mm_add_ps(_mm_mul_ps(z1, pz[p]), pw[p]));
+
+            inside0 = _mm_and_ps(inside0, _mm_cmpge_ps(d0, neg_r0));
+            inside1 = _mm_and_ps(inside1, _mm_cmpge_ps(d1, neg_r1));
+        }
+
+        u32 mask = (u32)_mm_movemask_ps(inside0) | ((u32)_mm_movemask_ps(inside1) << 4);
+
+        if (end - i < CULL_BATCH_SIZE) {
+            mask &= (1u << (end - i)) - 1;
+        }
+
+        while (mask) {
+            visible[count++] = i + count_trailing_zeros(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    return count;
+}
+
+u32 frustum_cull(Frustum* frustum, CullSpheres* spheres, u32* visible) {
+    Scratch scratch = get_scratch(0);
+
+    u32 job_count = (spheres->count + CULL_JOB_SIZE - 1) / CULL_JOB_SIZE;
+    u32* job_visible_counts = scratch->push_array<u32>(job_count);
+
+    // Each job writes to the part of visible that lines up with its input range, then the results are packed down.
+    parallel_for(job_count, 1, [&](u32 begin, u32 end) {
+        for (u32 job = begin; job < end; ++job) {
+            u32 first = job * CULL_JOB_SIZE;
+            u32 last = min(first + CULL_JOB_SIZE, spheres->count);
+            job_visible_counts[job] = frustum_cull_range(frustum, spheres, first, last, visible + first);
+        }
+    });
+
+    u32 total = 0;
+
+    for (u32 job = 0; job < job_count; ++job) {
+        memmove(visible + total, visible + job * CULL_JOB_SIZE, job_visible_counts[job] * sizeof(u32));
+        total += job_visible_counts[job];
+    }
+
+    return total;
+}
+
+static u32 frustum_cull_scalar(Frustum* frustum, CullSpheres* spheres, u32* visible) {
+    u32 count = 0;
+
+    for (u32 i = 0; i < spheres->count; ++i) {
+        bool inside = true;
+
+        for (int p = 0; p < 6; ++p) {
+            XMFLOAT4 plane = frustum->planes[p];
+            // Same association as the SIMD path so the results agree bit for bit.
+            f32 d = (spheres->x[i] * plane.x + spheres->y[i] * plane.y) + (spheres->z[i] * plane.z + plane.w);
+            inside &= d >= -spheres->radius[i];
+        }
+
+        if (inside) {
+            visible[count++] = i;
+        }
+    }
+
+    return count;
+}
+
+void frustum_cull_benchmark(u32 instance_count) {
+    Scratch scratch = get_scratch(0);
+
+    CullSpheres spheres = push_cull_spheres(scratch.arena, instance_count);
+
+    u32 seed = 0x9e3779b9;
+    auto random_f32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (f32)(seed & 0xffffff) / (f32)0x1000000;
+    };
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        XMVECTOR center = XMVectorSet(random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, random_f32() * 1000.0f - 500.0f, 1.0f);
+        spheres.set(i, center, 0.5f + random_f32() * 2.5f);
+    }
+
+    XMMATRIX view = XMMatrixLookAtRH(XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 1.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+    XMMATRIX projection = XMMatrixPerspectiveFovRH(XM_PIDIV4, 16.0f/9.0f, 1000.0f, 0.1f);
+    Frustum frustum = frustum_from_view_projection(view * projection);
+
+    u32* reference = scratch->push_array<u32>(instance_count);
+    u32* visible = scratch->push_array<u32>(instance_count);
+
+    u64 start = pf_ticks();
+    u32 reference_count = frustum_cull_scalar(&frustum, &spheres, reference);
+    u64 scalar_ticks = pf_ticks() - start;
+
+    const u32 iterations = 16;
+    u32 visible_count = 0;
+
+    start = pf_ticks();
+    for (u32 i = 0; i < iterations; ++i) {
+        visible_count = frustum_cull(&frustum, &spheres, visible);
+    }
+    u64 simd_ticks = pf_ticks() - start;
+
+    bool matches = visible_count == reference_count && memcmp(visible, reference, visible_count * sizeof(u32)) == 0;
+    assert(matches && "simd frustum culling disagrees with the scalar reference");
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    pf_debug_log("frustum_cull: %u instances, %u visible, scalar %.3fms, simd %.3fms on %u threads, %s\n",
+        instance_count, visible_count, (f64)scalar_ticks * ms_per_tick, (f64)simd_ticks * ms_per_tick / iterations,
+        jobs_thread_count(), matches ? "matches reference" : "MISMATCH");
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+
+// Spheres are tested 8 at a time, as two SSE lanes of 4.
+#define CULL_BATCH_SIZE 8
+#define CULL_JOB_SIZE (CULL_BATCH_SIZE * 512)
+
+// Planes are normalized, with the inside where dot(plane.xyz, p) + plane.w >= 0.
+struct Frustum {
+    XMFLOAT4 planes[6];
+};
+
+Frustum frustum_from_view_projection(XMMATRIX view_projection);
+
+// World space bounding spheres, structure of arrays. Each array is padded to a multiple of CULL_BATCH_SIZE.
+struct CullSpheres {
+    u32 count;
+    f32* x;
+    f32* y;
+    f32* z;
+    f32* radius;
+
+    void set(u32 i, XMVECTOR center, f32 r) {
+        x[i] = XMVectorGetX(center);
+        y[i] = XMVectorGetY(center);
+        z[i] = XMVectorGetZ(center);
+        radius[i] = r;
+    }
+};
+
+CullSpheres push_cull_spheres(Arena* arena, u32 count);
+
+// Writes the indices of every sphere touching the frustum to visible, in ascending order, and returns how many there are.
+// visible needs room for spheres->count indices. Runs across the job threads.
+u32 frustum_cull(Frustum* frustum, CullSpheres* spheres, u32* visible);
+
+// Culls instance_count random spheres a few times, checks the result against a scalar reference, and logs timings.
+void frustum_cull_benchmark(u32 instance_count);
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "derived_data.h"
+#include "profiler.h"
+
+#define DDC_ENTRY_MAGIC 0x43444444 // "DDDC"
+#define DDC_ENTRY_VERSION 1
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ull
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME64_3 0x165667b19e3779f9ull
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ull
+
+static u64 rotl64(u64 x, u32 r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static u64 read_u64(const u8* p) {
+    u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u32 read_u32(const u8* p) {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u64 xxh_round(u64 acc, u64 input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static u64 xxh_merge_round(u64 acc, u64 value) {
+    acc ^= xxh_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+u64 hash64(const void* data, u64 size, u64 seed) {
+    const u8* p = (const u8*)data;
+    const u8* end = p + size;
+
+    u64 h;
+
+    if (size >= 32) {
+        u64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        u64 v2 = seed + XXH_PRIME64_2;
+        u64 v3 = seed;
+        u64 v4 = seed - XXH_PRIME64_1;
+
+        const u8* limit = end - 32;
+
+        do {
+            v1 = xxh_round(v1, read_u64(p));
+            v2 = xxh_round(v2, read_u64(p + 8));
+            v3 = xxh_round(v3, read_u64(p + 16));
+            v4 = xxh_round(v4, read_u64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    }
+    else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += size;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, read_u64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (u64)read_u32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (u64)*p * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// Padded so the data that follows stays aligned for uploads.
+struct DDCEntryHeader {
+    u32 magic;
+    u32 version;
+    u64 key;
+    u64 size;
+    u64 hash;
+    u64 build_microseconds;
+    u8 padding[24];
+};
+
+static_assert(sizeof(DDCEntryHeader) == 64, "entry data should start 64 byte aligned");
+
+static void entry_path(DerivedDataCache* ddc, u64 key, char* path, u32 path_size) {
+    sprintf_s(path, path_size, "%s/%016llx", ddc->directory, (unsigned long long)key);
+}
+
+void ddc_init(DerivedDataCache* ddc, const char* directory) {
+    *ddc = {};
+    strcpy_s(ddc->directory, sizeof(ddc->directory), directory);
+
+    if (!pf_create_directory(directory)) {
+        pf_debug_log("%s: could not create the derived data cache, nothing will be kept\n", directory);
+    }
+}
+
+bool ddc_get(DerivedDataCache* ddc, u64 key, DDCEntry* entry) {
+    PROFILE_FUNCTION();
+
+    u64 start = pf_ticks();
+
+    char path[512];
+    entry_path(ddc, key, path, sizeof(path));
+
+    FileContents file = pf_map_file(path);
+    DDCEntryHeader* header = (DDCEntryHeader*)file.memory;
+
+    bool valid = file.size >= sizeof(DDCEntryHeader) &&
+        header->magic == DDC_ENTRY_MAGIC &&
+        header->version == DDC_ENTRY_VERSION &&
+        header->key == key &&
+        header->size == file.size - sizeof(DDCEntryHeader) &&
+        hash64(header + 1, header->size, key) == header->hash;
+
+    if (!valid) {
+        pf_unmap_file(file);
+        atomic_increment(&ddc->misses);
+        return false;
+    }
+
+    entry->file = file;
+    entry->data = header + 1;
+    entry->size = header->size;
+
+    u64 ticks = pf_ticks() - start;
+
+    atomic_increment(&ddc->hits);
+    atomic_add_u64(&ddc->bytes_read, file.size);
+    atomic_add_u64(&ddc->fetch_ticks, ticks);
+    atomic_add_u64(&ddc->saved_ticks, header->build_microseconds * pf_ticks_per_second() / 1000000);
+
+    return true;
+}
+
+void ddc_release(DDCEntry* entry) {
+    pf_unmap_file(entry->file);
+    *entry = {};
+}
+
+void ddc_put(DerivedDataCache* ddc, u64 key, void* data, u64 size, u64 build_ticks) {
+    PROFILE_FUNCTION();
+
+    atomic_add_u64(&ddc->build_ticks, build_ticks);
+
+    u8* file = (u8*)malloc(sizeof(DDCEntryHeader) + size);
+
+    DDCEntryHeader* header = (DDCEntryHeader*)file;
+    *header = {};
+    header->magic = DDC_ENTRY_MAGIC;
+    header->version = DDC_ENTRY_VERSION;
+    header->key = key;
+    header->size = size;
+    header->hash = hash64(data, size, key);
+    header->build_microseconds = build_ticks * 1000000 / pf_ticks_per_second();
+
+    memcpy(header + 1, data, size);
+
+    char path[512];
+    entry_path(ddc, key, path, sizeof(path));
+
+    if (pf_write_file(path, file, sizeof(DDCEntryHeader) + size)) {
+        atomic_add_u64(&ddc->bytes_written, sizeof(DDCEntryHeader) + size);
+    }
+
+    ::free(file);
+}
+
+void ddc_report(DerivedDataCache* ddc) {
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    pf_debug_log("%s: %u hits and %u misses, read %.2f MB in %.2fms and wrote %.2f MB, hits saved %.2fms, misses took %.2fms to make\n",
+        ddc->directory, ddc->hits, ddc->misses,
+        (f64)ddc->bytes_read / (1024.0 * 1024.0), (f64)ddc->fetch_ticks * ms_per_tick, (f64)ddc->bytes_written / (1024.0 * 1024.0),
+        (f64)ddc->saved_ticks * ms_per_tick - (f64)ddc->fetch_ticks * ms_per_tick, (f64)ddc->build_ticks * ms_per_tick);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include "platform.h"
+
+// Derived data is anything slow to make from source files, like compressed textures and simplified meshes. The cache
+// keeps it on disk, keyed by a hash of everything that went into it: the source bytes, the version of the code that
+// made it and the settings it was made with. Nothing is ever invalidated, a change to any of those just makes a new key.
+// Entries can be made and fetched from any thread.
+
+#define DDC_DIRECTORY "ddc"
+
+// XXH64, around 10 GB/s. Chain calls through seed to hash several pieces as one key.
+u64 hash64(const void* data, u64 size, u64 seed);
+
+struct DerivedDataCache {
+    char directory[256];
+
+    volatile u32 hits;
+    volatile u32 misses;
+    volatile u64 bytes_read;
+    volatile u64 bytes_written;
+    // Spent reading and checking hits.
+    volatile u64 fetch_ticks;
+    // What the hits took to make when they were put.
+    volatile u64 saved_ticks;
+    // Spent making misses.
+    volatile u64 build_ticks;
+};
+
+void ddc_init(DerivedDataCache* ddc, const char* directory);
+
+// data points into the mapped entry, aligned to 64 bytes, until ddc_release.
+struct DDCEntry {
+    FileContents file;
+    void* data;
+    u64 size;
+};
+
+// Counts a miss when there is no entry, or when it is damaged, which is checked against a hash of its data.
+bool ddc_get(DerivedDataCache* ddc, u64 key, DDCEntry* entry);
+void ddc_release(DDCEntry* entry);
+
+// build_ticks is how long the data took to make. Failing to write, when another thread is putting the same key, is
+// harmless, the entry is just made again next time.
+void ddc_put(DerivedDataCache* ddc, u64 key, void* data, u64 size, u64 build_ticks);
+
+// Logs hits, misses and the time the hits saved.
+void ddc_report(DerivedDataCache* ddc);
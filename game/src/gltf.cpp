@@ -1,5 +1,7 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
 
 #pragma warning(push, 0)
 #define STB_IMAGE_IMPLEMENTATION
@@ -9,6 +11,15 @@
 #include "gltf.h"
 #include "platform.h"
 #include "json.h"
+#include "profiler.h"
+#include "mesh_optimizer.h"
+#include "vertex_format.h"
+#include "simplify.h"
+#include "batching.h"
+#include "mipmaps.h"
+#include "block_compression.h"
+#include "jobs.h"
+#include "derived_data.h"
 
 struct Buffer {
     u32 len;
@@ -19,6 +30,7 @@ struct BufferView {
     u32 buffer;
     u32 len;
     u32 offset;
+    u32 stride;
 };
 
 struct Texture {
@@ -35,10 +47,24 @@ enum GLType {
     GL_FLOAT          = 0x1406,
 };
 
+static u32 gl_type_size(GLType type) {
+    switch (type) {
+        case GL_BYTE:
+        case GL_UNSIGNED_BYTE:
+            return 1;
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+            return 2;
+        default:
+            return 4;
+    }
+}
+
 struct Accessor {
     u32 buffer_view;
     u32 offset;
     GLType component_type;
+    bool normalized;
     u32 count;
     u32 component_count;
 
@@ -47,6 +73,198 @@ struct Accessor {
         u32 buffer_offset = buffer_views[buffer_view].offset + offset;
         return (u8*)base + buffer_offset;
     }
+
+    // Bytes between elements, which is only given for interleaved buffer views.
+    u32 get_stride(BufferView* buffer_views) {
+        u32 stride = buffer_views[buffer_view].stride;
+        return stride ? stride : component_count * gl_type_size(component_type);
+    }
+};
+
+// Reads component c of element i as a float, applying the normalization rules from the spec.
+static f32 read_component(void* memory, u32 stride, GLType type, bool normalized, u32 i, u32 c) {
+    u8* element = (u8*)memory + (u64)i * stride;
+
+    switch (type) {
+        case GL_BYTE: {
+            f32 v = (f32)((i8*)element)[c];
+            return normalized ? max(v / 127.0f, -1.0f) : v;
+        }
+        case GL_UNSIGNED_BYTE: {
+            f32 v = (f32)((u8*)element)[c];
+            return normalized ? v / 255.0f : v;
+        }
+        case GL_SHORT: {
+            f32 v = (f32)((i16*)element)[c];
+            return normalized ? max(v / 32767.0f, -1.0f) : v;
+        }
+        case GL_UNSIGNED_SHORT: {
+            f32 v = (f32)((u16*)element)[c];
+            return normalized ? v / 65535.0f : v;
+        }
+        case GL_FLOAT:
+            return ((f32*)element)[c];
+        default:
+            assert(false && "invalid gltf component type");
+            return 0.0f;
+    }
+}
+
+// Returns count tightly packed elements of component_count floats, or the accessor memory itself when it already is that.
+static f32* accessor_as_floats(Arena* arena, Accessor* accessor, Buffer* buffers, BufferView* buffer_views) {
+    void* memory = accessor->get_memory(buffers, buffer_views);
+    u32 stride = accessor->get_stride(buffer_views);
+
+    if (accessor->component_type == GL_FLOAT && stride == accessor->component_count * sizeof(f32)) {
+        return (f32*)memory;
+    }
+
+    f32* floats = arena->push_array<f32>(accessor->count * accessor->component_count);
+
+    for (u32 i = 0; i < accessor->count; ++i) {
+        for (u32 c = 0; c < accessor->component_count; ++c) {
+            floats[i * accessor->component_count + c] = read_component(memory, stride, accessor->component_type, accessor->normalized, i, c);
+        }
+    }
+
+    return floats;
+}
+
+// KHR_mesh_quantization positions are already 8 or 16 bit integers, so they are rebiased into unorm16 as is and
+// the quantization reproduces the value the attribute would have had as a float.
+static RDMeshQuantization pack_integer_positions(RDPackedVertex* out, Accessor* accessor, void* memory, u32 stride) {
+    f32 scale = 1.0f;
+    i32 bias = 0;
+
+    switch (accessor->component_type) {
+        case GL_BYTE:
+            scale = accessor->normalized ? 1.0f / 127.0f : 1.0f;
+            bias = 128;
+            break;
+        case GL_UNSIGNED_BYTE:
+            scale = accessor->normalized ? 1.0f / 255.0f : 1.0f;
+            break;
+        case GL_SHORT:
+            scale = accessor->normalized ? 1.0f / 32767.0f : 1.0f;
+            bias = 32768;
+            break;
+        case GL_UNSIGNED_SHORT:
+            scale = accessor->normalized ? 1.0f / 65535.0f : 1.0f;
+            break;
+        default:
+            assert(false && "invalid gltf position type");
+            break;
+    }
+
+    for (u32 i = 0; i < accessor->count; ++i) {
+        u8* element = (u8*)memory + (u64)i * stride;
+
+        for (u32 c = 0; c < 3; ++c) {
+            i32 v = 0;
+
+            switch (accessor->component_type) {
+                case GL_BYTE:           v = ((i8*)element)[c]; break;
+                case GL_UNSIGNED_BYTE:  v = ((u8*)element)[c]; break;
+                case GL_SHORT:          v = ((i16*)element)[c]; break;
+                case GL_UNSIGNED_SHORT: v = ((u16*)element)[c]; break;
+                default: break;
+            }
+
+            out[i].position[c] = (u16)(v + bias);
+        }
+
+        out[i].padding = 0;
+    }
+
+    // The most negative value of a normalized signed type lands just past -1 instead of clamping, which is harmless for positions.
+    f32 offset = -(f32)bias * scale;
+
+    RDMeshQuantization quantization;
+    quantization.position_offset = { offset, offset, offset };
+    quantization.position_scale = { scale, scale, scale };
+    return quantization;
+}
+
+// Images are block compressed at this quality as they load.
+#define GLTF_TEXTURE_QUALITY BC_QUALITY_NORMAL
+
+// Part of every cache key. Bump it whenever anything that makes meshes or textures changes what it makes, down to
+// mesh optimization, simplification, mips and block compression.
+#define GLTF_IMPORTER_VERSION 1
+
+// Primitives up to this many indices are built on the job threads. Simplifying bigger ones could outgrow a job
+// thread's scratch, so they are built after, on the calling thread.
+#define GLTF_JOB_MAX_MESH_INDICES (768 * 1024)
+
+#define GLB_MAGIC 0x46546c67 // "glTF"
+#define GLB_CHUNK_JSON 0x4e4f534a
+#define GLB_CHUNK_BIN 0x004e4942
+
+struct DecodedImage {
+    void* raw_data;
+    u32 raw_data_len;
+
+    u32 width;
+    u32 height;
+    u32 mip_levels;
+    RDFormat format;
+    u64 size;
+    u8* chain;
+
+    // Holds chain when it came from the cache.
+    DDCEntry entry;
+    // Otherwise made with malloc, with chain after its CachedTexture so it goes to the cache as it is.
+    u8* blob;
+
+    // Couldn't be decoded. Materials using it sample the white texture instead.
+    bool failed;
+};
+
+// What goes in front of a texture's chain in the cache.
+struct CachedTexture {
+    u32 width;
+    u32 height;
+    u32 mip_levels;
+    RDFormat format;
+};
+
+// Stands in for an image that couldn't be decoded, so the scene's texture indices stay as they are.
+static void fail_image(DecodedImage* image) {
+    image->width = 1;
+    image->height = 1;
+    image->mip_levels = 1;
+    image->format = RD_FORMAT_RGBA8_UNORM;
+    image->size = 4;
+    image->blob = (u8*)malloc(sizeof(CachedTexture) + image->size);
+    image->chain = image->blob + sizeof(CachedTexture);
+    image->failed = true;
+
+    memset(image->chain, 0xff, image->size);
+}
+
+// What goes in front of a mesh's vertices and indices in the cache.
+struct CachedMesh {
+    u32 vertex_count;
+    u32 index_count;
+    u32 lod_count;
+    RDMeshQuantization quantization;
+    RDMeshLod lods[RD_MAX_MESH_LODS];
+};
+
+// A primitive or batch as packed, before it is optimized and gets its levels of detail.
+struct MeshBuild {
+    RDPackedVertex* vertices;
+    u32 vertex_count;
+    RDMeshQuantization quantization;
+    u32* indices;
+    u32 index_count;
+
+    // The vertices and indices of mesh are in blob or entry until they are moved onto the arena.
+    SceneMesh mesh;
+    u8* blob;
+    DDCEntry entry;
+    MeshOptimizeStats stats;
+    u64 ticks;
 };
 
 struct MeshGroup {
@@ -61,22 +279,22 @@ struct Node {
     MeshGroup mesh_group;
 };
 
-static void process_node(Node node, Node* nodes, RDMesh* meshes, u32* mesh_materials, RDMaterial* materials, XMMATRIX parent_transform, Vec<RDMeshInstance>* instances) {
+static void process_node(Node node, Node* nodes, u32* mesh_materials, XMMATRIX parent_transform, Vec<SceneInstance>* instances) {
     XMMATRIX transform = node.transform * parent_transform;
 
     for (u32 i = 0; i < node.mesh_group.count; ++i) {
-        int mesh_index = i + node.mesh_group.start;
+        u32 mesh_index = i + node.mesh_group.start;
 
-        RDMeshInstance instance;
-        instance.mesh = meshes[mesh_index];
-        instance.transform = transform;
-        instance.material = materials[mesh_materials[mesh_index]];
+        SceneInstance instance;
+        instance.mesh = mesh_index;
+        instance.material = mesh_materials[mesh_index];
+        XMStoreFloat4x4(&instance.transform, transform);
 
         instances->push(instance);
     }
 
     for (u32 i = 0; i < node.num_children; ++i) {
-        process_node(nodes[node.children[i]], nodes, meshes, mesh_materials, materials, transform, instances);
+        process_node(nodes[node.children[i]], nodes, mesh_materials, transform, instances);
     }
 }
 
@@ -92,11 +310,113 @@ static XMVECTOR json_to_xmvector(JSON arr) {
     return *((XMVECTOR*)vector_as_floats);
 }
 
-GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_context, const char* path) {
-    Scratch scratch = get_scratch(arena);
+// Seeds the keys of one kind of derived data with the version and settings it is made with.
+static u64 settings_seed(const char* kind) {
+    struct {
+        u32 importer_version;
+        u32 texture_quality;
+    } settings = { GLTF_IMPORTER_VERSION, GLTF_TEXTURE_QUALITY };
 
-    char dir[512];
-    strcpy_s(dir, sizeof(dir), path);
+    return hash64(&settings, sizeof(settings), hash64(kind, strlen(kind), 0));
+}
+
+static void point_into_cached_mesh(SceneMesh* mesh, u8* blob) {
+    CachedMesh* cached = (CachedMesh*)blob;
+
+    mesh->vertex_count = cached->vertex_count;
+    mesh->index_count = cached->index_count;
+    mesh->lod_count = cached->lod_count;
+    mesh->quantization = cached->quantization;
+    memcpy(mesh->lods, cached->lods, sizeof(mesh->lods));
+    mesh->vertices = (RDPackedVertex*)(cached + 1);
+    mesh->indices = (u32*)(mesh->vertices + cached->vertex_count);
+}
+
+// Optimizes the mesh and builds its levels of detail, unless the cache has them for the same vertices and indices.
+static void build_mesh(DerivedDataCache* ddc, u64 seed, MeshBuild* build) {
+    PROFILE_FUNCTION();
+
+    u64 start = pf_ticks();
+
+    u64 key = hash64(&build->quantization, sizeof(build->quantization), seed);
+    key = hash64(build->vertices, build->vertex_count * sizeof(RDPackedVertex), key);
+    key = hash64(build->indices, build->index_count * sizeof(u32), key);
+
+    if (ddc && ddc_get(ddc, key, &build->entry)) {
+        point_into_cached_mesh(&build->mesh, (u8*)build->entry.data);
+        build->ticks = pf_ticks() - start;
+        return;
+    }
+
+    Scratch scratch = get_scratch(0);
+
+    u32 vertex_count = optimize_mesh(build->vertices, build->vertex_count, &build->quantization, build->indices, build->index_count, &build->stats);
+
+    CachedMesh cached = {};
+    u32* lod_indices = scratch->push_array<u32>(build->index_count * 4);
+    cached.lod_count = build_mesh_lods(build->vertices, vertex_count, &build->quantization, build->indices, build->index_count, lod_indices, cached.lods);
+
+    RDMeshLod* last = &cached.lods[cached.lod_count - 1];
+
+    cached.vertex_count = vertex_count;
+    cached.index_count = last->index_offset + last->index_count;
+    cached.quantization = build->quantization;
+
+    // Laid out as it is in the cache, so the same memory can be put there.
+    u64 blob_size = sizeof(CachedMesh) + cached.vertex_count * sizeof(RDPackedVertex) + cached.index_count * sizeof(u32);
+    build->blob = (u8*)malloc(blob_size);
+
+    memcpy(build->blob, &cached, sizeof(cached));
+    point_into_cached_mesh(&build->mesh, build->blob);
+    memcpy(build->mesh.vertices, build->vertices, cached.vertex_count * sizeof(RDPackedVertex));
+    memcpy(build->mesh.indices, lod_indices, cached.index_count * sizeof(u32));
+
+    build->ticks = pf_ticks() - start;
+
+    if (ddc) {
+        ddc_put(ddc, key, build->blob, blob_size, build->ticks);
+    }
+}
+
+static void build_meshes(DerivedDataCache* ddc, u64 seed, u32 count, MeshBuild* builds) {
+    parallel_for(count, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            if (builds[i].index_count <= GLTF_JOB_MAX_MESH_INDICES) {
+                build_mesh(ddc, seed, &builds[i]);
+            }
+        }
+    });
+
+    for (u32 i = 0; i < count; ++i) {
+        if (builds[i].index_count > GLTF_JOB_MAX_MESH_INDICES) {
+            build_mesh(ddc, seed, &builds[i]);
+        }
+    }
+}
+
+// Moves a built mesh onto the arena at its final size.
+static SceneMesh finish_mesh(Arena* arena, MeshBuild* build) {
+    SceneMesh mesh = build->mesh;
+
+    mesh.vertices = (RDPackedVertex*)arena->push(mesh.vertex_count * sizeof(RDPackedVertex));
+    mesh.indices = (u32*)arena->push(mesh.index_count * sizeof(u32));
+
+    memcpy(mesh.vertices, build->mesh.vertices, mesh.vertex_count * sizeof(RDPackedVertex));
+    memcpy(mesh.indices, build->mesh.indices, mesh.index_count * sizeof(u32));
+
+    if (build->blob) {
+        ::free(build->blob);
+    }
+    else {
+        ddc_release(&build->entry);
+    }
+
+    return mesh;
+}
+
+// The directory the scene's uris are relative to, with its trailing slash.
+static void gltf_directory(const char* path, char* dir, u32 dir_size) {
+    strcpy_s(dir, dir_size, path);
     sanitise_path(dir);
 
     char* path_last_slash = strrchr(dir, '/');
@@ -106,9 +426,98 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
     else {
         dir[0] = '\0';
     }
+}
+
+// Loads a .gltf or .glb and parses its JSON. glb_bin gets the binary chunk of a .glb, which buffers without a uri refer to.
+static JSON load_gltf_json(Arena* arena, const char* path, FileContents* file, FileContents* glb_bin) {
+    *file = pf_load_file(arena, path);
+    *glb_bin = {};
+
+    char* json_text = (char*)file->memory;
+
+    // A .glb is a header, the JSON chunk and then the binary chunk.
+    if (file->size >= 12 && ((u32*)file->memory)[0] == GLB_MAGIC) {
+        u8* glb = (u8*)file->memory;
+        u64 chunk_offset = 12;
+
+        while (chunk_offset + 8 <= file->size) {
+            u32 chunk_len = *(u32*)(glb + chunk_offset);
+            u32 chunk_type = *(u32*)(glb + chunk_offset + 4);
+            u8* chunk = glb + chunk_offset + 8;
+
+            assert(chunk_offset + 8 + chunk_len <= file->size && "glb chunk runs past the end of the file");
+
+            if (chunk_type == GLB_CHUNK_JSON) {
+                // The parser wants the text null terminated.
+                json_text = arena->push_array<char>(chunk_len + 1);
+                memcpy(json_text, chunk, chunk_len);
+            }
+            else if (chunk_type == GLB_CHUNK_BIN && !glb_bin->memory) {
+                glb_bin->memory = chunk;
+                glb_bin->size = chunk_len;
+            }
+
+            chunk_offset += 8 + ((chunk_len + 3) & ~3u);
+        }
+    }
+
+    return json_parse(arena, json_text);
+}
+
+u64 gltf_source_key(const char* path, bool batch_static) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    char dir[512];
+    gltf_directory(path, dir, sizeof(dir));
 
-    FileContents file = pf_load_file(scratch.arena, path);
-    JSON root = json_parse(scratch.arena, (char*)file.memory);
+    FileContents file;
+    FileContents glb_bin;
+    JSON root = load_gltf_json(scratch.arena, path, &file, &glb_bin);
+
+    u64 key = hash64(&batch_static, sizeof(batch_static), settings_seed("scene"));
+    key = hash64(file.memory, file.size, key);
+
+    // Then every file it refers to, in the order they are listed.
+    const char* lists[] = { "buffers", "images" };
+
+    for (u32 i = 0; i < ARRAY_LEN(lists); ++i) {
+        if (!root.has(lists[i])) {
+            continue;
+        }
+
+        JSON list = root[lists[i]];
+
+        for (u32 j = 0; j < list.array_len(); ++j) {
+            if (!list[j].has("uri")) {
+                continue;
+            }
+
+            char uri_path[512];
+            sprintf_s(uri_path, sizeof(uri_path), "%s%s", dir, list[j]["uri"].as_string());
+
+            scratch->save();
+            FileContents contents = pf_load_file(scratch.arena, uri_path);
+            key = hash64(contents.memory, contents.size, key);
+            scratch->restore();
+        }
+    }
+
+    return key;
+}
+
+SceneData gltf_import(Arena* arena, DerivedDataCache* ddc, const char* path, bool batch_static) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(arena);
+
+    char dir[512];
+    gltf_directory(path, dir, sizeof(dir));
+
+    FileContents file;
+    FileContents glb_bin;
+    JSON root = load_gltf_json(scratch.arena, path, &file, &glb_bin);
 
     char* version = root["asset"]["version"].as_string();
     (void)version;
@@ -120,18 +529,23 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
     {
         JSON json_buffer = json_buffers[i];
 
-        char* uri = json_buffer["uri"].as_string();
+        FileContents buffer_contents = glb_bin;
 
-        char buffer_path[512];
-        sprintf_s(buffer_path, sizeof(buffer_path), "%s%s", dir, uri);
+        if (json_buffer.has("uri")) {
+            char* uri = json_buffer["uri"].as_string();
 
-        FileContents buffer_contents = pf_load_file(scratch.arena, buffer_path);
+            char buffer_path[512];
+            sprintf_s(buffer_path, sizeof(buffer_path), "%s%s", dir, uri);
+
+            buffer_contents = pf_load_file(scratch.arena, buffer_path);
+        }
 
         Buffer buffer = {};
         buffer.len = json_buffer["byteLength"].as_int();
         buffer.memory = buffer_contents.memory;
 
-        assert(buffer.len == buffer_contents.size);
+        // The binary chunk may be padded past the buffer's length.
+        assert(buffer.memory && buffer.len <= buffer_contents.size);
 
         buffers[i] = buffer;
     }
@@ -150,17 +564,24 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
             buffer_view.offset = json_buffer_view["byteOffset"].as_int();
         }
 
+        if (json_buffer_view.has("byteStride")) {
+            buffer_view.stride = json_buffer_view["byteStride"].as_int();
+        }
+
         buffer_views[i] = buffer_view;
     }
 
     u32 num_images = 0;
-    RDTexture* images = 0;
+    SceneTexture* images = 0;
+    DecodedImage* decoded_images = 0;
     
     if (root.has("images"))
     {
         JSON json_images = root["images"];
         num_images = json_images.array_len();
-        images = arena->push_array<RDTexture>(num_images); // Pushed onto ARENA not scratch, as we are returning this.
+        images = arena->push_array<SceneTexture>(num_images); // Pushed onto ARENA not scratch, as we are returning this.
+
+        decoded_images = scratch->push_array<DecodedImage>(num_images);
 
         for (u32 i = 0; i < num_images; ++i)
         {
@@ -187,13 +608,146 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
                 raw_data_len = buffer_view.len;
             }
 
-            int width, height;
-            u8* image_data = stbi_load_from_memory((u8*)raw_data, raw_data_len, &width, &height, 0, 4);
+            decoded_images[i].raw_data = raw_data;
+            decoded_images[i].raw_data_len = raw_data_len;
+        }
+
+        // Images decode and build their mips on the job threads, one image per job. Within a job the rows of each
+        // level run inline, so a scene with a single large image still splits it across threads. Images the cache
+        // has already made, keyed by their encoded bytes, are only checked and mapped.
+        u64 mip_start = pf_ticks();
+        u64 texture_seed = settings_seed("texture");
+        volatile u32 cached_images = 0;
+
+        parallel_for(num_images, 1, [&](u32 begin, u32 end) {
+            for (u32 i = begin; i < end; ++i) {
+                PROFILE_ZONE("gltf_import_image");
+
+                DecodedImage* image = &decoded_images[i];
+
+                u64 image_start = pf_ticks();
+                u64 key = hash64(image->raw_data, image->raw_data_len, texture_seed);
+
+                if (ddc && ddc_get(ddc, key, &image->entry)) {
+                    CachedTexture* cached = (CachedTexture*)image->entry.data;
+
+                    image->width = cached->width;
+                    image->height = cached->height;
+                    image->mip_levels = cached->mip_levels;
+                    image->format = cached->format;
+                    image->size = image->entry.size - sizeof(CachedTexture);
+                    image->chain = (u8*)(cached + 1);
+
+                    atomic_increment(&cached_images);
+                    continue;
+                }
+
+                int width, height;
+                u8* image_data = stbi_load_from_memory((u8*)image->raw_data, image->raw_data_len, &width, &height, 0, 4);
+
+                if (!image_data) {
+                    pf_debug_log("%s: failed to decode image %u: %s\n", path, i, stbi_failure_reason());
+                    fail_image(image);
+                    continue;
+                }
+
+                image->width = width;
+                image->height = height;
+                image->mip_levels = mip_level_count(width, height);
+
+                u64 rgba_size = mip_chain_size(width, height, image->mip_levels);
+
+                // The final chain is written once, straight after the header it's cached with. Block compressed
+                // textures need level 0 to be whole blocks.
+                if (width % 4 == 0 && height % 4 == 0) {
+                    // stb allocates with malloc, so its level 0 grows into the uncompressed chain, in place when the
+                    // heap has room.
+                    u8* rgba = (u8*)realloc(image_data, rgba_size);
+
+                    if (!rgba) {
+                        pf_debug_log("%s: out of memory for image %u's mips\n", path, i);
+                        stbi_image_free(image_data);
+                        fail_image(image);
+                        continue;
+                    }
+
+                    // Only base color textures are sampled, and glTF stores those as sRGB.
+                    generate_mips(rgba, width, height, image->mip_levels, true);
+
+                    bool has_alpha = false;
+
+                    for (u64 k = 0; k < (u64)width * height; ++k) {
+                        if (rgba[k * 4 + 3] != 255) {
+                            has_alpha = true;
+                            break;
+                        }
+                    }
+
+                    image->format = bc_color_format(has_alpha, GLTF_TEXTURE_QUALITY);
+                    image->size = bc_chain_size(image->format, width, height, image->mip_levels);
+                    image->blob = (u8*)malloc(sizeof(CachedTexture) + image->size);
+                    image->chain = image->blob + sizeof(CachedTexture);
+
+                    bc_compress_chain(image->format, GLTF_TEXTURE_QUALITY, rgba, width, height, image->mip_levels, image->chain);
+
+                    ::free(rgba);
+                }
+                else {
+                    image->format = RD_FORMAT_RGBA8_UNORM;
+                    image->size = rgba_size;
+                    image->blob = (u8*)malloc(sizeof(CachedTexture) + image->size);
+                    image->chain = image->blob + sizeof(CachedTexture);
+
+                    memcpy(image->chain, image_data, (u64)width * height * 4);
+                    stbi_image_free(image_data);
+
+                    generate_mips(image->chain, width, height, image->mip_levels, true);
+                }
+
+                CachedTexture* cached = (CachedTexture*)image->blob;
+                cached->width = image->width;
+                cached->height = image->height;
+                cached->mip_levels = image->mip_levels;
+                cached->format = image->format;
+
+                if (ddc) {
+                    ddc_put(ddc, key, image->blob, sizeof(CachedTexture) + image->size, pf_ticks() - image_start);
+                }
+            }
+        });
+
+        u64 texture_bytes = 0;
+        u64 uncompressed_bytes = 0;
+
+        for (u32 i = 0; i < num_images; ++i) {
+            DecodedImage* image = &decoded_images[i];
+            texture_bytes += image->size;
+            uncompressed_bytes += mip_chain_size(image->width, image->height, image->mip_levels);
+        }
+
+        pf_debug_log("%s: decoded %u images, built their mips and compressed them in %.2fms, %u from the cache, %.2f MB of textures, %.2f MB uncompressed\n", path, num_images,
+            (f64)(pf_ticks() - mip_start) / (f64)pf_ticks_per_second() * 1000.0, cached_images, (f64)texture_bytes / (1024.0 * 1024.0), (f64)uncompressed_bytes / (1024.0 * 1024.0));
 
-            images[i] = rd_create_texture(renderer, width, height, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RESOURCE);
-            rd_upload_texture_data(renderer, upload_context, images[i], image_data);
+        // The arena can't be pushed to from the jobs, so the finished chains are moved onto it here.
+        for (u32 i = 0; i < num_images; ++i) {
+            DecodedImage* image = &decoded_images[i];
 
-            stbi_image_free(image_data);
+            SceneTexture* texture = &images[i];
+            texture->width = image->width;
+            texture->height = image->height;
+            texture->mip_levels = image->mip_levels;
+            texture->format = image->format;
+            texture->size = image->size;
+            texture->data = (u8*)arena->push(image->size);
+
+            memcpy(texture->data, image->chain, image->size);
+
+            if (image->entry.file.memory) {
+                ddc_release(&image->entry);
+            }
+            else {
+                ::free(image->blob);
+            }
         }
     }
 
@@ -208,10 +762,14 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
         {
             JSON json_texture = json_textures[i];
             textures[i].image = json_texture["source"].as_int();
+
+            if (decoded_images[textures[i].image].failed) {
+                textures[i].image = SCENE_NO_TEXTURE;
+            }
         }
     }
 
-    Vec<RDMaterial> materials = {};
+    Vec<SceneMaterial> materials = {};
 
     if (root.has("materials"))
     {
@@ -222,14 +780,14 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
             JSON json_material = json_materials[i];
             JSON pbr_material = json_material["pbrMetallicRoughness"];
 
-            RDMaterial material;
+            SceneMaterial material;
 
             if (pbr_material.has("baseColorTexture")) {
                 int albedo_texture_index = pbr_material["baseColorTexture"]["index"].as_int();
-                material.albedo_texture = images[textures[albedo_texture_index].image];
+                material.albedo_texture = textures[albedo_texture_index].image;
             }
             else {
-                material.albedo_texture = rd_get_white_texture(renderer);
+                material.albedo_texture = SCENE_NO_TEXTURE;
             }
 
             if (pbr_material.has("baseColorFactor")) {
@@ -244,8 +802,8 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
         }
     }
 
-    RDMaterial default_material = {};
-    default_material.albedo_texture = rd_get_white_texture(renderer);
+    SceneMaterial default_material = {};
+    default_material.albedo_texture = SCENE_NO_TEXTURE;
     default_material.albedo_factor = XMFLOAT3(0.5f, 0.5f, 0.5f);
     materials.push(default_material);
 
@@ -263,6 +821,10 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
             accessor.offset = json_accessor["byteOffset"].as_int();
         }
 
+        if (json_accessor.has("normalized")) {
+            accessor.normalized = json_accessor["normalized"].as_boolean();
+        }
+
         char* type = json_accessor["type"].as_string();
 
         if (strcmp(type, "SCALAR") == 0) {
@@ -285,7 +847,7 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
     }
 
     JSON json_meshes = root["meshes"];
-    Vec<RDMesh> meshes = {};
+    Vec<MeshBuild> builds = {};
     Vec<u32> mesh_materials = {};
     MeshGroup* mesh_groups = scratch->push_array<MeshGroup>(json_meshes.array_len());
     for (u32 i = 0; i < json_meshes.array_len(); ++i)
@@ -294,11 +856,13 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
         JSON primitives = json_mesh["primitives"];
 
         MeshGroup mesh_group = {};
-        mesh_group.start = meshes.len;
+        mesh_group.start = builds.len;
         mesh_group.count = primitives.array_len();
 
         for (u32 j = 0; j < mesh_group.count; ++j)
         {
+            PROFILE_ZONE("gltf_import_primitive");
+
             scratch->save();
 
             JSON primitive = primitives[j];
@@ -322,44 +886,62 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
             assert(norm_accessor.component_count == 3);
             assert(uv_accessor.component_count == 2);
 
-            assert(pos_accessor.component_type  == GL_FLOAT);
-            assert(norm_accessor.component_type == GL_FLOAT);
-            assert(uv_accessor.component_type   == GL_FLOAT);
-
-            f32* pos_accessor_memory  = (f32*)pos_accessor.get_memory(buffers, buffer_views);
-            f32* norm_accessor_memory = (f32*)norm_accessor.get_memory(buffers, buffer_views);
-            f32* uv_accessor_memory   = (f32*)uv_accessor.get_memory(buffers, buffer_views);
-
             u32 vertex_count = pos_accessor.count;
-            RDVertex* vertex_data = scratch->push_array<RDVertex>(vertex_count);
+            // Kept past the primitive for building, which happens for all of them at once.
+            RDPackedVertex* vertex_data = (RDPackedVertex*)calloc(vertex_count, sizeof(RDPackedVertex));
+            RDMeshQuantization quantization;
+
+            void* pos_accessor_memory = pos_accessor.get_memory(buffers, buffer_views);
+            u32 pos_stride = pos_accessor.get_stride(buffer_views);
 
-            for (u32 k = 0; k < vertex_count; ++k) {
-                RDVertex vertex;
+            if (pos_accessor.component_type == GL_FLOAT) {
+                XMVECTOR aabb_min = XMVectorReplicate(FLT_MAX);
+                XMVECTOR aabb_max = XMVectorReplicate(-FLT_MAX);
 
-                vertex.pos.x = pos_accessor_memory[k * pos_accessor.component_count + 0];
-                vertex.pos.y = pos_accessor_memory[k * pos_accessor.component_count + 1];
-                vertex.pos.z = pos_accessor_memory[k * pos_accessor.component_count + 2];
+                for (u32 k = 0; k < vertex_count; ++k) {
+                    XMVECTOR pos = XMLoadFloat3((XMFLOAT3*)((u8*)pos_accessor_memory + (u64)k * pos_stride));
+                    aabb_min = XMVectorMin(aabb_min, pos);
+                    aabb_max = XMVectorMax(aabb_max, pos);
+                }
 
-                vertex.norm.x = norm_accessor_memory[k * norm_accessor.component_count + 0];
-                vertex.norm.y = norm_accessor_memory[k * norm_accessor.component_count + 1];
-                vertex.norm.z = norm_accessor_memory[k * norm_accessor.component_count + 2];
+                if (vertex_count == 0) {
+                    aabb_min = aabb_max = XMVectorZero();
+                }
 
-                vertex.uv.x = uv_accessor_memory[k * uv_accessor.component_count + 0];
-                vertex.uv.y = uv_accessor_memory[k * uv_accessor.component_count + 1];
+                XMFLOAT3 bounds_min, bounds_max;
+                XMStoreFloat3(&bounds_min, aabb_min);
+                XMStoreFloat3(&bounds_max, aabb_max);
 
-                vertex_data[k] = vertex;
+                quantization = quantization_from_bounds(bounds_min, bounds_max);
+                pack_positions(vertex_data, vertex_count, pos_accessor_memory, pos_stride, &quantization);
             }
+            else {
+                quantization = pack_integer_positions(vertex_data, &pos_accessor, pos_accessor_memory, pos_stride);
+            }
+
+            f32* normals = accessor_as_floats(scratch.arena, &norm_accessor, buffers, buffer_views);
+            f32* uvs = accessor_as_floats(scratch.arena, &uv_accessor, buffers, buffer_views);
+
+            pack_normals(vertex_data, vertex_count, normals, 3 * sizeof(f32));
+            pack_uvs(vertex_data, vertex_count, uvs, 2 * sizeof(f32));
 
             void* indices_accessor_memory = indices_accessor.get_memory(buffers, buffer_views);
 
             u32 index_count = indices_accessor.count;
-            u32* index_data = scratch->push_array<u32>(index_count);
+            u32* index_data = (u32*)malloc(index_count * sizeof(u32));
 
             switch (indices_accessor.component_type) {
                 default:
                     assert(false && "invalid gltf index type");
                     break;
 
+                case GL_UNSIGNED_BYTE: {
+                    u8* bytes = (u8*)indices_accessor_memory;
+                    for (u32 k = 0; k < index_count; ++k) {
+                        index_data[k] = bytes[k];
+                    }
+                } break;
+
                 case GL_UNSIGNED_SHORT: {
                     u16* shorts = (u16*)indices_accessor_memory;
                     for (u32 k = 0; k < index_count; ++k) {
@@ -372,10 +954,16 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
                 } break;
             }
 
-            RDMesh mesh = rd_create_mesh(renderer, upload_context, vertex_data, vertex_count, index_data, index_count);
+            MeshBuild build = {};
+            build.vertices = vertex_data;
+            build.vertex_count = vertex_count;
+            build.quantization = quantization;
+            build.indices = index_data;
+            build.index_count = index_count;
+
             u32 material = primitive.has("material") ? primitive["material"].as_int() : materials.len - 1;
 
-            meshes.push(mesh);
+            builds.push(build);
             mesh_materials.push(material);
             
             scratch->restore();
@@ -384,6 +972,66 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
         mesh_groups[i] = mesh_group;
     }
 
+    // Primitives are optimized and get their levels of detail on the job threads, one primitive per job.
+    u64 mesh_seed = settings_seed("mesh");
+    u64 build_start = pf_ticks();
+
+    build_meshes(ddc, mesh_seed, builds.len, builds.mem);
+
+    u64 build_ticks = pf_ticks() - build_start;
+
+    VertexCacheStats cache_before = {};
+    VertexCacheStats cache_after = {};
+    u64 vertex_bytes = 0;
+    u64 index_bytes = 0;
+    u64 unpacked_bytes = 0;
+    u32 lod_triangle_counts[RD_MAX_MESH_LODS] = {};
+    u32 cached_meshes = 0;
+    Vec<SceneMesh> meshes = {};
+
+    for (u32 i = 0; i < builds.len; ++i) {
+        MeshBuild* build = &builds[i];
+        SceneMesh* mesh = &build->mesh;
+
+        // Meshes from the cache weren't optimized this time, so they have no statistics.
+        if (build->blob) {
+            cache_before.triangle_count += build->stats.before.triangle_count;
+            cache_before.vertex_count += build->stats.before.vertex_count;
+            cache_before.cache_misses += build->stats.before.cache_misses;
+            cache_after.triangle_count += build->stats.after.triangle_count;
+            cache_after.vertex_count += build->stats.after.vertex_count;
+            cache_after.cache_misses += build->stats.after.cache_misses;
+        }
+        else {
+            cached_meshes++;
+        }
+
+        for (u32 l = 0; l < mesh->lod_count; ++l) {
+            lod_triangle_counts[l] += mesh->lods[l].index_count / 3;
+        }
+
+        // Against float position, normal and uv with 32 bit indices.
+        unpacked_bytes += mesh->vertex_count * 8 * sizeof(f32) + mesh->lods[0].index_count * sizeof(u32);
+        vertex_bytes += mesh->vertex_count * sizeof(RDPackedVertex);
+        index_bytes += mesh->index_count * (mesh->vertex_count <= 65536 ? sizeof(u16) : sizeof(u32));
+
+        meshes.push(finish_mesh(arena, build));
+
+        ::free(build->vertices);
+        ::free(build->indices);
+    }
+
+    // Meshes from the cache were optimized when they were put, so they are left out.
+    if (cached_meshes < meshes.len) {
+        pf_debug_log("%s: %u triangles, vertex cache ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", path, lod_triangle_counts[0],
+            cache_before.acmr(), cache_after.acmr(), cache_before.atvr(), cache_after.atvr());
+    }
+    pf_debug_log("%s: %.2f MB of vertices and %.2f MB of indices, %.2f MB as 32 byte float vertices and 32 bit indices\n", path,
+        (f64)vertex_bytes / (1024.0 * 1024.0), (f64)index_bytes / (1024.0 * 1024.0), (f64)unpacked_bytes / (1024.0 * 1024.0));
+    pf_debug_log("%s: built %u meshes in %.2fms, %u from the cache, triangles per level %u %u %u %u %u %u\n", path, meshes.len,
+        (f64)build_ticks / (f64)pf_ticks_per_second() * 1000.0, cached_meshes, lod_triangle_counts[0], lod_triangle_counts[1], lod_triangle_counts[2],
+        lod_triangle_counts[3], lod_triangle_counts[4], lod_triangle_counts[5]);
+
     JSON json_nodes = root["nodes"];
     Node* nodes = scratch->push_array<Node>(json_nodes.array_len());
     for (u32 i = 0; i < json_nodes.array_len(); ++i)
@@ -450,7 +1098,7 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
     }
 
     JSON scenes = root["scenes"];
-    Vec<RDMeshInstance> instances = {};
+    Vec<SceneInstance> instances = {};
     for (u32 i = 0; i < scenes.array_len(); ++i)
     {
         JSON scene = scenes[i];
@@ -459,21 +1107,98 @@ GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_c
         {
             int node_index = scene_nodes[j].as_int();
             Node node = nodes[node_index];
-            process_node(node, nodes, meshes.mem, mesh_materials.mem, materials.mem, XMMatrixIdentity(), &instances);
+            process_node(node, nodes, mesh_materials.mem, XMMatrixIdentity(), &instances);
         }
     }
     
-    GLTFResult result = {};
+    Vec<SceneInstance> batched_instances = {};
+
+    if (batch_static) {
+        PROFILE_ZONE("gltf_batch_static");
+
+        u64 batch_start = pf_ticks();
+
+        // Level 0 of every mesh, which is its indices as they were optimized.
+        BatchSource* batch_sources = scratch->push_array<BatchSource>(meshes.len);
+
+        for (u32 i = 0; i < meshes.len; ++i) {
+            SceneMesh* mesh = &meshes[i];
+            batch_sources[i].vertices = mesh->vertices;
+            batch_sources[i].vertex_count = mesh->vertex_count;
+            batch_sources[i].quantization = mesh->quantization;
+            batch_sources[i].indices = mesh->indices + mesh->lods[0].index_offset;
+            batch_sources[i].index_count = mesh->lods[0].index_count;
+        }
+
+        BatchInstance* batch_instances = scratch->push_array<BatchInstance>(instances.len);
+
+        for (u32 i = 0; i < instances.len; ++i) {
+            batch_instances[i].source = instances[i].mesh;
+            batch_instances[i].material = instances[i].material;
+            batch_instances[i].transform = XMLoadFloat4x4(&instances[i].transform);
+        }
+
+        bool* batched = scratch->push_array<bool>(instances.len);
+        StaticBatch* batches = scratch->push_array<StaticBatch>(instances.len / 2);
+        u32 batch_count = build_static_batches(scratch.arena, batch_sources, instances.len, batch_instances, batched, batches);
+
+        u32 batched_count = 0;
+
+        for (u32 i = 0; i < instances.len; ++i) {
+            if (batched[i]) {
+                batched_count++;
+            }
+            else {
+                batched_instances.push(instances[i]);
+            }
+        }
+
+        // Batches are keyed by their merged geometry, so they come from the cache as long as their instances stay put.
+        MeshBuild* batch_builds = scratch->push_array<MeshBuild>(batch_count);
+
+        for (u32 i = 0; i < batch_count; ++i) {
+            batch_builds[i].vertices = batches[i].vertices;
+            batch_builds[i].vertex_count = batches[i].vertex_count;
+            batch_builds[i].quantization = batches[i].quantization;
+            batch_builds[i].indices = batches[i].indices;
+            batch_builds[i].index_count = batches[i].index_count;
+        }
+
+        build_meshes(ddc, mesh_seed, batch_count, batch_builds);
+
+        for (u32 i = 0; i < batch_count; ++i) {
+            SceneInstance instance;
+            instance.mesh = meshes.len;
+            instance.material = batches[i].material;
+            XMStoreFloat4x4(&instance.transform, XMMatrixIdentity());
+
+            meshes.push(finish_mesh(arena, &batch_builds[i]));
+            batched_instances.push(instance);
+        }
+
+        pf_debug_log("%s: batched %u of %u instances into %u meshes in %.2fms, %u instances left to draw\n", path,
+            batched_count, instances.len, batch_count,
+            (f64)(pf_ticks() - batch_start) / (f64)pf_ticks_per_second() * 1000.0, batched_instances.len);
+    }
+
+    SceneData result = {};
     result.num_meshes = meshes.len;
     result.meshes = arena->push_vec_contents(meshes);
-    result.num_instances = instances.len;
-    result.instances = arena->push_vec_contents(instances);
     result.num_textures = num_images;
     result.textures = images;
+    result.num_materials = materials.len;
+    result.materials = arena->push_vec_contents(materials);
+    result.num_instances = instances.len;
+    result.instances = arena->push_vec_contents(instances);
+    result.num_batched_instances = batched_instances.len;
+    result.batched_instances = arena->push_vec_contents(batched_instances);
 
+    builds.free();
     meshes.free();
     mesh_materials.free();
+    materials.free();
     instances.free();
+    batched_instances.free();
 
     return result;
 }
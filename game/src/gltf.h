@@ -1,15 +1,14 @@
 #pragma once
 
-#include "renderer.h"
-
-struct GLTFResult {
-    u32 num_instances;
-    RDMeshInstance* instances;
-    u32 num_meshes;
-    RDMesh* meshes;
-    u32 num_textures;
-    RDTexture* textures;
-};
-
-GLTFResult gltf_load(Arena* arena, Renderer* renderer, RDUploadContext* upload_context, const char* path);
-
+#include "scene.h"
+#include "derived_data.h"
+
+// Imports a .gltf, or a .glb with its buffers in the binary chunk. Meshes come out optimized with their levels of
+// detail, and images as mip chains that are block compressed when their size allows. Everything is pushed onto arena.
+// With batch_static, small static instances are also merged into batches of their own. Meshes and textures are taken
+// from ddc when it has them and put there when it doesn't. ddc can be null.
+SceneData gltf_import(Arena* arena, DerivedDataCache* ddc, const char* path, bool batch_static);
+
+// Hash of the scene file, every file it refers to, the importer's version and the settings. The same key means
+// gltf_import would make the same scene.
+u64 gltf_source_key(const char* path, bool batch_static);
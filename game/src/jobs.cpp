@@ -0,0 +1,114 @@
+#include "jobs.h"
+#include "platform.h"
+#include "profiler.h"
+
+struct JobSystem {
+    u32 worker_count;
+    void* wake_semaphore;
+    SpinLock submit_lock;
+
+    JobProc proc;
+    void* data;
+    u32 count;
+    u32 batch_size;
+    u32 batch_count;
+
+    volatile u32 next_batch;
+    volatile u32 finished_batches;
+    volatile u32 exited_workers;
+};
+
+static JobSystem job_system;
+
+static thread_local u32 job_thread_index;
+static thread_local bool job_thread_busy;
+
+static void run_batches() {
+    while (true) {
+        u32 batch = atomic_increment(&job_system.next_batch) - 1;
+
+        if (batch >= job_system.batch_count) {
+            break;
+        }
+
+        u32 begin = batch * job_system.batch_size;
+        u32 end = min(begin + job_system.batch_size, job_system.count);
+
+        PROFILE_ZONE("job_batch");
+        job_system.proc(job_system.data, begin, end);
+
+        atomic_increment(&job_system.finished_batches);
+    }
+}
+
+static void worker_proc(void* data) {
+    job_thread_index = (u32)(u64)data;
+    job_thread_busy = true;
+
+    pf_init_thread_scratch(JOB_THREAD_SCRATCH_SIZE);
+    profiler_set_thread_name("worker");
+
+    while (true) {
+        pf_semaphore_wait(job_system.wake_semaphore);
+        run_batches();
+        atomic_increment(&job_system.exited_workers);
+    }
+}
+
+void jobs_init(u32 worker_count) {
+    job_system.worker_count = min(worker_count, (u32)MAX_JOB_THREADS - 1);
+    job_system.wake_semaphore = pf_create_semaphore(0, MAX_JOB_THREADS);
+
+    for (u32 i = 0; i < job_system.worker_count; ++i) {
+        pf_create_thread(worker_proc, (void*)(u64)(i + 1));
+    }
+}
+
+u32 jobs_thread_count() {
+    return job_system.worker_count + 1;
+}
+
+u32 jobs_thread_index() {
+    return job_thread_index;
+}
+
+void jobs_run(JobProc proc, void* data, u32 count, u32 batch_size) {
+    if (count == 0) {
+        return;
+    }
+
+    assert(batch_size > 0);
+    u32 batch_count = (count + batch_size - 1) / batch_size;
+
+    if (job_thread_busy || batch_count == 1 || job_system.worker_count == 0) {
+        for (u32 begin = 0; begin < count; begin += batch_size) {
+            proc(data, begin, min(begin + batch_size, count));
+        }
+        return;
+    }
+
+    job_system.submit_lock.lock();
+    job_thread_busy = true;
+
+    job_system.proc = proc;
+    job_system.data = data;
+    job_system.count = count;
+    job_system.batch_size = batch_size;
+    job_system.batch_count = batch_count;
+    job_system.next_batch = 0;
+    job_system.finished_batches = 0;
+    job_system.exited_workers = 0;
+
+    // Every woken worker must check out before the job state can be overwritten by the next run.
+    u32 woken = min(job_system.worker_count, batch_count - 1);
+    pf_semaphore_signal(job_system.wake_semaphore, woken);
+
+    run_batches();
+
+    while (atomic_load(&job_system.finished_batches) < batch_count || atomic_load(&job_system.exited_workers) < woken) {
+        _mm_pause();
+    }
+
+    job_thread_busy = false;
+    job_system.submit_lock.unlock();
+}
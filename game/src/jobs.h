@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+
+#define MAX_JOB_THREADS 32
+#define JOB_THREAD_SCRATCH_SIZE (256 * 1024 * 1024)
+
+using JobProc = void (*)(void* data, u32 begin, u32 end);
+
+void jobs_init(u32 worker_count);
+
+// Number of threads that can execute batches, including the calling thread.
+u32 jobs_thread_count();
+
+// 0 on the thread that called jobs_init, 1..n on the workers.
+u32 jobs_thread_index();
+
+// Splits [0, count) into batches of batch_size and blocks until every batch has run.
+// The calling thread helps out. Calls made from inside a job run inline.
+void jobs_run(JobProc proc, void* data, u32 count, u32 batch_size);
+
+template<typename F>
+inline void parallel_for(u32 count, u32 batch_size, F f) {
+    auto thunk = [](void* data, u32 begin, u32 end) {
+        (*(F*)data)(begin, end);
+    };
+
+    jobs_run(thunk, &f, count, batch_size);
+}
@@ -4,6 +4,7 @@
 
 #include "json.h"
 #include "platform.h"
+#include "profiler.h"
 
 enum TokenKind {
     TOKEN_EOF,
@@ -253,6 +254,8 @@ static JSON parse(Arena* arena, Scanner* scanner) {
 }
 
 JSON json_parse(Arena* arena, char* str) {
+    PROFILE_FUNCTION();
+
     Scanner scanner;
     scanner.line = 1;
     scanner.src = str;
@@ -0,0 +1,339 @@
+#include <math.h>
+
+#include "light_culling.h"
+#include "jobs.h"
+#include "platform.h"
+#include "profiler.h"
+
+// Unit normals of the view space planes between tiles, which all pass through the eye, and the depths between slices.
+// Column planes face right and row planes face up, so a point's signed distance grows towards higher columns and lower rows.
+struct ClusterPlanes {
+    f32 column_x[CLUSTER_COUNT_X + 1];
+    f32 column_z[CLUSTER_COUNT_X + 1];
+    f32 row_y[CLUSTER_COUNT_Y + 1];
+    f32 row_z[CLUSTER_COUNT_Y + 1];
+    f32 slice_depth[CLUSTER_COUNT_Z + 1];
+};
+
+static ClusterPlanes cluster_planes(ClusterView* view) {
+    ClusterPlanes planes;
+
+    f32 tan_half_fov = tanf(view->vertical_fov * 0.5f);
+
+    // The boundary at slope s holds the points where x = -z * s, with z negative in front of the camera.
+    for (u32 i = 0; i <= CLUSTER_COUNT_X; ++i) {
+        f32 s = ((f32)i / CLUSTER_COUNT_X * 2.0f - 1.0f) * tan_half_fov * view->aspect;
+        f32 inv_length = 1.0f / sqrtf(1.0f + s * s);
+        planes.column_x[i] = inv_length;
+        planes.column_z[i] = s * inv_length;
+    }
+
+    for (u32 i = 0; i <= CLUSTER_COUNT_Y; ++i) {
+        f32 s = (1.0f - (f32)i / CLUSTER_COUNT_Y * 2.0f) * tan_half_fov;
+        f32 inv_length = 1.0f / sqrtf(1.0f + s * s);
+        planes.row_y[i] = inv_length;
+        planes.row_z[i] = s * inv_length;
+    }
+
+    for (u32 i = 0; i <= CLUSTER_COUNT_Z; ++i) {
+        planes.slice_depth[i] = view->near_depth * powf(view->far_depth / view->near_depth, (f32)i / CLUSTER_COUNT_Z);
+    }
+
+    return planes;
+}
+
+static f32 point_light_radius(RDPointLight* light) {
+    return max(light->intensity.x, max(light->intensity.y, light->intensity.z)) / POINT_LIGHT_CUTOFF;
+}
+
+// A light touches cluster (x, y, z) when bit x of columns and bit y of rows are set and first_slice <= z < end_slice.
+struct LightBins {
+    u32 columns;
+    u32 rows;
+    u32 first_slice;
+    u32 end_slice;
+};
+
+static void bin_lights(ClusterPlanes* planes, XMMATRIX view, RDPointLight* lights, u32 begin, u32 end, LightBins* bins) {
+    __m128 zero = _mm_setzero_ps();
+
+    for (u32 i = begin; i < end; i += 4) {
+        u32 n = min(end - i, 4u);
+
+        alignas(16) f32 x[4] = {};
+        alignas(16) f32 y[4] = {};
+        alignas(16) f32 z[4] = {};
+        alignas(16) f32 r[4] = {};
+
+        for (u32 l = 0; l < n; ++l) {
+            XMVECTOR p = XMVector3Transform(XMLoadFloat3(&lights[i + l].position), view);
+            x[l] = XMVectorGetX(p);
+            y[l] = XMVectorGetY(p);
+            z[l] = XMVectorGetZ(p);
+            r[l] = point_light_radius(&lights[i + l]);
+        }
+
+        __m128 vx = _mm_load_ps(x);
+        __m128 vy = _mm_load_ps(y);
+        __m128 vz = _mm_load_ps(z);
+        __m128 vr = _mm_load_ps(r);
+        __m128 neg_r = _mm_sub_ps(zero, vr);
+
+        // Bit k of ahead/behind is set when the sphere reaches the positive/negative side of boundary k.
+        __m128i column_ahead = _mm_setzero_si128();
+        __m128i column_behind = _mm_setzero_si128();
+
+        for (u32 k = 0; k <= CLUSTER_COUNT_X; ++k) {
+            __m128 d = _mm_add_ps(_mm_mul_ps(vx, _mm_set1_ps(planes->column_x[k])), _mm_mul_ps(vz, _mm_set1_ps(planes->column_z[k])));
+            __m128i bit = _mm_set1_epi32(1 << k);
+            column_ahead = _mm_or_si128(column_ahead, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(d, neg_r)), bit));
+            column_behind = _mm_or_si128(column_behind, _mm_and_si128(_mm_castps_si128(_mm_cmple_ps(d, vr)), bit));
+        }
+
+        __m128i row_ahead = _mm_setzero_si128();
+        __m128i row_behind = _mm_setzero_si128();
+
+        for (u32 k = 0; k <= CLUSTER_COUNT_Y; ++k) {
+            __m128 d = _mm_add_ps(_mm_mul_ps(vy, _mm_set1_ps(planes->row_y[k])), _mm_mul_ps(vz, _mm_set1_ps(planes->row_z[k])));
+            __m128i bit = _mm_set1_epi32(1 << k);
+            row_ahead = _mm_or_si128(row_ahead, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(d, neg_r)), bit));
+            row_behind = _mm_or_si128(row_behind, _mm_and_si128(_mm_castps_si128(_mm_cmple_ps(d, vr)), bit));
+        }
+
+        // Column c lies between boundaries c and c + 1, row r between boundaries r (above) and r + 1 (below).
+        __m128i columns = _mm_and_si128(column_ahead, _mm_srli_epi32(column_behind, 1));
+        __m128i rows = _mm_and_si128(row_behind, _mm_srli_epi32(row_ahead, 1));
+
+        // Slice depths increase, so the slices a light touches are contiguous. Comparisons count -1 for true.
+        __m128 depth = _mm_sub_ps(zero, vz);
+        __m128 lo = _mm_sub_ps(depth, vr);
+        __m128 hi = _mm_add_ps(depth, vr);
+
+        __m128i first_slice = _mm_setzero_si128();
+        __m128i end_slice = _mm_setzero_si128();
+
+        for (u32 k = 0; k < CLUSTER_COUNT_Z; ++k) {
+            first_slice = _mm_sub_epi32(first_slice, _mm_castps_si128(_mm_cmplt_ps(_mm_set1_ps(planes->slice_depth[k + 1]), lo)));
+            end_slice = _mm_sub_epi32(end_slice, _mm_castps_si128(_mm_cmple_ps(_mm_set1_ps(planes->slice_depth[k]), hi)));
+        }
+
+        alignas(16) u32 out_columns[4];
+        alignas(16) u32 out_rows[4];
+        alignas(16) u32 out_first[4];
+        alignas(16) u32 out_end[4];
+
+        _mm_store_si128((__m128i*)out_columns, _mm_and_si128(columns, _mm_set1_epi32((1 << CLUSTER_COUNT_X) - 1)));
+        _mm_store_si128((__m128i*)out_rows, _mm_and_si128(rows, _mm_set1_epi32((1 << CLUSTER_COUNT_Y) - 1)));
+        _mm_store_si128((__m128i*)out_first, first_slice);
+        _mm_store_si128((__m128i*)out_end, end_slice);
+
+        for (u32 l = 0; l < n; ++l) {
+            bins[i + l] = { out_columns[l], out_rows[l], out_first[l], out_end[l] };
+        }
+    }
+}
+
+static bool light_in_slice(LightBins* bins, u32 slice) {
+    return bins->columns && bins->rows && slice >= bins->first_slice && slice < bins->end_slice;
+}
+
+LightClusters build_light_clusters(Arena* arena, ClusterView* view, u32 light_count, RDPointLight* lights) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(arena);
+
+    ClusterPlanes planes = cluster_planes(view);
+
+    LightBins* bins = scratch->push_array<LightBins>(light_count);
+    u32 job_count = (light_count + LIGHT_CULL_JOB_SIZE - 1) / LIGHT_CULL_JOB_SIZE;
+
+    parallel_for(job_count, 1, [&](u32 begin, u32 end) {
+        for (u32 job = begin; job < end; ++job) {
+            u32 first = job * LIGHT_CULL_JOB_SIZE;
+            bin_lights(&planes, view->view, lights, first, min(first + LIGHT_CULL_JOB_SIZE, light_count), bins);
+        }
+    });
+
+    LightClusters clusters = {};
+    clusters.ranges = arena->push_array<ClusterRange>(CLUSTER_COUNT);
+
+    const u32 clusters_per_slice = CLUSTER_COUNT_X * CLUSTER_COUNT_Y;
+
+    // Count, lay the lists out back to back, then fill. Each slice is its own job so no two threads touch a cluster.
+    parallel_for(CLUSTER_COUNT_Z, 1, [&](u32 begin, u32 end) {
+        for (u32 slice = begin; slice < end; ++slice) {
+            ClusterRange* slice_ranges = clusters.ranges + slice * clusters_per_slice;
+
+            for (u32 i = 0; i < light_count; ++i) {
+                LightBins* b = &bins[i];
+
+                if (!light_in_slice(b, slice)) {
+                    continue;
+                }
+
+                for (u32 rows = b->rows; rows; rows &= rows - 1) {
+                    ClusterRange* row = slice_ranges + count_trailing_zeros(rows) * CLUSTER_COUNT_X;
+
+                    for (u32 columns = b->columns; columns; columns &= columns - 1) {
+                        row[count_trailing_zeros(columns)].count++;
+                    }
+                }
+            }
+        }
+    });
+
+    for (u32 i = 0; i < CLUSTER_COUNT; ++i) {
+        clusters.ranges[i].offset = clusters.index_count;
+        clusters.index_count += clusters.ranges[i].count;
+    }
+
+    clusters.indices = (u32*)arena->push(clusters.index_count * sizeof(u32));
+
+    parallel_for(CLUSTER_COUNT_Z, 1, [&](u32 begin, u32 end) {
+        for (u32 slice = begin; slice < end; ++slice) {
+            ClusterRange* slice_ranges = clusters.ranges + slice * clusters_per_slice;
+
+            u32 cursors[CLUSTER_COUNT_X * CLUSTER_COUNT_Y];
+            for (u32 i = 0; i < clusters_per_slice; ++i) {
+                cursors[i] = slice_ranges[i].offset;
+            }
+
+            for (u32 i = 0; i < light_count; ++i) {
+                LightBins* b = &bins[i];
+
+                if (!light_in_slice(b, slice)) {
+                    continue;
+                }
+
+                for (u32 rows = b->rows; rows; rows &= rows - 1) {
+                    u32* row = cursors + count_trailing_zeros(rows) * CLUSTER_COUNT_X;
+
+                    for (u32 columns = b->columns; columns; columns &= columns - 1) {
+                        clusters.indices[row[count_trailing_zeros(columns)]++] = i;
+                    }
+                }
+            }
+        }
+    });
+
+    f32 log_depth_range = logf(view->far_depth / view->near_depth);
+    clusters.slice_scale = (f32)CLUSTER_COUNT_Z / log_depth_range;
+    clusters.slice_bias = -(f32)CLUSTER_COUNT_Z * logf(view->near_depth) / log_depth_range;
+
+    // View space looks down -z, so depth is the negated third column of the view matrix.
+    XMFLOAT4X4 v;
+    XMStoreFloat4x4(&v, view->view);
+    clusters.depth_plane = { -v.m[0][2], -v.m[1][2], -v.m[2][2], -v.m[3][2] };
+
+    PROFILE_COUNTER("cluster_light_indices", clusters.index_count);
+
+    return clusters;
+}
+
+// Tests every light against every cluster independently.
+static void build_light_clusters_reference(ClusterView* view, u32 light_count, RDPointLight* lights, ClusterRange* ranges, Vec<u32>* indices) {
+    ClusterPlanes planes = cluster_planes(view);
+
+    for (u32 slice = 0; slice < CLUSTER_COUNT_Z; ++slice) {
+        for (u32 row = 0; row < CLUSTER_COUNT_Y; ++row) {
+            for (u32 column = 0; column < CLUSTER_COUNT_X; ++column) {
+                ClusterRange* range = &ranges[(slice * CLUSTER_COUNT_Y + row) * CLUSTER_COUNT_X + column];
+                range->offset = indices->len;
+
+                for (u32 i = 0; i < light_count; ++i) {
+                    XMVECTOR p = XMVector3Transform(XMLoadFloat3(&lights[i].position), view->view);
+                    f32 x = XMVectorGetX(p);
+                    f32 y = XMVectorGetY(p);
+                    f32 z = XMVectorGetZ(p);
+                    f32 r = point_light_radius(&lights[i]);
+
+                    f32 left = x * planes.column_x[column] + z * planes.column_z[column];
+                    f32 right = x * planes.column_x[column + 1] + z * planes.column_z[column + 1];
+                    f32 top = y * planes.row_y[row] + z * planes.row_z[row];
+                    f32 bottom = y * planes.row_y[row + 1] + z * planes.row_z[row + 1];
+
+                    f32 depth = 0.0f - z;
+
+                    bool inside = left >= -r && right <= r && top <= r && bottom >= -r &&
+                        planes.slice_depth[slice + 1] >= depth - r && planes.slice_depth[slice] <= depth + r;
+
+                    if (inside) {
+                        indices->push(i);
+                    }
+                }
+
+                range->count = indices->len - range->offset;
+            }
+        }
+    }
+}
+
+void light_culling_benchmark(u32 light_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32 seed = 0x6c8e9cf5;
+    auto random_f32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (f32)(seed & 0xffffff) / (f32)0x1000000;
+    };
+
+    RDPointLight* lights = scratch->push_array<RDPointLight>(light_count);
+
+    // Small lights spread through the view volume, like sparks or a lit city, rather than a few that cover everything.
+    for (u32 i = 0; i < light_count; ++i) {
+        f32 radius = 1.0f + random_f32() * 7.0f;
+        f32 brightest = radius * POINT_LIGHT_CUTOFF;
+
+        lights[i].position = { random_f32() * 300.0f - 150.0f, random_f32() * 100.0f - 50.0f, -2.0f - random_f32() * 300.0f };
+        lights[i].intensity = { brightest, brightest * random_f32(), brightest * random_f32() };
+    }
+
+    ClusterView view = {};
+    view.view = XMMatrixLookAtRH(XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 1.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+    view.vertical_fov = XM_PIDIV2;
+    view.aspect = 16.0f/9.0f;
+    view.near_depth = 0.1f;
+    view.far_depth = 1000.0f;
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    const u32 iterations = 16;
+
+    u64 start = pf_ticks();
+    for (u32 i = 0; i < iterations; ++i) {
+        Scratch iteration = get_scratch(0);
+        build_light_clusters(iteration.arena, &view, light_count, lights);
+    }
+    u64 build_ticks = pf_ticks() - start;
+
+    LightClusters clusters = build_light_clusters(scratch.arena, &view, light_count, lights);
+
+    ClusterRange* reference_ranges = scratch->push_array<ClusterRange>(CLUSTER_COUNT);
+    Vec<u32> reference_indices = {};
+
+    start = pf_ticks();
+    build_light_clusters_reference(&view, light_count, lights, reference_ranges, &reference_indices);
+    u64 reference_ticks = pf_ticks() - start;
+
+    bool matches = clusters.index_count == reference_indices.len &&
+        memcmp(clusters.ranges, reference_ranges, CLUSTER_COUNT * sizeof(ClusterRange)) == 0 &&
+        memcmp(clusters.indices, reference_indices.mem, clusters.index_count * sizeof(u32)) == 0;
+
+    assert(matches && "light clusters disagree with the brute force reference");
+
+    u32 occupied = 0;
+    u32 largest = 0;
+
+    for (u32 i = 0; i < CLUSTER_COUNT; ++i) {
+        occupied += clusters.ranges[i].count > 0;
+        largest = max(largest, clusters.ranges[i].count);
+    }
+
+    pf_debug_log("light_culling: %u lights, %u indices in %u/%u clusters (%.1f avg, %u max), build %.3fms on %u threads, brute force %.1fms, %s\n",
+        light_count, clusters.index_count, occupied, CLUSTER_COUNT, occupied ? (f64)clusters.index_count / occupied : 0.0, largest,
+        (f64)build_ticks * ms_per_tick / iterations, jobs_thread_count(), (f64)reference_ticks * ms_per_tick, matches ? "matches reference" : "MISMATCH");
+
+    reference_indices.free();
+}
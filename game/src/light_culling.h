@@ -0,0 +1,51 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "renderer.h"
+
+// View space froxel grid. Tiles split the screen evenly and slices split depth exponentially between the near and far planes.
+// Cluster (x, y, z) lives at (z * CLUSTER_COUNT_Y + y) * CLUSTER_COUNT_X + x, with y = 0 at the top of the screen.
+#define CLUSTER_COUNT_X 16
+#define CLUSTER_COUNT_Y 9
+#define CLUSTER_COUNT_Z 24
+#define CLUSTER_COUNT (CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z)
+
+// Same cutoff as lighting.hlsl: a point light stops at the distance where 1/distance falls to this fraction of its brightest channel.
+#define POINT_LIGHT_CUTOFF 0.01f
+
+// Lights are binned in jobs of this many.
+#define LIGHT_CULL_JOB_SIZE 1024
+
+struct ClusterView {
+    XMMATRIX view;
+    f32 vertical_fov;
+    f32 aspect;
+    f32 near_depth;
+    f32 far_depth;
+};
+
+struct ClusterRange {
+    u32 offset;
+    u32 count;
+};
+
+struct LightClusters {
+    ClusterRange* ranges;
+    u32 index_count;
+    u32* indices;
+
+    // slice = floor(log(depth) * slice_scale + slice_bias), where depth = dot(depth_plane.xyz, world position) + depth_plane.w.
+    f32 slice_scale;
+    f32 slice_bias;
+    XMFLOAT4 depth_plane;
+};
+
+// Bins every point light into the clusters its range touches. Each cluster's list is in ascending light order.
+// Allocates the result from arena and runs across the job threads.
+LightClusters build_light_clusters(Arena* arena, ClusterView* view, u32 light_count, RDPointLight* lights);
+
+// Bins light_count random lights, checks every cluster against a brute force reference, and logs timings.
+void light_culling_benchmark(u32 light_count);
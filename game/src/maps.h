@@ -4,9 +4,9 @@
 
 #define MAX_LOAD_FACTOR 0.5f
 
-inline u64 fn1va_hash_bytes(void* bytes, size_t len) {
-    u64 hash = 0xcbf29ce484222325;
+#define FN1VA_HASH_OFFSET 0xcbf29ce484222325
 
+inline u64 fn1va_hash_bytes(void* bytes, size_t len, u64 hash = FN1VA_HASH_OFFSET) {
     for (size_t i = 0; i < len; ++i) {
         hash ^= ((u8*)bytes)[i];
         hash *= 0x100000001b3;
@@ -0,0 +1,409 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "mesh_optimizer.h"
+#include "vertex_format.h"
+#include "maps.h"
+#include "profiler.h"
+
+VertexCacheStats analyze_vertex_cache(u32* indices, u32 index_count, u32 vertex_count) {
+    Scratch scratch = get_scratch(0);
+
+    // A vertex is cached if fewer than MESH_CACHE_SIZE vertices were pushed since it was. 0 means never pushed.
+    u32* pushed_at = scratch->push_array<u32>(vertex_count);
+    u32 pushes = 0;
+
+    VertexCacheStats stats = {};
+    stats.triangle_count = index_count / 3;
+
+    for (u32 i = 0; i < index_count; ++i) {
+        u32 v = indices[i];
+
+        if (pushed_at[v] == 0) {
+            stats.vertex_count++;
+        }
+
+        if (pushed_at[v] == 0 || pushes - pushed_at[v] >= MESH_CACHE_SIZE) {
+            pushed_at[v] = ++pushes;
+            stats.cache_misses++;
+        }
+    }
+
+    return stats;
+}
+
+u32 weld_vertices(RDPackedVertex* vertices, u32 vertex_count, u32* indices, u32 index_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32 cap = 1;
+    while (cap < vertex_count * 2) {
+        cap *= 2;
+    }
+
+    // Open addressing over the indices of the vertices kept so far, which are compacted to the front as they are found.
+    u32* table = scratch->push_array<u32>(cap);
+    memset(table, 0xff, cap * sizeof(u32));
+
+    u32* remap = scratch->push_array<u32>(vertex_count);
+    u32 unique_count = 0;
+
+    for (u32 v = 0; v < vertex_count; ++v) {
+        u32 slot = (u32)fn1va_hash_bytes(&vertices[v], sizeof(RDPackedVertex)) & (cap - 1);
+
+        while (table[slot] != UINT32_MAX && memcmp(&vertices[table[slot]], &vertices[v], sizeof(RDPackedVertex)) != 0) {
+            slot = (slot + 1) & (cap - 1);
+        }
+
+        if (table[slot] == UINT32_MAX) {
+            vertices[unique_count] = vertices[v];
+            table[slot] = unique_count++;
+        }
+
+        remap[v] = table[slot];
+    }
+
+    for (u32 i = 0; i < index_count; ++i) {
+        indices[i] = remap[indices[i]];
+    }
+
+    return unique_count;
+}
+
+// Tipsify
+
+struct TriangleAdjacency {
+    u32* offsets;
+    u32* triangles;
+};
+
+static TriangleAdjacency build_triangle_adjacency(Arena* arena, u32* indices, u32 index_count, u32 vertex_count) {
+    TriangleAdjacency adjacency;
+    adjacency.offsets = arena->push_array<u32>(vertex_count + 1);
+    adjacency.triangles = arena->push_array<u32>(index_count);
+
+    for (u32 i = 0; i < index_count; ++i) {
+        adjacency.offsets[indices[i] + 1]++;
+    }
+
+    for (u32 v = 0; v < vertex_count; ++v) {
+        adjacency.offsets[v + 1] += adjacency.offsets[v];
+    }
+
+    u32* cursors = arena->push_array<u32>(vertex_count);
+    memcpy(cursors, adjacency.offsets, vertex_count * sizeof(u32));
+
+    for (u32 i = 0; i < index_count; ++i) {
+        adjacency.triangles[cursors[indices[i]]++] = i / 3;
+    }
+
+    return adjacency;
+}
+
+void optimize_vertex_cache(u32* indices, u32 index_count, u32 vertex_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32 triangle_count = index_count / 3;
+
+    TriangleAdjacency adjacency = build_triangle_adjacency(scratch.arena, indices, index_count, vertex_count);
+
+    u32* live_triangles = scratch->push_array<u32>(vertex_count);
+    for (u32 v = 0; v < vertex_count; ++v) {
+        live_triangles[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+    }
+
+    u32* cache_time = scratch->push_array<u32>(vertex_count);
+    bool* emitted = scratch->push_array<bool>(triangle_count);
+
+    // Vertices of recently emitted triangles, for restarting somewhere local when the fan runs dry.
+    u32* dead_ends = scratch->push_array<u32>(index_count);
+    u32 dead_end_count = 0;
+
+    u32* candidates = scratch->push_array<u32>(index_count);
+
+    u32* output = scratch->push_array<u32>(index_count);
+    u32 output_count = 0;
+
+    u32 time = MESH_CACHE_SIZE + 1;
+    u32 cursor = 0;
+
+    auto skip_dead_end = [&]() -> u32 {
+        while (dead_end_count > 0) {
+            u32 v = dead_ends[--dead_end_count];
+            if (live_triangles[v] > 0) {
+                return v;
+            }
+        }
+
+        while (cursor < vertex_count) {
+            if (live_triangles[cursor] > 0) {
+                return cursor;
+            }
+            cursor++;
+        }
+
+        return UINT32_MAX;
+    };
+
+    u32 fan = skip_dead_end();
+
+    while (fan != UINT32_MAX) {
+        u32 candidate_count = 0;
+
+        for (u32 a = adjacency.offsets[fan]; a < adjacency.offsets[fan + 1]; ++a) {
+            u32 t = adjacency.triangles[a];
+
+            if (emitted[t]) {
+                continue;
+            }
+
+            for (u32 k = 0; k < 3; ++k) {
+                u32 v = indices[t * 3 + k];
+
+                output[output_count++] = v;
+                dead_ends[dead_end_count++] = v;
+                candidates[candidate_count++] = v;
+                live_triangles[v]--;
+
+                if (time - cache_time[v] > MESH_CACHE_SIZE) {
+                    cache_time[v] = time++;
+                }
+            }
+
+            emitted[t] = true;
+        }
+
+        // Prefer the candidate that has been in the cache longest but will still be there after its remaining triangles.
+        u32 next = UINT32_MAX;
+        i32 best_priority = -1;
+
+        for (u32 i = 0; i < candidate_count; ++i) {
+            u32 v = candidates[i];
+
+            if (live_triangles[v] == 0) {
+                continue;
+            }
+
+            i32 priority = 0;
+            if (time - cache_time[v] + 2 * live_triangles[v] <= MESH_CACHE_SIZE) {
+                priority = (i32)(time - cache_time[v]);
+            }
+
+            if (priority > best_priority) {
+                best_priority = priority;
+                next = v;
+            }
+        }
+
+        fan = next != UINT32_MAX ? next : skip_dead_end();
+    }
+
+    assert(output_count == triangle_count * 3);
+    memcpy(indices, output, output_count * sizeof(u32));
+}
+
+// Overdraw
+
+struct ClusterSortKey {
+    f32 key;
+    u32 cluster;
+};
+
+static int compare_cluster_sort_keys(const void* a, const void* b) {
+    ClusterSortKey* x = (ClusterSortKey*)a;
+    ClusterSortKey* y = (ClusterSortKey*)b;
+
+    if (x->key != y->key) {
+        return x->key > y->key ? -1 : 1;
+    }
+
+    return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+// Same cache model as Tipsify. Returns how many of the triangle's vertices missed.
+static u32 simulate_triangle(u32* indices, u32 triangle, u32* cache_time, u32* time) {
+    u32 misses = 0;
+
+    for (u32 k = 0; k < 3; ++k) {
+        u32 v = indices[triangle * 3 + k];
+
+        if (*time - cache_time[v] > MESH_CACHE_SIZE) {
+            cache_time[v] = (*time)++;
+            misses++;
+        }
+    }
+
+    return misses;
+}
+
+void optimize_overdraw(u32* indices, u32 index_count, RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization) {
+    Scratch scratch = get_scratch(0);
+
+    u32 triangle_count = index_count / 3;
+
+    if (triangle_count == 0) {
+        return;
+    }
+
+    u32* cache_time = scratch->push_array<u32>(vertex_count);
+    u32 time = MESH_CACHE_SIZE + 1;
+
+    // A triangle where all three vertices miss starts a new patch; Tipsify only does that when it restarts somewhere else.
+    u32* hard_boundaries = scratch->push_array<u32>(triangle_count + 1);
+    u32 hard_count = 0;
+
+    for (u32 t = 0; t < triangle_count; ++t) {
+        if (simulate_triangle(indices, t, cache_time, &time) == 3 || t == 0) {
+            hard_boundaries[hard_count++] = t;
+        }
+    }
+
+    hard_boundaries[hard_count] = triangle_count;
+
+    // Split each patch further wherever the misses so far are already as good as the patch as a whole, within the threshold.
+    u32* clusters = scratch->push_array<u32>(triangle_count + 1);
+    u32 cluster_count = 0;
+
+    for (u32 h = 0; h < hard_count; ++h) {
+        u32 begin = hard_boundaries[h];
+        u32 end = hard_boundaries[h + 1];
+
+        time += MESH_CACHE_SIZE + 1;
+        u32 patch_misses = 0;
+        for (u32 t = begin; t < end; ++t) {
+            patch_misses += simulate_triangle(indices, t, cache_time, &time);
+        }
+
+        f32 threshold = MESH_OVERDRAW_THRESHOLD * (f32)patch_misses / (f32)(end - begin);
+
+        time += MESH_CACHE_SIZE + 1;
+        clusters[cluster_count++] = begin;
+
+        u32 cluster_begin = begin;
+        u32 cluster_misses = 0;
+
+        for (u32 t = begin; t < end; ++t) {
+            cluster_misses += simulate_triangle(indices, t, cache_time, &time);
+
+            if (t + 1 < end && (f32)cluster_misses <= threshold * (f32)(t + 1 - cluster_begin)) {
+                clusters[cluster_count++] = t + 1;
+                cluster_begin = t + 1;
+                cluster_misses = 0;
+                time += MESH_CACHE_SIZE + 1;
+            }
+        }
+    }
+
+    clusters[cluster_count] = triangle_count;
+
+    // Area weighted centroid and normal of each cluster, and of the whole mesh.
+    XMFLOAT3* cluster_centroids = scratch->push_array<XMFLOAT3>(cluster_count);
+    XMFLOAT3* cluster_normals = scratch->push_array<XMFLOAT3>(cluster_count);
+
+    f32 mesh_area = 0.0f;
+    XMFLOAT3 mesh_centroid = {};
+
+    for (u32 c = 0; c < cluster_count; ++c) {
+        f32 area = 0.0f;
+        XMFLOAT3 centroid = {};
+        XMFLOAT3 normal = {};
+
+        for (u32 t = clusters[c]; t < clusters[c + 1]; ++t) {
+            XMFLOAT3 p0 = unpack_position(&vertices[indices[t * 3 + 0]], quantization);
+            XMFLOAT3 p1 = unpack_position(&vertices[indices[t * 3 + 1]], quantization);
+            XMFLOAT3 p2 = unpack_position(&vertices[indices[t * 3 + 2]], quantization);
+
+            XMFLOAT3 e1 = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+            XMFLOAT3 e2 = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+            XMFLOAT3 n = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+
+            f32 a = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+
+            centroid.x += (p0.x + p1.x + p2.x) / 3.0f * a;
+            centroid.y += (p0.y + p1.y + p2.y) / 3.0f * a;
+            centroid.z += (p0.z + p1.z + p2.z) / 3.0f * a;
+            normal.x += n.x;
+            normal.y += n.y;
+            normal.z += n.z;
+            area += a;
+        }
+
+        mesh_centroid.x += centroid.x;
+        mesh_centroid.y += centroid.y;
+        mesh_centroid.z += centroid.z;
+        mesh_area += area;
+
+        f32 inv_area = area > 0.0f ? 1.0f / area : 0.0f;
+        cluster_centroids[c] = { centroid.x * inv_area, centroid.y * inv_area, centroid.z * inv_area };
+
+        f32 length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+        f32 inv_length = length > 0.0f ? 1.0f / length : 0.0f;
+        cluster_normals[c] = { normal.x * inv_length, normal.y * inv_length, normal.z * inv_length };
+    }
+
+    f32 inv_mesh_area = mesh_area > 0.0f ? 1.0f / mesh_area : 0.0f;
+    mesh_centroid = { mesh_centroid.x * inv_mesh_area, mesh_centroid.y * inv_mesh_area, mesh_centroid.z * inv_mesh_area };
+
+    // Clusters further out along their own normal are more likely to be in front of the others from any view.
+    ClusterSortKey* keys = scratch->push_array<ClusterSortKey>(cluster_count);
+
+    for (u32 c = 0; c < cluster_count; ++c) {
+        XMFLOAT3 d = { cluster_centroids[c].x - mesh_centroid.x, cluster_centroids[c].y - mesh_centroid.y, cluster_centroids[c].z - mesh_centroid.z };
+        XMFLOAT3 n = cluster_normals[c];
+        keys[c] = { d.x * n.x + d.y * n.y + d.z * n.z, c };
+    }
+
+    qsort(keys, cluster_count, sizeof(ClusterSortKey), compare_cluster_sort_keys);
+
+    u32* output = scratch->push_array<u32>(index_count);
+    u32 output_count = 0;
+
+    for (u32 i = 0; i < cluster_count; ++i) {
+        u32 c = keys[i].cluster;
+        u32 count = (clusters[c + 1] - clusters[c]) * 3;
+
+        memcpy(output + output_count, indices + clusters[c] * 3, count * sizeof(u32));
+        output_count += count;
+    }
+
+    memcpy(indices, output, output_count * sizeof(u32));
+}
+
+u32 optimize_vertex_fetch(RDPackedVertex* vertices, u32 vertex_count, u32* indices, u32 index_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32* remap = scratch->push_array<u32>(vertex_count);
+    memset(remap, 0xff, vertex_count * sizeof(u32));
+
+    RDPackedVertex* reordered = scratch->push_array<RDPackedVertex>(vertex_count);
+    u32 used_count = 0;
+
+    for (u32 i = 0; i < index_count; ++i) {
+        u32 v = indices[i];
+
+        if (remap[v] == UINT32_MAX) {
+            reordered[used_count] = vertices[v];
+            remap[v] = used_count++;
+        }
+
+        indices[i] = remap[v];
+    }
+
+    memcpy(vertices, reordered, used_count * sizeof(RDPackedVertex));
+
+    return used_count;
+}
+
+u32 optimize_mesh(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, MeshOptimizeStats* stats) {
+    PROFILE_FUNCTION();
+
+    stats->before = analyze_vertex_cache(indices, index_count, vertex_count);
+
+    vertex_count = weld_vertices(vertices, vertex_count, indices, index_count);
+    optimize_vertex_cache(indices, index_count, vertex_count);
+    optimize_overdraw(indices, index_count, vertices, vertex_count, quantization);
+    vertex_count = optimize_vertex_fetch(vertices, vertex_count, indices, index_count);
+
+    stats->after = analyze_vertex_cache(indices, index_count, vertex_count);
+
+    return vertex_count;
+}
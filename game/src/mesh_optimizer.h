@@ -0,0 +1,48 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "renderer.h"
+
+// Size of the post-transform cache that triangle order is tuned for and that the simulator models as a FIFO.
+#define MESH_CACHE_SIZE 16
+
+// Clusters of the cache optimized order are kept as long as reordering them costs less than this much extra ACMR.
+#define MESH_OVERDRAW_THRESHOLD 1.05f
+
+struct VertexCacheStats {
+    u32 triangle_count;
+    u32 vertex_count;
+    u32 cache_misses;
+
+    // Average cache miss ratio, transformed vertices per triangle. 0.5 is ideal for a regular grid, 3 is the worst case.
+    f32 acmr() { return triangle_count ? (f32)cache_misses / (f32)triangle_count : 0.0f; }
+    // Average transform to vertex ratio, how many times each vertex is transformed. 1 is ideal.
+    f32 atvr() { return vertex_count ? (f32)cache_misses / (f32)vertex_count : 0.0f; }
+};
+
+// Runs indices through a FIFO cache of MESH_CACHE_SIZE entries. vertex_count only counts vertices that are referenced.
+VertexCacheStats analyze_vertex_cache(u32* indices, u32 index_count, u32 vertex_count);
+
+// Merges identical packed vertices and remaps indices to match. Returns the new vertex count.
+u32 weld_vertices(RDPackedVertex* vertices, u32 vertex_count, u32* indices, u32 index_count);
+
+// Reorders triangles for the post-transform cache with Tipsify (Sander et al. 2007).
+void optimize_vertex_cache(u32* indices, u32 index_count, u32 vertex_count);
+
+// Splits cache optimized triangles into clusters and draws outward facing ones first so they occlude the rest,
+// giving up at most MESH_OVERDRAW_THRESHOLD in ACMR.
+void optimize_overdraw(u32* indices, u32 index_count, RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization);
+
+// Orders vertices by first use so fetches walk memory forwards, dropping unreferenced ones. Returns the new vertex count.
+u32 optimize_vertex_fetch(RDPackedVertex* vertices, u32 vertex_count, u32* indices, u32 index_count);
+
+struct MeshOptimizeStats {
+    VertexCacheStats before;
+    VertexCacheStats after;
+};
+
+// All of the above, in order. Returns the new vertex count.
+u32 optimize_mesh(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, MeshOptimizeStats* stats);
@@ -0,0 +1,352 @@
+#include <math.h>
+#include <float.h>
+
+#include "meshlets.h"
+#include "mesh_optimizer.h"
+#include "jobs.h"
+#include "platform.h"
+
+static Meshlet finish_meshlet(XMFLOAT3* positions, u32* indices, u32 begin, u32 end, u32* vertices, u32 vertex_count) {
+    Meshlet meshlet = {};
+    meshlet.index_offset = begin;
+    meshlet.index_count = end - begin;
+    meshlet.vertex_count = vertex_count;
+
+    // Sphere centred on the box, like the mesh bounds.
+    XMVECTOR aabb_min = XMVectorReplicate(FLT_MAX);
+    XMVECTOR aabb_max = XMVectorReplicate(-FLT_MAX);
+
+    for (u32 i = 0; i < vertex_count; ++i) {
+        XMVECTOR pos = XMLoadFloat3(&positions[vertices[i]]);
+        aabb_min = XMVectorMin(aabb_min, pos);
+        aabb_max = XMVectorMax(aabb_max, pos);
+    }
+
+    XMVECTOR center = (aabb_min + aabb_max) * 0.5f;
+    XMVECTOR radius_sq = XMVectorZero();
+
+    for (u32 i = 0; i < vertex_count; ++i) {
+        radius_sq = XMVectorMax(radius_sq, XMVector3LengthSq(XMLoadFloat3(&positions[vertices[i]]) - center));
+    }
+
+    XMStoreFloat3(&meshlet.center, center);
+    meshlet.radius = sqrtf(XMVectorGetX(radius_sq));
+
+    // The cone axis is the average triangle normal and its angle covers the normal furthest from it.
+    u32 triangle_count = meshlet.index_count / 3;
+    XMFLOAT3 normals[MESHLET_MAX_TRIANGLES];
+    XMVECTOR normal_sum = XMVectorZero();
+
+    for (u32 t = 0; t < triangle_count; ++t) {
+        XMVECTOR p0 = XMLoadFloat3(&positions[indices[begin + t * 3 + 0]]);
+        XMVECTOR p1 = XMLoadFloat3(&positions[indices[begin + t * 3 + 1]]);
+        XMVECTOR p2 = XMLoadFloat3(&positions[indices[begin + t * 3 + 2]]);
+
+        XMVECTOR n = XMVector3Normalize(XMVector3Cross(p1 - p0, p2 - p0));
+        XMStoreFloat3(&normals[t], n);
+        normal_sum += n;
+    }
+
+    meshlet.cone_apex = meshlet.center;
+    meshlet.cone_cutoff = 2.0f;
+
+    if (XMVectorGetX(XMVector3LengthSq(normal_sum)) == 0.0f) {
+        return meshlet;
+    }
+
+    XMVECTOR axis = XMVector3Normalize(normal_sum);
+    XMStoreFloat3(&meshlet.cone_axis, axis);
+
+    f32 min_dot = 1.0f;
+
+    for (u32 t = 0; t < triangle_count; ++t) {
+        XMVECTOR n = XMLoadFloat3(&normals[t]);
+
+        // Degenerate triangles are never drawn, so they don't constrain the cone.
+        if (XMVectorGetX(XMVector3LengthSq(n)) > 0.0f) {
+            min_dot = min(min_dot, XMVectorGetX(XMVector3Dot(n, axis)));
+        }
+    }
+
+    if (min_dot <= MESHLET_MIN_CONE_DOT) {
+        return meshlet;
+    }
+
+    // Slide the apex back along the axis until it is behind every triangle's plane. Any camera inside the cone
+    // around it is then behind every plane too.
+    f32 max_t = 0.0f;
+
+    for (u32 t = 0; t < triangle_count; ++t) {
+        XMVECTOR n = XMLoadFloat3(&normals[t]);
+        f32 dn = XMVectorGetX(XMVector3Dot(n, axis));
+
+        if (dn > 0.0f) {
+            XMVECTOR p0 = XMLoadFloat3(&positions[indices[begin + t * 3]]);
+            max_t = max(max_t, XMVectorGetX(XMVector3Dot(center - p0, n)) / dn);
+        }
+    }
+
+    XMStoreFloat3(&meshlet.cone_apex, center - axis * max_t);
+    meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+
+    return meshlet;
+}
+
+u32 build_meshlets(XMFLOAT3* positions, u32 vertex_count, u32* indices, u32 index_count, Meshlet* meshlets) {
+    Scratch scratch = get_scratch(0);
+
+    // Which meshlet last took each vertex, plus one so that zero is none.
+    u32* vertex_meshlet = scratch->push_array<u32>(vertex_count);
+
+    u32 meshlet_count = 0;
+    u32 meshlet_vertices[MESHLET_MAX_VERTICES];
+    u32 meshlet_vertex_count = 0;
+    u32 begin = 0;
+
+    for (u32 i = 0; i + 3 <= index_count; i += 3) {
+        u32 new_vertices = 0;
+
+        for (u32 k = 0; k < 3; ++k) {
+            new_vertices += vertex_meshlet[indices[i + k]] != meshlet_count + 1;
+        }
+
+        if (meshlet_vertex_count + new_vertices > MESHLET_MAX_VERTICES || i - begin == MESHLET_MAX_TRIANGLES * 3) {
+            meshlets[meshlet_count] = finish_meshlet(positions, indices, begin, i, meshlet_vertices, meshlet_vertex_count);
+            meshlet_count++;
+
+            begin = i;
+            meshlet_vertex_count = 0;
+        }
+
+        for (u32 k = 0; k < 3; ++k) {
+            u32 v = indices[i + k];
+
+            if (vertex_meshlet[v] != meshlet_count + 1) {
+                vertex_meshlet[v] = meshlet_count + 1;
+                meshlet_vertices[meshlet_vertex_count++] = v;
+            }
+        }
+    }
+
+    if (meshlet_vertex_count > 0) {
+        meshlets[meshlet_count] = finish_meshlet(positions, indices, begin, index_count - index_count % 3, meshlet_vertices, meshlet_vertex_count);
+        meshlet_count++;
+    }
+
+    return meshlet_count;
+}
+
+MeshletCullView meshlet_cull_view(Frustum* frustum, XMVECTOR camera_position, XMMATRIX transform) {
+    MeshletCullView view;
+
+    // A world plane dotted with p * transform is the plane transformed by the transpose, dotted with p.
+    // Renormalizing keeps distances in local units, so they compare directly against local radii.
+    XMMATRIX transpose = XMMatrixTranspose(transform);
+
+    for (int p = 0; p < 6; ++p) {
+        XMVECTOR plane = XMVector4Transform(XMLoadFloat4(&frustum->planes[p]), transpose);
+        XMStoreFloat4(&view.planes[p], XMPlaneNormalize(plane));
+    }
+
+    XMStoreFloat3(&view.camera_position, XMVector3Transform(camera_position, XMMatrixInverse(0, transform)));
+
+    f32 determinant = XMVectorGetX(XMVector3Dot(XMVector3Cross(transform.r[0], transform.r[1]), transform.r[2]));
+    view.cone_culling = determinant > 0.0f;
+
+    return view;
+}
+
+u32 cull_meshlets(MeshletCullView* view, u32 meshlet_count, Meshlet* meshlets, IndexRange* ranges) {
+    XMFLOAT3 camera = view->camera_position;
+    u32 range_count = 0;
+
+    for (u32 i = 0; i < meshlet_count; ++i) {
+        Meshlet* meshlet = &meshlets[i];
+        XMFLOAT3 c = meshlet->center;
+
+        bool visible = true;
+
+        for (int p = 0; p < 6; ++p) {
+            XMFLOAT4 plane = view->planes[p];
+            visible &= c.x * plane.x + c.y * plane.y + c.z * plane.z + plane.w >= -meshlet->radius;
+        }
+
+        if (visible && view->cone_culling && meshlet->cone_cutoff <= 1.0f) {
+            f32 dx = meshlet->cone_apex.x - camera.x;
+            f32 dy = meshlet->cone_apex.y - camera.y;
+            f32 dz = meshlet->cone_apex.z - camera.z;
+
+            f32 d = dx * meshlet->cone_axis.x + dy * meshlet->cone_axis.y + dz * meshlet->cone_axis.z;
+            visible = d < meshlet->cone_cutoff * sqrtf(dx * dx + dy * dy + dz * dz);
+        }
+
+        if (!visible) {
+            continue;
+        }
+
+        if (range_count > 0 && ranges[range_count - 1].offset + ranges[range_count - 1].count == meshlet->index_offset) {
+            ranges[range_count - 1].count += meshlet->index_count;
+        }
+        else {
+            ranges[range_count].offset = meshlet->index_offset;
+            ranges[range_count].count = meshlet->index_count;
+            range_count++;
+        }
+    }
+
+    return range_count;
+}
+
+// True when a meshlet that was culled really has nothing to draw: each triangle faces away from the camera or lies
+// outside one of the frustum planes. Works in world space, so it doesn't share anything with the local space path.
+static bool meshlet_cull_is_conservative(Meshlet* meshlet, XMFLOAT3* positions, u32* indices, XMMATRIX transform, Frustum* frustum, XMVECTOR camera_position) {
+    for (u32 t = 0; t < meshlet->index_count / 3; ++t) {
+        XMVECTOR local[3];
+        XMVECTOR p[3];
+
+        for (u32 k = 0; k < 3; ++k) {
+            local[k] = XMLoadFloat3(&positions[indices[meshlet->index_offset + t * 3 + k]]);
+            p[k] = XMVector3Transform(local[k], transform);
+        }
+
+        // Edges are transformed rather than taken between world positions, which would cancel away small triangles.
+        XMVECTOR n = XMVector3Cross(XMVector3TransformNormal(local[1] - local[0], transform), XMVector3TransformNormal(local[2] - local[0], transform));
+        f32 scale = XMVectorGetX(XMVector3Length(n)) * XMVectorGetX(XMVector3Length(camera_position - p[0]));
+
+        if (XMVectorGetX(XMVector3Dot(camera_position - p[0], n)) <= scale * 1e-4f) {
+            continue;
+        }
+
+        bool outside = false;
+
+        for (int plane = 0; plane < 6 && !outside; ++plane) {
+            XMVECTOR pl = XMLoadFloat4(&frustum->planes[plane]);
+            outside = true;
+
+            for (u32 k = 0; k < 3; ++k) {
+                outside &= XMVectorGetX(XMVector3Dot(pl, p[k])) + XMVectorGetW(pl) < 1e-3f;
+            }
+        }
+
+        if (!outside) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void meshlet_benchmark(u32 segments) {
+    Scratch scratch = get_scratch(0);
+
+    // UV sphere of radius 10 with counter clockwise outward triangles, in the cache optimized order the loader produces.
+    u32 rings = segments / 2;
+    u32 vertex_count = (segments + 1) * (rings + 1);
+    u32 index_count = segments * rings * 6;
+
+    XMFLOAT3* positions = scratch->push_array<XMFLOAT3>(vertex_count);
+    u32* indices = scratch->push_array<u32>(index_count);
+
+    for (u32 y = 0; y <= rings; ++y) {
+        for (u32 x = 0; x <= segments; ++x) {
+            f32 theta = (f32)y / (f32)rings * XM_PI;
+            f32 phi = (f32)x / (f32)segments * 2.0f * XM_PI;
+            positions[y * (segments + 1) + x] = XMFLOAT3(10.0f * sinf(theta) * cosf(phi), 10.0f * cosf(theta), -10.0f * sinf(theta) * sinf(phi));
+        }
+    }
+
+    u32 written = 0;
+
+    for (u32 y = 0; y < rings; ++y) {
+        for (u32 x = 0; x < segments; ++x) {
+            u32 a = y * (segments + 1) + x;
+            u32 b = a + segments + 1;
+
+            u32 quad[6] = { a, b, a + 1, a + 1, b, b + 1 };
+            memcpy(indices + written, quad, sizeof(quad));
+            written += 6;
+        }
+    }
+
+    optimize_vertex_cache(indices, index_count, vertex_count);
+
+    Meshlet* meshlets = scratch->push_array<Meshlet>(index_count / 3);
+
+    u64 start = pf_ticks();
+    u32 meshlet_count = build_meshlets(positions, vertex_count, indices, index_count, meshlets);
+    u64 build_ticks = pf_ticks() - start;
+
+    u32 total_vertices = 0;
+    u32 coned = 0;
+
+    for (u32 i = 0; i < meshlet_count; ++i) {
+        total_vertices += meshlets[i].vertex_count;
+        coned += meshlets[i].cone_cutoff <= 1.0f;
+    }
+
+    // Random cameras around random non uniformly scaled instances. One in four is mirrored to exercise the fallback.
+    u32 seed = 0x9e3779b9;
+    auto random_f32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (f32)(seed & 0xffffff) / (f32)0x1000000;
+    };
+
+    const u32 view_count = 64;
+    IndexRange* ranges = scratch->push_array<IndexRange>(meshlet_count);
+
+    u64 cull_ticks = 0;
+    u64 drawn_indices = 0;
+    u32 drawn_ranges = 0;
+    bool conservative = true;
+
+    for (u32 v = 0; v < view_count; ++v) {
+        f32 mirror = v % 4 == 3 ? -1.0f : 1.0f;
+        XMMATRIX transform = XMMatrixScaling(mirror * (0.5f + random_f32()), 0.5f + random_f32(), 0.5f + random_f32()) *
+            XMMatrixRotationX(random_f32() * XM_PI) * XMMatrixRotationY(random_f32() * 2.0f * XM_PI) * XMMatrixTranslation(0.0f, 0.0f, -40.0f);
+
+        XMVECTOR target = XMVectorSet(random_f32() * 16.0f - 8.0f, random_f32() * 16.0f - 8.0f, -40.0f + random_f32() * 16.0f - 8.0f, 1.0f);
+        XMVECTOR camera_position = XMVectorSet(random_f32() * 20.0f - 10.0f, random_f32() * 20.0f - 10.0f, random_f32() * 10.0f, 1.0f);
+
+        XMMATRIX view = XMMatrixLookAtRH(camera_position, target, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+        XMMATRIX projection = XMMatrixPerspectiveFovRH(XM_PIDIV4, 16.0f/9.0f, 1000.0f, 0.1f);
+        Frustum frustum = frustum_from_view_projection(view * projection);
+
+        start = pf_ticks();
+        MeshletCullView cull_view = meshlet_cull_view(&frustum, camera_position, transform);
+        u32 range_count = cull_meshlets(&cull_view, meshlet_count, meshlets, ranges);
+        cull_ticks += pf_ticks() - start;
+
+        drawn_ranges += range_count;
+
+        u32 r = 0;
+
+        for (u32 i = 0; i < meshlet_count; ++i) {
+            while (r < range_count && ranges[r].offset + ranges[r].count <= meshlets[i].index_offset) {
+                r++;
+            }
+
+            bool drawn = r < range_count && ranges[r].offset <= meshlets[i].index_offset;
+
+            if (drawn) {
+                drawn_indices += meshlets[i].index_count;
+            }
+            else if (!meshlet_cull_is_conservative(&meshlets[i], positions, indices, transform, &frustum, camera_position)) {
+                conservative = false;
+            }
+        }
+    }
+
+    assert(conservative && "meshlet culling dropped a visible triangle");
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    pf_debug_log("meshlets: %u triangles into %u meshlets in %.3fms, %.1f triangles and %.1f vertices each, %u%% with cones\n",
+        index_count / 3, meshlet_count, (f64)build_ticks * ms_per_tick, (f64)index_count / 3.0 / meshlet_count,
+        (f64)total_vertices / meshlet_count, coned * 100 / max(meshlet_count, 1u));
+
+    pf_debug_log("meshlets: culling %.3fms per view, %.1f%% of triangles drawn in %.1f ranges, %s\n",
+        (f64)cull_ticks * ms_per_tick / view_count, (f64)drawn_indices * 100.0 / ((f64)index_count * view_count),
+        (f64)drawn_ranges / view_count, conservative ? "conservative" : "DROPPED VISIBLE TRIANGLES");
+}
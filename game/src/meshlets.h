@@ -0,0 +1,60 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "culling.h"
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// Instances per job when culling their meshlets.
+#define MESHLET_CULL_JOB_SIZE 64
+
+// Meshlets whose normals spread further than this from the cone axis don't get a cone, as it would almost never cull.
+#define MESHLET_MIN_CONE_DOT 0.1f
+
+// A run of consecutive triangles in the mesh index buffer that touches at most MESHLET_MAX_VERTICES vertices.
+// Everything is in the mesh's local space.
+struct Meshlet {
+    u32 index_offset;
+    u32 index_count;
+    u32 vertex_count;
+
+    XMFLOAT3 center;
+    f32 radius;
+
+    // Every triangle faces away from a camera at c when dot(normalize(cone_apex - c), cone_axis) >= cone_cutoff.
+    // A cutoff above 1 never culls.
+    XMFLOAT3 cone_apex;
+    XMFLOAT3 cone_axis;
+    f32 cone_cutoff;
+};
+
+// Splits the index buffer into meshlets without reordering it, so it should already be optimized for the vertex cache.
+// meshlets needs room for index_count / 3. Returns how many were written.
+u32 build_meshlets(XMFLOAT3* positions, u32 vertex_count, u32* indices, u32 index_count, Meshlet* meshlets);
+
+// An instance's view, brought into its mesh's local space so meshlets can be tested without transforming them.
+struct MeshletCullView {
+    XMFLOAT4 planes[6];
+    XMFLOAT3 camera_position;
+    // Off for mirrored instances, whose triangles flip winding on screen.
+    bool cone_culling;
+};
+
+MeshletCullView meshlet_cull_view(Frustum* frustum, XMVECTOR camera_position, XMMATRIX transform);
+
+struct IndexRange {
+    u32 offset;
+    u32 count;
+};
+
+// Writes the index ranges of the visible meshlets to ranges, merging meshlets that follow each other in the index buffer.
+// ranges needs room for meshlet_count. Returns how many were written.
+u32 cull_meshlets(MeshletCullView* view, u32 meshlet_count, Meshlet* meshlets, IndexRange* ranges);
+
+// Builds meshlets for a dense sphere, culls them from random cameras, checks that no front facing triangle was culled,
+// and logs timings.
+void meshlet_benchmark(u32 segments);
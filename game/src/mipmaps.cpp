@@ -0,0 +1,242 @@
+#include <math.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include "mipmaps.h"
+#include "platform.h"
+#include "jobs.h"
+#include "profiler.h"
+
+// Linear light is quantized to this many steps to look up its sRGB encoding. Fine enough that the result is never more
+// than one code off the exact curve, even near black where sRGB codes are closest together.
+#define SRGB_ENCODE_STEPS 65536
+
+static f32 srgb_to_linear(f32 s) {
+    return s <= 0.04045f ? s / 12.92f : powf((s + 0.055f) / 1.055f, 2.4f);
+}
+
+static f32 linear_to_srgb(f32 l) {
+    return l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+}
+
+struct MipTables {
+    f32 srgb_to_linear[256];
+    f32 unorm_to_float[256];
+    u8 linear_to_srgb[SRGB_ENCODE_STEPS];
+
+    MipTables() {
+        for (u32 i = 0; i < 256; ++i) {
+            srgb_to_linear[i] = ::srgb_to_linear((f32)i / 255.0f);
+            unorm_to_float[i] = (f32)i / 255.0f;
+        }
+
+        for (u32 i = 0; i < SRGB_ENCODE_STEPS; ++i) {
+            linear_to_srgb[i] = (u8)(::linear_to_srgb((f32)i / (f32)(SRGB_ENCODE_STEPS - 1)) * 255.0f + 0.5f);
+        }
+    }
+};
+
+static MipTables* mip_tables() {
+    static MipTables tables;
+    return &tables;
+}
+
+u32 mip_level_count(u32 width, u32 height) {
+    u32 levels = 1;
+    while ((width | height) >> levels) {
+        levels++;
+    }
+    return levels;
+}
+
+u64 mip_chain_size(u32 width, u32 height, u32 levels) {
+    u64 size = 0;
+
+    for (u32 i = 0; i < levels; ++i) {
+        size += (u64)width * height * 4;
+        width = max(width >> 1, 1u);
+        height = max(height >> 1, 1u);
+    }
+
+    return size;
+}
+
+static void decode_row(u8* texels, u32 width, f32* color, f32* alpha, f32* out) {
+    for (u32 x = 0; x < width; ++x) {
+        out[x * 4 + 0] = color[texels[x * 4 + 0]];
+        out[x * 4 + 1] = color[texels[x * 4 + 1]];
+        out[x * 4 + 2] = color[texels[x * 4 + 2]];
+        out[x * 4 + 3] = alpha[texels[x * 4 + 3]];
+    }
+}
+
+// An odd source edge drops its last row or column, which a box filter can't split evenly.
+static void downsample(MipTables* tables, u8* src, u32 src_w, u32 src_h, u8* dst, u32 dst_w, u32 dst_h, bool srgb) {
+    f32* color = srgb ? tables->srgb_to_linear : tables->unorm_to_float;
+
+    // Averages of four texels come out scaled to the range they are stored back in.
+    f32 color_scale = srgb ? (f32)(SRGB_ENCODE_STEPS - 1) : 255.0f;
+    __m128 scale = _mm_set_ps(0.25f * 255.0f, 0.25f * color_scale, 0.25f * color_scale, 0.25f * color_scale);
+
+    parallel_for(dst_h, MIP_JOB_ROWS, [&](u32 begin, u32 end) {
+        Scratch scratch = get_scratch(0);
+
+        f32* row0 = scratch->push_array<f32>(src_w * 4);
+        f32* row1 = scratch->push_array<f32>(src_w * 4);
+
+        for (u32 y = begin; y < end; ++y) {
+            decode_row(src + (u64)min(y * 2, src_h - 1) * src_w * 4, src_w, color, tables->unorm_to_float, row0);
+            decode_row(src + (u64)min(y * 2 + 1, src_h - 1) * src_w * 4, src_w, color, tables->unorm_to_float, row1);
+
+            u8* out = dst + (u64)y * dst_w * 4;
+
+            for (u32 x = 0; x < dst_w; ++x) {
+                u32 x0 = min(x * 2, src_w - 1) * 4;
+                u32 x1 = min(x * 2 + 1, src_w - 1) * 4;
+
+                __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)), _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+
+                alignas(16) i32 q[4];
+                _mm_store_si128((__m128i*)q, _mm_cvtps_epi32(_mm_mul_ps(sum, scale)));
+
+                if (srgb) {
+                    out[x * 4 + 0] = tables->linear_to_srgb[q[0]];
+                    out[x * 4 + 1] = tables->linear_to_srgb[q[1]];
+                    out[x * 4 + 2] = tables->linear_to_srgb[q[2]];
+                }
+                else {
+                    out[x * 4 + 0] = (u8)q[0];
+                    out[x * 4 + 1] = (u8)q[1];
+                    out[x * 4 + 2] = (u8)q[2];
+                }
+
+                out[x * 4 + 3] = (u8)q[3];
+            }
+        }
+    });
+}
+
+void generate_mips(u8* chain, u32 width, u32 height, u32 levels, bool srgb) {
+    PROFILE_FUNCTION();
+
+    MipTables* tables = mip_tables();
+
+    u8* src = chain;
+
+    for (u32 i = 1; i < levels; ++i) {
+        u32 dst_w = max(width >> 1, 1u);
+        u32 dst_h = max(height >> 1, 1u);
+        u8* dst = src + (u64)width * height * 4;
+
+        downsample(tables, src, width, height, dst, dst_w, dst_h, srgb);
+
+        src = dst;
+        width = dst_w;
+        height = dst_h;
+    }
+}
+
+void mip_benchmark(u32 size) {
+    Scratch scratch = get_scratch(0);
+
+    u32 levels = mip_level_count(size, size);
+    u64 chain_size = mip_chain_size(size, size, levels);
+
+    u8* chain = scratch->push_array<u8>(chain_size);
+    u8* reference = scratch->push_array<u8>(chain_size);
+
+    u32 seed = 0x2545f491;
+    auto random_u32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+
+    // Noise over a gradient, with a black and white checker in one corner that averaging sRGB codes would darken.
+    for (u32 y = 0; y < size; ++y) {
+        for (u32 x = 0; x < size; ++x) {
+            u8* texel = chain + ((u64)y * size + x) * 4;
+
+            if (x < size / 4 && y < size / 4) {
+                u8 v = ((x ^ y) & 1) ? 255 : 0;
+                texel[0] = texel[1] = texel[2] = v;
+                texel[3] = 255;
+                continue;
+            }
+
+            u32 noise = random_u32();
+            texel[0] = (u8)(x * 255 / size / 2 + (noise & 127));
+            texel[1] = (u8)(y * 255 / size / 2 + ((noise >> 8) & 127));
+            texel[2] = (u8)(noise >> 16);
+            texel[3] = (u8)(noise >> 24);
+        }
+    }
+
+    mip_tables();
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    const u32 iterations = 8;
+
+    u64 start = pf_ticks();
+    for (u32 i = 0; i < iterations; ++i) {
+        generate_mips(chain, size, size, levels, true);
+    }
+    u64 ticks = pf_ticks() - start;
+
+    // Each reference level is made from the chain's level above it, so a one code difference doesn't compound.
+    start = pf_ticks();
+
+    u32 width = size;
+    u32 height = size;
+    u64 offset = 0;
+    u32 max_difference = 0;
+
+    memcpy(reference, chain, (u64)size * size * 4);
+
+    for (u32 l = 1; l < levels; ++l) {
+        u32 dst_w = max(width >> 1, 1u);
+        u32 dst_h = max(height >> 1, 1u);
+        u8* src = chain + offset;
+        u8* dst = reference + offset + (u64)width * height * 4;
+
+        for (u32 y = 0; y < dst_h; ++y) {
+            for (u32 x = 0; x < dst_w; ++x) {
+                for (u32 c = 0; c < 4; ++c) {
+                    f32 sum = 0.0f;
+
+                    for (u32 j = 0; j < 4; ++j) {
+                        u32 sx = min(x * 2 + (j & 1), width - 1);
+                        u32 sy = min(y * 2 + (j >> 1), height - 1);
+                        f32 v = (f32)src[((u64)sy * width + sx) * 4 + c] / 255.0f;
+                        sum += c < 3 ? srgb_to_linear(v) : v;
+                    }
+
+                    f32 average = sum * 0.25f;
+                    dst[((u64)y * dst_w + x) * 4 + c] = (u8)((c < 3 ? linear_to_srgb(average) : average) * 255.0f + 0.5f);
+                }
+            }
+        }
+
+        offset += (u64)width * height * 4;
+        width = dst_w;
+        height = dst_h;
+    }
+
+    u64 reference_ticks = pf_ticks() - start;
+
+    for (u64 i = 0; i < chain_size; ++i) {
+        u32 difference = chain[i] > reference[i] ? chain[i] - reference[i] : reference[i] - chain[i];
+        max_difference = max(max_difference, difference);
+    }
+
+    assert(max_difference <= 1 && "mip chain strays from the exact sRGB reference");
+
+    f64 ms = (f64)ticks * ms_per_tick / iterations;
+    u8 checker = chain[(u64)size * size * 4];
+
+    pf_debug_log("mips: %ux%u, %u levels in %.2fms on %u threads (%.0f MB/s of level 0), scalar reference %.1fms, max difference %u, checker averages to %u (linear mid grey is 188)\n",
+        size, size, levels, ms, jobs_thread_count(), (f64)size * size * 4 / (1024.0 * 1024.0) / (ms / 1000.0),
+        (f64)reference_ticks * ms_per_tick, max_difference, checker);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+
+// Destination rows per job when downsampling a level.
+#define MIP_JOB_ROWS 16
+
+// Levels down to and including 1x1.
+u32 mip_level_count(u32 width, u32 height);
+
+// Bytes of an RGBA8 chain with every level tightly packed, level 0 first.
+u64 mip_chain_size(u32 width, u32 height, u32 levels);
+
+// chain holds level 0 and has room for mip_chain_size. Fills levels 1 and on, each a 2x2 box filter of the one before,
+// split across the job threads. With srgb, color is averaged as linear light and stored back as sRGB, so distant
+// texels keep their brightness. Alpha is always averaged as is.
+void generate_mips(u8* chain, u32 width, u32 height, u32 levels, bool srgb);
+
+// Generates the chain of a size x size image and checks it against a scalar reference that uses the exact sRGB curve,
+// and logs throughput.
+void mip_benchmark(u32 size);
@@ -0,0 +1,418 @@
+#include <float.h>
+#include <math.h>
+
+#include "occlusion.h"
+#include "jobs.h"
+#include "platform.h"
+#include "profiler.h"
+
+// Rows of tiles per rasterization job. Jobs own disjoint rows, so tiles are updated without synchronization.
+#define OCCLUSION_BAND_TILE_ROWS 2
+#define OCCLUSION_QUERY_JOB_SIZE 256
+
+// Edge functions are oriented so the inside is positive; depth is interpolated as 1/w, which is affine in screen space.
+struct OcclusionTriangle {
+    bool valid;
+    f32 edge_a[3];
+    f32 edge_b[3];
+    f32 edge_c[3];
+    f32 inv_w_a, inv_w_b, inv_w_c;
+    f32 inv_w_min;
+    f32 min_x, min_y, max_x, max_y;
+    i32 tile_min_x, tile_min_y, tile_max_x, tile_max_y;
+};
+
+static void to_screen(XMVECTOR clip, f32* x, f32* y, f32* w) {
+    *w = XMVectorGetW(clip);
+    *x = (XMVectorGetX(clip) / *w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+    *y = (0.5f - XMVectorGetY(clip) / *w * 0.5f) * OCCLUSION_HEIGHT;
+}
+
+static OcclusionTriangle setup_triangle(XMVECTOR c0, XMVECTOR c1, XMVECTOR c2) {
+    OcclusionTriangle tri = {};
+
+    f32 x[3], y[3], w[3];
+    XMVECTOR clip[3] = { c0, c1, c2 };
+
+    for (int i = 0; i < 3; ++i) {
+        // Occluders are optional, so triangles crossing the near plane are dropped instead of clipped.
+        if (XMVectorGetW(clip[i]) < OCCLUSION_NEAR_W) {
+            return tri;
+        }
+
+        to_screen(clip[i], &x[i], &y[i], &w[i]);
+    }
+
+    f32 area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+
+    if (fabsf(area) < 1e-4f) {
+        return tri;
+    }
+
+    // Winding doesn't matter for occlusion; back faces are still surfaces.
+    if (area < 0.0f) {
+        swap(x[1], x[2]);
+        swap(y[1], y[2]);
+        swap(w[1], w[2]);
+        area = -area;
+    }
+
+    tri.min_x = max(min(min(x[0], x[1]), x[2]), 0.0f);
+    tri.min_y = max(min(min(y[0], y[1]), y[2]), 0.0f);
+    tri.max_x = min(max(max(x[0], x[1]), x[2]), (f32)OCCLUSION_WIDTH);
+    tri.max_y = min(max(max(y[0], y[1]), y[2]), (f32)OCCLUSION_HEIGHT);
+
+    if (tri.min_x >= tri.max_x || tri.min_y >= tri.max_y) {
+        return tri;
+    }
+
+    tri.tile_min_x = (i32)tri.min_x / OCCLUSION_TILE_WIDTH;
+    tri.tile_min_y = (i32)tri.min_y / OCCLUSION_TILE_HEIGHT;
+    tri.tile_max_x = min((i32)tri.max_x / OCCLUSION_TILE_WIDTH, OCCLUSION_TILES_X - 1);
+    tri.tile_max_y = min((i32)tri.max_y / OCCLUSION_TILE_HEIGHT, OCCLUSION_TILES_Y - 1);
+
+    for (int i = 0; i < 3; ++i) {
+        int j = (i + 1) % 3;
+        tri.edge_a[i] = -(y[j] - y[i]);
+        tri.edge_b[i] = x[j] - x[i];
+        tri.edge_c[i] = -(tri.edge_a[i] * x[i] + tri.edge_b[i] * y[i]);
+    }
+
+    f32 iw[3] = { 1.0f / w[0], 1.0f / w[1], 1.0f / w[2] };
+
+    tri.inv_w_a = ((iw[1] - iw[0]) * (y[2] - y[0]) - (iw[2] - iw[0]) * (y[1] - y[0])) / area;
+    tri.inv_w_b = ((iw[2] - iw[0]) * (x[1] - x[0]) - (iw[1] - iw[0]) * (x[2] - x[0])) / area;
+    tri.inv_w_c = iw[0] - tri.inv_w_a * x[0] - tri.inv_w_b * y[0];
+    tri.inv_w_min = min(min(iw[0], iw[1]), iw[2]);
+
+    tri.valid = true;
+    return tri;
+}
+
+// One bit per pixel, row major, 8 bits per row. Pixel centres strictly inside count, so coverage never grows.
+static u32 triangle_coverage(OcclusionTriangle* tri, i32 tx, i32 ty) {
+    f32 base_x = (f32)(tx * OCCLUSION_TILE_WIDTH);
+    f32 base_y = (f32)(ty * OCCLUSION_TILE_HEIGHT);
+
+    __m128 px0 = _mm_add_ps(_mm_set1_ps(base_x), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+    __m128 px1 = _mm_add_ps(_mm_set1_ps(base_x), _mm_setr_ps(4.5f, 5.5f, 6.5f, 7.5f));
+    __m128 zero = _mm_setzero_ps();
+
+    __m128 ex0[3], ex1[3];
+    for (int e = 0; e < 3; ++e) {
+        __m128 a = _mm_set1_ps(tri->edge_a[e]);
+        __m128 c = _mm_set1_ps(tri->edge_c[e]);
+        ex0[e] = _mm_add_ps(_mm_mul_ps(a, px0), c);
+        ex1[e] = _mm_add_ps(_mm_mul_ps(a, px1), c);
+    }
+
+    u32 mask = 0;
+
+    for (int row = 0; row < OCCLUSION_TILE_HEIGHT; ++row) {
+        f32 py = base_y + (f32)row + 0.5f;
+
+        __m128 inside0 = _mm_cmpeq_ps(zero, zero);
+        __m128 inside1 = inside0;
+
+        for (int e = 0; e < 3; ++e) {
+            __m128 by = _mm_set1_ps(tri->edge_b[e] * py);
+            inside0 = _mm_and_ps(inside0, _mm_cmpgt_ps(_mm_add_ps(ex0[e], by), zero));
+            inside1 = _mm_and_ps(inside1, _mm_cmpgt_ps(_mm_add_ps(ex1[e], by), zero));
+        }
+
+        u32 bits = (u32)_mm_movemask_ps(inside0) | ((u32)_mm_movemask_ps(inside1) << 4);
+        mask |= bits << (row * OCCLUSION_TILE_WIDTH);
+    }
+
+    return mask;
+}
+
+// Farthest depth of the triangle within the tile. 1/w is affine, so its minimum over the clamped rect is at a corner.
+static f32 triangle_tile_far(OcclusionTriangle* tri, i32 tx, i32 ty) {
+    f32 x0 = max((f32)(tx * OCCLUSION_TILE_WIDTH), tri->min_x);
+    f32 y0 = max((f32)(ty * OCCLUSION_TILE_HEIGHT), tri->min_y);
+    f32 x1 = min((f32)((tx + 1) * OCCLUSION_TILE_WIDTH), tri->max_x);
+    f32 y1 = min((f32)((ty + 1) * OCCLUSION_TILE_HEIGHT), tri->max_y);
+
+    f32 base = tri->inv_w_c;
+    f32 c00 = base + tri->inv_w_a * x0 + tri->inv_w_b * y0;
+    f32 c10 = base + tri->inv_w_a * x1 + tri->inv_w_b * y0;
+    f32 c01 = base + tri->inv_w_a * x0 + tri->inv_w_b * y1;
+    f32 c11 = base + tri->inv_w_a * x1 + tri->inv_w_b * y1;
+
+    f32 inv_w = max(min(min(c00, c10), min(c01, c11)), tri->inv_w_min);
+    return 1.0f / inv_w;
+}
+
+static void update_tile(OcclusionTile* tile, u32 coverage, f32 tri_far) {
+    if (!coverage || tri_far >= tile->far0) {
+        return;
+    }
+
+    // A triangle closer in depth to the reference layer than to the working layer starts a new working layer.
+    if (tile->mask && fabsf(tri_far - tile->far1) > fabsf(tile->far0 - tri_far)) {
+        tile->far1 = 0.0f;
+        tile->mask = 0;
+    }
+
+    tile->far1 = max(tile->far1, tri_far);
+    tile->mask |= coverage;
+
+    if (tile->mask == 0xffffffff) {
+        tile->far0 = min(tile->far0, tile->far1);
+        tile->far1 = 0.0f;
+        tile->mask = 0;
+    }
+}
+
+void occlusion_render(OcclusionBuffer* buffer, XMMATRIX view_projection, u32 occluder_count, Occluder* occluders) {
+    PROFILE_FUNCTION();
+
+    for (u32 i = 0; i < ARRAY_LEN(buffer->tiles); ++i) {
+        buffer->tiles[i].far0 = FLT_MAX;
+        buffer->tiles[i].far1 = 0.0f;
+        buffer->tiles[i].mask = 0;
+    }
+
+    Scratch scratch = get_scratch(0);
+
+    // Triangles land at fixed offsets, so the raster order (and the layer heuristics) are deterministic.
+    u32* first_triangle = scratch->push_array<u32>(occluder_count);
+    u32 triangle_count = 0;
+
+    for (u32 i = 0; i < occluder_count; ++i) {
+        first_triangle[i] = triangle_count;
+        triangle_count += occluders[i].index_count / 3;
+    }
+
+    OcclusionTriangle* triangles = scratch->push_array<OcclusionTriangle>(triangle_count);
+
+    parallel_for(occluder_count, 1, [&](u32 begin, u32 end) {
+        for (u32 o = begin; o < end; ++o) {
+            Occluder* occluder = &occluders[o];
+            XMMATRIX m = *occluder->transform * view_projection;
+
+            Scratch vertex_scratch = get_scratch(scratch.arena);
+            XMFLOAT4* clip = vertex_scratch->push_array<XMFLOAT4>(occluder->vertex_count);
+
+            for (u32 v = 0; v < occluder->vertex_count; ++v) {
+                XMStoreFloat4(&clip[v], XMVector3Transform(XMLoadFloat3(&occluder->positions[v]), m));
+            }
+
+            for (u32 t = 0; t < occluder->index_count / 3; ++t) {
+                XMVECTOR c0 = XMLoadFloat4(&clip[occluder->indices[t * 3 + 0]]);
+                XMVECTOR c1 = XMLoadFloat4(&clip[occluder->indices[t * 3 + 1]]);
+                XMVECTOR c2 = XMLoadFloat4(&clip[occluder->indices[t * 3 + 2]]);
+                triangles[first_triangle[o] + t] = setup_triangle(c0, c1, c2);
+            }
+        }
+    });
+
+    parallel_for(OCCLUSION_TILES_Y / OCCLUSION_BAND_TILE_ROWS, 1, [&](u32 begin, u32 end) {
+        for (u32 band = begin; band < end; ++band) {
+            i32 band_min_y = (i32)(band * OCCLUSION_BAND_TILE_ROWS);
+            i32 band_max_y = band_min_y + OCCLUSION_BAND_TILE_ROWS - 1;
+
+            for (u32 i = 0; i < triangle_count; ++i) {
+                OcclusionTriangle* tri = &triangles[i];
+
+                if (!tri->valid || tri->tile_max_y < band_min_y || tri->tile_min_y > band_max_y) {
+                    continue;
+                }
+
+                i32 ty0 = max(tri->tile_min_y, band_min_y);
+                i32 ty1 = min(tri->tile_max_y, band_max_y);
+
+                for (i32 ty = ty0; ty <= ty1; ++ty) {
+                    for (i32 tx = tri->tile_min_x; tx <= tri->tile_max_x; ++tx) {
+                        u32 coverage = triangle_coverage(tri, tx, ty);
+
+                        if (coverage) {
+                            update_tile(&buffer->tiles[ty * OCCLUSION_TILES_X + tx], coverage, triangle_tile_far(tri, tx, ty));
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+bool occlusion_test(OcclusionBuffer* buffer, XMMATRIX view_projection, OcclusionQuery* query) {
+    XMMATRIX m = *query->transform * view_projection;
+
+    f32 min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    f32 near_w = FLT_MAX;
+
+    for (int i = 0; i < 8; ++i) {
+        XMVECTOR corner = XMVectorSet(
+            (i & 1) ? query->aabb_max.x : query->aabb_min.x,
+            (i & 2) ? query->aabb_max.y : query->aabb_min.y,
+            (i & 4) ? query->aabb_max.z : query->aabb_min.z,
+            1.0f
+        );
+
+        XMVECTOR clip = XMVector3Transform(corner, m);
+
+        if (XMVectorGetW(clip) < OCCLUSION_NEAR_W) {
+            return true;
+        }
+
+        f32 x, y, w;
+        to_screen(clip, &x, &y, &w);
+
+        min_x = min(min_x, x);
+        min_y = min(min_y, y);
+        max_x = max(max_x, x);
+        max_y = max(max_y, y);
+        near_w = min(near_w, w);
+    }
+
+    if (max_x < 0.0f || max_y < 0.0f || min_x >= (f32)OCCLUSION_WIDTH || min_y >= (f32)OCCLUSION_HEIGHT) {
+        return false;
+    }
+
+    i32 tx0 = max((i32)min_x, 0) / OCCLUSION_TILE_WIDTH;
+    i32 ty0 = max((i32)min_y, 0) / OCCLUSION_TILE_HEIGHT;
+    i32 tx1 = min((i32)max_x / OCCLUSION_TILE_WIDTH, OCCLUSION_TILES_X - 1);
+    i32 ty1 = min((i32)max_y / OCCLUSION_TILE_HEIGHT, OCCLUSION_TILES_Y - 1);
+
+    for (i32 ty = ty0; ty <= ty1; ++ty) {
+        for (i32 tx = tx0; tx <= tx1; ++tx) {
+            if (buffer->tiles[ty * OCCLUSION_TILES_X + tx].far0 >= near_w) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+u32 occlusion_cull(OcclusionBuffer* buffer, XMMATRIX view_projection, OcclusionQuery* queries, u32* indices, u32 count) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+    bool* keep = scratch->push_array<bool>(count);
+
+    parallel_for(count, OCCLUSION_QUERY_JOB_SIZE, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            keep[i] = occlusion_test(buffer, view_projection, &queries[i]);
+        }
+    });
+
+    u32 kept = 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        if (keep[i]) {
+            indices[kept++] = indices[i];
+        }
+    }
+
+    return kept;
+}
+
+void occlusion_benchmark() {
+    Scratch scratch = get_scratch(0);
+
+    XMMATRIX view = XMMatrixLookAtRH(XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 1.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+    XMMATRIX projection = XMMatrixPerspectiveFovRH(XM_PIDIV2, (f32)OCCLUSION_WIDTH/(f32)OCCLUSION_HEIGHT, 1000.0f, 0.1f);
+    XMMATRIX view_projection = view * projection;
+
+    // A 20x20 wall, 10 units in front of the camera.
+    XMMATRIX identity = XMMatrixIdentity();
+    XMFLOAT3 wall_positions[] = {
+        {-10.0f, -10.0f, -10.0f},
+        { 10.0f, -10.0f, -10.0f},
+        { 10.0f,  10.0f, -10.0f},
+        {-10.0f,  10.0f, -10.0f},
+    };
+    u32 wall_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    Occluder wall = {};
+    wall.transform = &identity;
+    wall.vertex_count = ARRAY_LEN(wall_positions);
+    wall.positions = wall_positions;
+    wall.index_count = ARRAY_LEN(wall_indices);
+    wall.indices = wall_indices;
+
+    // Two grids of small boxes, one in front of the wall and one behind it.
+    const u32 grid = 128;
+    u32 query_count = grid * grid * 2;
+
+    XMMATRIX* transforms = (XMMATRIX*)_mm_malloc(query_count * sizeof(XMMATRIX), 16);
+    OcclusionQuery* queries = scratch->push_array<OcclusionQuery>(query_count);
+    u32* indices = scratch->push_array<u32>(query_count);
+
+    for (u32 i = 0; i < query_count; ++i) {
+        u32 gx = i % grid;
+        u32 gy = (i / grid) % grid;
+        bool front = i < grid * grid;
+
+        // Both grids fill most of the screen at their depth.
+        f32 depth = front ? -5.0f : -20.0f;
+        f32 extent = front ? 8.0f : 36.0f;
+
+        f32 x = ((f32)gx / (f32)(grid - 1) * 2.0f - 1.0f) * extent;
+        f32 y = ((f32)gy / (f32)(grid - 1) * 2.0f - 1.0f) * extent * 0.5f;
+
+        transforms[i] = XMMatrixTranslation(x, y, depth);
+
+        queries[i].transform = &transforms[i];
+        queries[i].aabb_min = XMFLOAT3(-0.25f, -0.25f, -0.25f);
+        queries[i].aabb_max = XMFLOAT3(0.25f, 0.25f, 0.25f);
+        indices[i] = i;
+    }
+
+    OcclusionBuffer* buffer = scratch->push_type<OcclusionBuffer>();
+    u32* visible = scratch->push_array<u32>(query_count);
+
+    const u32 iterations = 16;
+
+    u64 start = pf_ticks();
+    for (u32 i = 0; i < iterations; ++i) {
+        occlusion_render(buffer, view_projection, 1, &wall);
+    }
+    u64 render_ticks = pf_ticks() - start;
+
+    u32 visible_count = 0;
+
+    start = pf_ticks();
+    for (u32 i = 0; i < iterations; ++i) {
+        memcpy(visible, indices, query_count * sizeof(u32));
+        visible_count = occlusion_cull(buffer, view_projection, queries, visible, query_count);
+    }
+    u64 cull_ticks = pf_ticks() - start;
+
+    bool* is_visible = scratch->push_array<bool>(query_count);
+    for (u32 i = 0; i < visible_count; ++i) {
+        is_visible[visible[i]] = true;
+    }
+
+    // Nothing in front of the wall may be culled. Behind it, the wall covers |x|, |y| < 20; boxes
+    // comfortably inside that should all be gone, the ones near the edge depend on tile coverage.
+    u32 front_culled = 0;
+    u32 shadowed = 0;
+    u32 shadowed_culled = 0;
+
+    for (u32 i = 0; i < query_count; ++i) {
+        XMFLOAT4X4 t;
+        XMStoreFloat4x4(&t, transforms[i]);
+
+        if (i < grid * grid) {
+            front_culled += !is_visible[i];
+        }
+        else if (fabsf(t._41) < 18.0f && fabsf(t._42) < 18.0f) {
+            shadowed++;
+            shadowed_culled += !is_visible[i];
+        }
+    }
+
+    assert(front_culled == 0 && "occlusion culling removed a box in front of the occluder");
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    pf_debug_log("occlusion: render %.3fms, cull %.3fms for %u boxes, %u visible, %u/%u shadowed boxes culled, %u wrongly culled\n",
+        (f64)render_ticks * ms_per_tick / iterations, (f64)cull_ticks * ms_per_tick / iterations,
+        query_count, visible_count, shadowed_culled, shadowed, front_culled);
+
+    _mm_free(transforms);
+}
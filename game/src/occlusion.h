@@ -0,0 +1,56 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+
+// A low resolution depth buffer split into 8x4 pixel tiles, in the style of masked occlusion culling.
+// Each tile keeps a reference layer, the farthest occluder depth known to cover the whole tile, and a
+// working layer of partially covered pixels that is folded into the reference once it covers everything.
+// Depth is clip space w, so smaller is closer.
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_TILE_WIDTH 8
+#define OCCLUSION_TILE_HEIGHT 4
+#define OCCLUSION_TILES_X (OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH)
+#define OCCLUSION_TILES_Y (OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT)
+
+// Triangles and boxes closer than this are not rasterized or tested; occluders are dropped and boxes are kept.
+#define OCCLUSION_NEAR_W 0.1f
+
+struct OcclusionTile {
+    f32 far0;
+    f32 far1;
+    u32 mask;
+};
+
+struct OcclusionBuffer {
+    OcclusionTile tiles[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+};
+
+struct Occluder {
+    XMMATRIX* transform;
+    u32 vertex_count;
+    XMFLOAT3* positions;
+    u32 index_count;
+    u32* indices;
+};
+
+struct OcclusionQuery {
+    XMMATRIX* transform;
+    XMFLOAT3 aabb_min;
+    XMFLOAT3 aabb_max;
+};
+
+// Clears the buffer and rasterizes every occluder into it across the job threads.
+void occlusion_render(OcclusionBuffer* buffer, XMMATRIX view_projection, u32 occluder_count, Occluder* occluders);
+
+// Conservative: true unless every tile under the box's screen rect is covered by something closer than the box.
+bool occlusion_test(OcclusionBuffer* buffer, XMMATRIX view_projection, OcclusionQuery* query);
+
+// Filters indices in place, keeping indices[i] unless queries[i] is occluded. Returns the new count.
+u32 occlusion_cull(OcclusionBuffer* buffer, XMMATRIX view_projection, OcclusionQuery* queries, u32* indices, u32 count);
+
+// Renders a wall in front of a grid of boxes, checks which ones come out hidden, and logs timings.
+void occlusion_benchmark();
@@ -3,8 +3,19 @@
 #include "common.h"
 
 void pf_msg_box(const char* fmt, ...);
+// Shows the message and exits, for errors the game can't run past in any configuration.
+void pf_fatal(const char* fmt, ...);
 void pf_debug_log(const char* fmt, ...);
 f32 pf_time();
+u64 pf_ticks();
+u64 pf_ticks_per_second();
+
+u32 pf_processor_count();
+void pf_init_thread_scratch(u64 size);
+void pf_create_thread(void (*proc)(void* data), void* data);
+void* pf_create_semaphore(u32 initial_count, u32 max_count);
+void pf_semaphore_wait(void* semaphore);
+void pf_semaphore_signal(void* semaphore, u32 count);
 
 struct FileContents {
     u64 size;
@@ -12,3 +23,22 @@ struct FileContents {
 };
 
 FileContents pf_load_file(Arena* arena, const char* path);
+bool pf_write_file(const char* path, void* data, u64 size);
+
+// Maps a whole file read only. memory is null when it can't be opened. Pages are read in as they are first touched.
+FileContents pf_map_file(const char* path);
+void pf_unmap_file(FileContents file);
+
+// Succeeds when the directory already exists.
+bool pf_create_directory(const char* path);
+
+// For the -test_ modes, in a function returning bool. On failure it logs the message, calls the test's cleanup lambda
+// and returns false.
+#define TEST_CHECK(condition, message) \
+    do { \
+        if (!(condition)) { \
+            pf_debug_log("%s failed: %s\n", __FUNCTION__, message); \
+            cleanup(); \
+            return false; \
+        } \
+    } while (0)
@@ -0,0 +1,251 @@
+#include "profiler.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+enum ProfileEventType {
+    PROFILE_EVENT_BEGIN,
+    PROFILE_EVENT_END,
+    PROFILE_EVENT_COUNTER,
+    PROFILE_EVENT_PLOT,
+};
+
+struct ProfileEvent {
+    u64 ticks;
+    const char* name;
+    union {
+        i64 counter;
+        f64 plot;
+    };
+    ProfileEventType type;
+};
+
+// Single producer ring. Only the owning thread writes; the exporter reads whatever has not been overwritten.
+struct ProfilerThread {
+    const char* name;
+    volatile u32 write_index;
+    ProfileEvent events[PROFILER_RING_SIZE];
+};
+
+struct Profiler {
+    volatile u32 thread_count;
+    ProfilerThread* threads[PROFILER_MAX_THREADS];
+};
+
+static Profiler profiler;
+static thread_local ProfilerThread* profiler_thread;
+
+static ProfilerThread* get_profiler_thread() {
+    if (!profiler_thread) {
+        ProfilerThread* thread = (ProfilerThread*)calloc(1, sizeof(ProfilerThread));
+
+        u32 slot = atomic_increment(&profiler.thread_count) - 1;
+        assert(slot < PROFILER_MAX_THREADS && "too many profiled threads");
+
+        profiler.threads[slot] = thread;
+        profiler_thread = thread;
+    }
+
+    return profiler_thread;
+}
+
+static ProfileEvent* begin_event(ProfilerThread* thread) {
+    return &thread->events[thread->write_index & (PROFILER_RING_SIZE - 1)];
+}
+
+static void end_event(ProfilerThread* thread) {
+    atomic_store(&thread->write_index, thread->write_index + 1);
+}
+
+void profiler_set_thread_name(const char* name) {
+    get_profiler_thread()->name = name;
+}
+
+void profiler_begin_zone(const char* name) {
+    ProfilerThread* thread = get_profiler_thread();
+    ProfileEvent* event = begin_event(thread);
+    event->name = name;
+    event->type = PROFILE_EVENT_BEGIN;
+    event->ticks = pf_ticks();
+    end_event(thread);
+}
+
+void profiler_end_zone() {
+    u64 ticks = pf_ticks();
+    ProfilerThread* thread = get_profiler_thread();
+    ProfileEvent* event = begin_event(thread);
+    event->name = 0;
+    event->type = PROFILE_EVENT_END;
+    event->ticks = ticks;
+    end_event(thread);
+}
+
+void profiler_counter(const char* name, i64 value) {
+    ProfilerThread* thread = get_profiler_thread();
+    ProfileEvent* event = begin_event(thread);
+    event->name = name;
+    event->type = PROFILE_EVENT_COUNTER;
+    event->counter = value;
+    event->ticks = pf_ticks();
+    end_event(thread);
+}
+
+void profiler_plot(const char* name, f64 value) {
+    ProfilerThread* thread = get_profiler_thread();
+    ProfileEvent* event = begin_event(thread);
+    event->name = name;
+    event->type = PROFILE_EVENT_PLOT;
+    event->plot = value;
+    event->ticks = pf_ticks();
+    end_event(thread);
+}
+
+struct ThreadCapture {
+    const char* name;
+    u32 count;
+    ProfileEvent* events;
+};
+
+static ThreadCapture capture_thread(Arena* arena, ProfilerThread* thread) {
+    ThreadCapture capture = {};
+    capture.name = thread->name;
+
+    u32 end = atomic_load(&thread->write_index);
+    u32 begin = end > PROFILER_RING_SIZE ? end - PROFILER_RING_SIZE : 0;
+
+    ProfileEvent* events = arena->push_array<ProfileEvent>(end - begin);
+
+    for (u32 i = begin; i < end; ++i) {
+        events[i - begin] = thread->events[i & (PROFILER_RING_SIZE - 1)];
+    }
+
+    // Anything the owner wrote while we were copying may have overwritten the oldest events.
+    u32 new_end = atomic_load(&thread->write_index);
+    u32 valid_begin = new_end > PROFILER_RING_SIZE ? new_end - PROFILER_RING_SIZE : 0;
+    u32 skip = valid_begin > begin ? min(valid_begin - begin, end - begin) : 0;
+
+    capture.events = events + skip;
+    capture.count = (end - begin) - skip;
+
+    return capture;
+}
+
+// Zone names are arbitrary strings, so quotes, backslashes and control characters get escaped for JSON.
+// Worst case each character becomes a six character unicode escape.
+static const char* json_escape(char* result, const char* string) {
+    char* out = result;
+
+    for (const char* c = string ? string : ""; *c; ++c) {
+        u8 ch = (u8)*c;
+
+        if (ch == '"' || ch == '\\') {
+            *out++ = '\\';
+            *out++ = (char)ch;
+        } else if (ch < 0x20) {
+            out += snprintf(out, 7, "\\u%04x", ch);
+        } else {
+            *out++ = (char)ch;
+        }
+    }
+
+    *out = 0;
+    return result;
+}
+
+bool profiler_export_chrome_trace(const char* path) {
+    Scratch scratch = get_scratch(0);
+
+    u32 thread_count = min(atomic_load(&profiler.thread_count), (u32)PROFILER_MAX_THREADS);
+    ThreadCapture* captures = scratch->push_array<ThreadCapture>(thread_count);
+
+    u64 capacity = 64;
+    u64 base_ticks = UINT64_MAX;
+    u64 max_name_length = 0;
+
+    for (u32 i = 0; i < thread_count; ++i) {
+        if (!profiler.threads[i]) {
+            continue;
+        }
+
+        captures[i] = capture_thread(scratch.arena, profiler.threads[i]);
+
+        // Enough room for the fixed part of the longest event line plus its name, fully escaped.
+        u64 name_length = captures[i].name ? strlen(captures[i].name) : 0;
+        capacity += 128 + name_length * 6;
+        max_name_length = max(max_name_length, name_length);
+
+        for (u32 j = 0; j < captures[i].count; ++j) {
+            name_length = captures[i].events[j].name ? strlen(captures[i].events[j].name) : 0;
+            capacity += 128 + name_length * 6;
+            max_name_length = max(max_name_length, name_length);
+        }
+
+        if (captures[i].count > 0) {
+            base_ticks = min(base_ticks, captures[i].events[0].ticks);
+        }
+    }
+
+    f64 us_per_tick = 1000000.0 / (f64)pf_ticks_per_second();
+
+    char* buffer = (char*)scratch->push(capacity);
+    char* escaped = (char*)scratch->push(max_name_length * 6 + 1);
+    u64 len = 0;
+
+    #define EMIT(...) len += (u64)snprintf(buffer + len, capacity - len, __VA_ARGS__)
+
+    EMIT("{\"traceEvents\":[\n");
+
+    bool first = true;
+    const char* separator = "";
+
+    for (u32 tid = 0; tid < thread_count; ++tid) {
+        ThreadCapture* capture = &captures[tid];
+
+        if (capture->name) {
+            separator = first ? "" : ",\n";
+            first = false;
+            EMIT("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", separator, tid, json_escape(escaped, capture->name));
+        }
+
+        // Zones whose begin event fell out of the ring would close a parent that was never opened.
+        u32 depth = 0;
+
+        for (u32 i = 0; i < capture->count; ++i) {
+            ProfileEvent* event = &capture->events[i];
+            f64 ts = (f64)(event->ticks - base_ticks) * us_per_tick;
+
+            if (event->type == PROFILE_EVENT_END && depth == 0) {
+                continue;
+            }
+
+            separator = first ? "" : ",\n";
+            first = false;
+
+            switch (event->type) {
+                case PROFILE_EVENT_BEGIN:
+                    ++depth;
+                    EMIT("%s{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}", separator, json_escape(escaped, event->name), ts, tid);
+                    break;
+                case PROFILE_EVENT_END:
+                    --depth;
+                    EMIT("%s{\"ph\":\"E\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}", separator, ts, tid);
+                    break;
+                case PROFILE_EVENT_COUNTER:
+                    EMIT("%s{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{\"value\":%lld}}", separator, json_escape(escaped, event->name), ts, tid, (long long)event->counter);
+                    break;
+                case PROFILE_EVENT_PLOT:
+                    EMIT("%s{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{\"value\":%.9g}}", separator, json_escape(escaped, event->name), ts, tid, event->plot);
+                    break;
+            }
+        }
+    }
+
+    EMIT("\n]}\n");
+
+    #undef EMIT
+
+    assert(len < capacity);
+
+    return pf_write_file(path, buffer, len);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+#define PROFILER_MAX_THREADS 64
+#define PROFILER_RING_SIZE (1 << 15)
+
+// Names passed to the profiler are stored by pointer and must outlive the capture (string literals).
+void profiler_set_thread_name(const char* name);
+
+void profiler_begin_zone(const char* name);
+void profiler_end_zone();
+
+// Counters record integral values (instance counts, bytes), plots record floating point values (frame times).
+// Both show up as counter tracks in the trace viewer.
+void profiler_counter(const char* name, i64 value);
+void profiler_plot(const char* name, f64 value);
+
+// Writes everything still held in the per-thread rings as a Chrome trace (chrome://tracing, Perfetto).
+bool profiler_export_chrome_trace(const char* path);
+
+struct ProfileZone {
+    ProfileZone(const char* name) {
+        profiler_begin_zone(name);
+    }
+
+    ~ProfileZone() {
+        profiler_end_zone();
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#if PROFILER_ENABLED
+    #define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+    #define PROFILE_FUNCTION() PROFILE_ZONE(__FUNCTION__)
+    #define PROFILE_COUNTER(name, value) profiler_counter(name, (i64)(value))
+    #define PROFILE_PLOT(name, value) profiler_plot(name, (f64)(value))
+#else
+    #define PROFILE_ZONE(name)
+    #define PROFILE_FUNCTION()
+    #define PROFILE_COUNTER(name, value)
+    #define PROFILE_PLOT(name, value)
+#endif
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+
+#include "render_stats.h"
+#include "platform.h"
+
+void add_pass_counters(RDPassCounters* dst, RDPassCounters* src) {
+    dst->draws += src->draws;
+    dst->dispatches += src->dispatches;
+    dst->barriers += src->barriers;
+    dst->root_constant_sets += src->root_constant_sets;
+    dst->constant_buffers += src->constant_buffers;
+    dst->upload_bytes += src->upload_bytes;
+}
+
+void RenderStatsHistory::push(f32 sample) {
+    samples[next] = sample;
+    next = (next + 1) % RENDER_STATS_HISTORY;
+    len = min(len + 1, (u32)RENDER_STATS_HISTORY);
+}
+
+static int compare_f32(const void* a, const void* b) {
+    f32 x = *(f32*)a;
+    f32 y = *(f32*)b;
+    return (x > y) - (x < y);
+}
+
+RDTimingStats RenderStatsHistory::summarize() {
+    RDTimingStats result = {};
+
+    if (len == 0) {
+        return result;
+    }
+
+    f32 sorted[RENDER_STATS_HISTORY];
+    memcpy(sorted, samples, len * sizeof(f32));
+    qsort(sorted, len, sizeof(f32), compare_f32);
+
+    f32 total = 0.0f;
+    for (u32 i = 0; i < len; ++i) {
+        total += sorted[i];
+    }
+
+    // Nearest-rank percentiles.
+    auto percentile = [&](u32 p) {
+        u32 rank = (p * len + 99) / 100;
+        return sorted[max(rank, 1u) - 1];
+    };
+
+    result.average = total / (f32)len;
+    result.p50 = percentile(50);
+    result.p95 = percentile(95);
+    result.p99 = percentile(99);
+    result.maximum = sorted[len-1];
+
+    return result;
+}
+
+static RenderStatsPassHistory* find_pass_history(RenderStats* stats, const char* name) {
+    for (u32 i = 0; i < stats->pass_count; ++i) {
+        if (strcmp(stats->passes[i].name, name) == 0) {
+            return &stats->passes[i];
+        }
+    }
+
+    if (stats->pass_count == RD_MAX_PASS_STATS) {
+        return 0;
+    }
+
+    RenderStatsPassHistory* history = &stats->passes[stats->pass_count++];
+    memset(history, 0, sizeof(*history));
+    history->name = name;
+
+    return history;
+}
+
+// Reads back finished frames oldest first, stopping at the first one the GPU hasn't finished.
+static void collect_frames(RenderStats* stats) {
+    while (true) {
+        RenderStatsFrame* oldest = 0;
+        u32 oldest_slot = 0;
+
+        for (u32 i = 0; i < RENDER_STATS_FRAME_LATENCY; ++i) {
+            RenderStatsFrame* frame = &stats->frames[i];
+
+            if (frame->pending && (!oldest || frame->fence < oldest->fence)) {
+                oldest = frame;
+                oldest_slot = i;
+            }
+        }
+
+        if (!oldest) {
+            return;
+        }
+
+        f32 gpu_ms[RD_MAX_PASS_STATS];
+
+        if (stats->backend.read) {
+            if (!stats->backend.read(stats->backend.data, oldest_slot, oldest->fence, oldest->pass_count, gpu_ms)) {
+                return;
+            }
+
+            for (u32 i = 0; i < oldest->pass_count; ++i) {
+                RenderStatsPassHistory* history = find_pass_history(stats, oldest->passes[i].name);
+
+                if (history) {
+                    history->gpu_ms.push(gpu_ms[i]);
+                }
+            }
+        }
+
+        oldest->pending = false;
+    }
+}
+
+void RenderStats::begin_frame(u64 frame_index) {
+    collect_frames(this);
+
+    // If the slot's previous frame is still on the GPU its timings are dropped rather than waited for.
+    slot = (u32)(frame_index % RENDER_STATS_FRAME_LATENCY);
+
+    RenderStatsFrame* frame = &frames[slot];
+    frame->pending = false;
+    frame->pass_count = 0;
+
+    frame_start_ticks = pf_ticks();
+}
+
+u32 RenderStats::add_pass(const char* name) {
+    RenderStatsFrame* frame = &frames[slot];
+
+    if (frame->pass_count == RD_MAX_PASS_STATS) {
+        return UINT32_MAX;
+    }
+
+    u32 pass = frame->pass_count++;
+    memset(&frame->passes[pass], 0, sizeof(RenderStatsPass));
+    frame->passes[pass].name = name;
+
+    return pass;
+}
+
+void RenderStats::begin_pass_timestamp(CommandList* cmd, u32 pass) {
+    if (pass != UINT32_MAX && backend.begin_pass) {
+        backend.begin_pass(backend.data, cmd, slot, pass);
+    }
+}
+
+void RenderStats::end_pass_timestamp(CommandList* cmd, u32 pass) {
+    if (pass != UINT32_MAX && backend.end_pass) {
+        backend.end_pass(backend.data, cmd, slot, pass);
+    }
+}
+
+void RenderStats::set_pass_cpu(u32 pass, f32 cpu_ms, RDPassCounters counters) {
+    if (pass == UINT32_MAX) {
+        return;
+    }
+
+    RenderStatsPass* frame_pass = &frames[slot].passes[pass];
+    frame_pass->cpu_ms = cpu_ms;
+    frame_pass->counters = counters;
+
+    RenderStatsPassHistory* history = find_pass_history(this, frame_pass->name);
+
+    if (history) {
+        history->cpu_ms.push(cpu_ms);
+        history->counters = counters;
+    }
+}
+
+void RenderStats::resolve(CommandList* cmd) {
+    if (backend.resolve && frames[slot].pass_count > 0) {
+        backend.resolve(backend.data, cmd, slot, frames[slot].pass_count);
+    }
+}
+
+void RenderStats::end_frame(u64 fence) {
+    RenderStatsFrame* frame = &frames[slot];
+    frame->pending = true;
+    frame->fence = fence;
+
+    cpu_frame_ms.push((f32)((f64)(pf_ticks() - frame_start_ticks) * 1000.0 / (f64)pf_ticks_per_second()));
+}
+
+void RenderStats::get(RDFrameStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->cpu_frame_ms = cpu_frame_ms.summarize();
+    stats->num_passes = pass_count;
+
+    for (u32 i = 0; i < pass_count; ++i) {
+        RDPassStats* pass = &stats->passes[i];
+        pass->name = passes[i].name;
+        pass->cpu_ms = passes[i].cpu_ms.summarize();
+        pass->gpu_ms = passes[i].gpu_ms.summarize();
+        pass->counters = passes[i].counters;
+    }
+}
+
+#define FAKE_TICKS_PER_MS 1000
+
+// Stands in for the GPU: every pass takes a set number of ticks, and frames finish once completed_fence reaches them.
+struct FakeTimestamps {
+    u64 completed_fence;
+    u64 now;
+    u64 pass_ticks[RD_MAX_PASS_STATS];
+    u64 begin_ticks[RENDER_STATS_FRAME_LATENCY][RD_MAX_PASS_STATS];
+    u64 end_ticks[RENDER_STATS_FRAME_LATENCY][RD_MAX_PASS_STATS];
+    u32 timestamp_count;
+};
+
+static void fake_begin_pass(void* data, CommandList*, u32 slot, u32 pass) {
+    FakeTimestamps* fake = (FakeTimestamps*)data;
+    fake->begin_ticks[slot][pass] = fake->now;
+    fake->timestamp_count++;
+}
+
+static void fake_end_pass(void* data, CommandList*, u32 slot, u32 pass) {
+    FakeTimestamps* fake = (FakeTimestamps*)data;
+    fake->now += fake->pass_ticks[pass];
+    fake->end_ticks[slot][pass] = fake->now;
+    fake->timestamp_count++;
+}
+
+static bool fake_read(void* data, u32 slot, u64 fence, u32 pass_count, f32* gpu_ms) {
+    FakeTimestamps* fake = (FakeTimestamps*)data;
+
+    if (fence > fake->completed_fence) {
+        return false;
+    }
+
+    for (u32 i = 0; i < pass_count; ++i) {
+        gpu_ms[i] = (f32)((f64)(fake->end_ticks[slot][i] - fake->begin_ticks[slot][i]) / FAKE_TICKS_PER_MS);
+    }
+
+    return true;
+}
+
+bool render_stats_test() {
+    RenderStats* stats = (RenderStats*)calloc(1, sizeof(RenderStats));
+    FakeTimestamps* fake = (FakeTimestamps*)calloc(1, sizeof(FakeTimestamps));
+
+    auto cleanup = [&]() {
+        free(stats);
+        free(fake);
+    };
+
+    stats->backend.data = fake;
+    stats->backend.begin_pass = fake_begin_pass;
+    stats->backend.end_pass = fake_end_pass;
+    stats->backend.read = fake_read;
+
+    // Frame f's first pass takes f % 128 + 1 ms on the GPU and on the CPU, so a full window holds 1..128 once each.
+    // The second always takes 0.5 ms. The GPU finishes each frame RENDER_STATS_FRAME_LATENCY - 1 frames later.
+    u32 frame_count = 200;
+
+    // Two threads record part of every pass, each with counters that change from frame to frame.
+    auto thread_counters = [](u32 f, u32 pass, u32 thread) {
+        RDPassCounters counters = {};
+        counters.draws = f + thread;
+        counters.dispatches = pass + thread;
+        counters.barriers = 2 * thread + 1;
+        counters.root_constant_sets = 3 * f;
+        counters.constant_buffers = thread;
+        counters.upload_bytes = ((u64)f << 32) + thread;
+        return counters;
+    };
+
+    for (u32 f = 0; f < frame_count; ++f) {
+        u32 lag = RENDER_STATS_FRAME_LATENCY - 1;
+        fake->completed_fence = f > lag ? f - lag : 0;
+
+        stats->begin_frame(f);
+
+        u32 read_frames = min((u32)fake->completed_fence, (u32)RENDER_STATS_HISTORY);
+        TEST_CHECK(stats->passes[0].gpu_ms.len == read_frames, "timings not read back exactly when their frame finished");
+
+        f32 ms = (f32)(f % RENDER_STATS_HISTORY + 1);
+        fake->pass_ticks[0] = (u64)ms * FAKE_TICKS_PER_MS;
+        fake->pass_ticks[1] = FAKE_TICKS_PER_MS / 2;
+
+        const char* names[] = { "gbuffer", "lighting" };
+
+        for (u32 i = 0; i < ARRAY_LEN(names); ++i) {
+            u32 pass = stats->add_pass(names[i]);
+            TEST_CHECK(pass == i, "passes not numbered in order");
+
+            stats->begin_pass_timestamp(0, pass);
+            stats->end_pass_timestamp(0, pass);
+
+            RDPassCounters counters = {};
+
+            for (u32 t = 0; t < 2; ++t) {
+                RDPassCounters thread = thread_counters(f, i, t);
+                add_pass_counters(&counters, &thread);
+            }
+
+            stats->set_pass_cpu(pass, i == 0 ? ms : 0.5f, counters);
+        }
+
+        stats->resolve(0);
+        stats->end_frame(f + 1);
+    }
+
+    RDFrameStats frame_stats;
+    stats->get(&frame_stats);
+
+    TEST_CHECK(frame_stats.num_passes == 2, "wrong pass count");
+
+    // Nearest rank over 1..128: the 64th, 122nd and 127th values.
+    RDTimingStats timings[] = { frame_stats.passes[0].gpu_ms, frame_stats.passes[0].cpu_ms };
+
+    for (u32 i = 0; i < ARRAY_LEN(timings); ++i) {
+        TEST_CHECK(timings[i].average == 64.5f, "wrong average");
+        TEST_CHECK(timings[i].p50 == 64.0f, "wrong p50");
+        TEST_CHECK(timings[i].p95 == 122.0f, "wrong p95");
+        TEST_CHECK(timings[i].p99 == 127.0f, "wrong p99");
+        TEST_CHECK(timings[i].maximum == 128.0f, "wrong maximum");
+    }
+
+    TEST_CHECK(frame_stats.passes[1].gpu_ms.p99 == 0.5f && frame_stats.passes[1].gpu_ms.maximum == 0.5f, "wrong timings for the second pass");
+
+    // Counters are the last frame's, summed over both threads.
+    u32 last = frame_count - 1;
+
+    for (u32 i = 0; i < frame_stats.num_passes; ++i) {
+        RDPassCounters counters = frame_stats.passes[i].counters;
+        TEST_CHECK(counters.draws == 2 * last + 1 && counters.dispatches == 2 * i + 1 && counters.barriers == 4, "counters not the last frame's sums");
+        TEST_CHECK(counters.root_constant_sets == 6 * last && counters.constant_buffers == 1 && counters.upload_bytes == ((u64)(2 * last) << 32) + 1, "counters not the last frame's sums");
+    }
+
+    // Passes past RD_MAX_PASS_STATS go unrecorded, and don't touch the backend or the history.
+    stats->begin_frame(frame_count);
+
+    for (u32 i = 0; i < RD_MAX_PASS_STATS; ++i) {
+        TEST_CHECK(stats->add_pass("gbuffer") == i, "ran out of passes early");
+    }
+
+    u32 overflow = stats->add_pass("overflow");
+    TEST_CHECK(overflow == UINT32_MAX, "pass past the limit not refused");
+
+    u32 timestamp_count = fake->timestamp_count;
+    u32 cpu_next = stats->passes[0].cpu_ms.next;
+
+    stats->begin_pass_timestamp(0, overflow);
+    stats->end_pass_timestamp(0, overflow);
+    stats->set_pass_cpu(overflow, 1.0f, thread_counters(frame_count, 0, 0));
+
+    TEST_CHECK(fake->timestamp_count == timestamp_count, "timestamps written for an unrecorded pass");
+    TEST_CHECK(stats->pass_count == 2 && stats->passes[0].cpu_ms.next == cpu_next && stats->passes[0].counters.draws == 2 * last + 1, "unrecorded pass reached the history");
+
+    free(stats);
+    free(fake);
+
+    pf_debug_log("render stats test passed\n");
+
+    return true;
+}
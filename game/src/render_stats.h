@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "renderer.h"
+
+#define RENDER_STATS_HISTORY 128
+#define RENDER_STATS_FRAME_LATENCY 3
+
+struct CommandList;
+
+// Where GPU pass timings come from. The renderer plugs in D3D12 timestamp queries; anything that
+// implements these (a fake clock, say) lets the bookkeeping run without a device.
+struct TimestampBackend {
+    void* data;
+
+    void (*begin_pass)(void* data, CommandList* cmd, u32 slot, u32 pass);
+    void (*end_pass)(void* data, CommandList* cmd, u32 slot, u32 pass);
+    void (*resolve)(void* data, CommandList* cmd, u32 slot, u32 pass_count);
+
+    // Fills gpu_ms for every pass of the frame in slot. Returns false while the frame is still in flight.
+    bool (*read)(void* data, u32 slot, u64 fence, u32 pass_count, f32* gpu_ms);
+};
+
+struct RenderStatsPass {
+    const char* name;
+    f32 cpu_ms;
+    RDPassCounters counters;
+};
+
+// A frame whose GPU timings haven't been read back yet.
+struct RenderStatsFrame {
+    bool pending;
+    u64 fence;
+    u32 pass_count;
+    RenderStatsPass passes[RD_MAX_PASS_STATS];
+};
+
+struct RenderStatsHistory {
+    u32 len;
+    u32 next;
+    f32 samples[RENDER_STATS_HISTORY];
+
+    void push(f32 sample);
+    RDTimingStats summarize();
+};
+
+struct RenderStatsPassHistory {
+    const char* name;
+    RenderStatsHistory cpu_ms;
+    RenderStatsHistory gpu_ms;
+    RDPassCounters counters;
+};
+
+struct RenderStats {
+    TimestampBackend backend;
+
+    u32 slot;
+    u64 frame_start_ticks;
+    RenderStatsFrame frames[RENDER_STATS_FRAME_LATENCY];
+
+    RenderStatsHistory cpu_frame_ms;
+    u32 pass_count;
+    RenderStatsPassHistory passes[RD_MAX_PASS_STATS];
+
+    void begin_frame(u64 frame_index);
+
+    // Returns UINT32_MAX once the frame has RD_MAX_PASS_STATS passes; such passes go unrecorded.
+    u32 add_pass(const char* name);
+    void begin_pass_timestamp(CommandList* cmd, u32 pass);
+    void end_pass_timestamp(CommandList* cmd, u32 pass);
+    void set_pass_cpu(u32 pass, f32 cpu_ms, RDPassCounters counters);
+
+    void resolve(CommandList* cmd);
+    void end_frame(u64 fence);
+
+    void get(RDFrameStats* stats);
+};
+
+void add_pass_counters(RDPassCounters* dst, RDPassCounters* src);
+
+// Runs frames against a fake backend with known timings, and checks the percentiles, how many frames late GPU timings
+// are read back, and passes past RD_MAX_PASS_STATS. Returns false and logs what went wrong on a failure.
+bool render_stats_test();
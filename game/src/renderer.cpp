@@ -1,15 +1,31 @@
 #include <dxgi1_4.h>
 #include <agility/d3d12.h>
 
-#include <dxc/dxcapi.h>
-#include <dxc/d3d12shader.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
 
 #include "renderer.h"
 #include "platform.h"
 #include "maps.h"
 #include "shader.h"
+#include "shader_codegen.h"
+#include "root_constants.h"
+#include "derived_data.h"
+#include "jobs.h"
+#include "profiler.h"
+#include "render_stats.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "light_culling.h"
+#include "vertex_format.h"
+#include "meshlets.h"
+#include "texture_streaming.h"
+#include "staging_ring.h"
+#include "block_compression.h"
 
 #define RENDERER_ARENA_SIZE (50 * 1024 * 1024)
+#define RENDERER_FRAME_ARENA_SIZE (64 * 1024 * 1024)
 
 #define MAX_RTV_COUNT 1024
 #define MAX_CBV_SRV_UAV_COUNT 1000000
@@ -17,13 +33,62 @@
 
 #define CONSTANT_BUFFER_CAPACITY 256
 #define CONSTANT_BUFFER_POOL_COUNT 256
+#define CONSTANT_BUFFER_STASH_SIZE 64
 
-#define MAX_POINT_LIGHT_COUNT 1024
+#define MAX_POINT_LIGHT_COUNT 65536
 #define MAX_DIRECTIONAL_LIGHT_COUNT 16
-
-#define DEFAULT_UPLOAD_POOL_SIZE (256 * 256)
-
-#define RENDER_GRAPH_NODE_MAX_INPUT_OUTPUTS 16
+#define MAX_CLUSTER_LIGHT_INDEX_COUNT (1024 * 1024)
+
+// Default budgets of queued uploads, see rd_set_upload_budget.
+#define UPLOAD_BYTES_PER_FRAME (16 * 1024 * 1024)
+#define UPLOAD_STAGING_BYTES (64 * 1024 * 1024)
+
+// What the lighting pass uploads on the compute queue each frame, at most.
+#define LIGHT_UPLOAD_BYTES (MAX_POINT_LIGHT_COUNT * sizeof(RDPointLight) + MAX_DIRECTIONAL_LIGHT_COUNT * sizeof(RDDirectionalLight) + \
+    CLUSTER_COUNT * sizeof(ClusterRange) + MAX_CLUSTER_LIGHT_INDEX_COUNT * sizeof(u32))
+// Frames whose uploads can be alive at once: those the swapchain lets the GPU lag by, and the one being recorded.
+#define STAGING_RING_FRAMES 3
+
+// Staging ring of each queue. The copy queue's has room for the upload budget and what wrapping wastes, the compute
+// queue's for the lighting pass's largest frames and wrapping past its largest upload.
+#define DIRECT_STAGING_RING_SIZE (16 * 1024 * 1024)
+#define COMPUTE_STAGING_RING_SIZE (STAGING_RING_FRAMES * LIGHT_UPLOAD_BYTES + MAX_CLUSTER_LIGHT_INDEX_COUNT * sizeof(u32))
+#define COPY_STAGING_RING_SIZE (UPLOAD_STAGING_BYTES + 32 * 1024 * 1024)
+// Every staging allocation starts on this, so copies and raw views of it can use aligned loads.
+#define STAGING_MIN_ALIGNMENT 16
+
+// Size of the root signature's only parameter, in 32 bit values.
+#define ROOT_CONSTANT_COUNT 32
+
+#define PIPELINE_MANIFEST_PATH "shaders/variants.txt"
+#define PIPELINE_MAX_VARIANTS (1 << SHADER_MAX_FEATURES)
+
+#define RENDER_GRAPH_MIN_CHUNK_WORK 512
+#define RENDER_GRAPH_CACHE_SIZE 8
+#define RENDER_GRAPH_TEXTURE_RETIRE_FRAMES 16
+
+// Meshlet ranges drawn per instance, and best of how many runs is reported.
+#define RECORDING_BENCHMARK_RANGES 2
+#define RECORDING_BENCHMARK_ITERATIONS 10
+
+// Meshes up to this size keep a CPU copy of their geometry for the occlusion rasterizer.
+#define OCCLUDER_MAX_TRIANGLES 1024
+#define MAX_OCCLUDERS 64
+// Bounding sphere radius over distance; anything smaller covers too little of the screen to be worth rasterizing.
+#define OCCLUDER_MIN_SCREEN_SIZE 0.1f
+// Simplified levels can bulge past the real surface, so one only stands in as an occluder while its error is this small
+// next to the bounding sphere radius.
+#define OCCLUDER_MAX_LOD_ERROR 0.01f
+
+// Levels of streamed textures this size and under are uploaded with the texture and never evicted.
+#define TEXTURE_STREAMING_TAIL_SIZE 64
+#define TEXTURE_STREAMING_BYTES_PER_FRAME (4 * 1024 * 1024)
+#define TEXTURE_STREAMING_MEMORY_BYTES (512ull * 1024 * 1024)
+
+// A level is detailed enough while its error covers at most this many pixels. An instance only moves to a coarser level
+// once that level's error drops under LOD_HYSTERESIS times the threshold, so it doesn't flicker between two at the edge.
+#define LOD_MAX_PIXEL_ERROR 1.0f
+#define LOD_HYSTERESIS 0.75f
 
 extern "C" { __declspec(dllexport) extern const UINT D3D12SDKVersion = 608;}
 extern "C" { __declspec(dllexport) extern const char* D3D12SDKPath = ".\\d3d12\\"; }
@@ -152,13 +217,6 @@ struct DescriptorHeap {
     }
 };
 
-struct UploadPool {
-    ID3D12Resource* buffer;
-    void* ptr;
-    u32 allocated;
-    u32 size;
-};
-
 struct ConstantBuffer {
     Descriptor view;
     void* ptr;
@@ -167,6 +225,7 @@ struct ConstantBuffer {
 struct UploadRegion {
     ID3D12Resource* resource;
     u32 offset;
+    void* ptr;
 };
 
 struct CommandList {
@@ -174,19 +233,37 @@ struct CommandList {
     ID3D12GraphicsCommandList* list;
     ID3D12CommandAllocator* allocator;
     Vec<ConstantBuffer> constant_buffers;
-    Vec<UploadPool> upload_pools;
+    Vec<ConstantBuffer> constant_buffer_stash;
+    // Identifies the list's allocations in its queue's staging ring.
+    u64 staging_owner;
+    // Uploads too large for the ring, released once the list finishes.
+    Vec<ID3D12Resource*> dedicated_uploads;
     u64 fence_val;
+    RDPassCounters counters;
 
     ID3D12GraphicsCommandList* operator->() {
         return list;
     }
 
-    UploadRegion get_upload_region(Renderer* r, u32 data_size, void* data);
-    void buffer_upload(Renderer* renderer, ID3D12Resource* buffer, u32 data_size, void* data);
+    void draw(u32 vertex_count) {
+        list->DrawInstanced(vertex_count, 1, 0, 0);
+        counters.draws++;
+    }
+
+    void draw_indexed(u32 index_count, u32 first_index) {
+        list->DrawIndexedInstanced(index_count, 1, first_index, 0, 0);
+        counters.draws++;
+    }
 
-    void drop_constant_buffer(ConstantBuffer cbuffer) {
-        constant_buffers.push(cbuffer);
+    void dispatch(u32 x, u32 y, u32 z) {
+        list->Dispatch(x, y, z);
+        counters.dispatches++;
     }
+
+    UploadRegion alloc_upload_region(Renderer* r, u32 size, u32 alignment);
+    UploadRegion get_upload_region(Renderer* r, u32 data_size, void* data);
+    void buffer_upload(Renderer* renderer, ID3D12Resource* buffer, u32 data_size, void* data);
+    ConstantBuffer get_constant_buffer(Renderer* r, u32 size, void* data);
 };
 
 struct Queue {
@@ -195,7 +272,14 @@ struct Queue {
     ID3D12Fence* fence;
     Vec<CommandList> occupied_command_lists;
 
-    void init(ID3D12Device* device, D3D12_COMMAND_LIST_TYPE type) {
+    // Upload memory for the lists submitted here, mapped for as long as the queue lives. Lists record on several
+    // threads, so the ring is behind staging_lock.
+    StagingRing staging;
+    ID3D12Resource* staging_buffer;
+    u8* staging_ptr;
+    SpinLock staging_lock;
+
+    void init(ID3D12Device* device, D3D12_COMMAND_LIST_TYPE type, u64 staging_size) {
         assert(!queue);
 
         D3D12_COMMAND_QUEUE_DESC queue_desc = {};
@@ -205,11 +289,29 @@ struct Queue {
 
         fence_val = 0;
         device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence));
+
+        D3D12_RESOURCE_DESC desc = {};
+        desc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        desc.Width = staging_size;
+        desc.Height = 1;
+        desc.DepthOrArraySize = 1;
+        desc.MipLevels = 1;
+        desc.SampleDesc.Count = 1;
+        desc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+
+        D3D12_HEAP_PROPERTIES heap_properties = {};
+        heap_properties.Type = D3D12_HEAP_TYPE_UPLOAD;
+
+        device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_GENERIC_READ, 0, IID_PPV_ARGS(&staging_buffer));
+        staging_buffer->Map(0, 0, (void**)&staging_ptr);
+        staging.init(staging_size);
     }
 
     void free() {
         queue->Release();
         fence->Release();
+        staging_buffer->Release();
+        staging.free();
         occupied_command_lists.free();
     }
 
@@ -233,15 +335,48 @@ struct Queue {
         wait(signal());
     }
 
-    void submit_command_list(CommandList list) {
-        list.list->Close();
-        ID3D12CommandList* p_list = list.list;
-        queue->ExecuteCommandLists(1, &p_list);
-        list.fence_val = signal();
-        occupied_command_lists.push(list);
+    // Makes this queue wait on the GPU until another queue's fence reaches val.
+    void wait_for(Queue* other, u64 val) {
+        queue->Wait(other->fence, val);
+    }
+
+    u64 submit_command_lists(u32 count, CommandList* lists) {
+        Scratch scratch = get_scratch(0);
+        ID3D12CommandList** p_lists = scratch->push_array<ID3D12CommandList*>(count);
+
+        for (u32 i = 0; i < count; ++i) {
+            lists[i].list->Close();
+            p_lists[i] = lists[i].list;
+        }
+
+        queue->ExecuteCommandLists(count, p_lists);
+        u64 val = signal();
+
+        staging_lock.lock();
+
+        for (u32 i = 0; i < count; ++i) {
+            staging.submit(lists[i].staging_owner, val);
+        }
+
+        staging_lock.unlock();
+
+        for (u32 i = 0; i < count; ++i) {
+            lists[i].fence_val = val;
+            occupied_command_lists.push(lists[i]);
+        }
+
+        return val;
+    }
+
+    u64 submit_command_list(CommandList list) {
+        return submit_command_lists(1, &list);
     }
 
-    void poll_command_lists(Vec<CommandList>* avail_lists, Vec<ConstantBuffer>* avail_cbuffers, Vec<UploadPool>* avail_upload_pools) {
+    void poll_command_lists(Vec<CommandList>* avail_lists, Vec<ConstantBuffer>* avail_cbuffers) {
+        staging_lock.lock();
+        staging.retire(fence->GetCompletedValue());
+        staging_lock.unlock();
+
         for (int i = occupied_command_lists.len-1; i >= 0; --i)
         {
             CommandList list = occupied_command_lists[i];
@@ -251,19 +386,12 @@ struct Queue {
                     avail_cbuffers->push(list.constant_buffers[j]);
                 }
 
-                for (u32 j = 0; j < list.upload_pools.len; ++j) {
-                    UploadPool upload_pool = list.upload_pools[j];
-                    if (upload_pool.size > DEFAULT_UPLOAD_POOL_SIZE) {
-                        upload_pool.buffer->Release();
-                    }
-                    else {
-                        upload_pool.allocated = 0;
-                        avail_upload_pools->push(upload_pool);
-                    }
+                for (u32 j = 0; j < list.dedicated_uploads.len; ++j) {
+                    list.dedicated_uploads[j]->Release();
                 }
 
                 list.constant_buffers.clear();
-                list.upload_pools.clear();
+                list.dedicated_uploads.clear();
 
                 avail_lists->push(list);
 
@@ -273,17 +401,43 @@ struct Queue {
     }
 };
 
+struct MeshLod {
+    u32 index_offset;
+    u32 index_count;
+    f32 error;
+
+    u32 meshlet_offset;
+    u32 meshlet_count;
+};
+
 struct MeshData {
     ID3D12Resource* vbuffer;
     ID3D12Resource* ibuffer;
     Descriptor vbuffer_view;
-    Descriptor ibuffer_view;
+    D3D12_INDEX_BUFFER_VIEW ibuffer_view;
     u32 index_count;
+    RDMeshQuantization quantization;
+    RDMeshBounds bounds;
+
+    // Uv units per local unit along the surface of level 0, for picking the mip levels of streamed textures.
+    f32 uv_density;
+
+    u32 occluder_vertex_count;
+    u32 occluder_index_count;
+    XMFLOAT3* occluder_positions;
+    u32* occluder_indices;
+
+    u32 lod_count;
+    MeshLod lods[RD_MAX_MESH_LODS];
+
+    // The meshlets of every level, one level after another.
+    Meshlet* meshlets;
 };
 
 struct TextureData {
     u32 width;
     u32 height;
+    u32 mip_levels;
     DXGI_FORMAT format;
     ID3D12Resource* resource;
     D3D12_RESOURCE_STATES state;
@@ -292,6 +446,15 @@ struct TextureData {
     Descriptor dsv;
     Descriptor uav;
 
+    // STREAMING_NONE unless made by rd_create_streamed_texture, in which case resource holds the levels of the chain
+    // in source from first_mip on.
+    u32 streaming;
+    u32 first_mip;
+    u8* source;
+    u64 mip_offsets[STREAMING_MAX_MIPS];
+    // Set once the levels uploaded with it have landed, until then no others are streamed.
+    bool streaming_ready;
+
     void transition(CommandList* cmd, D3D12_RESOURCE_STATES target_state) {
         if (state == target_state) {
             return;
@@ -305,15 +468,133 @@ struct TextureData {
         barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
 
         cmd->list->ResourceBarrier(1, &barrier);
+        cmd->counters.barriers++;
 
         state = target_state;
     }
+
+    // Orders UAV writes before later UAV accesses, which a transition can't as the state stays the same.
+    void uav_barrier(CommandList* cmd) {
+        D3D12_RESOURCE_BARRIER barrier = {};
+        barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+        barrier.UAV.pResource = resource;
+
+        cmd->list->ResourceBarrier(1, &barrier);
+        cmd->counters.barriers++;
+    }
 };
 
 struct RDUploadContext {
     CommandList command_list;
 };
 
+enum UploadRequestKind {
+    // Levels level to level + level_count - 1 of texture from data.
+    UPLOAD_REQUEST_TEXTURE,
+    // The buffers of mesh, from data as vertices and indices.
+    UPLOAD_REQUEST_MESH,
+    // Rebuilds texture with streaming_op, leaving level as its first. Swapped in once finished.
+    UPLOAD_REQUEST_STREAMING,
+};
+
+// Queued until the budgets let drain_uploads record it into a frame's copy command list, then kept until the copy
+// queue reaches fence.
+struct UploadRequest {
+    UploadRequestKind kind;
+    u32 priority;
+    u64 sequence;
+    // Staging memory it takes.
+    u64 size;
+
+    RDTexture texture;
+    RDMesh mesh;
+    void* data;
+    u32* indices;
+    u32 vertex_count;
+    u32 index_count;
+    u32 level;
+    u32 level_count;
+    StreamingOpKind streaming_op;
+    // Made for a streaming request when it's recorded.
+    ID3D12Resource* resource;
+
+    RDUploadCallback callback;
+    void* user_data;
+    u64 fence;
+};
+
+// The next request in line is last in queue once it's sorted. Within a priority they go in the order queued.
+static int compare_upload_requests(const void* a, const void* b) {
+    UploadRequest* x = (UploadRequest*)a;
+    UploadRequest* y = (UploadRequest*)b;
+
+    if (x->priority != y->priority) {
+        return x->priority < y->priority ? -1 : 1;
+    }
+
+    return x->sequence > y->sequence ? -1 : x->sequence < y->sequence;
+}
+
+struct UploadScheduler {
+    Vec<UploadRequest> queue;
+    bool sorted;
+    // In the order recorded, which is the order they finish in.
+    Vec<UploadRequest> in_flight;
+    u64 next_sequence;
+
+    u64 queued_bytes;
+    u64 staging_bytes;
+
+    u64 bytes_per_frame;
+    u64 staging_budget;
+
+    void enqueue(UploadRequest request) {
+        request.sequence = next_sequence++;
+        queue.push(request);
+        queued_bytes += request.size;
+        sorted = false;
+    }
+
+    // Takes the next request in line if the budgets let it go this frame. Strictly in order, so a large request holds
+    // back the ones behind it rather than being starved by them. One over a budget by itself goes alone.
+    bool next(u64 frame_bytes, UploadRequest* request) {
+        if (queue.empty()) {
+            return false;
+        }
+
+        if (!sorted) {
+            qsort(queue.mem, queue.len, sizeof(UploadRequest), compare_upload_requests);
+            sorted = true;
+        }
+
+        u64 size = queue[queue.len-1].size;
+
+        if (frame_bytes > 0 && frame_bytes + size > bytes_per_frame) {
+            return false;
+        }
+
+        if (staging_bytes > 0 && staging_bytes + size > staging_budget) {
+            return false;
+        }
+
+        *request = queue.pop();
+        queued_bytes -= size;
+        return true;
+    }
+
+    void free() {
+        queue.free();
+        in_flight.free();
+    }
+};
+
+// What a streamed texture was swapped away from, released once the direct queue reaches fence.
+struct RetiredTextureResource {
+    ID3D12Resource* resource;
+    Descriptor view;
+    u64 fence;
+};
+
 struct RDUploadStatus {
 };
 
@@ -378,7 +659,9 @@ struct HandledResourceManager {
 struct Pipeline {
     bool is_compute;
     ID3D12PipelineState* pipeline_state;
-    Dictionary<int> bindings;
+    // In 32 bit values, and the layout from root_constants_layout to check against root_constants.h.
+    u32 root_constants_size;
+    u64 root_layout;
     u32 group_size_x;
     u32 group_size_y;
     u32 group_size_z;
@@ -387,30 +670,174 @@ struct Pipeline {
         cmd->list->SetPipelineState(pipeline_state);
     }
 
-    void bind_descriptor_at_offset(CommandList* cmd, int offset, Descriptor descriptor) {
+    // constants is the pipeline's struct from root_constants.h, set whole.
+    void set_root_constants(CommandList* cmd, void* constants, u32 size) {
+        assert(size == root_constants_size * sizeof(u32));
+
+        cmd->counters.root_constant_sets++;
+
         if (is_compute) {
-            cmd->list->SetComputeRoot32BitConstant(0, descriptor.index, offset);
+            cmd->list->SetComputeRoot32BitConstants(0, root_constants_size, constants, 0);
         }
         else {
-            cmd->list->SetGraphicsRoot32BitConstant(0, descriptor.index, offset);
+            cmd->list->SetGraphicsRoot32BitConstants(0, root_constants_size, constants, 0);
+        }
+    }
+
+    void free() {
+        pipeline_state->Release();
+    }
+};
+
+// Every permutation of one shader file, keyed by the bitmask of its features. Variants listed in the manifest are
+// created by rd_init, the rest the first time they are asked for.
+struct PipelineVariants {
+    // As written in the manifest.
+    const char* name;
+    // Holds vs_main and ps_main, or cs_main for compute.
+    const char* path;
+    bool is_compute;
+    StaticVec<DXGI_FORMAT, 8> rtv_formats;
+
+    u32 num_features;
+    const char* const* features;
+
+    // From root_constants.h, every variant has to match it.
+    u64 root_layout;
+
+    SpinLock lock;
+    volatile u32 ready[PIPELINE_MAX_VARIANTS];
+    Pipeline variants[PIPELINE_MAX_VARIANTS];
+
+    void free() {
+        for (u32 i = 0; i < PIPELINE_MAX_VARIANTS; ++i) {
+            if (ready[i]) {
+                variants[i].free();
+            }
         }
     }
+};
+
+// Without it the pixel shader takes albedo_factor as is, for materials on the white texture.
+#define GBUFFER_ALBEDO_TEXTURE (1 << 0)
+
+static const char* const gbuffer_features[] = {
+    "ALBEDO_TEXTURE",
+};
 
-    void bind_descriptor(CommandList* cmd, const char* name, Descriptor descriptor) {
-        int offset = bindings[name];
-        bind_descriptor_at_offset(cmd, offset, descriptor);
+// Light loops are left out of frames without lights of that kind.
+#define LIGHTING_POINT_LIGHTS (1 << 0)
+#define LIGHTING_DIRECTIONAL_LIGHTS (1 << 1)
+
+static const char* const lighting_features[] = {
+    "POINT_LIGHTS",
+    "DIRECTIONAL_LIGHTS",
+};
+
+static_assert(GBUFFER_ROOT_CONSTANTS_SIZE <= ROOT_CONSTANT_COUNT, "gbuffer root constants don't fit the root signature");
+static_assert(LIGHTING_ROOT_CONSTANTS_SIZE <= ROOT_CONSTANT_COUNT, "lighting root constants don't fit the root signature");
+
+#define TIMESTAMP_QUERIES_PER_FRAME (RD_MAX_PASS_STATS * 2)
+
+// Backs RenderStats with a timestamp query heap. Each in-flight frame owns a range of queries and
+// a range of the readback buffer, which is read once the frame's fence has passed.
+struct TimestampQueries {
+    Queue* direct_queue;
+    ID3D12QueryHeap* heap;
+    ID3D12Resource* readback;
+    u64* readback_ptr;
+    u64 direct_frequency;
+    u64 compute_frequency;
+    bool on_compute[RENDER_STATS_FRAME_LATENCY][RD_MAX_PASS_STATS];
+
+    void init(ID3D12Device* device, Queue* direct, Queue* compute) {
+        direct_queue = direct;
+
+        D3D12_QUERY_HEAP_DESC heap_desc = {};
+        heap_desc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+        heap_desc.Count = TIMESTAMP_QUERIES_PER_FRAME * RENDER_STATS_FRAME_LATENCY;
+        device->CreateQueryHeap(&heap_desc, IID_PPV_ARGS(&heap));
+
+        D3D12_RESOURCE_DESC desc = {};
+        desc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+        desc.Width = heap_desc.Count * sizeof(u64);
+        desc.Height = 1;
+        desc.DepthOrArraySize = 1;
+        desc.MipLevels = 1;
+        desc.SampleDesc.Count = 1;
+        desc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+
+        D3D12_HEAP_PROPERTIES heap_properties = {};
+        heap_properties.Type = D3D12_HEAP_TYPE_READBACK;
+
+        device->CreateCommittedResource(&heap_properties, D3D12_HEAP_FLAG_NONE, &desc, D3D12_RESOURCE_STATE_COPY_DEST, 0, IID_PPV_ARGS(&readback));
+        readback->Map(0, 0, (void**)&readback_ptr);
+
+        direct->queue->GetTimestampFrequency(&direct_frequency);
+        compute->queue->GetTimestampFrequency(&compute_frequency);
     }
 
     void free() {
-        pipeline_state->Release();
-        bindings.free();
+        readback->Unmap(0, 0);
+        readback->Release();
+        heap->Release();
+    }
+
+    static void begin_pass(void* data, CommandList* cmd, u32 slot, u32 pass) {
+        TimestampQueries* q = (TimestampQueries*)data;
+        q->on_compute[slot][pass] = cmd->type == D3D12_COMMAND_LIST_TYPE_COMPUTE;
+        cmd->list->EndQuery(q->heap, D3D12_QUERY_TYPE_TIMESTAMP, slot * TIMESTAMP_QUERIES_PER_FRAME + pass * 2);
+    }
+
+    static void end_pass(void* data, CommandList* cmd, u32 slot, u32 pass) {
+        TimestampQueries* q = (TimestampQueries*)data;
+        cmd->list->EndQuery(q->heap, D3D12_QUERY_TYPE_TIMESTAMP, slot * TIMESTAMP_QUERIES_PER_FRAME + pass * 2 + 1);
+    }
+
+    // Must be recorded on the direct queue once every pass of the frame has been ordered before it.
+    static void resolve(void* data, CommandList* cmd, u32 slot, u32 pass_count) {
+        TimestampQueries* q = (TimestampQueries*)data;
+        u32 first = slot * TIMESTAMP_QUERIES_PER_FRAME;
+        cmd->list->ResolveQueryData(q->heap, D3D12_QUERY_TYPE_TIMESTAMP, first, pass_count * 2, q->readback, first * sizeof(u64));
+    }
+
+    static bool read(void* data, u32 slot, u64 fence, u32 pass_count, f32* gpu_ms) {
+        TimestampQueries* q = (TimestampQueries*)data;
+
+        if (!q->direct_queue->reached(fence)) {
+            return false;
+        }
+
+        u64* ticks = q->readback_ptr + slot * TIMESTAMP_QUERIES_PER_FRAME;
+
+        for (u32 i = 0; i < pass_count; ++i) {
+            u64 frequency = q->on_compute[slot][i] ? q->compute_frequency : q->direct_frequency;
+            u64 elapsed = ticks[i * 2 + 1] > ticks[i * 2] ? ticks[i * 2 + 1] - ticks[i * 2] : 0;
+            gpu_ms[i] = (f32)((f64)elapsed * 1000.0 / (f64)frequency);
+        }
+
+        return true;
+    }
+
+    TimestampBackend backend() {
+        TimestampBackend result = {};
+        result.data = this;
+        result.begin_pass = begin_pass;
+        result.end_pass = end_pass;
+        result.resolve = resolve;
+        result.read = read;
+        return result;
     }
 };
 
 struct RenderGraph;
+struct RenderGraphCompiled;
+struct RenderGraphPooledTexture;
 
 struct Renderer {
     Arena arena;
+    Arena frame_arena;
+    u64 frame_index;
     HWND window;
 
     IDXGIFactory3* factory;
@@ -418,6 +845,7 @@ struct Renderer {
     ID3D12Device* device;
 
     Queue direct_queue;
+    Queue compute_queue;
     Queue copy_queue;
 
     DescriptorHeap rtv_heap;
@@ -435,30 +863,67 @@ struct Renderer {
 
     Vec<CommandList> available_command_lists;
     Vec<ConstantBuffer> available_constant_buffers;
-    Vec<UploadPool> available_upload_pools;
+    SpinLock pool_lock;
+    u64 next_staging_owner;
+
+    Vec<CommandList> frame_command_lists;
 
     HandledResourceManager<MeshData, RDMesh> mesh_manager;
     HandledResourceManager<TextureData, RDTexture> texture_manager;
     
     PoolAllocator<RDUploadContext> upload_context_allocator;
+    UploadScheduler uploads;
 
     ID3D12RootSignature* root_signature;
 
-    Pipeline gbuffer_pipeline;
-    Pipeline lighting_pipeline;
+    DerivedDataCache shader_cache;
+    PipelineVariants gbuffer_pipelines;
+    PipelineVariants lighting_pipelines;
 
-    RenderGraph* render_graph;
+    StaticVec<RenderGraphCompiled*, RENDER_GRAPH_CACHE_SIZE> compiled_graphs;
+    Vec<RenderGraphPooledTexture> render_graph_textures;
+
+    TimestampQueries timestamp_queries;
+    RenderStats stats;
 
     ID3D12Resource* point_light_buffer;
     ID3D12Resource* directional_light_buffer;
     Descriptor point_light_buffer_view;
     Descriptor directional_light_buffer_view;
 
+    ID3D12Resource* cluster_range_buffer;
+    ID3D12Resource* cluster_light_index_buffer;
+    Descriptor cluster_range_buffer_view;
+    Descriptor cluster_light_index_buffer_view;
+
     RDTexture white_texture;
 
+    TextureStreamer texture_streamer;
+    // By index in texture_streamer.
+    Vec<RDTexture> streamed_textures;
+    Vec<RetiredTextureResource> retired_texture_resources;
+
     RDRenderInfo* render_info;
     XMMATRIX view_projection_matrix; 
 
+    u32 num_visible_instances;
+    u32* visible_instances;
+
+    // Level of detail each instance drew with last frame, kept for hysteresis. Reset when the instance count changes.
+    Vec<u8> instance_lods;
+
+    // Per visible instance, the level of detail it draws with this frame.
+    u8* visible_lods;
+
+    // Per visible instance, the index ranges left after meshlet culling.
+    u32* visible_range_offsets;
+    u32* visible_range_counts;
+    IndexRange* visible_ranges;
+
+    OcclusionBuffer occlusion_buffer;
+
+    LightClusters light_clusters;
+
     void get_swapchain_buffers() {
         for (u32 i = 0; i < swapchain_buffer_count; ++i) {
             swapchain->GetBuffer(i, IID_PPV_ARGS(&swapchain_buffers[i]));
@@ -471,9 +936,21 @@ struct Renderer {
         }
     }
 
+    Queue* queue_for(D3D12_COMMAND_LIST_TYPE type) {
+        switch (type) {
+            case D3D12_COMMAND_LIST_TYPE_COMPUTE:
+                return &compute_queue;
+            case D3D12_COMMAND_LIST_TYPE_COPY:
+                return &copy_queue;
+            default:
+                return &direct_queue;
+        }
+    }
+
     CommandList open_command_list(D3D12_COMMAND_LIST_TYPE type) {
-        direct_queue.poll_command_lists(&available_command_lists, &available_constant_buffers, &available_upload_pools);
-        copy_queue.poll_command_lists(&available_command_lists, &available_constant_buffers, &available_upload_pools);
+        direct_queue.poll_command_lists(&available_command_lists, &available_constant_buffers);
+        compute_queue.poll_command_lists(&available_command_lists, &available_constant_buffers);
+        copy_queue.poll_command_lists(&available_command_lists, &available_constant_buffers);
 
         CommandList list = {};
 
@@ -494,14 +971,29 @@ struct Renderer {
 
         list.allocator->Reset();
         list.list->Reset(list.allocator, 0);
+        list.counters = {};
+        list.staging_owner = ++next_staging_owner;
+
+        return list;
+    }
+
+    CommandList open_frame_command_list(D3D12_COMMAND_LIST_TYPE type) {
+        CommandList list = open_command_list(type);
+        list->SetDescriptorHeaps(1, &bindless_heap.heap);
+
+        if (type == D3D12_COMMAND_LIST_TYPE_DIRECT) {
+            list->SetGraphicsRootSignature(root_signature);
+        }
 
+        list->SetComputeRootSignature(root_signature);
         return list;
     }
 
-    ConstantBuffer get_constant_buffer(u32 size, void* data) {
-        assert(size <= CONSTANT_BUFFER_CAPACITY);
+    // Command lists take constant buffers from the shared pool in batches, so recording threads only contend once per batch.
+    void refill_constant_buffer_stash(Vec<ConstantBuffer>* stash) {
+        pool_lock.lock();
 
-        if (available_constant_buffers.empty()) {
+        if (available_constant_buffers.len < CONSTANT_BUFFER_STASH_SIZE) {
             D3D12_RESOURCE_DESC desc = {};
             desc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
             desc.Width = CONSTANT_BUFFER_CAPACITY * CONSTANT_BUFFER_POOL_COUNT;
@@ -536,10 +1028,11 @@ struct Renderer {
             permanent_resources.push(buf);
         }
 
-        ConstantBuffer cbuffer = available_constant_buffers.pop();
-        memcpy(cbuffer.ptr, data, size);
+        for (u32 i = 0; i < CONSTANT_BUFFER_STASH_SIZE; ++i) {
+            stash->push(available_constant_buffers.pop());
+        }
 
-        return cbuffer;
+        pool_lock.unlock();
     }
 };
 
@@ -571,51 +1064,63 @@ static ID3D12Resource* create_buffer(ID3D12Device* device, u32 size, D3D12_HEAP_
     return buffer;
 }
 
-static UploadPool steal_suitable_upload_pool(Vec<UploadPool>* list, u32 size) {
-    UploadPool found_pool = {};
+// Left for the caller to fill before the command list executes. Comes from the queue's staging ring, waiting for older
+// lists to finish when it's full. Only an upload larger than the ring, or one that can't fit while the lists holding the
+// ring are still recording, gets a buffer of its own.
+UploadRegion CommandList::alloc_upload_region(Renderer* r, u32 size, u32 alignment) {
+    Queue* queue = r->queue_for(type);
+    alignment = max(alignment, (u32)STAGING_MIN_ALIGNMENT);
 
-    for (u32 i = 0; i < list->len; ++i)
-    {
-        UploadPool pool = list->at(i);
+    UploadRegion region = {};
+    u64 offset = 0;
+
+    queue->staging_lock.lock();
 
-        if (pool.size-pool.allocated >= size) {
-            found_pool = pool;
-            list->remove_by_patch(i);
+    for (;;) {
+        if (queue->staging.alloc(size, alignment, staging_owner, &offset)) {
+            region.resource = queue->staging_buffer;
+            region.offset = (u32)offset;
+            region.ptr = queue->staging_ptr + offset;
             break;
         }
-    }
 
-    return found_pool;
-}
+        u64 fence = queue->staging.oldest_fence();
 
-UploadRegion CommandList::get_upload_region(Renderer* r, u32 data_size, void* data) {
-    UploadPool pool = steal_suitable_upload_pool(&upload_pools, data_size);
+        if (fence == 0 || size > queue->staging.capacity) {
+            break;
+        }
 
-    if (!pool.ptr) {
-        pool = steal_suitable_upload_pool(&r->available_upload_pools, data_size);
-    }
+        queue->staging_lock.unlock();
+
+        {
+            PROFILE_ZONE("staging_wait");
+            queue->wait(fence);
+        }
 
-    if (!pool.ptr) {
-        u32 pool_size = max(data_size, DEFAULT_UPLOAD_POOL_SIZE);
+        queue->staging_lock.lock();
 
-        pool.buffer = create_buffer(r->device, pool_size, D3D12_HEAP_TYPE_UPLOAD, D3D12_RESOURCE_STATE_GENERIC_READ);
-        pool.buffer->Map(0, 0, &pool.ptr);
-        pool.allocated = 0;
-        pool.size = pool_size;
+        queue->staging.retire(queue->fence->GetCompletedValue());
     }
 
-    assert(pool.size-pool.allocated >= data_size);
+    queue->staging_lock.unlock();
+
+    if (!region.resource) {
+        ID3D12Resource* buffer = create_buffer(r->device, size, D3D12_HEAP_TYPE_UPLOAD, D3D12_RESOURCE_STATE_GENERIC_READ);
+        buffer->Map(0, 0, &region.ptr);
+        dedicated_uploads.push(buffer);
 
-    u32 offset = pool.allocated;
-    memcpy((u8*)pool.ptr + offset, data, data_size);
+        region.resource = buffer;
+        region.offset = 0;
+    }
 
-    pool.allocated += data_size;
-    upload_pools.push(pool);
+    counters.upload_bytes += size;
 
-    UploadRegion region = {};
-    region.resource = pool.buffer;
-    region.offset = offset;
+    return region;
+}
 
+UploadRegion CommandList::get_upload_region(Renderer* r, u32 data_size, void* data) {
+    UploadRegion region = alloc_upload_region(r, data_size, 1);
+    memcpy(region.ptr, data, data_size);
     return region;
 }
 
@@ -624,45 +1129,35 @@ void CommandList::buffer_upload(Renderer* r, ID3D12Resource* buffer, u32 data_si
     list->CopyBufferRegion(buffer, 0, region.resource, region.offset, data_size);
 }
 
-static void get_pipeline_reflection_data(Shader shader, Pipeline* pipeline) {
-    IDxcUtils* utils;
-    DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&utils));
-
-    DxcBuffer shader_buf = {};
-    shader_buf.Ptr = shader.memory;
-    shader_buf.Size = shader.len;
+ConstantBuffer CommandList::get_constant_buffer(Renderer* r, u32 size, void* data) {
+    assert(size <= CONSTANT_BUFFER_CAPACITY);
 
-    ID3D12ShaderReflection* reflection;
-    utils->CreateReflection(&shader_buf, IID_PPV_ARGS(&reflection));
-
-    reflection->GetThreadGroupSize(&pipeline->group_size_x, &pipeline->group_size_y, &pipeline->group_size_z);
-
-    ID3D12ShaderReflectionConstantBuffer* cbuffer = reflection->GetConstantBufferByIndex(0);
-
-    D3D12_SHADER_BUFFER_DESC cbuffer_desc;
-    cbuffer->GetDesc(&cbuffer_desc);
-
-    for (u32 i = 0; i < cbuffer_desc.Variables; ++i) {
-        ID3D12ShaderReflectionVariable* var = cbuffer->GetVariableByIndex(i);
-        D3D12_SHADER_VARIABLE_DESC var_desc;
-        var->GetDesc(&var_desc);
-        pipeline->bindings.insert(var_desc.Name, i);
+    if (constant_buffer_stash.empty()) {
+        r->refill_constant_buffer_stash(&constant_buffer_stash);
     }
 
-    utils->Release();
-}
+    ConstantBuffer cbuffer = constant_buffer_stash.pop();
+    memcpy(cbuffer.ptr, data, size);
+    constant_buffers.push(cbuffer);
+    counters.constant_buffers++;
 
-static Pipeline create_graphics_pipeline(ID3D12Device* device, ID3D12RootSignature* root_signature, u32 num_rtvs, DXGI_FORMAT* rtv_formats, const char* vs_ps_path) {
-    Scratch scratch = get_scratch(0);
+    return cbuffer;
+}
 
-    Shader vs = compile_shader(scratch.arena, vs_ps_path, "vs_main", "vs_6_6");
-    Shader ps = compile_shader(scratch.arena, vs_ps_path, "ps_main", "ps_6_6");
+static void set_pipeline_reflection_data(Shader shader, Pipeline* pipeline) {
+    pipeline->group_size_x = shader.reflection.group_size_x;
+    pipeline->group_size_y = shader.reflection.group_size_y;
+    pipeline->group_size_z = shader.reflection.group_size_z;
+    pipeline->root_constants_size = shader.reflection.constants_size;
+    pipeline->root_layout = root_constants_layout(&shader.reflection);
+}
 
+static Pipeline create_graphics_pipeline(ID3D12Device* device, ID3D12RootSignature* root_signature, u32 num_rtvs, DXGI_FORMAT* rtv_formats, Shader vs, Shader ps) {
     assert(vs.len);
     assert(ps.len);
 
     Pipeline pipeline = {};
-    get_pipeline_reflection_data(vs, &pipeline);
+    set_pipeline_reflection_data(vs, &pipeline);
 
     D3D12_GRAPHICS_PIPELINE_STATE_DESC pipeline_state_desc = {};
 
@@ -710,15 +1205,12 @@ static Pipeline create_graphics_pipeline(ID3D12Device* device, ID3D12RootSignatu
     return pipeline;
 }
 
-static Pipeline create_compute_pipeline(ID3D12Device* device, ID3D12RootSignature* root_signature, const char* cs_path) {
-    Scratch scratch = get_scratch(0);
-
-    Shader cs = compile_shader(scratch.arena, cs_path, "cs_main", "cs_6_6");
+static Pipeline create_compute_pipeline(ID3D12Device* device, ID3D12RootSignature* root_signature, Shader cs) {
     assert(cs.len);
 
     Pipeline pipeline = {};
     pipeline.is_compute = true;
-    get_pipeline_reflection_data(cs, &pipeline);
+    set_pipeline_reflection_data(cs, &pipeline);
 
     D3D12_COMPUTE_PIPELINE_STATE_DESC pipeline_state_desc = {};
 
@@ -731,746 +1223,2967 @@ static Pipeline create_compute_pipeline(ID3D12Device* device, ID3D12RootSignatur
     return pipeline;
 }
 
-struct RenderGraphTexture {
-    int index;
-    int version;
+struct PipelineRequest {
+    PipelineVariants* pipelines;
+    u32 variant;
 };
 
-struct BindPair {
-    Descriptor descriptor;
-    int offset;
-};
+// Compiles every shader and then creates every pipeline state, each across the job threads.
+static void create_pipelines(ID3D12Device* device, ID3D12RootSignature* root_signature, DerivedDataCache* ddc, u32 count, PipelineRequest* requests) {
+    PROFILE_FUNCTION();
 
-struct RenderGraphNode {
-    using Procedure = void (*)(Renderer*, CommandList*, Pipeline*);
+    Scratch scratch = get_scratch(0);
 
-    Pipeline* pipeline;
-    Procedure procedure;
-    bool visited;
-    RenderGraph* graph;
-    StaticVec<RenderGraphTexture, 16> reads;
-    StaticVec<RenderGraphTexture, 16> writes;
-    StaticSet<RenderGraphNode*, 16> parents;
-    
-    StaticVec<BindPair, 16> binds;
-    StaticVec<RDTexture, 16> write_by_uav_textures;
-    StaticVec<RDTexture, 16> render_targets;
-    bool has_depth_buffer;
-    RDTexture depth_buffer_texture;
+    ShaderDesc* shader_descs = scratch->push_array<ShaderDesc>(count * 2);
+    u32* first_shader = scratch->push_array<u32>(count);
+    u32 num_shaders = 0;
 
-    RenderGraphNode* read(Renderer* r, RenderGraphTexture texture, const char* where);
-    void mark_write(RenderGraphTexture& texture);
-    RenderGraphNode* write(Renderer* r, RenderGraphTexture& texture, const char* where);
-    RenderGraphNode* render_target(Renderer* r, RenderGraphTexture& texture);
-    RenderGraphNode* depth_buffer(Renderer* r, RenderGraphTexture& texture);
-    void execute(Renderer* r, CommandList* cmd);
-};
+    for (u32 i = 0; i < count; ++i) {
+        PipelineVariants* pipelines = requests[i].pipelines;
 
-struct RenderGraph {
-    bool is_built;
-    StaticVec<RDTexture, 16> textures;
-    StaticVec<RenderGraphNode, 16> nodes;
-    HashMap<RenderGraphTexture, RenderGraphNode*> texture_owners;
-    RenderGraphNode* final_node;
-    StaticVec<RenderGraphNode*, 16> ordered_nodes;
+        ShaderDesc desc = {};
+        desc.path = pipelines->path;
+        desc.num_features = pipelines->num_features;
+        desc.features = pipelines->features;
+        desc.variant = requests[i].variant;
 
-    RenderGraphTexture create_texture(Renderer* r, RDFormat format, RDTextureUsage usage) {
-        RDTexture texture = rd_create_texture(r, r->swapchain_w, r->swapchain_h, format, usage);
-        textures.push(texture);
+        first_shader[i] = num_shaders;
 
-        RenderGraphTexture handle;
-        handle.index = textures.len-1;
-        handle.version = 0;
+        if (pipelines->is_compute) {
+            desc.entry_point = "cs_main";
+            desc.target = "cs_6_6";
+            shader_descs[num_shaders++] = desc;
+        }
+        else {
+            desc.entry_point = "vs_main";
+            desc.target = "vs_6_6";
+            shader_descs[num_shaders++] = desc;
 
-        return handle;
+            desc.entry_point = "ps_main";
+            desc.target = "ps_6_6";
+            shader_descs[num_shaders++] = desc;
+        }
     }
 
-    RenderGraphNode* add_pass(Pipeline* pipeline, RenderGraphNode::Procedure procedure) {
-        RenderGraphNode node = {};
-        node.pipeline = pipeline;
-        node.procedure = procedure;
-        node.graph = this;
-        return &nodes.push(node);
-    }
+    Shader* shaders = scratch->push_array<Shader>(num_shaders);
+    compile_shaders(scratch.arena, ddc, num_shaders, shader_descs, shaders);
 
-    void set_final_pass(RenderGraphNode* node) {
-        final_node = node;
-    }
+    // The device is free threaded, and creating pipeline states is where the driver compiles the DXIL.
+    parallel_for(count, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            PipelineVariants* pipelines = requests[i].pipelines;
+            u32 variant = requests[i].variant;
+            Shader* pipeline_shaders = &shaders[first_shader[i]];
 
-    void visit_node(RenderGraphNode* node) {
-        if (node->visited) {
-            return;
+            if (pipelines->is_compute) {
+                pipelines->variants[variant] = create_compute_pipeline(device, root_signature, pipeline_shaders[0]);
+            }
+            else {
+                pipelines->variants[variant] = create_graphics_pipeline(device, root_signature, pipelines->rtv_formats.len, pipelines->rtv_formats.mem, pipeline_shaders[0], pipeline_shaders[1]);
+            }
+
+            // root_constants.h is stale, which puts constants in the wrong place for every variant, so nothing can stand in.
+            if (pipelines->variants[variant].root_layout != pipelines->root_layout) {
+                pf_fatal("%s: root constants don't match root_constants.h, run with -gen_root_constants.", pipelines->path);
+            }
+
+            atomic_store(&pipelines->ready[variant], 1);
         }
+    });
+}
+
+// Lines of a pipeline name followed by the names of the features set, like "gbuffer ALBEDO_TEXTURE". Lines starting
+// with # are comments. Returns the number of requests, leaving out duplicates and anything it doesn't know.
+static u32 read_pipeline_manifest(const char* path, u32 num_pipelines, PipelineVariants** pipelines, u32 max_requests, PipelineRequest* requests) {
+    Scratch scratch = get_scratch(0);
 
-        auto fn = [=](RenderGraphNode* node) {
-            visit_node(node);
-        };
+    FileContents file = pf_map_file(path);
 
-        node->visited = true;
-        node->parents.for_each(fn);
-        ordered_nodes.push(node);
+    if (!file.memory) {
+        pf_debug_log("%s: no pipeline manifest, every variant is created on first use\n", path);
+        return 0;
     }
 
-    void build() {
-        assert(final_node && "must give final node");
+    // Copied to be null terminated for strtok_s.
+    char* text = (char*)scratch->push(file.size + 1);
+    memcpy(text, file.memory, file.size);
+    text[file.size] = 0;
 
-        for (u32 i = 0; i < nodes.len; ++i) {
-            RenderGraphNode* node = &nodes[i];
-            
-            for (u32 j = 0; j < node->reads.len; ++j) {
-                if (node->reads[j].version != 0) {
-                    RenderGraphNode* parent = texture_owners[node->reads[j]];
-                    node->parents.insert(parent);
-                }
-            }
-        }
+    pf_unmap_file(file);
 
-        visit_node(final_node);
+    u32 count = 0;
+    char* line_context = 0;
 
-        is_built = true;
-    }
+    for (char* line = strtok_s(text, "\r\n", &line_context); line; line = strtok_s(0, "\r\n", &line_context)) {
+        char* token_context = 0;
+        char* name = strtok_s(line, " \t", &token_context);
 
-    RDTexture execute(Renderer* r, CommandList* cmd) {
-        for (u32 i = 0; i < ordered_nodes.len; ++i) {
-            ordered_nodes[i]->execute(r, cmd);
+        if (!name || name[0] == '#') {
+            continue;
         }
-        
-        return textures[final_node->writes[0].index];
-    }
 
-    void free(Renderer* r) {
-        for (u32 i = 0; i < textures.len; ++i) {
-            rd_free_texture(r, textures[i]);
+        PipelineVariants* found = 0;
+
+        for (u32 i = 0; i < num_pipelines; ++i) {
+            if (strcmp(pipelines[i]->name, name) == 0) {
+                found = pipelines[i];
+            }
         }
-        
-        texture_owners.free();
 
-        memset(this, 0, sizeof(*this));
-    }
-};
+        if (!found) {
+            pf_debug_log("%s: unknown pipeline %s\n", path, name);
+            continue;
+        }
 
-RenderGraphNode* RenderGraphNode::read(Renderer* r, RenderGraphTexture texture, const char* where) {
-    reads.push(texture);
+        u32 variant = 0;
+        bool valid = true;
 
-    BindPair bind;
-    bind.descriptor = r->texture_manager.at(graph->textures[texture.index])->view;
-    bind.offset = pipeline->bindings[where];
+        for (char* feature = strtok_s(0, " \t", &token_context); feature; feature = strtok_s(0, " \t", &token_context)) {
+            u32 f = 0;
 
-    binds.push(bind);
+            while (f < found->num_features && strcmp(found->features[f], feature) != 0) {
+                f++;
+            }
 
-    return this;
-}
+            if (f == found->num_features) {
+                pf_debug_log("%s: %s has no feature %s\n", path, name, feature);
+                valid = false;
+                break;
+            }
 
-void RenderGraphNode::mark_write(RenderGraphTexture& texture) {
-    texture.version++;
-    graph->texture_owners.insert(texture, this);
-    writes.push(texture);
-}
+            variant |= 1 << f;
+        }
 
-RenderGraphNode* RenderGraphNode::write(Renderer* r, RenderGraphTexture& texture, const char* where) {
-    mark_write(texture);
+        bool duplicate = false;
 
-    BindPair bind;
-    bind.descriptor = r->texture_manager.at(graph->textures[texture.index])->uav;
-    bind.offset = pipeline->bindings[where];
+        for (u32 i = 0; i < count; ++i) {
+            duplicate |= requests[i].pipelines == found && requests[i].variant == variant;
+        }
 
-    binds.push(bind);
-    write_by_uav_textures.push(graph->textures[texture.index]);
-    
-    return this;
+        if (valid && !duplicate && count < max_requests) {
+            requests[count].pipelines = found;
+            requests[count].variant = variant;
+            count++;
+        }
+    }
+
+    return count;
 }
 
-RenderGraphNode* RenderGraphNode::render_target(Renderer* r, RenderGraphTexture& texture) {
-    (void)r;
-    assert(!pipeline->is_compute);
-    mark_write(texture);
-    render_targets.push(graph->textures[texture.index]);
-    return this;
+// What every pipeline is made from, for rd_init and rd_generate_root_constants.
+static void describe_pipelines(PipelineVariants* gbuffer, PipelineVariants* lighting) {
+    gbuffer->name = "gbuffer";
+    gbuffer->path = "shaders/gbuffer.hlsl";
+    gbuffer->num_features = ARRAY_LEN(gbuffer_features);
+    gbuffer->features = gbuffer_features;
+    gbuffer->root_layout = GBUFFER_ROOT_LAYOUT;
+    gbuffer->rtv_formats.push(DXGI_FORMAT_R8G8B8A8_UNORM);
+    gbuffer->rtv_formats.push(DXGI_FORMAT_R8G8B8A8_UNORM);
+
+    lighting->name = "lighting";
+    lighting->path = "shaders/lighting.hlsl";
+    lighting->is_compute = true;
+    lighting->num_features = ARRAY_LEN(lighting_features);
+    lighting->features = lighting_features;
+    lighting->root_layout = LIGHTING_ROOT_LAYOUT;
 }
 
-RenderGraphNode* RenderGraphNode::depth_buffer(Renderer* r, RenderGraphTexture& texture) {
-    (void)r;
-    assert(!pipeline->is_compute);
-    mark_write(texture);
+void rd_staging_benchmark() {
+    u64 light_uploads[] = {
+        MAX_POINT_LIGHT_COUNT * sizeof(RDPointLight),
+        MAX_DIRECTIONAL_LIGHT_COUNT * sizeof(RDDirectionalLight),
+        CLUSTER_COUNT * sizeof(ClusterRange),
+        MAX_CLUSTER_LIGHT_INDEX_COUNT * sizeof(u32),
+    };
+
+    staging_ring_frame_benchmark("lighting", COMPUTE_STAGING_RING_SIZE, STAGING_RING_FRAMES - 1, ARRAY_LEN(light_uploads), light_uploads);
+}
+
+RDRootConstantsStatus rd_generate_root_constants(const char* path) {
+    Scratch scratch = get_scratch(0);
+
+    PipelineVariants* gbuffer = scratch->push_type<PipelineVariants>();
+    PipelineVariants* lighting = scratch->push_type<PipelineVariants>();
+    describe_pipelines(gbuffer, lighting);
+
+    PipelineVariants* pipelines[] = {
+        gbuffer,
+        lighting,
+    };
+
+    // The variant with every feature, as the others can only use less of the root constant buffer.
+    ShaderDesc descs[ARRAY_LEN(pipelines)];
+    const char* names[ARRAY_LEN(pipelines)];
+
+    for (u32 i = 0; i < ARRAY_LEN(pipelines); ++i) {
+        descs[i] = {};
+        descs[i].path = pipelines[i]->path;
+        descs[i].entry_point = pipelines[i]->is_compute ? "cs_main" : "vs_main";
+        descs[i].target = pipelines[i]->is_compute ? "cs_6_6" : "vs_6_6";
+        descs[i].num_features = pipelines[i]->num_features;
+        descs[i].features = pipelines[i]->features;
+        descs[i].variant = (1 << pipelines[i]->num_features) - 1;
+        names[i] = pipelines[i]->name;
+    }
+
+    DerivedDataCache ddc;
+    ddc_init(&ddc, DDC_DIRECTORY);
+
+    Shader shaders[ARRAY_LEN(pipelines)];
+    compile_shaders(scratch.arena, &ddc, ARRAY_LEN(pipelines), descs, shaders);
+
+    ShaderReflection reflections[ARRAY_LEN(pipelines)];
+    bool stale = false;
+
+    for (u32 i = 0; i < ARRAY_LEN(pipelines); ++i) {
+        if (!shaders[i].len) {
+            pf_debug_log("%s: failed to compile, root_constants.h left as is\n", pipelines[i]->path);
+            return RD_ROOT_CONSTANTS_FAILED;
+        }
+
+        reflections[i] = shaders[i].reflection;
+
+        // root_layout is what this build was compiled with.
+        if (root_constants_layout(&reflections[i]) != pipelines[i]->root_layout) {
+            pf_debug_log("%s: root constants changed since root_constants.h was generated\n", pipelines[i]->path);
+            stale = true;
+        }
+    }
+
+    // Left alone when it matches, so running this as a build step doesn't rebuild everything that includes it.
+    if (!stale) {
+        return RD_ROOT_CONSTANTS_UP_TO_DATE;
+    }
+
+    if (!write_root_constants_header(path, ARRAY_LEN(pipelines), names, reflections)) {
+        pf_debug_log("couldn't write %s\n", path);
+        return RD_ROOT_CONSTANTS_FAILED;
+    }
+
+    pf_debug_log("regenerated %s, build again\n", path);
+    return RD_ROOT_CONSTANTS_REGENERATED;
+}
+
+// Creates the variant on the calling thread when it wasn't in the manifest, stalling every other thread that wants it.
+static Pipeline* get_pipeline_variant(Renderer* r, PipelineVariants* pipelines, u32 variant) {
+    assert(variant < (1u << pipelines->num_features));
+
+    if (!atomic_load(&pipelines->ready[variant])) {
+        pipelines->lock.lock();
+
+        if (!atomic_load(&pipelines->ready[variant])) {
+            PipelineRequest request = { pipelines, variant };
+            create_pipelines(r->device, r->root_signature, &r->shader_cache, 1, &request);
+
+            pf_debug_log("created %s variant %u on first use, list it in %s to create it up front\n", pipelines->name, variant, PIPELINE_MANIFEST_PATH);
+        }
+
+        pipelines->lock.unlock();
+    }
+
+    return &pipelines->variants[variant];
+}
+
+struct RenderGraphTexture {
+    u32 index;
+    u32 version;
+};
+
+struct RenderGraphTextureDesc {
+    RDFormat format;
+    RDTextureUsage usage;
+    u32 width;
+    u32 height;
+};
+
+enum RenderGraphBindKind {
+    RENDER_GRAPH_BIND_SRV,
+    RENDER_GRAPH_BIND_UAV,
+};
+
+struct RenderGraphBind {
+    u32 texture;
+    RenderGraphBindKind kind;
+    // In 32 bit values, from root_constants.h.
+    u32 offset;
+};
+
+enum RenderGraphQueue {
+    RENDER_GRAPH_QUEUE_DIRECT,
+    RENDER_GRAPH_QUEUE_COMPUTE,
+};
+
+// A run of consecutive ordered nodes on one queue. Submitted as a unit, with at most one cross-queue wait.
+struct RenderGraphBatch {
+    RenderGraphQueue queue;
+    u32 first_node;
+    u32 node_count;
+    int wait_batch;
+
+    // Compute batches only: the state every texture enters the batch in, recorded on the direct queue as transitions
+    // out of graphics states are illegal on the compute queue.
+    u32 first_entry_barrier;
+    u32 entry_barrier_count;
+};
+
+enum RenderGraphBarrierKind {
+    // To state, from whatever the texture is in when the barrier is recorded.
+    RENDER_GRAPH_BARRIER_TRANSITION,
+    // Between two passes writing the texture as a UAV.
+    RENDER_GRAPH_BARRIER_UAV,
+};
+
+struct RenderGraphBarrier {
+    u32 texture;
+    RenderGraphBarrierKind kind;
+    D3D12_RESOURCE_STATES state;
+};
+
+struct RenderGraphCompiledNode {
+    u32 node;
+    u32 batch;
+    u32 first_barrier;
+    u32 barrier_count;
+};
+
+// Everything derived from the structure of a graph. Cached by the hash of the declaration,
+// so a frame only pays for compilation when its passes or resources change.
+struct RenderGraphCompiled {
+    u64 hash;
+    u64 last_used_frame;
+    u32 culled_count;
+    Vec<RenderGraphCompiledNode> nodes;
+    Vec<RenderGraphBatch> batches;
+    Vec<RenderGraphBarrier> barriers;
+    Vec<RenderGraphBarrier> entry_barriers;
+    Vec<u32> texture_slots;
+    Vec<RenderGraphTextureDesc> slots;
+
+    void free() {
+        nodes.free();
+        batches.free();
+        barriers.free();
+        entry_barriers.free();
+        texture_slots.free();
+        slots.free();
+        ::free(this);
+    }
+};
+
+struct RenderGraphPooledTexture {
+    RenderGraphTextureDesc desc;
+    RDTexture texture;
+    u64 last_used_frame;
+    u64 last_used_fence;
+};
+
+struct RenderGraphNode {
+    // root_constants is the pipeline's struct from root_constants.h with the graph's textures already in it. Procedures
+    // fill in the rest and set it whole.
+    using Procedure = void (*)(Renderer*, CommandList*, Pipeline*, void* root_constants, u32 begin, u32 end);
+    using WorkCount = u32 (*)(Renderer*);
+
+    RenderGraph* graph;
+    u32 index;
+    const char* name;
+
+    Pipeline* pipeline;
+    Procedure procedure;
+    WorkCount work_count;
+    RenderGraphQueue queue;
+
+    ArenaVec<RenderGraphTexture> reads;
+    ArenaVec<RenderGraphTexture> writes;
+    ArenaVec<RenderGraphBind> binds;
+    ArenaVec<u32> write_by_uav_textures;
+    ArenaVec<u32> render_targets;
+    bool has_depth_buffer;
+    u32 depth_buffer_texture;
+
+    RenderGraphNode* read(RenderGraphTexture texture, u32 offset);
+    void mark_write(RenderGraphTexture& texture);
+    RenderGraphNode* write(RenderGraphTexture& texture, u32 offset);
+    RenderGraphNode* render_target(RenderGraphTexture& texture);
+    RenderGraphNode* depth_buffer(RenderGraphTexture& texture);
+    RenderGraphNode* parallel(WorkCount count);
+    RenderGraphNode* async_compute();
+    void prepare(Renderer* r, CommandList* cmd, RenderGraphCompiled* compiled, RenderGraphCompiledNode* compiled_node);
+    void record(Renderer* r, CommandList* cmd, u32 begin, u32 end);
+};
+
+struct RenderGraphTask {
+    RenderGraphNode* node;
+    u32 run;
+    u32 list;
+    u32 begin;
+    u32 end;
+    u64 ticks;
+};
+
+// Per batch bookkeeping for one execute. Kept apart from RenderGraphBatch, as compiled graphs are cached and shared
+// between frames.
+struct RenderGraphBatchRun {
+    u32 first_list;
+    u32 list_count;
+    u32 prologue_list;
+    u64 fence;
+};
+
+// Per compiled node bookkeeping for one execute, feeding the pass stats.
+struct RenderGraphNodeRun {
+    u32 stats_pass;
+    u32 first_list;
+    u32 list_count;
+    u64 record_ticks;
+    RDPassCounters counters;
+};
+
+static void release_texture(Renderer* r, RDTexture texture);
+static void cancel_uploads(Renderer* r, void* owner);
+
+// Declared from scratch every frame in the frame arena.
+struct RenderGraph {
+    Arena* arena;
+    ArenaVec<RenderGraphTextureDesc> textures;
+    ArenaVec<ArenaVec<u32>> texture_writers;
+    ArenaVec<RenderGraphNode*> nodes;
+    RenderGraphNode* final_node;
+
+    RenderGraphCompiled* compiled;
+    RDTexture* physical_textures;
+
+    void init(Arena* frame_arena) {
+        memset(this, 0, sizeof(*this));
+        arena = frame_arena;
+        textures.arena = arena;
+        texture_writers.arena = arena;
+        nodes.arena = arena;
+    }
+
+    RenderGraphTexture create_texture(Renderer* r, RDFormat format, RDTextureUsage usage) {
+        RenderGraphTextureDesc desc = {};
+        desc.format = format;
+        desc.usage = usage;
+        desc.width = r->swapchain_w;
+        desc.height = r->swapchain_h;
+
+        textures.push(desc);
+
+        ArenaVec<u32> writers = {};
+        writers.arena = arena;
+        texture_writers.push(writers);
+
+        RenderGraphTexture handle;
+        handle.index = textures.len-1;
+        handle.version = 0;
+
+        return handle;
+    }
+
+    RenderGraphNode* add_pass(const char* name, Pipeline* pipeline, RenderGraphNode::Procedure procedure) {
+        RenderGraphNode* node = arena->push_type<RenderGraphNode>();
+        node->graph = this;
+        node->index = nodes.len;
+        node->name = name;
+        node->pipeline = pipeline;
+        node->procedure = procedure;
+
+        node->reads.arena = arena;
+        node->writes.arena = arena;
+        node->binds.arena = arena;
+        node->write_by_uav_textures.arena = arena;
+        node->render_targets.arena = arena;
+
+        nodes.push(node);
+
+        return node;
+    }
+
+    void set_final_pass(RenderGraphNode* node) {
+        final_node = node;
+    }
+
+    // Covers everything compile() looks at. Bind offsets and work counts are resolved every frame and are left out.
+    u64 hash() {
+        u64 h = fn1va_hash_bytes(textures.mem, textures.len * sizeof(textures[0]));
+
+        for (u32 i = 0; i < nodes.len; ++i) {
+            RenderGraphNode* node = nodes[i];
+
+            h = fn1va_hash_bytes(&node->pipeline, sizeof(node->pipeline), h);
+            h = fn1va_hash_bytes(&node->procedure, sizeof(node->procedure), h);
+            h = fn1va_hash_bytes(&node->queue, sizeof(node->queue), h);
+            h = fn1va_hash_bytes(node->reads.mem, node->reads.len * sizeof(node->reads[0]), h);
+            h = fn1va_hash_bytes(node->writes.mem, node->writes.len * sizeof(node->writes[0]), h);
+            h = fn1va_hash_bytes(node->write_by_uav_textures.mem, node->write_by_uav_textures.len * sizeof(u32), h);
+            h = fn1va_hash_bytes(node->render_targets.mem, node->render_targets.len * sizeof(u32), h);
+            h = fn1va_hash_bytes(&node->has_depth_buffer, sizeof(node->has_depth_buffer), h);
+            h = fn1va_hash_bytes(&node->depth_buffer_texture, sizeof(node->depth_buffer_texture), h);
+        }
+
+        return fn1va_hash_bytes(&final_node->index, sizeof(final_node->index), h);
+    }
+
+    // Calls f(texture, state) for every texture node uses, with the state it needs the texture in.
+    template<typename F>
+    static void for_each_use(RenderGraphNode* node, F f) {
+        // Pixel shader states are illegal on the compute queue.
+        D3D12_RESOURCE_STATES read_state = node->queue == RENDER_GRAPH_QUEUE_COMPUTE ? D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE : D3D12_RESOURCE_STATE_ALL_SHADER_RESOURCE;
+
+        for (u32 i = 0; i < node->reads.len; ++i) {
+            f(node->reads[i].index, read_state);
+        }
+
+        for (u32 i = 0; i < node->write_by_uav_textures.len; ++i) {
+            f(node->write_by_uav_textures[i], D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        }
+
+        for (u32 i = 0; i < node->render_targets.len; ++i) {
+            f(node->render_targets[i], D3D12_RESOURCE_STATE_RENDER_TARGET);
+        }
+
+        if (node->has_depth_buffer) {
+            f(node->depth_buffer_texture, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+        }
+    }
+
+    void visit_node(ArenaVec<u32>* parents, bool* visited, RenderGraphCompiled* result, u32 node) {
+        if (visited[node]) {
+            return;
+        }
+
+        visited[node] = true;
+
+        for (u32 i = 0; i < parents[node].len; ++i) {
+            visit_node(parents, visited, result, parents[node][i]);
+        }
+
+        RenderGraphCompiledNode compiled_node = {};
+        compiled_node.node = node;
+        result->nodes.push(compiled_node);
+    }
+
+    RenderGraphCompiled* compile() {
+        assert(final_node && "must give final node");
+
+        Scratch scratch = get_scratch(arena);
+
+        RenderGraphCompiled* result = (RenderGraphCompiled*)calloc(1, sizeof(RenderGraphCompiled));
+
+        // Dependencies: readers of a version and the next writer both follow the writer of that version.
+        ArenaVec<u32>* parents = scratch->push_array<ArenaVec<u32>>(nodes.len);
+
+        for (u32 i = 0; i < nodes.len; ++i) {
+            RenderGraphNode* node = nodes[i];
+            parents[i].arena = scratch.arena;
+
+            auto depend_on = [&](RenderGraphTexture texture) {
+                if (texture.version == 0) {
+                    return;
+                }
+
+                u32 parent = texture_writers[texture.index][texture.version-1];
+
+                for (u32 j = 0; j < parents[i].len; ++j) {
+                    if (parents[i][j] == parent) {
+                        return;
+                    }
+                }
+
+                parents[i].push(parent);
+            };
+
+            for (u32 j = 0; j < node->reads.len; ++j) {
+                depend_on(node->reads[j]);
+            }
+
+            for (u32 j = 0; j < node->writes.len; ++j) {
+                RenderGraphTexture previous = node->writes[j];
+                previous.version--;
+                depend_on(previous);
+            }
+        }
+
+        // Only passes the final pass depends on are ordered, everything else is culled.
+        bool* visited = scratch->push_array<bool>(nodes.len);
+        visit_node(parents, visited, result, final_node->index);
+        result->culled_count = nodes.len - result->nodes.len;
+
+        u32* order_of_node = scratch->push_array<u32>(nodes.len);
+
+        for (u32 i = 0; i < result->nodes.len; ++i) {
+            order_of_node[result->nodes[i].node] = i;
+        }
+
+        // Split into per-queue batches and find the latest batch on the other queue each batch depends on.
+        for (u32 i = 0; i < result->nodes.len; ++i) {
+            RenderGraphNode* node = nodes[result->nodes[i].node];
+
+            if (result->batches.empty() || result->batches[result->batches.len-1].queue != node->queue) {
+                RenderGraphBatch batch = {};
+                batch.queue = node->queue;
+                batch.first_node = i;
+                batch.wait_batch = -1;
+                result->batches.push(batch);
+            }
+
+            result->nodes[i].batch = result->batches.len-1;
+            result->batches[result->nodes[i].batch].node_count++;
+        }
+
+        for (u32 i = 0; i < result->nodes.len; ++i) {
+            RenderGraphCompiledNode* compiled_node = &result->nodes[i];
+            RenderGraphBatch* batch = &result->batches[compiled_node->batch];
+            ArenaVec<u32>* node_parents = &parents[compiled_node->node];
+
+            for (u32 j = 0; j < node_parents->len; ++j) {
+                u32 parent_batch = result->nodes[order_of_node[node_parents->at(j)]].batch;
+
+                if (result->batches[parent_batch].queue != batch->queue) {
+                    batch->wait_batch = max(batch->wait_batch, (int)parent_batch);
+                }
+            }
+        }
+
+        // Texture lifetimes in execution order.
+        u32* first_use = scratch->push_array<u32>(textures.len);
+        u32* last_use = scratch->push_array<u32>(textures.len);
+
+        for (u32 i = 0; i < textures.len; ++i) {
+            first_use[i] = UINT32_MAX;
+        }
+
+        for (u32 i = 0; i < result->nodes.len; ++i) {
+            for_each_use(nodes[result->nodes[i].node], [&](u32 texture, D3D12_RESOURCE_STATES) {
+                first_use[texture] = min(first_use[texture], i);
+                last_use[texture] = i;
+            });
+        }
+
+        // Alias textures whose lifetimes don't overlap onto the same physical texture.
+        // Only within one queue, as the queues can run ahead of each other.
+        Vec<u32> slot_last_use = {};
+        Vec<RenderGraphQueue> slot_queue = {};
+
+        for (u32 i = 0; i < textures.len; ++i) {
+            result->texture_slots.push(UINT32_MAX);
+        }
+
+        for (u32 i = 0; i < result->nodes.len; ++i) {
+            for (u32 t = 0; t < textures.len; ++t) {
+                if (first_use[t] != i) {
+                    continue;
+                }
+
+                RenderGraphQueue first_queue = nodes[result->nodes[first_use[t]].node]->queue;
+                RenderGraphQueue last_queue = nodes[result->nodes[last_use[t]].node]->queue;
+
+                u32 slot = UINT32_MAX;
+
+                for (u32 s = 0; s < result->slots.len; ++s) {
+                    bool same_desc = memcmp(&result->slots[s], &textures[t], sizeof(RenderGraphTextureDesc)) == 0;
+
+                    if (same_desc && slot_last_use[s] < first_use[t] && slot_queue[s] == first_queue) {
+                        slot = s;
+                        break;
+                    }
+                }
+
+                if (slot == UINT32_MAX) {
+                    slot = result->slots.len;
+                    result->slots.push(textures[t]);
+                    slot_last_use.push(0);
+                    slot_queue.push(first_queue);
+                }
+
+                slot_last_use[slot] = last_use[t];
+                slot_queue[slot] = last_queue;
+                result->texture_slots[t] = slot;
+            }
+        }
+
+        slot_last_use.free();
+        slot_queue.free();
+
+        // Barriers in front of every pass, following the state of each physical texture through the batch, so passes
+        // that hand a texture on, or alias it, get a barrier between them. A texture's first use in a compute batch is an
+        // entry barrier instead, leaving only transitions between compute states on the compute queue.
+        D3D12_RESOURCE_STATES* slot_state = scratch->push_array<D3D12_RESOURCE_STATES>(result->slots.len);
+        u32* slot_user = scratch->push_array<u32>(result->slots.len);
+
+        for (u32 b = 0; b < result->batches.len; ++b) {
+            RenderGraphBatch* batch = &result->batches[b];
+            bool is_compute = batch->queue == RENDER_GRAPH_QUEUE_COMPUTE;
+
+            for (u32 i = 0; i < result->slots.len; ++i) {
+                slot_user[i] = UINT32_MAX;
+            }
+
+            batch->first_entry_barrier = result->entry_barriers.len;
+
+            for (u32 i = batch->first_node; i < batch->first_node + batch->node_count; ++i) {
+                RenderGraphCompiledNode* compiled_node = &result->nodes[i];
+                compiled_node->first_barrier = result->barriers.len;
+
+                for_each_use(nodes[compiled_node->node], [&](u32 texture, D3D12_RESOURCE_STATES state) {
+                    u32 slot = result->texture_slots[texture];
+
+                    RenderGraphBarrier barrier = {};
+                    barrier.texture = texture;
+                    barrier.kind = RENDER_GRAPH_BARRIER_TRANSITION;
+                    barrier.state = state;
+
+                    if (slot_user[slot] == UINT32_MAX) {
+                        if (is_compute) {
+                            result->entry_barriers.push(barrier);
+                        }
+                        else {
+                            result->barriers.push(barrier);
+                        }
+                    }
+                    else if (slot_user[slot] != i) {
+                        if (state == D3D12_RESOURCE_STATE_UNORDERED_ACCESS && slot_state[slot] == D3D12_RESOURCE_STATE_UNORDERED_ACCESS) {
+                            barrier.kind = RENDER_GRAPH_BARRIER_UAV;
+                            result->barriers.push(barrier);
+                        }
+                        else if (state != slot_state[slot]) {
+                            result->barriers.push(barrier);
+                        }
+                    }
+
+                    slot_state[slot] = state;
+                    slot_user[slot] = i;
+                });
+
+                compiled_node->barrier_count = result->barriers.len - compiled_node->first_barrier;
+            }
+
+            batch->entry_barrier_count = result->entry_barriers.len - batch->first_entry_barrier;
+        }
+
+        return result;
+    }
+
+    RenderGraphCompiled* find_or_compile(Renderer* r) {
+        u64 h = hash();
+
+        for (u32 i = 0; i < r->compiled_graphs.len; ++i) {
+            if (r->compiled_graphs[i]->hash == h) {
+                r->compiled_graphs[i]->last_used_frame = r->frame_index;
+                return r->compiled_graphs[i];
+            }
+        }
+
+        if (r->compiled_graphs.len == RENDER_GRAPH_CACHE_SIZE) {
+            u32 oldest = 0;
+
+            for (u32 i = 1; i < r->compiled_graphs.len; ++i) {
+                if (r->compiled_graphs[i]->last_used_frame < r->compiled_graphs[oldest]->last_used_frame) {
+                    oldest = i;
+                }
+            }
+
+            r->compiled_graphs[oldest]->free();
+            r->compiled_graphs.remove_by_patch(oldest);
+        }
+
+        PROFILE_ZONE("render_graph_compile");
+        RenderGraphCompiled* result = compile();
+        result->hash = h;
+        result->last_used_frame = r->frame_index;
+
+        r->compiled_graphs.push(result);
+
+        return result;
+    }
+
+    void acquire_textures(Renderer* r) {
+        RDTexture* slot_textures = arena->push_array<RDTexture>(compiled->slots.len);
+
+        for (u32 s = 0; s < compiled->slots.len; ++s) {
+            RenderGraphPooledTexture* found = 0;
+
+            for (u32 i = 0; i < r->render_graph_textures.len; ++i) {
+                RenderGraphPooledTexture* pooled = &r->render_graph_textures[i];
+
+                if (pooled->last_used_frame != r->frame_index && memcmp(&pooled->desc, &compiled->slots[s], sizeof(RenderGraphTextureDesc)) == 0) {
+                    found = pooled;
+                    break;
+                }
+            }
+
+            if (!found) {
+                RenderGraphTextureDesc desc = compiled->slots[s];
+
+                RenderGraphPooledTexture pooled = {};
+                pooled.desc = desc;
+                pooled.texture = rd_create_texture(r, desc.width, desc.height, 1, desc.format, desc.usage);
+                found = &r->render_graph_textures.push(pooled);
+            }
+
+            found->last_used_frame = r->frame_index;
+            slot_textures[s] = found->texture;
+        }
+
+        physical_textures = arena->push_array<RDTexture>(textures.len);
+
+        for (u32 t = 0; t < textures.len; ++t) {
+            if (compiled->texture_slots[t] != UINT32_MAX) {
+                physical_textures[t] = slot_textures[compiled->texture_slots[t]];
+            }
+        }
+    }
+
+    // Records one command list per task into command_lists, then submits the batches in order.
+    // Barriers are resolved serially, every task is recorded in parallel.
+    // On return the direct queue is ordered after every pass, so the final texture can be used on it.
+    RDTexture execute(Renderer* r, Vec<CommandList>* command_lists) {
+        compiled = find_or_compile(r);
+        acquire_textures(r);
+
+        Vec<RenderGraphTask> tasks = {};
+        RenderGraphNodeRun* runs = arena->push_array<RenderGraphNodeRun>(compiled->nodes.len);
+        RenderGraphBatchRun* batch_runs = arena->push_array<RenderGraphBatchRun>(compiled->batches.len);
+
+        command_lists->clear();
+
+        for (u32 b = 0; b < compiled->batches.len; ++b) {
+            RenderGraphBatch* batch = &compiled->batches[b];
+            RenderGraphBatchRun* batch_run = &batch_runs[b];
+            bool is_compute = batch->queue == RENDER_GRAPH_QUEUE_COMPUTE;
+
+            if (is_compute) {
+                // Transitions out of graphics states are illegal on the compute queue, so the batch's entry states are
+                // recorded on the direct queue and handed over with a fence. Barriers between its passes stay on it.
+                CommandList prologue = r->open_frame_command_list(D3D12_COMMAND_LIST_TYPE_DIRECT);
+
+                for (u32 i = 0; i < batch->entry_barrier_count; ++i) {
+                    RenderGraphBarrier barrier = compiled->entry_barriers[batch->first_entry_barrier + i];
+                    r->texture_manager.at(physical_textures[barrier.texture])->transition(&prologue, barrier.state);
+                }
+
+                runs[batch->first_node].counters.barriers += prologue.counters.barriers;
+
+                batch_run->prologue_list = command_lists->len;
+                command_lists->push(prologue);
+            }
+
+            batch_run->first_list = command_lists->len;
+
+            for (u32 i = 0; i < batch->node_count; ++i) {
+                RenderGraphCompiledNode* compiled_node = &compiled->nodes[batch->first_node + i];
+                RenderGraphNode* node = nodes[compiled_node->node];
+
+                u32 work = node->work_count ? node->work_count(r) : 0;
+                u32 chunk_count = min(work / RENDER_GRAPH_MIN_CHUNK_WORK + 1, jobs_thread_count());
+                u32 chunk_size = work / chunk_count + 1;
+
+                RenderGraphNodeRun* run = &runs[batch->first_node + i];
+                run->stats_pass = r->stats.add_pass(node->name);
+                run->first_list = command_lists->len;
+                run->list_count = chunk_count;
+
+                for (u32 j = 0; j < chunk_count; ++j) {
+                    RenderGraphTask task = {};
+                    task.node = node;
+                    task.run = batch->first_node + i;
+                    task.list = command_lists->len;
+                    task.begin = min(j * chunk_size, work);
+                    task.end = min(task.begin + chunk_size, work);
+                    tasks.push(task);
+
+                    CommandList cmd = r->open_frame_command_list(is_compute ? D3D12_COMMAND_LIST_TYPE_COMPUTE : D3D12_COMMAND_LIST_TYPE_DIRECT);
+
+                    if (j == 0) {
+                        r->stats.begin_pass_timestamp(&cmd, run->stats_pass);
+                        node->prepare(r, &cmd, compiled, compiled_node);
+                    }
+
+                    command_lists->push(cmd);
+                }
+            }
+
+            batch_run->list_count = command_lists->len - batch_run->first_list;
+        }
+
+        CommandList* lists = command_lists->mem;
+
+        PROFILE_COUNTER("render_graph_command_lists", command_lists->len);
+
+        parallel_for(tasks.len, 1, [&](u32 begin, u32 end) {
+            for (u32 i = begin; i < end; ++i) {
+                u64 start = pf_ticks();
+                tasks[i].node->record(r, &lists[tasks[i].list], tasks[i].begin, tasks[i].end);
+                tasks[i].ticks = pf_ticks() - start;
+            }
+        });
+
+        for (u32 i = 0; i < tasks.len; ++i) {
+            runs[tasks[i].run].record_ticks += tasks[i].ticks;
+        }
+
+        tasks.free();
+
+        f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+        for (u32 n = 0; n < compiled->nodes.len; ++n) {
+            RenderGraphNodeRun* run = &runs[n];
+
+            r->stats.end_pass_timestamp(&lists[run->first_list + run->list_count - 1], run->stats_pass);
+
+            for (u32 i = 0; i < run->list_count; ++i) {
+                add_pass_counters(&run->counters, &lists[run->first_list + i].counters);
+            }
+
+            r->stats.set_pass_cpu(run->stats_pass, (f32)((f64)run->record_ticks * ms_per_tick), run->counters);
+        }
+
+        PROFILE_ZONE("render_graph_submit");
+
+        for (u32 b = 0; b < compiled->batches.len; ++b) {
+            RenderGraphBatch* batch = &compiled->batches[b];
+            RenderGraphBatchRun* batch_run = &batch_runs[b];
+
+            if (batch->queue == RENDER_GRAPH_QUEUE_COMPUTE) {
+                CommandList* prologue = &lists[batch_run->prologue_list];
+                bool prologue_has_barriers = prologue->counters.barriers > 0;
+                u64 prologue_fence = r->direct_queue.submit_command_list(*prologue);
+
+                if (prologue_has_barriers) {
+                    r->compute_queue.wait_for(&r->direct_queue, prologue_fence);
+                }
+                else if (batch->wait_batch != -1) {
+                    r->compute_queue.wait_for(&r->direct_queue, batch_runs[batch->wait_batch].fence);
+                }
+
+                batch_run->fence = r->compute_queue.submit_command_lists(batch_run->list_count, lists + batch_run->first_list);
+            }
+            else {
+                if (batch->wait_batch != -1) {
+                    r->direct_queue.wait_for(&r->compute_queue, batch_runs[batch->wait_batch].fence);
+                }
+
+                batch_run->fence = r->direct_queue.submit_command_lists(batch_run->list_count, lists + batch_run->first_list);
+            }
+        }
+
+        u32 last_batch = compiled->batches.len-1;
+
+        if (compiled->batches[last_batch].queue == RENDER_GRAPH_QUEUE_COMPUTE) {
+            r->direct_queue.wait_for(&r->compute_queue, batch_runs[last_batch].fence);
+        }
+
+        return physical_textures[final_node->writes[0].index];
+    }
+};
+
+bool rd_test_render_graph() {
+    Scratch scratch = get_scratch(0);
+
+    Renderer* r = scratch->push_type<Renderer>();
+    r->swapchain_w = 64;
+    r->swapchain_h = 64;
+
+    Pipeline* graphics = scratch->push_type<Pipeline>();
+    graphics->root_constants_size = 4;
+
+    Pipeline* compute = scratch->push_type<Pipeline>();
+    compute->is_compute = true;
+    compute->root_constants_size = 4;
+
+    // gbuffer on direct, then lighting, fog over its output and bloom on compute, then composite back on direct. The
+    // debug pass is culled.
+    RenderGraph graph;
+    graph.init(scratch.arena);
+
+    RenderGraphTexture albedo = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture depth = graph.create_texture(r, RD_FORMAT_R32_FLOAT, RD_TEXTURE_USAGE_DEPTH_BUFFER);
+    RenderGraphTexture lit = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture bloom = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture debug = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture composite = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+
+    graph.add_pass("gbuffer", graphics, 0)
+        ->render_target(albedo)
+        ->depth_buffer(depth);
+
+    graph.add_pass("lighting", compute, 0)
+        ->async_compute()
+        ->write(lit, 0)
+        ->read(albedo, 1)
+        ->read(depth, 2);
+
+    graph.add_pass("debug", compute, 0)
+        ->async_compute()
+        ->write(debug, 0)
+        ->read(depth, 1);
+
+    graph.add_pass("fog", compute, 0)
+        ->async_compute()
+        ->write(lit, 0)
+        ->read(depth, 1);
+
+    graph.add_pass("bloom", compute, 0)
+        ->async_compute()
+        ->write(bloom, 0)
+        ->read(lit, 1);
+
+    RenderGraphNode* final_pass = graph.add_pass("composite", graphics, 0)
+        ->read(lit, 0)
+        ->read(bloom, 1)
+        ->render_target(composite);
+
+    graph.set_final_pass(final_pass);
+
+    RenderGraphCompiled* compiled = graph.compile();
+    auto cleanup = [&]() { compiled->free(); };
+
+    TEST_CHECK(compiled->culled_count == 1 && compiled->nodes.len == 5, "unused pass not culled");
+    TEST_CHECK(compiled->nodes[0].node == 0 && compiled->nodes[1].node == 1 && compiled->nodes[2].node == 3 && compiled->nodes[3].node == 4 && compiled->nodes[4].node == 5, "passes out of order");
+
+    TEST_CHECK(compiled->batches.len == 3, "queues not split into three batches");
+    TEST_CHECK(compiled->batches[0].queue == RENDER_GRAPH_QUEUE_DIRECT && compiled->batches[0].first_node == 0 && compiled->batches[0].node_count == 1, "gbuffer batch wrong");
+    TEST_CHECK(compiled->batches[1].queue == RENDER_GRAPH_QUEUE_COMPUTE && compiled->batches[1].first_node == 1 && compiled->batches[1].node_count == 3, "compute passes not batched together");
+    TEST_CHECK(compiled->batches[2].queue == RENDER_GRAPH_QUEUE_DIRECT && compiled->batches[2].first_node == 4 && compiled->batches[2].node_count == 1, "composite batch wrong");
+
+    TEST_CHECK(compiled->batches[0].wait_batch == -1, "first batch waits");
+    TEST_CHECK(compiled->batches[1].wait_batch == 0, "compute batch doesn't wait on the gbuffer");
+    TEST_CHECK(compiled->batches[2].wait_batch == 1, "composite doesn't wait on the compute batch");
+
+    // bloom can take albedo's slot once lighting is done with it on the same queue.
+    TEST_CHECK(compiled->texture_slots[bloom.index] == compiled->texture_slots[albedo.index], "not aliased within a queue");
+    TEST_CHECK(compiled->texture_slots[debug.index] == UINT32_MAX, "culled texture given a slot");
+
+    struct ExpectedBarrier {
+        u32 node;
+        u32 texture;
+        RenderGraphBarrierKind kind;
+        D3D12_RESOURCE_STATES state;
+    };
+
+    // The compute batch's prologue on the direct queue only moves what lighting reads and writes into compute states.
+    ExpectedBarrier entry[] = {
+        { 1, albedo.index, RENDER_GRAPH_BARRIER_TRANSITION, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE },
+        { 1, depth.index, RENDER_GRAPH_BARRIER_TRANSITION, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE },
+        { 1, lit.index, RENDER_GRAPH_BARRIER_TRANSITION, D3D12_RESOURCE_STATE_UNORDERED_ACCESS },
+    };
+
+    RenderGraphBatch* compute_batch = &compiled->batches[1];
+    TEST_CHECK(compute_batch->entry_barrier_count == ARRAY_LEN(entry), "wrong number of entry barriers");
+
+    for (u32 i = 0; i < ARRAY_LEN(entry); ++i) {
+        RenderGraphBarrier barrier = compiled->entry_barriers[compute_batch->first_entry_barrier + i];
+        TEST_CHECK(entry[i].texture == barrier.texture && entry[i].kind == barrier.kind && entry[i].state == barrier.state, "wrong entry barrier");
+    }
+
+    // On the compute queue in front of each pass: a UAV barrier between lighting and fog writing lit, then bloom's read of
+    // lit after fog's write, and albedo's slot going from lighting's read to bloom's write.
+    ExpectedBarrier in_batch[] = {
+        { 2, lit.index, RENDER_GRAPH_BARRIER_UAV, D3D12_RESOURCE_STATE_UNORDERED_ACCESS },
+        { 3, lit.index, RENDER_GRAPH_BARRIER_TRANSITION, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE },
+        { 3, bloom.index, RENDER_GRAPH_BARRIER_TRANSITION, D3D12_RESOURCE_STATE_UNORDERED_ACCESS },
+    };
+
+    u32 in_batch_count = 0;
+
+    for (u32 i = compute_batch->first_node; i < compute_batch->first_node + compute_batch->node_count; ++i) {
+        RenderGraphCompiledNode* compiled_node = &compiled->nodes[i];
+
+        for (u32 j = 0; j < compiled_node->barrier_count; ++j) {
+            RenderGraphBarrier barrier = compiled->barriers[compiled_node->first_barrier + j];
+            TEST_CHECK(in_batch_count < ARRAY_LEN(in_batch), "extra barrier in the compute batch");
+
+            ExpectedBarrier expected = in_batch[in_batch_count++];
+            TEST_CHECK(expected.node == i && expected.texture == barrier.texture && expected.kind == barrier.kind && expected.state == barrier.state, "wrong barrier in the compute batch");
+        }
+    }
+
+    TEST_CHECK(in_batch_count == ARRAY_LEN(in_batch), "missing barrier in the compute batch");
+
+    compiled->free();
+
+    pf_debug_log("render graph test passed\n");
+
+    return true;
+}
+
+// Pooled textures that haven't been used for a while, and that the GPU is done with, are released.
+// This is what cleans up after a resize, without stalling on the queues.
+static void retire_render_graph_textures(Renderer* r) {
+    for (int i = r->render_graph_textures.len-1; i >= 0; --i) {
+        RenderGraphPooledTexture pooled = r->render_graph_textures[i];
+
+        if (r->frame_index - pooled.last_used_frame > RENDER_GRAPH_TEXTURE_RETIRE_FRAMES && r->direct_queue.reached(pooled.last_used_fence)) {
+            release_texture(r, pooled.texture);
+            r->render_graph_textures.remove_by_patch(i);
+        }
+    }
+}
+
+RenderGraphNode* RenderGraphNode::read(RenderGraphTexture texture, u32 offset) {
+    reads.push(texture);
+
+    RenderGraphBind bind = {};
+    bind.texture = texture.index;
+    bind.kind = RENDER_GRAPH_BIND_SRV;
+    assert(offset < pipeline->root_constants_size);
+    bind.offset = offset;
+
+    binds.push(bind);
+
+    return this;
+}
+
+void RenderGraphNode::mark_write(RenderGraphTexture& texture) {
+    texture.version++;
+    graph->texture_writers[texture.index].push(index);
+    assert(graph->texture_writers[texture.index].len == texture.version && "writing a stale texture version");
+    writes.push(texture);
+}
+
+RenderGraphNode* RenderGraphNode::write(RenderGraphTexture& texture, u32 offset) {
+    mark_write(texture);
+
+    RenderGraphBind bind = {};
+    bind.texture = texture.index;
+    bind.kind = RENDER_GRAPH_BIND_UAV;
+    assert(offset < pipeline->root_constants_size);
+    bind.offset = offset;
+
+    binds.push(bind);
+    write_by_uav_textures.push(texture.index);
+
+    return this;
+}
+
+RenderGraphNode* RenderGraphNode::render_target(RenderGraphTexture& texture) {
+    assert(!pipeline->is_compute);
+    mark_write(texture);
+    render_targets.push(texture.index);
+    return this;
+}
+
+RenderGraphNode* RenderGraphNode::depth_buffer(RenderGraphTexture& texture) {
+    assert(!pipeline->is_compute);
+    mark_write(texture);
     has_depth_buffer = true;
-    depth_buffer_texture = graph->textures[texture.index];
+    depth_buffer_texture = texture.index;
+    return this;
+}
+
+RenderGraphNode* RenderGraphNode::parallel(WorkCount count) {
+    work_count = count;
+    return this;
+}
+
+RenderGraphNode* RenderGraphNode::async_compute() {
+    assert(pipeline->is_compute);
+    queue = RENDER_GRAPH_QUEUE_COMPUTE;
     return this;
 }
 
-void RenderGraphNode::execute(Renderer* r, CommandList* cmd) {
-    pipeline->bind(cmd);
+void RenderGraphNode::prepare(Renderer* r, CommandList* cmd, RenderGraphCompiled* compiled, RenderGraphCompiledNode* compiled_node) {
+    for (u32 i = 0; i < compiled_node->barrier_count; ++i) {
+        RenderGraphBarrier barrier = compiled->barriers[compiled_node->first_barrier + i];
+        TextureData* texture_data = r->texture_manager.at(graph->physical_textures[barrier.texture]);
+
+        if (barrier.kind == RENDER_GRAPH_BARRIER_UAV) {
+            texture_data->uav_barrier(cmd);
+        }
+        else {
+            texture_data->transition(cmd, barrier.state);
+        }
+    }
+
+    for (u32 i = 0; i < render_targets.len; ++i) {
+        TextureData* texture_data = r->texture_manager.at(graph->physical_textures[render_targets[i]]);
+
+        f32 color[4] = {};
+        cmd->list->ClearRenderTargetView(r->rtv_heap.cpu_handle(texture_data->rtv), color, 0, 0);
+    }
+
+    if (has_depth_buffer) {
+        TextureData* texture_data = r->texture_manager.at(graph->physical_textures[depth_buffer_texture]);
+        cmd->list->ClearDepthStencilView(r->dsv_heap.cpu_handle(texture_data->dsv), D3D12_CLEAR_FLAG_DEPTH, 0.0f, 0, 0, 0);
+    }
+}
+
+// Safe to call from any thread: only reads renderer state and writes into cmd.
+void RenderGraphNode::record(Renderer* r, CommandList* cmd, u32 begin, u32 end) {
+    PROFILE_ZONE(name);
+
+    pipeline->bind(cmd);
+
+    if (!pipeline->is_compute) {
+        StaticVec<D3D12_CPU_DESCRIPTOR_HANDLE, 16> rtvs = {};
+        D3D12_CPU_DESCRIPTOR_HANDLE dsv = {};
+
+        for (u32 i = 0; i < render_targets.len; ++i) {
+            rtvs.push(r->rtv_heap.cpu_handle(r->texture_manager.at(graph->physical_textures[render_targets[i]])->rtv));
+        }
+
+        if (has_depth_buffer) {
+            dsv = r->dsv_heap.cpu_handle(r->texture_manager.at(graph->physical_textures[depth_buffer_texture])->dsv);
+        }
+
+        cmd->list->OMSetRenderTargets(rtvs.len, rtvs.mem, 0, has_depth_buffer ? &dsv : 0);
+
+        D3D12_VIEWPORT viewport = {};
+        viewport.Width = (f32)r->swapchain_w;
+        viewport.Height = (f32)r->swapchain_h;
+        viewport.MaxDepth = 1.0f;
+
+        cmd->list->RSSetViewports(1, &viewport);
+
+        D3D12_RECT scissor = {};
+        scissor.right = r->swapchain_w;
+        scissor.bottom = r->swapchain_h;
+
+        cmd->list->RSSetScissorRects(1, &scissor);
+    }
+
+    u32 root_constants[ROOT_CONSTANT_COUNT] = {};
+
+    for (u32 i = 0; i < binds.len; ++i) {
+        RenderGraphBind bind = binds[i];
+        TextureData* texture_data = r->texture_manager.at(graph->physical_textures[bind.texture]);
+        Descriptor descriptor = bind.kind == RENDER_GRAPH_BIND_UAV ? texture_data->uav : texture_data->view;
+        root_constants[bind.offset] = descriptor.index;
+    }
+
+    procedure(r, cmd, pipeline, root_constants, begin, end);
+}
+
+Renderer* rd_init(Arena* arena, void* window) {
+    Scratch scratch = get_scratch(arena);
+    Renderer* r = arena->push_type<Renderer>();
+
+    r->arena = arena->sub_arena(RENDERER_ARENA_SIZE);
+    r->frame_arena = r->arena.sub_arena(RENDERER_FRAME_ARENA_SIZE);
+
+    r->window = (HWND)window;
+
+    #if _DEBUG
+    {
+        ID3D12Debug* debug = 0;
+        if (SUCCEEDED(D3D12GetDebugInterface(IID_PPV_ARGS(&debug)))) {
+            debug->EnableDebugLayer();
+            debug->Release();
+        }
+    }
+    #endif
+
+    if (FAILED(CreateDXGIFactory(IID_PPV_ARGS(&r->factory)))) {
+        pf_msg_box("Failed to create DXGI device");
+        return 0;
+    }
+
+    if (FAILED(r->factory->EnumAdapters(0, &r->adapter))) {
+        pf_msg_box("Failed to find DXGI adapter");
+        return 0;
+    }
+
+    if (FAILED(D3D12CreateDevice(r->adapter, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&r->device)))) {
+        pf_msg_box("Failed to create D3D12 device");
+        return 0;
+    }
+
+    #if _DEBUG
+    {
+        ID3D12InfoQueue* info_queue = 0;
+        if (SUCCEEDED(r->device->QueryInterface(&info_queue)))
+        {
+            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_CORRUPTION, TRUE);
+            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_ERROR, TRUE);
+            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_WARNING, TRUE);
+
+            D3D12_MESSAGE_SEVERITY severity_filter = D3D12_MESSAGE_SEVERITY_INFO;
+
+            D3D12_MESSAGE_ID message_filter[] = {
+                D3D12_MESSAGE_ID_CLEARRENDERTARGETVIEW_MISMATCHINGCLEARVALUE,
+                D3D12_MESSAGE_ID_CLEARDEPTHSTENCILVIEW_MISMATCHINGCLEARVALUE,
+                D3D12_MESSAGE_ID_MAP_INVALID_NULLRANGE,
+                D3D12_MESSAGE_ID_UNMAP_INVALID_NULLRANGE,
+                D3D12_MESSAGE_ID_CREATEGRAPHICSPIPELINESTATE_DEPTHSTENCILVIEW_NOT_SET
+            };
+
+            D3D12_INFO_QUEUE_FILTER filter = {};
+            filter.DenyList.NumSeverities = 1;
+            filter.DenyList.pSeverityList = &severity_filter;
+            filter.DenyList.NumIDs = ARRAY_LEN(message_filter);
+            filter.DenyList.pIDList = message_filter;
+
+            info_queue->PushStorageFilter(&filter);
+            info_queue->Release();
+        }
+    }
+    #endif
+
+    r->direct_queue.init(r->device, D3D12_COMMAND_LIST_TYPE_DIRECT, DIRECT_STAGING_RING_SIZE);
+    r->compute_queue.init(r->device, D3D12_COMMAND_LIST_TYPE_COMPUTE, COMPUTE_STAGING_RING_SIZE);
+    r->copy_queue.init(r->device, D3D12_COMMAND_LIST_TYPE_COPY, COPY_STAGING_RING_SIZE);
+
+    r->timestamp_queries.init(r->device, &r->direct_queue, &r->compute_queue);
+    r->stats.backend = r->timestamp_queries.backend();
+
+    r->rtv_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_RTV, MAX_RTV_COUNT, false);
+    r->bindless_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, MAX_CBV_SRV_UAV_COUNT, true);
+    r->dsv_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_DSV, MAX_DSV_COUNT, false);
+
+    r->mesh_manager.init(&r->arena);
+    r->texture_manager.init(&r->arena);
+
+    r->upload_context_allocator.init(&r->arena); 
+
+    r->uploads.bytes_per_frame = UPLOAD_BYTES_PER_FRAME;
+    r->uploads.staging_budget = UPLOAD_STAGING_BYTES;
+
+    RDUploadContext* upload_context = rd_open_upload_context(r);
+
+    auto [window_w, window_h] = hwnd_size((HWND)window);
+    
+    r->swapchain_format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    r->swapchain_buffer_count = 2;
+    r->swapchain_w = window_w;
+    r->swapchain_h = window_h;
+
+    DXGI_SWAP_CHAIN_DESC1 swapchain_desc = {};
+    swapchain_desc.Width = window_w;
+    swapchain_desc.Height = window_h;
+    swapchain_desc.Format = r->swapchain_format;
+    swapchain_desc.SampleDesc.Count = 1;
+    swapchain_desc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    swapchain_desc.BufferCount = r->swapchain_buffer_count;
+    swapchain_desc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+
+    IDXGISwapChain1* swapchain = 0;
+    r->factory->CreateSwapChainForHwnd(r->direct_queue.queue, (HWND)window, &swapchain_desc, 0, 0, &swapchain);
+    swapchain->QueryInterface(&r->swapchain);
+    swapchain->Release();
+
+    r->get_swapchain_buffers();
+
+    D3D12_ROOT_SIGNATURE_DESC root_signature_desc = {};
+
+    D3D12_ROOT_PARAMETER root_param = {};
+    root_param.ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
+    root_param.Constants.Num32BitValues = ROOT_CONSTANT_COUNT;
+
+    root_signature_desc.NumParameters = 1;
+    root_signature_desc.pParameters = &root_param;
+
+    D3D12_STATIC_SAMPLER_DESC static_samplers[1] = {};
+    static_samplers[0].Filter = D3D12_FILTER_MIN_MAG_MIP_LINEAR;
+    static_samplers[0].AddressU = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
+    static_samplers[0].AddressV = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
+    static_samplers[0].AddressW = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
+    static_samplers[0].MaxLOD = D3D12_FLOAT32_MAX;
+    static_samplers[0].ShaderRegister = 0;
+    static_samplers[0].RegisterSpace = 0;
+
+    root_signature_desc.NumStaticSamplers = ARRAY_LEN(static_samplers);
+    root_signature_desc.pStaticSamplers = static_samplers;
+
+    root_signature_desc.Flags |= D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED;
+
+    ID3DBlob* root_signature_code;
+    D3D12SerializeRootSignature(&root_signature_desc, D3D_ROOT_SIGNATURE_VERSION_1, &root_signature_code, 0);
+    r->device->CreateRootSignature(0, root_signature_code->GetBufferPointer(), root_signature_code->GetBufferSize(), IID_PPV_ARGS(&r->root_signature));
+    root_signature_code->Release();
+
+    describe_pipelines(&r->gbuffer_pipelines, &r->lighting_pipelines);
+
+    PipelineVariants* pipelines[] = {
+        &r->gbuffer_pipelines,
+        &r->lighting_pipelines,
+    };
+
+    PipelineRequest requests[ARRAY_LEN(pipelines) * PIPELINE_MAX_VARIANTS];
+    u32 num_requests = read_pipeline_manifest(PIPELINE_MANIFEST_PATH, ARRAY_LEN(pipelines), pipelines, ARRAY_LEN(requests), requests);
+
+    ddc_init(&r->shader_cache, DDC_DIRECTORY);
+
+    create_pipelines(r->device, r->root_signature, &r->shader_cache, num_requests, requests);
+    ddc_report(&r->shader_cache);
+
+    r->point_light_buffer = create_buffer(r->device, MAX_POINT_LIGHT_COUNT * sizeof(RDPointLight), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+    r->directional_light_buffer = create_buffer(r->device, MAX_DIRECTIONAL_LIGHT_COUNT * sizeof(RDDirectionalLight), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+    r->cluster_range_buffer = create_buffer(r->device, CLUSTER_COUNT * sizeof(ClusterRange), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+    r->cluster_light_index_buffer = create_buffer(r->device, MAX_CLUSTER_LIGHT_INDEX_COUNT * sizeof(u32), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+    
+    D3D12_SHADER_RESOURCE_VIEW_DESC structured_buffer_view_desc = {};
+    structured_buffer_view_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+    structured_buffer_view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+    structured_buffer_view_desc.Buffer.NumElements = MAX_POINT_LIGHT_COUNT;
+    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(RDPointLight);
+    r->point_light_buffer_view = r->bindless_heap.create_srv(r->device, r->point_light_buffer, &structured_buffer_view_desc);
+
+    structured_buffer_view_desc.Buffer.NumElements = MAX_DIRECTIONAL_LIGHT_COUNT;
+    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(RDDirectionalLight);
+    r->directional_light_buffer_view = r->bindless_heap.create_srv(r->device, r->directional_light_buffer, &structured_buffer_view_desc);
+
+    structured_buffer_view_desc.Buffer.NumElements = CLUSTER_COUNT;
+    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(ClusterRange);
+    r->cluster_range_buffer_view = r->bindless_heap.create_srv(r->device, r->cluster_range_buffer, &structured_buffer_view_desc);
+
+    structured_buffer_view_desc.Buffer.NumElements = MAX_CLUSTER_LIGHT_INDEX_COUNT;
+    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(u32);
+    r->cluster_light_index_buffer_view = r->bindless_heap.create_srv(r->device, r->cluster_light_index_buffer, &structured_buffer_view_desc);
+
+    r->white_texture = rd_create_texture(r, 1, 1, 1, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RESOURCE);
+    RDUploadRegion white_texture_region = rd_reserve_texture_upload(r, upload_context, r->white_texture, 0);
+    memset(white_texture_region.ptr, 0xff, white_texture_region.row_size);
+
+    RDUploadStatus* upload_status = rd_submit_upload_context(r, upload_context);
+    rd_flush_upload(r, upload_status); 
+
+    return r;
+}
+
+void rd_free(Renderer* r) {
+    r->direct_queue.flush();
+    r->compute_queue.flush();
+    r->copy_queue.flush();
+
+    r->direct_queue.poll_command_lists(&r->available_command_lists, &r->available_constant_buffers);
+    r->compute_queue.poll_command_lists(&r->available_command_lists, &r->available_constant_buffers);
+    r->copy_queue.poll_command_lists(&r->available_command_lists, &r->available_constant_buffers);
+
+    for (u32 i = 0; i < r->available_command_lists.len; ++i) {
+        r->available_command_lists[i].list->Release();
+        r->available_command_lists[i].allocator->Release();
+        r->available_command_lists[i].constant_buffers.free();
+        r->available_command_lists[i].constant_buffer_stash.free();
+        r->available_command_lists[i].dedicated_uploads.free();
+    }
+
+    for (u32 i = 0; i < r->permanent_resources.len; ++i) {
+        r->permanent_resources[i]->Release();
+    }
+
+    for (u32 i = 0; i < r->compiled_graphs.len; ++i) {
+        r->compiled_graphs[i]->free();
+    }
+
+    for (u32 i = 0; i < r->render_graph_textures.len; ++i) {
+        release_texture(r, r->render_graph_textures[i].texture);
+    }
+
+    r->render_graph_textures.free();
+    r->instance_lods.free();
+
+    rd_free_texture(r, r->white_texture);
+
+    for (u32 i = 0; i < r->retired_texture_resources.len; ++i) {
+        r->bindless_heap.free_descriptor(r->retired_texture_resources[i].view);
+        r->retired_texture_resources[i].resource->Release();
+    }
+
+    for (u32 i = 0; i < r->uploads.in_flight.len; ++i) {
+        if (r->uploads.in_flight[i].resource) {
+            r->uploads.in_flight[i].resource->Release();
+        }
+    }
+
+    r->uploads.free();
+    r->retired_texture_resources.free();
+    r->streamed_textures.free();
+    r->texture_streamer.free();
+
+    r->cluster_light_index_buffer->Release();
+    r->cluster_range_buffer->Release();
+    r->directional_light_buffer->Release();
+    r->point_light_buffer->Release();
+
+    r->lighting_pipelines.free();
+    r->gbuffer_pipelines.free();
+
+    r->root_signature->Release();
+
+    r->timestamp_queries.free();
+
+    r->dsv_heap.free();
+    r->bindless_heap.free();
+    r->rtv_heap.free();
+
+    r->release_swapchain_buffers();
+    r->swapchain->Release();
+
+    r->copy_queue.free();
+    r->compute_queue.free();
+    r->direct_queue.free();
+
+    r->device->Release();
+    r->adapter->Release();
+    r->factory->Release();
+
+    r->available_command_lists.free();
+    r->available_constant_buffers.free();
+    r->frame_command_lists.free();
+}
+
+RDUploadContext* rd_open_upload_context(Renderer* r) {
+    RDUploadContext* upload_context = r->upload_context_allocator.alloc();
+    upload_context->command_list = r->open_command_list(D3D12_COMMAND_LIST_TYPE_COPY);
+    return upload_context;
+}
+
+RDUploadStatus* rd_submit_upload_context(Renderer* r, RDUploadContext* upload_context) {
+    r->copy_queue.submit_command_list(upload_context->command_list);
+    u64 fence_val = r->copy_queue.signal();
+    r->upload_context_allocator.free(upload_context);
+    return (RDUploadStatus*)fence_val;
+}
+
+bool rd_upload_status_finished(Renderer* r, RDUploadStatus* upload_status) {
+    return r->copy_queue.reached((u64)upload_status);
+}
+
+void rd_flush_upload(Renderer* r, RDUploadStatus* upload_status) {
+    return r->copy_queue.wait((u64)upload_status);
+}
+
+// The sphere is centred on the box, with the radius taken from the furthest vertex rather than the box corner.
+static RDMeshBounds compute_mesh_bounds(XMFLOAT3* positions, u32 vertex_count) {
+    XMVECTOR aabb_min = XMVectorReplicate(FLT_MAX);
+    XMVECTOR aabb_max = XMVectorReplicate(-FLT_MAX);
+
+    for (u32 i = 0; i < vertex_count; ++i) {
+        XMVECTOR pos = XMLoadFloat3(&positions[i]);
+        aabb_min = XMVectorMin(aabb_min, pos);
+        aabb_max = XMVectorMax(aabb_max, pos);
+    }
+
+    if (vertex_count == 0) {
+        aabb_min = aabb_max = XMVectorZero();
+    }
+
+    XMVECTOR center = (aabb_min + aabb_max) * 0.5f;
+    XMVECTOR radius_sq = XMVectorZero();
+
+    for (u32 i = 0; i < vertex_count; ++i) {
+        radius_sq = XMVectorMax(radius_sq, XMVector3LengthSq(XMLoadFloat3(&positions[i]) - center));
+    }
+
+    RDMeshBounds bounds;
+    XMStoreFloat3(&bounds.aabb_min, aabb_min);
+    XMStoreFloat3(&bounds.aabb_max, aabb_max);
+    XMStoreFloat3(&bounds.sphere_center, center);
+    bounds.sphere_radius = sqrtf(XMVectorGetX(radius_sq));
+
+    return bounds;
+}
+
+// The square root of uv area over surface area, so a texture n texels across puts about n * uv_density texels along a
+// unit of the surface.
+static f32 compute_uv_density(RDPackedVertex* vertices, XMFLOAT3* positions, u32* indices, u32 index_count) {
+    f64 surface_area = 0.0;
+    f64 uv_area = 0.0;
+
+    for (u32 i = 0; i + 2 < index_count; i += 3) {
+        XMVECTOR p0 = XMLoadFloat3(&positions[indices[i]]);
+        XMVECTOR p1 = XMLoadFloat3(&positions[indices[i+1]]);
+        XMVECTOR p2 = XMLoadFloat3(&positions[indices[i+2]]);
+
+        XMFLOAT2 t0 = unpack_uv(&vertices[indices[i]]);
+        XMFLOAT2 t1 = unpack_uv(&vertices[indices[i+1]]);
+        XMFLOAT2 t2 = unpack_uv(&vertices[indices[i+2]]);
+
+        // Both doubled, which cancels out.
+        surface_area += XMVectorGetX(XMVector3Length(XMVector3Cross(p1 - p0, p2 - p0)));
+        uv_area += fabsf((t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y));
+    }
+
+    if (surface_area <= 0.0) {
+        return 0.0f;
+    }
+
+    return (f32)sqrt(uv_area / surface_area);
+}
+
+// Half the index memory and bandwidth whenever every index fits.
+static u32 mesh_index_size(u32 vertex_count) {
+    return vertex_count <= 65536 ? sizeof(u16) : sizeof(u32);
+}
+
+// Fills the buffers of a mesh made by create_mesh. Indices are narrowed on their way into upload memory.
+static void record_mesh_upload(Renderer* r, CommandList* cmd, MeshData* data, RDPackedVertex* vertex_data, u32 vertex_count, u32* index_data, u32 index_count) {
+    u32 vertex_data_size = vertex_count * sizeof(vertex_data[0]);
+    cmd->buffer_upload(r, data->vbuffer, vertex_data_size, vertex_data);
+
+    u32 index_size = mesh_index_size(vertex_count);
+    u32 index_data_size = index_count * index_size;
+
+    UploadRegion region = cmd->alloc_upload_region(r, index_data_size, index_size);
+
+    if (index_size == sizeof(u16)) {
+        u16* shorts = (u16*)region.ptr;
+        for (u32 i = 0; i < index_count; ++i) {
+            shorts[i] = (u16)index_data[i];
+        }
+    }
+    else {
+        memcpy(region.ptr, index_data, index_data_size);
+    }
+
+    cmd->list->CopyBufferRegion(data->ibuffer, 0, region.resource, region.offset, index_data_size);
+}
+
+// Everything but filling the buffers, which the callers record or queue.
+static RDMesh create_mesh(Renderer* r, RDPackedVertex* vertex_data, u32 vertex_count, RDMeshQuantization* quantization, u32* index_data, u32 index_count, u32 lod_count, RDMeshLod* lods) {
+    assert(lod_count >= 1 && lod_count <= RD_MAX_MESH_LODS);
+
+    Scratch scratch = get_scratch(0);
+
+    RDMesh handle = r->mesh_manager.alloc();
+    MeshData* data = r->mesh_manager.at(handle);
+
+    u32 index_size = mesh_index_size(vertex_count);
+
+    u32 vertex_data_size = vertex_count * sizeof(vertex_data[0]);
+    u32 index_data_size = index_count * index_size;
+
+    data->vbuffer = create_buffer(r->device, vertex_data_size, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON); 
+    data->ibuffer = create_buffer(r->device, index_data_size, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+
+    D3D12_SHADER_RESOURCE_VIEW_DESC vbuffer_view_desc = {};
+    vbuffer_view_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+    vbuffer_view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    vbuffer_view_desc.Buffer.NumElements = vertex_count;
+    vbuffer_view_desc.Buffer.StructureByteStride = sizeof(RDPackedVertex);
+
+    data->vbuffer_view = r->bindless_heap.create_srv(r->device, data->vbuffer, &vbuffer_view_desc);
+
+    data->ibuffer_view.BufferLocation = data->ibuffer->GetGPUVirtualAddress();
+    data->ibuffer_view.SizeInBytes = index_data_size;
+    data->ibuffer_view.Format = index_size == sizeof(u16) ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+
+    // Everything on the CPU side works on the dequantized positions, so bounds and occluders match what the GPU draws.
+    XMFLOAT3* positions = scratch->push_array<XMFLOAT3>(vertex_count);
+    for (u32 i = 0; i < vertex_count; ++i) {
+        positions[i] = unpack_position(&vertex_data[i], quantization);
+    }
+
+    data->index_count = index_count;
+    data->quantization = *quantization;
+    data->bounds = compute_mesh_bounds(positions, vertex_count);
+    data->uv_density = compute_uv_density(vertex_data, positions, index_data + lods[0].index_offset, lods[0].index_count);
+
+    // The most detailed level that is small enough and close enough to the real surface.
+    for (u32 l = 0; l < lod_count; ++l) {
+        RDMeshLod* lod = &lods[l];
+
+        if (lod->error > data->bounds.sphere_radius * OCCLUDER_MAX_LOD_ERROR) {
+            break;
+        }
+
+        if (lod->index_count / 3 <= OCCLUDER_MAX_TRIANGLES) {
+            data->occluder_vertex_count = vertex_count;
+            data->occluder_index_count = lod->index_count;
+            data->occluder_positions = (XMFLOAT3*)malloc(vertex_count * sizeof(XMFLOAT3));
+            data->occluder_indices = (u32*)malloc(lod->index_count * sizeof(u32));
+
+            memcpy(data->occluder_positions, positions, vertex_count * sizeof(XMFLOAT3));
+
+            memcpy(data->occluder_indices, index_data + lod->index_offset, lod->index_count * sizeof(u32));
+            break;
+        }
+    }
+
+    Meshlet* meshlets = scratch->push_array<Meshlet>(index_count / 3);
+    u32 meshlet_count = 0;
+
+    data->lod_count = lod_count;
+
+    for (u32 l = 0; l < lod_count; ++l) {
+        RDMeshLod* lod = &lods[l];
+        Meshlet* lod_meshlets = meshlets + meshlet_count;
+
+        u32 lod_meshlet_count = build_meshlets(positions, vertex_count, index_data + lod->index_offset, lod->index_count, lod_meshlets);
+
+        for (u32 i = 0; i < lod_meshlet_count; ++i) {
+            lod_meshlets[i].index_offset += lod->index_offset;
+        }
+
+        data->lods[l].index_offset = lod->index_offset;
+        data->lods[l].index_count = lod->index_count;
+        data->lods[l].error = lod->error;
+        data->lods[l].meshlet_offset = meshlet_count;
+        data->lods[l].meshlet_count = lod_meshlet_count;
+
+        meshlet_count += lod_meshlet_count;
+    }
+
+    data->meshlets = (Meshlet*)malloc(meshlet_count * sizeof(Meshlet));
+    memcpy(data->meshlets, meshlets, meshlet_count * sizeof(Meshlet));
+
+    return handle;
+}
+
+RDMesh rd_create_mesh(Renderer* r, RDUploadContext* upload_context, RDPackedVertex* vertex_data, u32 vertex_count, RDMeshQuantization* quantization, u32* index_data, u32 index_count, u32 lod_count, RDMeshLod* lods) {
+    RDMesh handle = create_mesh(r, vertex_data, vertex_count, quantization, index_data, index_count, lod_count, lods);
+    record_mesh_upload(r, &upload_context->command_list, r->mesh_manager.at(handle), vertex_data, vertex_count, index_data, index_count);
+    return handle;
+}
+
+RDMesh rd_create_mesh_async(Renderer* r, RDPackedVertex* vertex_data, u32 vertex_count, RDMeshQuantization* quantization, u32* index_data, u32 index_count, u32 lod_count, RDMeshLod* lods, u32 priority, RDUploadCallback callback, void* user_data) {
+    RDMesh handle = create_mesh(r, vertex_data, vertex_count, quantization, index_data, index_count, lod_count, lods);
+
+    UploadRequest request = {};
+    request.kind = UPLOAD_REQUEST_MESH;
+    request.priority = priority;
+    request.size = (u64)vertex_count * sizeof(RDPackedVertex) + (u64)index_count * mesh_index_size(vertex_count);
+    request.mesh = handle;
+    request.data = vertex_data;
+    request.indices = index_data;
+    request.vertex_count = vertex_count;
+    request.index_count = index_count;
+    request.callback = callback;
+    request.user_data = user_data;
+
+    r->uploads.enqueue(request);
+
+    return handle;
+}
+
+RDMeshBounds rd_get_mesh_bounds(Renderer* r, RDMesh mesh) {
+    return r->mesh_manager.at(mesh)->bounds;
+}
+
+void rd_free_mesh(Renderer* r, RDMesh mesh) {
+    r->copy_queue.flush();
+    r->compute_queue.flush();
+    r->direct_queue.flush();
+
+    cancel_uploads(r, mesh.data);
+
+    MeshData* data = r->mesh_manager.at(mesh);
+
+    r->bindless_heap.free_descriptor(data->vbuffer_view);
+    data->vbuffer->Release();
+    data->ibuffer->Release();
+
+    ::free(data->occluder_positions);
+    ::free(data->occluder_indices);
+    ::free(data->meshlets);
+
+    r->mesh_manager.free(mesh);
+}
+
+static DXGI_FORMAT rd_format_to_dxgi_format(RDFormat format) {
+    switch (format) {
+        case RD_FORMAT_RGBA8_UNORM:
+            return DXGI_FORMAT_R8G8B8A8_UNORM;
+        case RD_FORMAT_R32_FLOAT:
+            return DXGI_FORMAT_R32_FLOAT;
+        case RD_FORMAT_BC1_UNORM:
+            return DXGI_FORMAT_BC1_UNORM;
+        case RD_FORMAT_BC3_UNORM:
+            return DXGI_FORMAT_BC3_UNORM;
+        case RD_FORMAT_BC5_UNORM:
+            return DXGI_FORMAT_BC5_UNORM;
+        case RD_FORMAT_BC7_UNORM:
+            return DXGI_FORMAT_BC7_UNORM;
+    }
+    
+    assert(false);
+    return DXGI_FORMAT_UNKNOWN;
+}
+
+static DXGI_FORMAT format_to_depth_format(DXGI_FORMAT format) {
+    switch (format) {
+        case DXGI_FORMAT_R32_FLOAT:
+            return DXGI_FORMAT_D32_FLOAT;
+    }
+
+    assert(false);
+    return DXGI_FORMAT_UNKNOWN;
+}
+
+RDTexture rd_create_texture(Renderer* r, u32 width, u32 height, u32 mip_levels, RDFormat format, RDTextureUsage usage) {
+    RDTexture handle = r->texture_manager.alloc();
+    TextureData* data = r->texture_manager.at(handle);
+
+    data->width = width;
+    data->height = height;
+    data->mip_levels = mip_levels;
+    data->format = rd_format_to_dxgi_format(format);
+    data->streaming = STREAMING_NONE;
+    data->streaming_ready = false;
+
+    D3D12_RESOURCE_DESC resource_desc = {};
+    resource_desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+    resource_desc.Width = width;
+    resource_desc.Height = height;
+    resource_desc.DepthOrArraySize = 1;
+    resource_desc.MipLevels = (u16)mip_levels;
+    resource_desc.Format = data->format;
+    resource_desc.SampleDesc.Count = 1;
+
+    D3D12_RESOURCE_STATES initial_state = {};
+
+    switch (usage) {
+        default:
+            assert(false);
+
+        case RD_TEXTURE_USAGE_RESOURCE:
+            initial_state = D3D12_RESOURCE_STATE_COMMON;
+            break;
+
+        case RD_TEXTURE_USAGE_RENDER_TARGET:
+            initial_state = D3D12_RESOURCE_STATE_RENDER_TARGET;
+            resource_desc.Flags |= D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET | D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+            break;
+
+        case RD_TEXTURE_USAGE_DEPTH_BUFFER:
+            initial_state = D3D12_RESOURCE_STATE_DEPTH_WRITE;
+            resource_desc.Flags |= D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL;
+            break;
+    }
+
+    D3D12_HEAP_PROPERTIES texture_heap_props = {};
+    texture_heap_props.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+    r->device->CreateCommittedResource(&texture_heap_props, D3D12_HEAP_FLAG_NONE, &resource_desc, initial_state, 0, IID_PPV_ARGS(&data->resource));
+    data->state = initial_state;
+
+    D3D12_SHADER_RESOURCE_VIEW_DESC view_desc = {};
+    view_desc.Format = resource_desc.Format;
+    view_desc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+    view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    view_desc.Texture2D.MipLevels = mip_levels;
+
+    data->view = r->bindless_heap.create_srv(r->device, data->resource, &view_desc);
+
+    if (usage == RD_TEXTURE_USAGE_RENDER_TARGET) {
+        D3D12_RENDER_TARGET_VIEW_DESC rtv_desc = {};
+        rtv_desc.Format = resource_desc.Format;
+        rtv_desc.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D;
+        data->rtv = r->rtv_heap.create_rtv(r->device, data->resource, &rtv_desc);
+
+        D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
+        uav_desc.Format = resource_desc.Format;
+        uav_desc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+        data->uav = r->bindless_heap.create_uav(r->device, data->resource, &uav_desc);
+    }
+
+    if (usage == RD_TEXTURE_USAGE_DEPTH_BUFFER) {
+        D3D12_DEPTH_STENCIL_VIEW_DESC dsv_desc = {};
+        dsv_desc.Format = format_to_depth_format(resource_desc.Format);
+        dsv_desc.ViewDimension = D3D12_DSV_DIMENSION_TEXTURE2D;
+        data->dsv = r->dsv_heap.create_dsv(r->device, data->resource, &dsv_desc);
+    }
+
+    return handle;
+}
+
+// Takes staging memory for a level of resource and records its copy, leaving the memory to be filled before cmd
+// executes. Rows are padded to D3D12_TEXTURE_DATA_PITCH_ALIGNMENT and the level starts on
+// D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT.
+static RDUploadRegion reserve_texture_upload(Renderer* r, CommandList* cmd, ID3D12Resource* resource, u32 level) {
+    D3D12_RESOURCE_DESC resource_desc = resource->GetDesc();
+
+    D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint;
+    u32 row_count;
+    u64 row_size;
+    u64 upload_size;
+
+    r->device->GetCopyableFootprints(&resource_desc, level, 1, 0, &footprint, &row_count, &row_size, &upload_size);
+
+    UploadRegion region = cmd->alloc_upload_region(r, (u32)upload_size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+
+    D3D12_TEXTURE_COPY_LOCATION texture_copy_src = {};
+    texture_copy_src.pResource = region.resource;
+    texture_copy_src.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+    texture_copy_src.PlacedFootprint = footprint;
+    texture_copy_src.PlacedFootprint.Offset += region.offset;
+
+    D3D12_TEXTURE_COPY_LOCATION texture_copy_dst = {};
+    texture_copy_dst.pResource = resource;
+    texture_copy_dst.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+    texture_copy_dst.SubresourceIndex = level;
+
+    cmd->list->CopyTextureRegion(&texture_copy_dst, 0, 0, 0, &texture_copy_src, 0);
+
+    RDUploadRegion result = {};
+    result.ptr = (u8*)region.ptr + footprint.Offset;
+    result.row_pitch = footprint.Footprint.RowPitch;
+    result.row_size = (u32)row_size;
+    result.row_count = row_count;
+
+    return result;
+}
+
+// Uploads level_count levels of resource from first_level on, from data, which holds them tightly packed.
+static void record_texture_upload(Renderer* r, CommandList* cmd, ID3D12Resource* resource, u32 first_level, u32 level_count, void* data) {
+    u8* src = (u8*)data;
+
+    for (u32 i = 0; i < level_count; ++i) {
+        RDUploadRegion region = reserve_texture_upload(r, cmd, resource, first_level + i);
+
+        for (u32 y = 0; y < region.row_count; ++y) {
+            memcpy(region.ptr + (u64)y * region.row_pitch, src, region.row_size);
+            src += region.row_size;
+        }
+    }
+}
+
+void rd_upload_texture_data(Renderer* r, RDUploadContext* upload_context, RDTexture texture, void* data) {
+    TextureData* texture_data = r->texture_manager.at(texture);
+    record_texture_upload(r, &upload_context->command_list, texture_data->resource, 0, texture_data->mip_levels, data);
+}
+
+RDUploadRegion rd_reserve_texture_upload(Renderer* r, RDUploadContext* upload_context, RDTexture texture, u32 level) {
+    TextureData* texture_data = r->texture_manager.at(texture);
+    assert(level < texture_data->mip_levels);
+    return reserve_texture_upload(r, &upload_context->command_list, texture_data->resource, level);
+}
+
+// Upload memory taken by level_count levels of a resource like desc from first_level on.
+static u64 texture_upload_size(Renderer* r, D3D12_RESOURCE_DESC* desc, u32 first_level, u32 level_count) {
+    u64 size = 0;
+    r->device->GetCopyableFootprints(desc, first_level, level_count, 0, 0, 0, 0, &size);
+    return size;
+}
+
+// Tightly packed, as the source of every texture upload.
+static u64 texture_level_size(Renderer* r, D3D12_RESOURCE_DESC* desc, u32 level) {
+    u32 row_count;
+    u64 row_size;
+    r->device->GetCopyableFootprints(desc, level, 1, 0, 0, &row_count, &row_size, 0);
+    return row_size * row_count;
+}
+
+void rd_upload_texture_data_async(Renderer* r, RDTexture texture, void* data, u32 priority, RDUploadCallback callback, void* user_data) {
+    TextureData* texture_data = r->texture_manager.at(texture);
+    D3D12_RESOURCE_DESC resource_desc = texture_data->resource->GetDesc();
+
+    u8* src = (u8*)data;
+
+    // A request per level, so a large texture doesn't have to go all in one frame.
+    for (u32 i = 0; i < texture_data->mip_levels; ++i) {
+        UploadRequest request = {};
+        request.kind = UPLOAD_REQUEST_TEXTURE;
+        request.priority = priority;
+        request.size = texture_upload_size(r, &resource_desc, i, 1);
+        request.texture = texture;
+        request.data = src;
+        request.level = i;
+        request.level_count = 1;
+
+        if (i == texture_data->mip_levels - 1) {
+            request.callback = callback;
+            request.user_data = user_data;
+        }
+
+        r->uploads.enqueue(request);
+
+        src += texture_level_size(r, &resource_desc, i);
+    }
+}
+
+// The levels of a streamed texture from first_mip on, with first_mip as the resource's level 0.
+static D3D12_RESOURCE_DESC streamed_resource_desc(TextureData* data, u32 first_mip) {
+    D3D12_RESOURCE_DESC resource_desc = {};
+    resource_desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+    resource_desc.Width = max(data->width >> first_mip, 1u);
+    resource_desc.Height = max(data->height >> first_mip, 1u);
+    resource_desc.DepthOrArraySize = 1;
+    resource_desc.MipLevels = (u16)(data->mip_levels - first_mip);
+    resource_desc.Format = data->format;
+    resource_desc.SampleDesc.Count = 1;
+    return resource_desc;
+}
+
+static ID3D12Resource* create_streamed_resource(Renderer* r, TextureData* data, u32 first_mip) {
+    D3D12_RESOURCE_DESC resource_desc = streamed_resource_desc(data, first_mip);
+
+    D3D12_HEAP_PROPERTIES texture_heap_props = {};
+    texture_heap_props.Type = D3D12_HEAP_TYPE_DEFAULT;
+
+    ID3D12Resource* resource = 0;
+    r->device->CreateCommittedResource(&texture_heap_props, D3D12_HEAP_FLAG_NONE, &resource_desc, D3D12_RESOURCE_STATE_COMMON, 0, IID_PPV_ARGS(&resource));
+
+    return resource;
+}
+
+static Descriptor create_streamed_view(Renderer* r, TextureData* data, ID3D12Resource* resource, u32 first_mip) {
+    D3D12_SHADER_RESOURCE_VIEW_DESC view_desc = {};
+    view_desc.Format = data->format;
+    view_desc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+    view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    view_desc.Texture2D.MipLevels = data->mip_levels - first_mip;
+
+    return r->bindless_heap.create_srv(r->device, resource, &view_desc);
+}
+
+RDTexture rd_create_streamed_texture(Renderer* r, u32 width, u32 height, u32 mip_levels, RDFormat format, void* data, RDUploadCallback callback, void* user_data) {
+    assert(mip_levels <= STREAMING_MAX_MIPS);
+
+    RDTexture handle = r->texture_manager.alloc();
+    TextureData* texture_data = r->texture_manager.at(handle);
+
+    *texture_data = {};
+    texture_data->width = width;
+    texture_data->height = height;
+    texture_data->mip_levels = mip_levels;
+    texture_data->format = rd_format_to_dxgi_format(format);
+    texture_data->state = D3D12_RESOURCE_STATE_COMMON;
+    texture_data->source = (u8*)data;
+
+    D3D12_RESOURCE_DESC chain_desc = streamed_resource_desc(texture_data, 0);
+
+    u64 mip_sizes[STREAMING_MAX_MIPS];
+    u64 offset = 0;
+
+    for (u32 i = 0; i < mip_levels; ++i) {
+        mip_sizes[i] = texture_level_size(r, &chain_desc, i);
+        texture_data->mip_offsets[i] = offset;
+        offset += mip_sizes[i];
+    }
+
+    // Block compressed resources need their level 0 to be whole blocks, so a level that isn't ends the streamed ones.
+    bool block_compressed = bc_format(format);
+    u32 tail_mip = 0;
+
+    while (tail_mip + 1 < mip_levels && max(width >> tail_mip, height >> tail_mip) > TEXTURE_STREAMING_TAIL_SIZE) {
+        u32 next_width = max(width >> (tail_mip + 1), 1u);
+        u32 next_height = max(height >> (tail_mip + 1), 1u);
+
+        if (block_compressed && (next_width % 4 != 0 || next_height % 4 != 0)) {
+            break;
+        }
+
+        tail_mip++;
+    }
+
+    texture_data->first_mip = tail_mip;
+    texture_data->resource = create_streamed_resource(r, texture_data, tail_mip);
+    texture_data->view = create_streamed_view(r, texture_data, texture_data->resource, tail_mip);
+    texture_data->streaming = r->texture_streamer.add(max(width, height), mip_levels, tail_mip, mip_sizes);
+
+    if (texture_data->streaming == r->streamed_textures.len) {
+        r->streamed_textures.push(handle);
+    }
+    else {
+        r->streamed_textures[texture_data->streaming] = handle;
+    }
+
+    // The tail goes as one small request, and the texture streams once it lands.
+    UploadRequest request = {};
+    request.kind = UPLOAD_REQUEST_TEXTURE;
+    request.priority = RD_UPLOAD_PRIORITY_HIGH;
+    request.size = texture_upload_size(r, &chain_desc, tail_mip, mip_levels - tail_mip);
+    request.texture = handle;
+    request.data = texture_data->source + texture_data->mip_offsets[tail_mip];
+    request.level = 0;
+    request.level_count = mip_levels - tail_mip;
+    request.callback = callback;
+    request.user_data = user_data;
+
+    r->uploads.enqueue(request);
+
+    return handle;
+}
+
+void rd_free_texture(Renderer* r, RDTexture texture) {
+    r->copy_queue.flush();
+    r->compute_queue.flush();
+    r->direct_queue.flush();
+
+    release_texture(r, texture);
+}
+
+// Frees a texture without waiting on the queues. The caller must know the GPU is done with it.
+static void release_texture(Renderer* r, RDTexture texture) {
+    TextureData* data = r->texture_manager.at(texture);
+
+    cancel_uploads(r, texture.data);
+
+    if (data->streaming != STREAMING_NONE) {
+        r->texture_streamer.remove(data->streaming);
+    }
+
+    if (r->rtv_heap.descriptor_valid(data->rtv)) {
+        r->rtv_heap.free_descriptor(data->rtv);
+    }
+
+    if (r->dsv_heap.descriptor_valid(data->dsv)) {
+        r->dsv_heap.free_descriptor(data->dsv);
+    }
+
+    if (r->bindless_heap.descriptor_valid(data->uav)) {
+        r->bindless_heap.free_descriptor(data->uav);
+    }
+
+    r->bindless_heap.free_descriptor(data->view);
+    data->resource->Release();
+
+    r->texture_manager.free(texture);
+}
+
+RDTexture rd_get_white_texture(Renderer* r) {
+    return r->white_texture;
+}
 
-    for (u32 i = 0; i < reads.len; ++i) {
-        RDTexture texture = graph->textures[reads[i].index];
-        r->texture_manager.at(texture)->transition(cmd, D3D12_RESOURCE_STATE_ALL_SHADER_RESOURCE);
-    }
+struct ShaderLightsInfo {
+	u32 num_point_lights;
+	u32 num_directional_lights;
+	u32 point_lights_addr;
+	u32 directional_lights_addr;
 
-    for (u32 i = 0; i < write_by_uav_textures.len; ++i) {
-        RDTexture texture = write_by_uav_textures[i];
-        r->texture_manager.at(texture)->transition(cmd, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-    }
+	u32 cluster_ranges_addr;
+	u32 cluster_light_indices_addr;
+	f32 slice_scale;
+	f32 slice_bias;
 
-    if (!pipeline->is_compute) {
-        StaticVec<D3D12_CPU_DESCRIPTOR_HANDLE, 16> rtvs = {};
-        D3D12_CPU_DESCRIPTOR_HANDLE dsv = {};
+	XMFLOAT4 depth_plane;
 
-        for (u32 i = 0; i < render_targets.len; ++i) {
-            TextureData* texture_data = r->texture_manager.at(render_targets[i]);
-            texture_data->transition(cmd, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	u32 cluster_count_x;
+	u32 cluster_count_y;
+	u32 cluster_count_z;
+	u32 padding;
+};
+
+struct ShaderInstance {
+    XMMATRIX transform;
+    XMFLOAT4 position_offset;
+    XMFLOAT4 position_scale;
+};
+
+struct ShaderMaterial {
+    u32 albedo_texture_addr;
+    XMFLOAT3 albedo_factor;
+};
+
+static u32 gbuffer_pass_work_count(Renderer* r) {
+    return r->num_visible_instances;
+}
 
-            f32 color[4] = {};
-            rtvs.push(r->rtv_heap.cpu_handle(texture_data->rtv));
-            cmd->list->ClearRenderTargetView(rtvs[i], color, 0, 0);
+static void gbuffer_pass_proc(Renderer* r, CommandList* cmd, Pipeline* pipeline, void* root_constants, u32 begin, u32 end) {
+    cmd->list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+    GbufferRootConstants* constants = (GbufferRootConstants*)root_constants;
+
+    ConstantBuffer camera_cbuffer = cmd->get_constant_buffer(r, sizeof(XMMATRIX), &r->view_projection_matrix);
+    constants->camera_addr = camera_cbuffer.view.index;
+
+    // Variants share the root signature and offsets, so switching keeps the constants bound.
+    u32 bound_variant = GBUFFER_ALBEDO_TEXTURE;
+
+    for (u32 i = begin; i < end; ++i) {
+        if (r->visible_range_counts[i] == 0) {
+            continue;
         }
 
-        if (has_depth_buffer) {
-            TextureData* texture_data = r->texture_manager.at(depth_buffer_texture);
-            texture_data->transition(cmd, D3D12_RESOURCE_STATE_DEPTH_WRITE);
-            dsv = r->dsv_heap.cpu_handle(texture_data->dsv);
-            cmd->list->ClearDepthStencilView(dsv, D3D12_CLEAR_FLAG_DEPTH, 0.0f, 0, 0, 0);
-            texture_data->transition(cmd, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+        RDMeshInstance* instance = &r->render_info->instances[r->visible_instances[i]];
+
+        u32 variant = instance->material.albedo_texture.data == r->white_texture.data ? 0 : GBUFFER_ALBEDO_TEXTURE;
+
+        if (variant != bound_variant) {
+            get_pipeline_variant(r, &r->gbuffer_pipelines, variant)->bind(cmd);
+            bound_variant = variant;
         }
 
-        cmd->list->OMSetRenderTargets(rtvs.len, rtvs.mem, 0, has_depth_buffer ? &dsv : 0);
+        MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
+        TextureData* texture_data = r->texture_manager.at(instance->material.albedo_texture);
 
-        D3D12_VIEWPORT viewport = {};
-        viewport.Width = (f32)r->swapchain_w;
-        viewport.Height = (f32)r->swapchain_h;
-        viewport.MaxDepth = 1.0f;
+        ShaderInstance shader_instance;
+        shader_instance.transform = instance->transform;
+        shader_instance.position_offset = XMFLOAT4(mesh_data->quantization.position_offset.x, mesh_data->quantization.position_offset.y, mesh_data->quantization.position_offset.z, 0.0f);
+        shader_instance.position_scale = XMFLOAT4(mesh_data->quantization.position_scale.x, mesh_data->quantization.position_scale.y, mesh_data->quantization.position_scale.z, 0.0f);
 
-        cmd->list->RSSetViewports(1, &viewport);
+        ConstantBuffer instance_cbuffer = cmd->get_constant_buffer(r, sizeof(shader_instance), &shader_instance);
 
-        D3D12_RECT scissor = {};
-        scissor.right = r->swapchain_w;
-        scissor.bottom = r->swapchain_h;
+        ShaderMaterial material;
+        material.albedo_texture_addr = texture_data->view.index;
+        material.albedo_factor = instance->material.albedo_factor;
 
-        cmd->list->RSSetScissorRects(1, &scissor);
-    }
+        ConstantBuffer material_cbuffer = cmd->get_constant_buffer(r, sizeof(material), &material);
 
-    for (u32 i = 0; i < binds.len; ++i) {
-        BindPair bind = binds[i];
-        pipeline->bind_descriptor_at_offset(cmd, bind.offset, bind.descriptor);
+        constants->vbuffer_addr = mesh_data->vbuffer_view.index;
+        constants->instance_addr = instance_cbuffer.view.index;
+        constants->material_addr = material_cbuffer.view.index;
+
+        pipeline->set_root_constants(cmd, constants, sizeof(*constants));
+
+        cmd->list->IASetIndexBuffer(&mesh_data->ibuffer_view);
+
+        IndexRange* ranges = &r->visible_ranges[r->visible_range_offsets[i]];
+
+        for (u32 j = 0; j < r->visible_range_counts[i]; ++j) {
+            cmd->draw_indexed(ranges[j].count, ranges[j].offset);
+        }
     }
+}
+
+// Records nothing, so recording can be timed without a device or the driver. Never reference counted, it lives on the
+// benchmark's stack.
+struct NullCommandList : ID3D12GraphicsCommandList {
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, void**) override { return E_NOINTERFACE; }
+    ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+    ULONG STDMETHODCALLTYPE Release() override { return 1; }
+
+    // ID3D12Object
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID, UINT*, void*) override { return E_FAIL; }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID, UINT, const void*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID, const IUnknown*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE SetName(LPCWSTR) override { return S_OK; }
+
+    // ID3D12DeviceChild
+    HRESULT STDMETHODCALLTYPE GetDevice(REFIID, void**) override { return E_NOINTERFACE; }
+
+    // ID3D12CommandList
+    D3D12_COMMAND_LIST_TYPE STDMETHODCALLTYPE GetType() override { return D3D12_COMMAND_LIST_TYPE_DIRECT; }
+
+    // ID3D12GraphicsCommandList
+    HRESULT STDMETHODCALLTYPE Close() override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE Reset(ID3D12CommandAllocator*, ID3D12PipelineState*) override { return S_OK; }
+    void STDMETHODCALLTYPE ClearState(ID3D12PipelineState*) override {}
+    void STDMETHODCALLTYPE DrawInstanced(UINT, UINT, UINT, UINT) override {}
+    void STDMETHODCALLTYPE DrawIndexedInstanced(UINT, UINT, UINT, INT, UINT) override {}
+    void STDMETHODCALLTYPE Dispatch(UINT, UINT, UINT) override {}
+    void STDMETHODCALLTYPE CopyBufferRegion(ID3D12Resource*, UINT64, ID3D12Resource*, UINT64, UINT64) override {}
+    void STDMETHODCALLTYPE CopyTextureRegion(const D3D12_TEXTURE_COPY_LOCATION*, UINT, UINT, UINT, const D3D12_TEXTURE_COPY_LOCATION*, const D3D12_BOX*) override {}
+    void STDMETHODCALLTYPE CopyResource(ID3D12Resource*, ID3D12Resource*) override {}
+    void STDMETHODCALLTYPE CopyTiles(ID3D12Resource*, const D3D12_TILED_RESOURCE_COORDINATE*, const D3D12_TILE_REGION_SIZE*, ID3D12Resource*, UINT64, D3D12_TILE_COPY_FLAGS) override {}
+    void STDMETHODCALLTYPE ResolveSubresource(ID3D12Resource*, UINT, ID3D12Resource*, UINT, DXGI_FORMAT) override {}
+    void STDMETHODCALLTYPE IASetPrimitiveTopology(D3D12_PRIMITIVE_TOPOLOGY) override {}
+    void STDMETHODCALLTYPE RSSetViewports(UINT, const D3D12_VIEWPORT*) override {}
+    void STDMETHODCALLTYPE RSSetScissorRects(UINT, const D3D12_RECT*) override {}
+    void STDMETHODCALLTYPE OMSetBlendFactor(const FLOAT[4]) override {}
+    void STDMETHODCALLTYPE OMSetStencilRef(UINT) override {}
+    void STDMETHODCALLTYPE SetPipelineState(ID3D12PipelineState*) override {}
+    void STDMETHODCALLTYPE ResourceBarrier(UINT, const D3D12_RESOURCE_BARRIER*) override {}
+    void STDMETHODCALLTYPE ExecuteBundle(ID3D12GraphicsCommandList*) override {}
+    void STDMETHODCALLTYPE SetDescriptorHeaps(UINT, ID3D12DescriptorHeap* const*) override {}
+    void STDMETHODCALLTYPE SetComputeRootSignature(ID3D12RootSignature*) override {}
+    void STDMETHODCALLTYPE SetGraphicsRootSignature(ID3D12RootSignature*) override {}
+    void STDMETHODCALLTYPE SetComputeRootDescriptorTable(UINT, D3D12_GPU_DESCRIPTOR_HANDLE) override {}
+    void STDMETHODCALLTYPE SetGraphicsRootDescriptorTable(UINT, D3D12_GPU_DESCRIPTOR_HANDLE) override {}
+    void STDMETHODCALLTYPE SetComputeRoot32BitConstant(UINT, UINT, UINT) override {}
+    void STDMETHODCALLTYPE SetGraphicsRoot32BitConstant(UINT, UINT, UINT) override {}
+    void STDMETHODCALLTYPE SetComputeRoot32BitConstants(UINT, UINT, const void*, UINT) override {}
+    void STDMETHODCALLTYPE SetGraphicsRoot32BitConstants(UINT, UINT, const void*, UINT) override {}
+    void STDMETHODCALLTYPE SetComputeRootConstantBufferView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE SetGraphicsRootConstantBufferView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE SetComputeRootShaderResourceView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE SetGraphicsRootShaderResourceView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE SetComputeRootUnorderedAccessView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE SetGraphicsRootUnorderedAccessView(UINT, D3D12_GPU_VIRTUAL_ADDRESS) override {}
+    void STDMETHODCALLTYPE IASetIndexBuffer(const D3D12_INDEX_BUFFER_VIEW*) override {}
+    void STDMETHODCALLTYPE IASetVertexBuffers(UINT, UINT, const D3D12_VERTEX_BUFFER_VIEW*) override {}
+    void STDMETHODCALLTYPE SOSetTargets(UINT, UINT, const D3D12_STREAM_OUTPUT_BUFFER_VIEW*) override {}
+    void STDMETHODCALLTYPE OMSetRenderTargets(UINT, const D3D12_CPU_DESCRIPTOR_HANDLE*, BOOL, const D3D12_CPU_DESCRIPTOR_HANDLE*) override {}
+    void STDMETHODCALLTYPE ClearDepthStencilView(D3D12_CPU_DESCRIPTOR_HANDLE, D3D12_CLEAR_FLAGS, FLOAT, UINT8, UINT, const D3D12_RECT*) override {}
+    void STDMETHODCALLTYPE ClearRenderTargetView(D3D12_CPU_DESCRIPTOR_HANDLE, const FLOAT[4], UINT, const D3D12_RECT*) override {}
+    void STDMETHODCALLTYPE ClearUnorderedAccessViewUint(D3D12_GPU_DESCRIPTOR_HANDLE, D3D12_CPU_DESCRIPTOR_HANDLE, ID3D12Resource*, const UINT[4], UINT, const D3D12_RECT*) override {}
+    void STDMETHODCALLTYPE ClearUnorderedAccessViewFloat(D3D12_GPU_DESCRIPTOR_HANDLE, D3D12_CPU_DESCRIPTOR_HANDLE, ID3D12Resource*, const FLOAT[4], UINT, const D3D12_RECT*) override {}
+    void STDMETHODCALLTYPE DiscardResource(ID3D12Resource*, const D3D12_DISCARD_REGION*) override {}
+    void STDMETHODCALLTYPE BeginQuery(ID3D12QueryHeap*, D3D12_QUERY_TYPE, UINT) override {}
+    void STDMETHODCALLTYPE EndQuery(ID3D12QueryHeap*, D3D12_QUERY_TYPE, UINT) override {}
+    void STDMETHODCALLTYPE ResolveQueryData(ID3D12QueryHeap*, D3D12_QUERY_TYPE, UINT, UINT, ID3D12Resource*, UINT64) override {}
+    void STDMETHODCALLTYPE SetPredication(ID3D12Resource*, UINT64, D3D12_PREDICATION_OP) override {}
+    void STDMETHODCALLTYPE SetMarker(UINT, const void*, UINT) override {}
+    void STDMETHODCALLTYPE BeginEvent(UINT, const void*, UINT) override {}
+    void STDMETHODCALLTYPE EndEvent() override {}
+    void STDMETHODCALLTYPE ExecuteIndirect(ID3D12CommandSignature*, UINT, ID3D12Resource*, UINT64, ID3D12Resource*, UINT64) override {}
+};
 
-    procedure(r, cmd, pipeline);
+// Valid for one descriptor at index 0, which is all the benchmark looks up.
+static void init_null_descriptor_heap(Arena* arena, DescriptorHeap* heap) {
+    heap->capacity = 1;
+    heap->generations = arena->push_array<u32>(1);
+    heap->generations[0] = 1;
 }
 
-Renderer* rd_init(Arena* arena, void* window) {
-    Scratch scratch = get_scratch(arena);
-    Renderer* r = arena->push_type<Renderer>();
+void rd_recording_benchmark(u32 instance_count) {
+    Scratch scratch = get_scratch(0);
 
-    r->arena = arena->sub_arena(RENDERER_ARENA_SIZE);
+    Renderer* r = scratch->push_type<Renderer>();
+    r->swapchain_w = 1920;
+    r->swapchain_h = 1080;
+    r->mesh_manager.init(scratch.arena);
+    r->texture_manager.init(scratch.arena);
 
-    r->window = (HWND)window;
+    init_null_descriptor_heap(scratch.arena, &r->rtv_heap);
+    init_null_descriptor_heap(scratch.arena, &r->dsv_heap);
 
-    #if _DEBUG
-    {
-        ID3D12Debug* debug = 0;
-        if (SUCCEEDED(D3D12GetDebugInterface(IID_PPV_ARGS(&debug)))) {
-            debug->EnableDebugLayer();
-            debug->Release();
+    Descriptor descriptor = {};
+    descriptor.generation = 1;
+
+    // Every instance is textured, so the pass never switches variants, which would create pipelines.
+    RDTexture texture = r->texture_manager.alloc();
+    TextureData* texture_data = r->texture_manager.at(texture);
+    texture_data->view = descriptor;
+    texture_data->rtv = descriptor;
+    texture_data->dsv = descriptor;
+
+    RDMesh mesh = r->mesh_manager.alloc();
+
+    RDRenderInfo* render_info = scratch->push_type<RDRenderInfo>();
+    render_info->num_instances = instance_count;
+    render_info->instances = scratch->push_array<RDMeshInstance>(instance_count);
+
+    r->render_info = render_info;
+    r->num_visible_instances = instance_count;
+    r->visible_instances = scratch->push_array<u32>(instance_count);
+    r->visible_range_offsets = scratch->push_array<u32>(instance_count);
+    r->visible_range_counts = scratch->push_array<u32>(instance_count);
+    r->visible_ranges = scratch->push_array<IndexRange>(instance_count * RECORDING_BENCHMARK_RANGES);
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        RDMeshInstance* instance = &render_info->instances[i];
+        instance->mesh = mesh;
+        instance->material.albedo_texture = texture;
+        instance->material.albedo_factor = XMFLOAT3(1.0f, 1.0f, 1.0f);
+        instance->transform = XMMatrixTranslation((f32)i, 0.0f, 0.0f);
+
+        r->visible_instances[i] = i;
+        r->visible_range_offsets[i] = i * RECORDING_BENCHMARK_RANGES;
+        r->visible_range_counts[i] = RECORDING_BENCHMARK_RANGES;
+
+        for (u32 j = 0; j < RECORDING_BENCHMARK_RANGES; ++j) {
+            r->visible_ranges[i * RECORDING_BENCHMARK_RANGES + j].offset = j * 384;
+            r->visible_ranges[i * RECORDING_BENCHMARK_RANGES + j].count = 384;
         }
     }
-    #endif
 
-    if (FAILED(CreateDXGIFactory(IID_PPV_ARGS(&r->factory)))) {
-        pf_msg_box("Failed to create DXGI device");
-        return 0;
-    }
+    // Two constant buffers per instance and one per list, in plain memory rather than an upload heap.
+    u32 cbuffer_count = instance_count * 2 + MAX_JOB_THREADS * (CONSTANT_BUFFER_STASH_SIZE + 1);
+    u8* cbuffer_memory = (u8*)scratch->push(cbuffer_count * CONSTANT_BUFFER_CAPACITY);
 
-    if (FAILED(r->factory->EnumAdapters(0, &r->adapter))) {
-        pf_msg_box("Failed to find DXGI adapter");
-        return 0;
+    for (u32 i = 0; i < cbuffer_count; ++i) {
+        ConstantBuffer cbuffer = {};
+        cbuffer.view.index = i;
+        cbuffer.ptr = cbuffer_memory + i * CONSTANT_BUFFER_CAPACITY;
+        r->available_constant_buffers.push(cbuffer);
     }
 
-    if (FAILED(D3D12CreateDevice(r->adapter, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(&r->device)))) {
-        pf_msg_box("Failed to create D3D12 device");
-        return 0;
+    Pipeline pipeline = {};
+    pipeline.root_constants_size = sizeof(GbufferRootConstants) / sizeof(u32);
+
+    RenderGraph graph;
+    graph.init(scratch.arena);
+
+    RenderGraphTexture gbuffer_albedo = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture gbuffer_normal = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture depth_buffer = graph.create_texture(r, RD_FORMAT_R32_FLOAT, RD_TEXTURE_USAGE_DEPTH_BUFFER);
+
+    RenderGraphNode* node = graph.add_pass("gbuffer", &pipeline, gbuffer_pass_proc)
+        ->parallel(gbuffer_pass_work_count)
+        ->render_target(gbuffer_albedo)
+        ->render_target(gbuffer_normal)
+        ->depth_buffer(depth_buffer);
+
+    graph.physical_textures = scratch->push_array<RDTexture>(graph.textures.len);
+
+    for (u32 i = 0; i < graph.textures.len; ++i) {
+        graph.physical_textures[i] = texture;
     }
 
-    #if _DEBUG
-    {
-        ID3D12InfoQueue* info_queue = 0;
-        if (SUCCEEDED(r->device->QueryInterface(&info_queue)))
-        {
-            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_CORRUPTION, TRUE);
-            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_ERROR, TRUE);
-            info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_WARNING, TRUE);
+    NullCommandList null_list;
+    ID3D12GraphicsCommandList* list = &null_list;
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+    f64 single_thread_ms = 0.0;
 
-            D3D12_MESSAGE_SEVERITY severity_filter = D3D12_MESSAGE_SEVERITY_INFO;
+    // Splits the pass into one list per thread, as execute() does for enough instances, and records them the same way.
+    // Thread counts double up to every job thread.
+    u32 thread_count = 1;
 
-            D3D12_MESSAGE_ID message_filter[] = {
-                D3D12_MESSAGE_ID_CLEARRENDERTARGETVIEW_MISMATCHINGCLEARVALUE,
-                D3D12_MESSAGE_ID_CLEARDEPTHSTENCILVIEW_MISMATCHINGCLEARVALUE,
-                D3D12_MESSAGE_ID_MAP_INVALID_NULLRANGE,
-                D3D12_MESSAGE_ID_UNMAP_INVALID_NULLRANGE,
-                D3D12_MESSAGE_ID_CREATEGRAPHICSPIPELINESTATE_DEPTHSTENCILVIEW_NOT_SET
-            };
+    for (;;) {
+        u32 chunk_size = instance_count / thread_count + 1;
+        CommandList lists[MAX_JOB_THREADS] = {};
+        u64 best_ticks = UINT64_MAX;
 
-            D3D12_INFO_QUEUE_FILTER filter = {};
-            filter.DenyList.NumSeverities = 1;
-            filter.DenyList.pSeverityList = &severity_filter;
-            filter.DenyList.NumIDs = ARRAY_LEN(message_filter);
-            filter.DenyList.pIDList = message_filter;
+        for (u32 iteration = 0; iteration < RECORDING_BENCHMARK_ITERATIONS; ++iteration) {
+            for (u32 i = 0; i < thread_count; ++i) {
+                lists[i].type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+                lists[i].list = list;
+            }
 
-            info_queue->PushStorageFilter(&filter);
-            info_queue->Release();
+            u64 start = pf_ticks();
+
+            parallel_for(thread_count, 1, [&](u32 begin, u32 end) {
+                for (u32 i = begin; i < end; ++i) {
+                    u32 first = min(i * chunk_size, instance_count);
+                    node->record(r, &lists[i], first, min(first + chunk_size, instance_count));
+                }
+            });
+
+            best_ticks = min(best_ticks, pf_ticks() - start);
+
+            // Back to the pool, as a finished list would be.
+            for (u32 i = 0; i < thread_count; ++i) {
+                for (u32 j = 0; j < lists[i].constant_buffers.len; ++j) {
+                    r->available_constant_buffers.push(lists[i].constant_buffers[j]);
+                }
+
+                for (u32 j = 0; j < lists[i].constant_buffer_stash.len; ++j) {
+                    r->available_constant_buffers.push(lists[i].constant_buffer_stash[j]);
+                }
+
+                lists[i].constant_buffers.clear();
+                lists[i].constant_buffer_stash.clear();
+            }
         }
-    }
-    #endif
 
-    r->direct_queue.init(r->device, D3D12_COMMAND_LIST_TYPE_DIRECT);
-    r->copy_queue.init(r->device, D3D12_COMMAND_LIST_TYPE_COPY);
+        for (u32 i = 0; i < thread_count; ++i) {
+            lists[i].constant_buffers.free();
+            lists[i].constant_buffer_stash.free();
+        }
 
-    r->rtv_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_RTV, MAX_RTV_COUNT, false);
-    r->bindless_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, MAX_CBV_SRV_UAV_COUNT, true);
-    r->dsv_heap.init(arena, r->device, D3D12_DESCRIPTOR_HEAP_TYPE_DSV, MAX_DSV_COUNT, false);
+        f64 ms = (f64)best_ticks * ms_per_tick;
 
-    r->mesh_manager.init(&r->arena);
-    r->texture_manager.init(&r->arena);
+        if (thread_count == 1) {
+            single_thread_ms = ms;
+        }
 
-    r->upload_context_allocator.init(&r->arena); 
+        pf_debug_log("recording %u instances on %u threads: %.2f ms, %.0f ns per instance, %.2fx\n", instance_count, thread_count, ms, ms * 1e6 / (f64)instance_count, single_thread_ms / ms);
 
-    RDUploadContext* upload_context = rd_open_upload_context(r);
+        if (thread_count == jobs_thread_count()) {
+            break;
+        }
 
-    auto [window_w, window_h] = hwnd_size((HWND)window);
-    
-    r->swapchain_format = DXGI_FORMAT_R8G8B8A8_UNORM;
-    r->swapchain_buffer_count = 2;
-    r->swapchain_w = window_w;
-    r->swapchain_h = window_h;
+        thread_count = min(thread_count * 2, jobs_thread_count());
+    }
 
-    DXGI_SWAP_CHAIN_DESC1 swapchain_desc = {};
-    swapchain_desc.Width = window_w;
-    swapchain_desc.Height = window_h;
-    swapchain_desc.Format = r->swapchain_format;
-    swapchain_desc.SampleDesc.Count = 1;
-    swapchain_desc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    swapchain_desc.BufferCount = r->swapchain_buffer_count;
-    swapchain_desc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+    r->available_constant_buffers.free();
+}
 
-    IDXGISwapChain1* swapchain = 0;
-    r->factory->CreateSwapChainForHwnd(r->direct_queue.queue, (HWND)window, &swapchain_desc, 0, 0, &swapchain);
-    swapchain->QueryInterface(&r->swapchain);
-    swapchain->Release();
+// Fills visible_instances with the instances whose bounding sphere touches the view frustum.
+static void cull_instances(Renderer* r) {
+    PROFILE_FUNCTION();
 
-    r->get_swapchain_buffers();
+    RDRenderInfo* render_info = r->render_info;
+    CullSpheres spheres = push_cull_spheres(&r->frame_arena, render_info->num_instances);
 
-    D3D12_ROOT_SIGNATURE_DESC root_signature_desc = {};
+    parallel_for(render_info->num_instances, CULL_JOB_SIZE, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            RDMeshInstance* instance = &render_info->instances[i];
+            RDMeshBounds* bounds = &r->mesh_manager.at(instance->mesh)->bounds;
 
-    D3D12_ROOT_PARAMETER root_param = {};
-    root_param.ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS;
-    root_param.Constants.Num32BitValues = 32;
+            XMVECTOR center = XMVector3Transform(XMLoadFloat3(&bounds->sphere_center), instance->transform);
 
-    root_signature_desc.NumParameters = 1;
-    root_signature_desc.pParameters = &root_param;
+            // Non-uniform scale stretches the sphere by at most its largest axis scale.
+            XMVECTOR scale_sq = XMVectorMax(XMVector3LengthSq(instance->transform.r[0]), XMVectorMax(XMVector3LengthSq(instance->transform.r[1]), XMVector3LengthSq(instance->transform.r[2])));
+            f32 radius = bounds->sphere_radius * sqrtf(XMVectorGetX(scale_sq));
 
-    D3D12_STATIC_SAMPLER_DESC static_samplers[1] = {};
-    static_samplers[0].Filter = D3D12_FILTER_MIN_MAG_MIP_LINEAR;
-    static_samplers[0].AddressU = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
-    static_samplers[0].AddressV = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
-    static_samplers[0].AddressW = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
-    static_samplers[0].MaxLOD = D3D12_FLOAT32_MAX;
-    static_samplers[0].ShaderRegister = 0;
-    static_samplers[0].RegisterSpace = 0;
+            spheres.set(i, center, radius);
+        }
+    });
 
-    root_signature_desc.NumStaticSamplers = ARRAY_LEN(static_samplers);
-    root_signature_desc.pStaticSamplers = static_samplers;
+    Frustum frustum = frustum_from_view_projection(r->view_projection_matrix);
 
-    root_signature_desc.Flags |= D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED;
+    r->visible_instances = r->frame_arena.push_array<u32>(render_info->num_instances);
+    r->num_visible_instances = frustum_cull(&frustum, &spheres, r->visible_instances);
 
-    ID3DBlob* root_signature_code;
-    D3D12SerializeRootSignature(&root_signature_desc, D3D_ROOT_SIGNATURE_VERSION_1, &root_signature_code, 0);
-    r->device->CreateRootSignature(0, root_signature_code->GetBufferPointer(), root_signature_code->GetBufferSize(), IID_PPV_ARGS(&r->root_signature));
-    root_signature_code->Release();
+    PROFILE_COUNTER("visible_instances", r->num_visible_instances);
+}
 
-    DXGI_FORMAT rtv_formats[] = {
-        DXGI_FORMAT_R8G8B8A8_UNORM,
-        DXGI_FORMAT_R8G8B8A8_UNORM,
-    };
+// Picks each visible instance's level of detail from how many pixels its error would cover on screen.
+static void select_instance_lods(Renderer* r) {
+    PROFILE_FUNCTION();
+
+    RDRenderInfo* render_info = r->render_info;
+    XMVECTOR camera_position = render_info->camera->transform.r[3];
 
-    r->gbuffer_pipeline = create_graphics_pipeline(
-        r->device,
-        r->root_signature,
-        ARRAY_LEN(rtv_formats), rtv_formats,
-        "shaders/gbuffer.hlsl"
-    );
+    if (r->instance_lods.len != render_info->num_instances) {
+        r->instance_lods.resize(render_info->num_instances);
+        memset(r->instance_lods.mem, 0, render_info->num_instances * sizeof(u8));
+    }
 
-    r->lighting_pipeline = create_compute_pipeline(r->device, r->root_signature, "shaders/lighting.hlsl");
+    // Pixels covered by one unit of error one unit in front of the camera.
+    f32 pixels_per_unit = (f32)r->swapchain_h / (2.0f * tanf(render_info->camera->vertical_fov * 0.5f));
 
-    r->point_light_buffer = create_buffer(r->device, MAX_POINT_LIGHT_COUNT * sizeof(RDPointLight), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
-    r->directional_light_buffer = create_buffer(r->device, MAX_DIRECTIONAL_LIGHT_COUNT * sizeof(RDDirectionalLight), D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
-    
-    D3D12_SHADER_RESOURCE_VIEW_DESC structured_buffer_view_desc = {};
-    structured_buffer_view_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
-    structured_buffer_view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+    r->visible_lods = r->frame_arena.push_array<u8>(r->num_visible_instances);
 
-    structured_buffer_view_desc.Buffer.NumElements = MAX_POINT_LIGHT_COUNT;
-    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(RDPointLight);
-    r->point_light_buffer_view = r->bindless_heap.create_srv(r->device, r->point_light_buffer, &structured_buffer_view_desc);
+    parallel_for(r->num_visible_instances, MESHLET_CULL_JOB_SIZE, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            u32 instance_index = r->visible_instances[i];
+            RDMeshInstance* instance = &render_info->instances[instance_index];
+            MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
 
-    structured_buffer_view_desc.Buffer.NumElements = MAX_DIRECTIONAL_LIGHT_COUNT;
-    structured_buffer_view_desc.Buffer.StructureByteStride = sizeof(RDDirectionalLight);
-    r->directional_light_buffer_view = r->bindless_heap.create_srv(r->device, r->directional_light_buffer, &structured_buffer_view_desc);
+            XMVECTOR center = XMVector3Transform(XMLoadFloat3(&mesh_data->bounds.sphere_center), instance->transform);
+            XMVECTOR scale_sq = XMVectorMax(XMVector3LengthSq(instance->transform.r[0]), XMVectorMax(XMVector3LengthSq(instance->transform.r[1]), XMVector3LengthSq(instance->transform.r[2])));
+            f32 scale = sqrtf(XMVectorGetX(scale_sq));
 
-    u32 white_texture_data = UINT32_MAX;
-    r->white_texture = rd_create_texture(r, 1, 1, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RESOURCE);
-    rd_upload_texture_data(r, upload_context, r->white_texture, &white_texture_data);
+            // Measured from the nearest point of the bounding sphere, so the error is never underestimated.
+            f32 distance = XMVectorGetX(XMVector3Length(center - camera_position)) - mesh_data->bounds.sphere_radius * scale;
+            f32 pixels_per_error = distance > 0.001f ? scale * pixels_per_unit / distance : FLT_MAX;
 
-    r->render_graph = arena->push_type<RenderGraph>();
+            u32 lod = min((u32)r->instance_lods[instance_index], mesh_data->lod_count - 1);
 
-    RDUploadStatus* upload_status = rd_submit_upload_context(r, upload_context);
-    rd_flush_upload(r, upload_status); 
+            while (lod > 0 && mesh_data->lods[lod].error * pixels_per_error > LOD_MAX_PIXEL_ERROR) {
+                lod--;
+            }
 
-    return r;
+            while (lod + 1 < mesh_data->lod_count && mesh_data->lods[lod + 1].error * pixels_per_error <= LOD_MAX_PIXEL_ERROR * LOD_HYSTERESIS) {
+                lod++;
+            }
+
+            r->instance_lods[instance_index] = (u8)lod;
+            r->visible_lods[i] = (u8)lod;
+        }
+    });
 }
 
-void rd_free(Renderer* r) {
-    r->direct_queue.flush();
-    r->copy_queue.flush();
+// Drops the meshlets of visible instances that are outside the frustum or face away from the camera.
+static void cull_instance_meshlets(Renderer* r) {
+    PROFILE_FUNCTION();
 
-    r->direct_queue.poll_command_lists(&r->available_command_lists, &r->available_constant_buffers, &r->available_upload_pools);
-    r->copy_queue.poll_command_lists(&r->available_command_lists, &r->available_constant_buffers, &r->available_upload_pools);
+    RDRenderInfo* render_info = r->render_info;
+    XMVECTOR camera_position = render_info->camera->transform.r[3];
+    Frustum frustum = frustum_from_view_projection(r->view_projection_matrix);
 
-    for (u32 i = 0; i < r->available_command_lists.len; ++i) {
-        r->available_command_lists[i].list->Release();
-        r->available_command_lists[i].allocator->Release();
-        r->available_command_lists[i].constant_buffers.free();
-        r->available_command_lists[i].upload_pools.free();
+    // Every instance gets room for all of its meshlets so jobs can write their ranges without coordinating.
+    r->visible_range_offsets = r->frame_arena.push_array<u32>(r->num_visible_instances);
+    r->visible_range_counts = r->frame_arena.push_array<u32>(r->num_visible_instances);
+
+    u32 range_capacity = 0;
+
+    for (u32 i = 0; i < r->num_visible_instances; ++i) {
+        r->visible_range_offsets[i] = range_capacity;
+        range_capacity += r->mesh_manager.at(render_info->instances[r->visible_instances[i]].mesh)->lods[r->visible_lods[i]].meshlet_count;
+    }
+
+    r->visible_ranges = r->frame_arena.push_array<IndexRange>(range_capacity);
+
+    parallel_for(r->num_visible_instances, MESHLET_CULL_JOB_SIZE, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            RDMeshInstance* instance = &render_info->instances[r->visible_instances[i]];
+            MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
+
+            MeshLod* lod = &mesh_data->lods[r->visible_lods[i]];
+
+            MeshletCullView view = meshlet_cull_view(&frustum, camera_position, instance->transform);
+            r->visible_range_counts[i] = cull_meshlets(&view, lod->meshlet_count, mesh_data->meshlets + lod->meshlet_offset, &r->visible_ranges[r->visible_range_offsets[i]]);
+        }
+    });
+
+    u32 range_count = 0;
+    u32 index_count = 0;
+
+    for (u32 i = 0; i < r->num_visible_instances; ++i) {
+        range_count += r->visible_range_counts[i];
+
+        IndexRange* ranges = &r->visible_ranges[r->visible_range_offsets[i]];
+
+        for (u32 j = 0; j < r->visible_range_counts[i]; ++j) {
+            index_count += ranges[j].count;
+        }
     }
 
-    for (u32 i = 0; i < r->available_upload_pools.len; ++i) {
-        r->available_upload_pools[i].buffer->Release();
+    PROFILE_COUNTER("visible_meshlet_ranges", range_count);
+    PROFILE_COUNTER("drawn_triangles", index_count / 3);
+}
+
+struct OccluderCandidate {
+    f32 screen_size;
+    u32 instance;
+};
+
+static int compare_occluder_candidates(const void* a, const void* b) {
+    f32 x = ((OccluderCandidate*)a)->screen_size;
+    f32 y = ((OccluderCandidate*)b)->screen_size;
+    return (x < y) - (x > y);
+}
+
+// Rasterizes the biggest on-screen instances that have occluder geometry, then drops visible instances hidden behind them.
+static void occlusion_cull_instances(Renderer* r) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    RDRenderInfo* render_info = r->render_info;
+    XMVECTOR camera_position = render_info->camera->transform.r[3];
+
+    OccluderCandidate* candidates = scratch->push_array<OccluderCandidate>(r->num_visible_instances);
+    u32 candidate_count = 0;
+
+    for (u32 i = 0; i < r->num_visible_instances; ++i) {
+        RDMeshInstance* instance = &render_info->instances[r->visible_instances[i]];
+        MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
+
+        if (!mesh_data->occluder_index_count) {
+            continue;
+        }
+
+        XMVECTOR center = XMVector3Transform(XMLoadFloat3(&mesh_data->bounds.sphere_center), instance->transform);
+        XMVECTOR scale_sq = XMVectorMax(XMVector3LengthSq(instance->transform.r[0]), XMVectorMax(XMVector3LengthSq(instance->transform.r[1]), XMVector3LengthSq(instance->transform.r[2])));
+        f32 radius = mesh_data->bounds.sphere_radius * sqrtf(XMVectorGetX(scale_sq));
+        f32 distance = max(XMVectorGetX(XMVector3Length(center - camera_position)), 0.001f);
+
+        if (radius / distance >= OCCLUDER_MIN_SCREEN_SIZE) {
+            candidates[candidate_count].screen_size = radius / distance;
+            candidates[candidate_count].instance = r->visible_instances[i];
+            candidate_count++;
+        }
     }
 
-    for (u32 i = 0; i < r->permanent_resources.len; ++i) {
-        r->permanent_resources[i]->Release();
+    qsort(candidates, candidate_count, sizeof(OccluderCandidate), compare_occluder_candidates);
+
+    u32 occluder_count = min(candidate_count, (u32)MAX_OCCLUDERS);
+    Occluder* occluders = scratch->push_array<Occluder>(occluder_count);
+
+    for (u32 i = 0; i < occluder_count; ++i) {
+        RDMeshInstance* instance = &render_info->instances[candidates[i].instance];
+        MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
+
+        occluders[i].transform = &instance->transform;
+        occluders[i].vertex_count = mesh_data->occluder_vertex_count;
+        occluders[i].positions = mesh_data->occluder_positions;
+        occluders[i].index_count = mesh_data->occluder_index_count;
+        occluders[i].indices = mesh_data->occluder_indices;
     }
 
-    r->render_graph->free(r);
+    PROFILE_COUNTER("occluders", occluder_count);
+
+    if (occluder_count == 0) {
+        return;
+    }
 
-    rd_free_texture(r, r->white_texture);
+    occlusion_render(&r->occlusion_buffer, r->view_projection_matrix, occluder_count, occluders);
 
-    r->directional_light_buffer->Release();
-    r->point_light_buffer->Release();
+    OcclusionQuery* queries = scratch->push_array<OcclusionQuery>(r->num_visible_instances);
 
-    r->lighting_pipeline.free();
-    r->gbuffer_pipeline.free();
+    for (u32 i = 0; i < r->num_visible_instances; ++i) {
+        RDMeshInstance* instance = &render_info->instances[r->visible_instances[i]];
+        MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
 
-    r->root_signature->Release();
+        queries[i].transform = &instance->transform;
+        queries[i].aabb_min = mesh_data->bounds.aabb_min;
+        queries[i].aabb_max = mesh_data->bounds.aabb_max;
+    }
 
-    r->dsv_heap.free();
-    r->bindless_heap.free();
-    r->rtv_heap.free();
+    r->num_visible_instances = occlusion_cull(&r->occlusion_buffer, r->view_projection_matrix, queries, r->visible_instances, r->num_visible_instances);
 
-    r->release_swapchain_buffers();
-    r->swapchain->Release();
+    PROFILE_COUNTER("unoccluded_instances", r->num_visible_instances);
+}
 
-    r->copy_queue.free();
-    r->direct_queue.free();
+// Bins the point lights into view space clusters so the lighting pass only visits the lights that can reach each pixel.
+static void cluster_lights(Renderer* r, XMMATRIX view_matrix) {
+    RDRenderInfo* render_info = r->render_info;
 
-    r->device->Release();
-    r->adapter->Release();
-    r->factory->Release();
+    ClusterView view = {};
+    view.view = view_matrix;
+    view.vertical_fov = render_info->camera->vertical_fov;
+    view.aspect = (f32)r->swapchain_w/(f32)r->swapchain_h;
+    view.near_depth = 0.1f;
+    view.far_depth = 1000.0f;
 
-    r->available_command_lists.free();
-    r->available_constant_buffers.free();
-    r->available_upload_pools.free();
-}
+    r->light_clusters = build_light_clusters(&r->frame_arena, &view, render_info->num_point_lights, render_info->point_lights);
 
-RDUploadContext* rd_open_upload_context(Renderer* r) {
-    RDUploadContext* upload_context = r->upload_context_allocator.alloc();
-    upload_context->command_list = r->open_command_list(D3D12_COMMAND_LIST_TYPE_COPY);
-    return upload_context;
-}
+    LightClusters* clusters = &r->light_clusters;
 
-RDUploadStatus* rd_submit_upload_context(Renderer* r, RDUploadContext* upload_context) {
-    r->copy_queue.submit_command_list(upload_context->command_list);
-    u64 fence_val = r->copy_queue.signal();
-    r->upload_context_allocator.free(upload_context);
-    return (RDUploadStatus*)fence_val;
-}
+    if (clusters->index_count > MAX_CLUSTER_LIGHT_INDEX_COUNT) {
+        static bool warned = false;
+        if (!warned) {
+            pf_debug_log("Clustered light lists need %u indices but only %u fit, dropping lights from distant clusters\n", clusters->index_count, MAX_CLUSTER_LIGHT_INDEX_COUNT);
+            warned = true;
+        }
 
-bool rd_upload_status_finished(Renderer* r, RDUploadStatus* upload_status) {
-    return r->copy_queue.reached((u64)upload_status);
-}
+        // Lists are laid out near to far, so the clusters that lose lights are the ones furthest away.
+        for (u32 i = 0; i < CLUSTER_COUNT; ++i) {
+            ClusterRange* range = &clusters->ranges[i];
+            range->count = range->offset >= MAX_CLUSTER_LIGHT_INDEX_COUNT ? 0 : min(range->count, MAX_CLUSTER_LIGHT_INDEX_COUNT - range->offset);
+        }
 
-void rd_flush_upload(Renderer* r, RDUploadStatus* upload_status) {
-    return r->copy_queue.wait((u64)upload_status);
+        clusters->index_count = MAX_CLUSTER_LIGHT_INDEX_COUNT;
+    }
 }
 
-RDMesh rd_create_mesh(Renderer* r, RDUploadContext* upload_context, RDVertex* vertex_data, u32 vertex_count, u32* index_data, u32 index_count) {
-    RDMesh handle = r->mesh_manager.alloc();
-    MeshData* data = r->mesh_manager.at(handle);
+static void lighting_pass_proc(Renderer* r, CommandList* cmd, Pipeline* pipeline, void* root_constants, u32 begin, u32 end) {
+    (void)begin;
+    (void)end;
 
-    u32 vertex_data_size = vertex_count * sizeof(vertex_data[0]);
-    u32 index_data_size = index_count * sizeof(index_data[0]);
+    auto render_info = r->render_info;
 
-    data->vbuffer = create_buffer(r->device, vertex_data_size, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON); 
-    data->ibuffer = create_buffer(r->device, index_data_size, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COMMON);
+    assert(render_info->num_point_lights <= MAX_POINT_LIGHT_COUNT);
+    assert(render_info->num_directional_lights <= MAX_DIRECTIONAL_LIGHT_COUNT);
 
-    upload_context->command_list.buffer_upload(r, data->vbuffer, vertex_data_size, vertex_data);
-    upload_context->command_list.buffer_upload(r, data->ibuffer, index_data_size, index_data);
+    cmd->buffer_upload(r, r->point_light_buffer, render_info->num_point_lights * sizeof(RDPointLight), render_info->point_lights);
+    cmd->buffer_upload(r, r->directional_light_buffer, render_info->num_directional_lights * sizeof(RDDirectionalLight), render_info->directional_lights);
 
-    D3D12_SHADER_RESOURCE_VIEW_DESC vbuffer_view_desc = {};
-    vbuffer_view_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
-    vbuffer_view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-    vbuffer_view_desc.Buffer.NumElements = vertex_count;
-    vbuffer_view_desc.Buffer.StructureByteStride = sizeof(RDVertex);
+    LightClusters* clusters = &r->light_clusters;
 
-    D3D12_SHADER_RESOURCE_VIEW_DESC ibuffer_view_desc = {};
-    ibuffer_view_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
-    ibuffer_view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-    ibuffer_view_desc.Buffer.NumElements = index_count;
-    ibuffer_view_desc.Buffer.StructureByteStride = sizeof(u32);
+    cmd->buffer_upload(r, r->cluster_range_buffer, CLUSTER_COUNT * sizeof(ClusterRange), clusters->ranges);
 
-    data->vbuffer_view = r->bindless_heap.create_srv(r->device, data->vbuffer, &vbuffer_view_desc);
-    data->ibuffer_view = r->bindless_heap.create_srv(r->device, data->ibuffer, &ibuffer_view_desc);
+    if (clusters->index_count > 0) {
+        cmd->buffer_upload(r, r->cluster_light_index_buffer, clusters->index_count * sizeof(u32), clusters->indices);
+    }
 
-    data->index_count = index_count;
+    ShaderLightsInfo lights_info = {};
+    lights_info.num_point_lights = render_info->num_point_lights;
+    lights_info.num_directional_lights = render_info->num_directional_lights;
+    lights_info.point_lights_addr = r->point_light_buffer_view.index;
+    lights_info.directional_lights_addr = r->directional_light_buffer_view.index;
+    lights_info.cluster_ranges_addr = r->cluster_range_buffer_view.index;
+    lights_info.cluster_light_indices_addr = r->cluster_light_index_buffer_view.index;
+    lights_info.slice_scale = clusters->slice_scale;
+    lights_info.slice_bias = clusters->slice_bias;
+    lights_info.depth_plane = clusters->depth_plane;
+    lights_info.cluster_count_x = CLUSTER_COUNT_X;
+    lights_info.cluster_count_y = CLUSTER_COUNT_Y;
+    lights_info.cluster_count_z = CLUSTER_COUNT_Z;
 
-    return handle;
-}
+    ConstantBuffer lights_cbuffer = cmd->get_constant_buffer(r, sizeof(lights_info), &lights_info);
 
-void rd_free_mesh(Renderer* r, RDMesh mesh) {
-    r->copy_queue.flush();
-    r->direct_queue.flush();
+    XMMATRIX inverse_view_projection_matrix = XMMatrixInverse(0, r->view_projection_matrix);
+    ConstantBuffer inverse_view_projection_cbuffer = cmd->get_constant_buffer(r, sizeof(inverse_view_projection_matrix), &inverse_view_projection_matrix);
 
-    MeshData* data = r->mesh_manager.at(mesh);
+    LightingRootConstants* constants = (LightingRootConstants*)root_constants;
+    constants->lights_info_addr = lights_cbuffer.view.index;
+    constants->inverse_view_projection_addr = inverse_view_projection_cbuffer.view.index;
 
-    r->bindless_heap.free_descriptor(data->vbuffer_view);
-    r->bindless_heap.free_descriptor(data->ibuffer_view);
-    data->vbuffer->Release();
-    data->ibuffer->Release();
+    pipeline->set_root_constants(cmd, constants, sizeof(*constants));
 
-    r->mesh_manager.free(mesh);
+    cmd->dispatch(r->swapchain_w / pipeline->group_size_x + 1, r->swapchain_h / pipeline->group_size_y + 1, 1);
 }
 
-static DXGI_FORMAT rd_format_to_dxgi_format(RDFormat format) {
-    switch (format) {
-        case RD_FORMAT_RGBA8_UNORM:
-            return DXGI_FORMAT_R8G8B8A8_UNORM;
-        case RD_FORMAT_R32_FLOAT:
-            return DXGI_FORMAT_R32_FLOAT;
-    }
-    
-    assert(false);
-    return DXGI_FORMAT_UNKNOWN;
-}
+// Drops the requests of a texture or mesh being freed, whose callbacks are then never called. The caller must know the
+// copy queue is done with the ones in flight.
+static void cancel_uploads(Renderer* r, void* owner) {
+    UploadScheduler* uploads = &r->uploads;
 
-static DXGI_FORMAT format_to_depth_format(DXGI_FORMAT format) {
-    switch (format) {
-        case DXGI_FORMAT_R32_FLOAT:
-            return DXGI_FORMAT_D32_FLOAT;
+    for (int i = uploads->queue.len-1; i >= 0; --i) {
+        UploadRequest* request = &uploads->queue[i];
+
+        if (request->texture.data == owner || request->mesh.data == owner) {
+            uploads->queued_bytes -= request->size;
+            uploads->queue.remove_by_patch(i);
+            uploads->sorted = false;
+        }
     }
 
-    assert(false);
-    return DXGI_FORMAT_UNKNOWN;
-}
+    u32 kept = 0;
 
-RDTexture rd_create_texture(Renderer* r, u32 width, u32 height, RDFormat format, RDTextureUsage usage) {
-    RDTexture handle = r->texture_manager.alloc();
-    TextureData* data = r->texture_manager.at(handle);
+    for (u32 i = 0; i < uploads->in_flight.len; ++i) {
+        UploadRequest* request = &uploads->in_flight[i];
 
-    data->width = width;
-    data->height = height;
-    data->format = rd_format_to_dxgi_format(format);
+        if (request->texture.data == owner || request->mesh.data == owner) {
+            uploads->staging_bytes -= request->size;
 
-    D3D12_RESOURCE_DESC resource_desc = {};
-    resource_desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
-    resource_desc.Width = width;
-    resource_desc.Height = height;
-    resource_desc.DepthOrArraySize = 1;
-    resource_desc.MipLevels = 1;
-    resource_desc.Format = data->format;
-    resource_desc.SampleDesc.Count = 1;
+            if (request->resource) {
+                request->resource->Release();
+            }
+        }
+        else {
+            uploads->in_flight[kept++] = *request;
+        }
+    }
 
-    D3D12_RESOURCE_STATES initial_state = {};
+    uploads->in_flight.len = kept;
+}
 
-    switch (usage) {
-        default:
-            assert(false);
+static void record_upload_request(Renderer* r, CommandList* cmd, UploadRequest* request) {
+    switch (request->kind) {
+        case UPLOAD_REQUEST_TEXTURE: {
+            TextureData* data = r->texture_manager.at(request->texture);
+            record_texture_upload(r, cmd, data->resource, request->level, request->level_count, request->data);
+        } break;
+
+        case UPLOAD_REQUEST_MESH: {
+            MeshData* data = r->mesh_manager.at(request->mesh);
+            record_mesh_upload(r, cmd, data, (RDPackedVertex*)request->data, request->vertex_count, request->indices, request->index_count);
+        } break;
+
+        case UPLOAD_REQUEST_STREAMING: {
+            // The levels both resources hold are copied over on the GPU, a load adds the new one from the source.
+            TextureData* data = r->texture_manager.at(request->texture);
+            request->resource = create_streamed_resource(r, data, request->level);
+
+            for (u32 m = max(request->level, data->first_mip); m < data->mip_levels; ++m) {
+                D3D12_TEXTURE_COPY_LOCATION copy_src = {};
+                copy_src.pResource = data->resource;
+                copy_src.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+                copy_src.SubresourceIndex = m - data->first_mip;
+
+                D3D12_TEXTURE_COPY_LOCATION copy_dst = {};
+                copy_dst.pResource = request->resource;
+                copy_dst.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+                copy_dst.SubresourceIndex = m - request->level;
+
+                cmd->list->CopyTextureRegion(&copy_dst, 0, 0, 0, &copy_src, 0);
+            }
 
-        case RD_TEXTURE_USAGE_RESOURCE:
-            initial_state = D3D12_RESOURCE_STATE_COMMON;
-            break;
+            if (request->streaming_op == STREAMING_OP_LOAD) {
+                record_texture_upload(r, cmd, request->resource, 0, 1, data->source + data->mip_offsets[request->level]);
+            }
+        } break;
+    }
+}
 
-        case RD_TEXTURE_USAGE_RENDER_TARGET:
-            initial_state = D3D12_RESOURCE_STATE_RENDER_TARGET;
-            resource_desc.Flags |= D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET | D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
-            break;
+// Records as many queued requests into one copy command list as this frame's budgets allow.
+static void drain_uploads(Renderer* r) {
+    PROFILE_FUNCTION();
 
-        case RD_TEXTURE_USAGE_DEPTH_BUFFER:
-            initial_state = D3D12_RESOURCE_STATE_DEPTH_WRITE;
-            resource_desc.Flags |= D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL;
-            break;
-    }
+    UploadScheduler* uploads = &r->uploads;
 
-    D3D12_HEAP_PROPERTIES texture_heap_props = {};
-    texture_heap_props.Type = D3D12_HEAP_TYPE_DEFAULT;
+    CommandList cmd = {};
+    u32 first_recorded = uploads->in_flight.len;
+    u64 frame_bytes = 0;
 
-    r->device->CreateCommittedResource(&texture_heap_props, D3D12_HEAP_FLAG_NONE, &resource_desc, initial_state, 0, IID_PPV_ARGS(&data->resource));
-    data->state = initial_state;
+    UploadRequest request;
 
-    D3D12_SHADER_RESOURCE_VIEW_DESC view_desc = {};
-    view_desc.Format = resource_desc.Format;
-    view_desc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
-    view_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-    view_desc.Texture2D.MipLevels = 1;
+    while (uploads->next(frame_bytes, &request)) {
+        if (!cmd.list) {
+            cmd = r->open_command_list(D3D12_COMMAND_LIST_TYPE_COPY);
+        }
 
-    data->view = r->bindless_heap.create_srv(r->device, data->resource, &view_desc);
+        record_upload_request(r, &cmd, &request);
 
-    if (usage == RD_TEXTURE_USAGE_RENDER_TARGET) {
-        D3D12_RENDER_TARGET_VIEW_DESC rtv_desc = {};
-        rtv_desc.Format = resource_desc.Format;
-        rtv_desc.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D;
-        data->rtv = r->rtv_heap.create_rtv(r->device, data->resource, &rtv_desc);
+        frame_bytes += request.size;
+        uploads->staging_bytes += request.size;
+        uploads->in_flight.push(request);
+    }
 
-        D3D12_UNORDERED_ACCESS_VIEW_DESC uav_desc = {};
-        uav_desc.Format = resource_desc.Format;
-        uav_desc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
-        data->uav = r->bindless_heap.create_uav(r->device, data->resource, &uav_desc);
+    if (!cmd.list) {
+        return;
     }
 
-    if (usage == RD_TEXTURE_USAGE_DEPTH_BUFFER) {
-        D3D12_DEPTH_STENCIL_VIEW_DESC dsv_desc = {};
-        dsv_desc.Format = format_to_depth_format(resource_desc.Format);
-        dsv_desc.ViewDimension = D3D12_DSV_DIMENSION_TEXTURE2D;
-        data->dsv = r->dsv_heap.create_dsv(r->device, data->resource, &dsv_desc);
+    u64 fence = r->copy_queue.submit_command_list(cmd);
+
+    for (u32 i = first_recorded; i < uploads->in_flight.len; ++i) {
+        uploads->in_flight[i].fence = fence;
     }
 
-    return handle;
+    PROFILE_COUNTER("upload_bytes", frame_bytes);
 }
 
-void rd_upload_texture_data(Renderer* r, RDUploadContext* upload_context, RDTexture texture, void* data) {
-    TextureData* texture_data = r->texture_manager.at(texture);
+// Swaps a rebuilt streamed texture in. Every frame recorded before this one may still sample what it replaces.
+static void finish_streaming_request(Renderer* r, UploadRequest* request) {
+    TextureData* data = r->texture_manager.at(request->texture);
 
-    UploadRegion texture_upload_region = upload_context->command_list.get_upload_region(r, texture_data->width * texture_data->height * 4, data);
+    RetiredTextureResource retired = {};
+    retired.resource = data->resource;
+    retired.view = data->view;
+    retired.fence = r->direct_queue.fence_val;
+    r->retired_texture_resources.push(retired);
 
-    D3D12_TEXTURE_COPY_LOCATION texture_copy_src = {};
-    texture_copy_src.pResource = texture_upload_region.resource;
-    texture_copy_src.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
-    texture_copy_src.PlacedFootprint.Offset = texture_upload_region.offset;
-    texture_copy_src.PlacedFootprint.Footprint.Format = texture_data->format;
-    texture_copy_src.PlacedFootprint.Footprint.Width = texture_data->width;
-    texture_copy_src.PlacedFootprint.Footprint.Height = texture_data->height;
-    texture_copy_src.PlacedFootprint.Footprint.Depth = 1;
-    texture_copy_src.PlacedFootprint.Footprint.RowPitch = texture_data->width * 4;
+    data->resource = request->resource;
+    data->view = create_streamed_view(r, data, request->resource, request->level);
+    data->first_mip = request->level;
 
-    D3D12_TEXTURE_COPY_LOCATION texture_copy_dst = {};
-    texture_copy_dst.pResource = texture_data->resource;
-    texture_copy_dst.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
-    texture_copy_dst.SubresourceIndex = 0;
-   
-    upload_context->command_list->CopyTextureRegion(&texture_copy_dst, 0, 0, 0, &texture_copy_src, 0);
+    r->texture_streamer.finish(data->streaming);
 }
 
-void rd_free_texture(Renderer* r, RDTexture texture) {
-    r->copy_queue.flush();
-    r->direct_queue.flush();
+// Finishes the requests the copy queue has reached, calling their callbacks in the order they were recorded.
+static void poll_uploads(Renderer* r) {
+    UploadScheduler* uploads = &r->uploads;
+    u32 finished = 0;
 
-    TextureData* data = r->texture_manager.at(texture);
+    for (; finished < uploads->in_flight.len; ++finished) {
+        UploadRequest* request = &uploads->in_flight[finished];
 
-    if (r->rtv_heap.descriptor_valid(data->rtv)) {
-        r->rtv_heap.free_descriptor(data->rtv);
-    }
+        if (!r->copy_queue.reached(request->fence)) {
+            break;
+        }
 
-    if (r->dsv_heap.descriptor_valid(data->dsv)) {
-        r->dsv_heap.free_descriptor(data->dsv);
-    }
+        uploads->staging_bytes -= request->size;
 
-    if (r->bindless_heap.descriptor_valid(data->uav)) {
-        r->bindless_heap.free_descriptor(data->uav);
-    }
+        if (request->kind == UPLOAD_REQUEST_STREAMING) {
+            finish_streaming_request(r, request);
+        }
 
-    r->bindless_heap.free_descriptor(data->view);
-    data->resource->Release();
+        if (request->kind == UPLOAD_REQUEST_TEXTURE) {
+            TextureData* data = r->texture_manager.at(request->texture);
+            data->streaming_ready = data->streaming != STREAMING_NONE;
+        }
 
-    r->texture_manager.free(texture);
-}
+        if (request->callback) {
+            request->callback(request->user_data);
+        }
+    }
 
-RDTexture rd_get_white_texture(Renderer* r) {
-    return r->white_texture;
+    memmove(uploads->in_flight.mem, uploads->in_flight.mem + finished, (uploads->in_flight.len - finished) * sizeof(UploadRequest));
+    uploads->in_flight.len -= finished;
 }
 
-struct ShaderLightsInfo {
-	u32 num_point_lights;
-	u32 num_directional_lights;
-	u32 point_lights_addr;
-	u32 directional_lights_addr;
-};
-
-struct ShaderMaterial {
-    u32 albedo_texture_addr;
-    XMFLOAT3 albedo_factor;
-};
+// Works out the levels each streamed texture wants from the instances using it, and queues the loads and evictions
+// that fit this frame. A texture changing levels is rebuilt whole, as a committed resource can't grow or shrink.
+static void stream_textures(Renderer* r) {
+    PROFILE_FUNCTION();
 
-static void gbuffer_pass_proc(Renderer* r, CommandList* cmd, Pipeline* pipeline) {
-    cmd->list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    for (int i = r->retired_texture_resources.len-1; i >= 0; --i) {
+        RetiredTextureResource retired = r->retired_texture_resources[i];
 
-    ConstantBuffer camera_cbuffer = r->get_constant_buffer(sizeof(XMMATRIX), &r->view_projection_matrix);
-    cmd->drop_constant_buffer(camera_cbuffer);
-    pipeline->bind_descriptor(cmd, "camera_addr", camera_cbuffer.view);
+        if (r->direct_queue.reached(retired.fence)) {
+            r->bindless_heap.free_descriptor(retired.view);
+            retired.resource->Release();
+            r->retired_texture_resources.remove_by_patch(i);
+        }
+    }
 
-    int vbuffer_addr   = pipeline->bindings["vbuffer_addr"];
-    int ibuffer_addr   = pipeline->bindings["ibuffer_addr"];
-    int transform_addr = pipeline->bindings["transform_addr"];
-    int material_addr  = pipeline->bindings["material_addr"];
+    RDRenderInfo* render_info = r->render_info;
+    StreamingInstance* instances = r->frame_arena.push_array<StreamingInstance>(render_info->num_instances);
+    u32 instance_count = 0;
 
-    for (u32 i = 0; i < r->render_info->num_instances; ++i) {
-        RDMeshInstance* instance = &r->render_info->instances[i];
+    for (u32 i = 0; i < render_info->num_instances; ++i) {
+        RDMeshInstance* instance = &render_info->instances[i];
+        TextureData* texture = r->texture_manager.at(instance->material.albedo_texture);
 
-        MeshData* mesh_data = r->mesh_manager.at(instance->mesh);
-        TextureData* texture_data = r->texture_manager.at(instance->material.albedo_texture);
+        if (!texture->streaming_ready) {
+            continue;
+        }
 
-        ConstantBuffer transform_cbuffer = r->get_constant_buffer(sizeof(XMMATRIX), &instance->transform);
-        cmd->drop_constant_buffer(transform_cbuffer);
+        MeshData* mesh = r->mesh_manager.at(instance->mesh);
 
-        ShaderMaterial material;
-        material.albedo_texture_addr = texture_data->view.index;
-        material.albedo_factor = instance->material.albedo_factor;
+        XMVECTOR center = XMVector3Transform(XMLoadFloat3(&mesh->bounds.sphere_center), instance->transform);
+        XMVECTOR scale_sq = XMVectorMax(XMVector3LengthSq(instance->transform.r[0]), XMVectorMax(XMVector3LengthSq(instance->transform.r[1]), XMVector3LengthSq(instance->transform.r[2])));
+        f32 scale = sqrtf(XMVectorGetX(scale_sq));
 
-        ConstantBuffer material_cbuffer = r->get_constant_buffer(sizeof(material), &material);
-        cmd->drop_constant_buffer(material_cbuffer);
+        StreamingInstance* streaming_instance = &instances[instance_count++];
+        streaming_instance->texture = texture->streaming;
+        XMStoreFloat3(&streaming_instance->center, center);
+        streaming_instance->radius = mesh->bounds.sphere_radius * scale;
+        streaming_instance->uv_density = scale > 0.0f ? mesh->uv_density / scale : 0.0f;
+    }
 
-        pipeline->bind_descriptor_at_offset(cmd, vbuffer_addr  , mesh_data->vbuffer_view);
-        pipeline->bind_descriptor_at_offset(cmd, ibuffer_addr  , mesh_data->ibuffer_view);
-        pipeline->bind_descriptor_at_offset(cmd, transform_addr, transform_cbuffer.view);
-        pipeline->bind_descriptor_at_offset(cmd, material_addr , material_cbuffer.view);
+    StreamingView view = {};
+    XMStoreFloat3(&view.position, render_info->camera->transform.r[3]);
+    view.vertical_fov = render_info->camera->vertical_fov;
+    view.screen_height = (f32)r->swapchain_h;
 
-        cmd->list->DrawInstanced(mesh_data->index_count, 1, 0, 0);
-    }
-}
+    r->texture_streamer.begin_frame();
+    streaming_compute_demand(&r->texture_streamer, &view, instance_count, instances);
 
-static void lighting_pass_proc(Renderer* r, CommandList* cmd, Pipeline* pipeline) {
-    auto render_info = r->render_info;
+    StreamingBudget budget = {};
+    budget.bytes_per_frame = TEXTURE_STREAMING_BYTES_PER_FRAME;
+    budget.memory_bytes = TEXTURE_STREAMING_MEMORY_BYTES;
 
-    assert(render_info->num_point_lights <= MAX_POINT_LIGHT_COUNT);
-    assert(render_info->num_directional_lights <= MAX_DIRECTIONAL_LIGHT_COUNT);
+    StreamingOp* ops = r->frame_arena.push_array<StreamingOp>(r->texture_streamer.textures.len);
+    u32 op_count = r->texture_streamer.schedule(&budget, ops);
 
-    cmd->buffer_upload(r, r->point_light_buffer, render_info->num_point_lights * sizeof(RDPointLight), render_info->point_lights);
-    cmd->buffer_upload(r, r->directional_light_buffer, render_info->num_directional_lights * sizeof(RDDirectionalLight), render_info->directional_lights);
+    for (u32 i = 0; i < op_count; ++i) {
+        StreamingOp* op = &ops[i];
+        RDTexture texture = r->streamed_textures[op->texture];
+        TextureData* data = r->texture_manager.at(texture);
 
-    ShaderLightsInfo lights_info = {};
-    lights_info.num_point_lights = render_info->num_point_lights;
-    lights_info.num_directional_lights = render_info->num_directional_lights;
-    lights_info.point_lights_addr = r->point_light_buffer_view.index;
-    lights_info.directional_lights_addr = r->directional_light_buffer_view.index;
+        UploadRequest request = {};
+        request.kind = UPLOAD_REQUEST_STREAMING;
+        request.priority = RD_UPLOAD_PRIORITY_STREAMING;
+        request.texture = texture;
+        request.level = op->mip;
+        request.streaming_op = op->kind;
 
-    ConstantBuffer lights_cbuffer = r->get_constant_buffer(sizeof(lights_info), &lights_info);
-    cmd->drop_constant_buffer(lights_cbuffer);
-    pipeline->bind_descriptor(cmd, "lights_info_addr", lights_cbuffer.view);
+        if (op->kind == STREAMING_OP_LOAD) {
+            D3D12_RESOURCE_DESC desc = streamed_resource_desc(data, op->mip);
+            request.size = texture_upload_size(r, &desc, 0, 1);
+        }
 
-    XMMATRIX inverse_view_projection_matrix = XMMatrixInverse(0, r->view_projection_matrix);
-    ConstantBuffer inverse_view_projection_cbuffer = r->get_constant_buffer(sizeof(inverse_view_projection_matrix), &inverse_view_projection_matrix);
-    cmd->drop_constant_buffer(inverse_view_projection_cbuffer);
-    pipeline->bind_descriptor(cmd, "inverse_view_projection_addr", inverse_view_projection_cbuffer.view);
-    
-    cmd->list->Dispatch(r->swapchain_w / pipeline->group_size_x + 1, r->swapchain_h / pipeline->group_size_y + 1, 1);
+        r->uploads.enqueue(request);
+    }
 }
 
 void rd_render(Renderer* r, RDRenderInfo* render_info) {
+    PROFILE_FUNCTION();
+
     r->render_info = render_info;
+    r->frame_index++;
+    r->frame_arena.reset();
 
     auto [window_w, window_h] = hwnd_size(r->window);
 
@@ -1481,8 +4194,6 @@ void rd_render(Renderer* r, RDRenderInfo* render_info) {
     if (r->swapchain_w != window_w || r->swapchain_h != window_h) {
         r->direct_queue.flush();
 
-        r->render_graph->free(r);
-
         r->release_swapchain_buffers();
         r->swapchain->ResizeBuffers(0, window_w, window_h, DXGI_FORMAT_UNKNOWN, 0);
 
@@ -1492,41 +4203,68 @@ void rd_render(Renderer* r, RDRenderInfo* render_info) {
         r->get_swapchain_buffers();
     }
 
-    if (!r->render_graph->is_built) {
-        RenderGraphTexture gbuffer_albedo = r->render_graph->create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
-        RenderGraphTexture gbuffer_normal = r->render_graph->create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
-        RenderGraphTexture render_target2 = r->render_graph->create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
-        RenderGraphTexture depth_buffer = r->render_graph->create_texture(r, RD_FORMAT_R32_FLOAT, RD_TEXTURE_USAGE_DEPTH_BUFFER);
+    retire_render_graph_textures(r);
 
-        r->render_graph->add_pass(&r->gbuffer_pipeline, gbuffer_pass_proc)
-            ->render_target(r, gbuffer_albedo)
-            ->render_target(r, gbuffer_normal)
-            ->depth_buffer(r, depth_buffer);
+    poll_uploads(r);
+    stream_textures(r);
+    drain_uploads(r);
 
-        auto final_pass = r->render_graph->add_pass(&r->lighting_pipeline, lighting_pass_proc)
-            ->write(r, render_target2, "target_texture_addr")
-            ->read(r, gbuffer_albedo, "albedo_texture_addr")
-            ->read(r, gbuffer_normal, "normal_texture_addr")
-            ->read(r, depth_buffer, "depth_texture_addr");
+    r->stats.begin_frame(r->frame_index);
 
-        r->render_graph->set_final_pass(final_pass);
+    RenderGraph graph;
+    graph.init(&r->frame_arena);
 
-        r->render_graph->build();
-    }
+    RenderGraphTexture gbuffer_albedo = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture gbuffer_normal = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture render_target2 = graph.create_texture(r, RD_FORMAT_RGBA8_UNORM, RD_TEXTURE_USAGE_RENDER_TARGET);
+    RenderGraphTexture depth_buffer = graph.create_texture(r, RD_FORMAT_R32_FLOAT, RD_TEXTURE_USAGE_DEPTH_BUFFER);
+
+    // Starts with the textured variant, the pass switches per material.
+    Pipeline* gbuffer_pipeline = get_pipeline_variant(r, &r->gbuffer_pipelines, GBUFFER_ALBEDO_TEXTURE);
+
+    u32 lighting_variant = 0;
+    lighting_variant |= render_info->num_point_lights > 0 ? LIGHTING_POINT_LIGHTS : 0;
+    lighting_variant |= render_info->num_directional_lights > 0 ? LIGHTING_DIRECTIONAL_LIGHTS : 0;
+
+    Pipeline* lighting_pipeline = get_pipeline_variant(r, &r->lighting_pipelines, lighting_variant);
+
+    graph.add_pass("gbuffer", gbuffer_pipeline, gbuffer_pass_proc)
+        ->parallel(gbuffer_pass_work_count)
+        ->render_target(gbuffer_albedo)
+        ->render_target(gbuffer_normal)
+        ->depth_buffer(depth_buffer);
+
+    auto final_pass = graph.add_pass("lighting", lighting_pipeline, lighting_pass_proc)
+        ->async_compute()
+        ->write(render_target2, LIGHTING_ROOT_TARGET_TEXTURE_ADDR)
+        ->read(gbuffer_albedo, LIGHTING_ROOT_ALBEDO_TEXTURE_ADDR)
+        ->read(gbuffer_normal, LIGHTING_ROOT_NORMAL_TEXTURE_ADDR)
+        ->read(depth_buffer, LIGHTING_ROOT_DEPTH_TEXTURE_ADDR);
+
+    graph.set_final_pass(final_pass);
+
+    PROFILE_COUNTER("instances", render_info->num_instances);
 
     u32 swapchain_index = r->swapchain->GetCurrentBackBufferIndex();
-    r->direct_queue.wait(r->swapchain_fences[swapchain_index]);
 
-    CommandList cmd = r->open_command_list(D3D12_COMMAND_LIST_TYPE_DIRECT);
-    cmd->SetGraphicsRootSignature(r->root_signature);
-    cmd->SetComputeRootSignature(r->root_signature);
-    cmd->SetDescriptorHeaps(1, &r->bindless_heap.heap);
+    {
+        PROFILE_ZONE("wait_for_swapchain");
+        r->direct_queue.wait(r->swapchain_fences[swapchain_index]);
+    }
 
     XMMATRIX view_matrix = XMMatrixInverse(0, render_info->camera->transform);
     XMMATRIX projection_matrix = XMMatrixPerspectiveFovRH(render_info->camera->vertical_fov, (f32)r->swapchain_w/(f32)r->swapchain_h, 1000.0f, 0.1f);
     r->view_projection_matrix = view_matrix * projection_matrix;
 
-    RDTexture final_image = r->render_graph->execute(r, &cmd);
+    cull_instances(r);
+    occlusion_cull_instances(r);
+    select_instance_lods(r);
+    cull_instance_meshlets(r);
+    cluster_lights(r, view_matrix);
+
+    RDTexture final_image = graph.execute(r, &r->frame_command_lists);
+
+    CommandList cmd = r->open_frame_command_list(D3D12_COMMAND_LIST_TYPE_DIRECT);
 
     r->texture_manager.at(final_image)->transition(&cmd, D3D12_RESOURCE_STATE_COPY_SOURCE);
 
@@ -1554,8 +4292,39 @@ void rd_render(Renderer* r, RDRenderInfo* render_info) {
     swap(barrier.Transition.StateBefore, barrier.Transition.StateAfter);
     cmd->ResourceBarrier(1, &barrier);
 
-    r->direct_queue.submit_command_list(cmd);
+    r->stats.resolve(&cmd);
+
+    u64 frame_fence = r->direct_queue.submit_command_list(cmd);
+
+    for (u32 i = 0; i < r->render_graph_textures.len; ++i) {
+        RenderGraphPooledTexture* pooled = &r->render_graph_textures[i];
+
+        if (pooled->last_used_frame == r->frame_index) {
+            pooled->last_used_fence = frame_fence;
+        }
+    }
+
+    {
+        PROFILE_ZONE("present");
+        r->swapchain->Present(0, 0);
+    }
 
-    r->swapchain->Present(0, 0);
     r->swapchain_fences[swapchain_index] = r->direct_queue.signal();
+
+    r->stats.end_frame(frame_fence);
+}
+
+void rd_get_frame_stats(Renderer* r, RDFrameStats* stats) {
+    r->stats.get(stats);
+
+    stats->streamed_texture_bytes = r->texture_streamer.resident_bytes;
+    stats->streamed_texture_loads = r->texture_streamer.loads;
+    stats->streamed_texture_evictions = r->texture_streamer.evictions;
+    stats->queued_upload_bytes = r->uploads.queued_bytes;
+    stats->staging_upload_bytes = r->uploads.staging_bytes;
+}
+
+void rd_set_upload_budget(Renderer* r, u64 bytes_per_frame, u64 staging_bytes) {
+    r->uploads.bytes_per_frame = bytes_per_frame;
+    r->uploads.staging_budget = staging_bytes;
 }
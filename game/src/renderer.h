@@ -12,6 +12,30 @@ struct Renderer;
 Renderer* rd_init(Arena* arena, void* window);
 void rd_free(Renderer* r);
 
+enum RDRootConstantsStatus {
+    RD_ROOT_CONSTANTS_UP_TO_DATE,
+    RD_ROOT_CONSTANTS_REGENERATED,
+    // A shader didn't compile or the header couldn't be written. The reason is in the debug log.
+    RD_ROOT_CONSTANTS_FAILED,
+};
+
+// Reflects the root constants of every pipeline's shaders and checks them against the root_constants.h this was built
+// with. When they differ it writes them out to path, so the post-build step that runs it fails until the renderer is
+// rebuilt against the new header. Needs no device.
+RDRootConstantsStatus rd_generate_root_constants(const char* path);
+
+// Runs the lighting pass's largest uploads through a ring the size of the compute queue's, checking they never wait on
+// the GPU. Needs no device.
+void rd_staging_benchmark();
+
+// Compiles a graph with passes on both queues and checks its batches, their waits and the barriers the compute batch's
+// prologue records. Needs no device.
+bool rd_test_render_graph();
+
+// Records a gbuffer pass of instance_count instances into command lists that do nothing, on one job thread and then
+// more, and logs how recording time scales. Needs no device.
+void rd_recording_benchmark(u32 instance_count);
+
 struct RDUploadContext;
 struct RDUploadStatus;
 RDUploadContext* rd_open_upload_context(Renderer* r);
@@ -19,21 +43,71 @@ RDUploadStatus* rd_submit_upload_context(Renderer* r, RDUploadContext* upload_co
 bool rd_upload_status_finished(Renderer* r, RDUploadStatus* upload_status);
 void rd_flush_upload(Renderer* r, RDUploadStatus* upload_status);
 
+// Async uploads are queued and recorded into one copy command list per frame by rd_render, as far as the budgets let
+// them: bytes_per_frame of requests recorded each frame, and staging_bytes of upload memory in flight. A request larger
+// than a budget goes by itself. Higher priorities go first, and requests of the same priority in the order made.
+#define RD_UPLOAD_PRIORITY_STREAMING 0
+#define RD_UPLOAD_PRIORITY_NORMAL 1
+#define RD_UPLOAD_PRIORITY_HIGH 2
+
+// Called from rd_render once the copy queue has finished the upload. It mustn't free renderer resources.
+typedef void (*RDUploadCallback)(void* user_data);
+
+void rd_set_upload_budget(Renderer* r, u64 bytes_per_frame, u64 staging_bytes);
+
 RESOURCE_HANDLE(RDMesh);
 RESOURCE_HANDLE(RDTexture);
 
-struct RDVertex {
-    XMFLOAT3 pos;
-    XMFLOAT3 norm;
-    XMFLOAT2 uv;
+// 16 bytes. Positions are unorm16 inside the mesh's quantization box, normals are octahedral snorm16 and uvs are halfs.
+// See vertex_format.h for packing.
+struct RDPackedVertex {
+    u16 position[3];
+    u16 padding;
+    i16 normal[2];
+    u16 uv[2];
 };
 
-RDMesh rd_create_mesh(Renderer* r, RDUploadContext* upload_context, RDVertex* vertex_data, u32 vertex_count, u32* index_data, u32 index_count);
+// Local space position = position_offset + position_scale * packed position, per axis.
+struct RDMeshQuantization {
+    XMFLOAT3 position_offset;
+    XMFLOAT3 position_scale;
+};
+
+#define RD_MAX_MESH_LODS 6
+
+// A level of detail is a range of the mesh's index buffer, sharing its vertices with the other levels. error is how far
+// its surface strays from level 0, in local units.
+struct RDMeshLod {
+    u32 index_offset;
+    u32 index_count;
+    f32 error;
+};
+
+// Indices are stored as 16 bits on the GPU when vertex_count allows. Level 0 is the most detailed.
+RDMesh rd_create_mesh(Renderer* r, RDUploadContext* upload_context, RDPackedVertex* vertex_data, u32 vertex_count, RDMeshQuantization* quantization, u32* index_data, u32 index_count, u32 lod_count, RDMeshLod* lods);
+// vertex_data and index_data have to stay around until callback is called.
+RDMesh rd_create_mesh_async(Renderer* r, RDPackedVertex* vertex_data, u32 vertex_count, RDMeshQuantization* quantization, u32* index_data, u32 index_count, u32 lod_count, RDMeshLod* lods, u32 priority, RDUploadCallback callback, void* user_data);
 void rd_free_mesh(Renderer* r, RDMesh mesh);
 
+// Local space, computed from the vertices when the mesh is created.
+struct RDMeshBounds {
+    XMFLOAT3 aabb_min;
+    XMFLOAT3 aabb_max;
+    XMFLOAT3 sphere_center;
+    f32 sphere_radius;
+};
+
+RDMeshBounds rd_get_mesh_bounds(Renderer* r, RDMesh mesh);
+
 enum RDFormat {
     RD_FORMAT_RGBA8_UNORM,
     RD_FORMAT_R32_FLOAT,
+
+    // Block compressed, resource textures only. Level 0 must be a multiple of 4 on each side.
+    RD_FORMAT_BC1_UNORM,
+    RD_FORMAT_BC3_UNORM,
+    RD_FORMAT_BC5_UNORM,
+    RD_FORMAT_BC7_UNORM,
 };
 
 enum RDTextureUsage {
@@ -42,10 +116,33 @@ enum RDTextureUsage {
     RD_TEXTURE_USAGE_RENDER_TARGET,
 };
 
-RDTexture rd_create_texture(Renderer* r, u32 width, u32 height, RDFormat format, RDTextureUsage usage);
+RDTexture rd_create_texture(Renderer* r, u32 width, u32 height, u32 mip_levels, RDFormat format, RDTextureUsage usage);
+// data holds every mip level tightly packed, level 0 first. Block compressed levels are rows of blocks.
 void rd_upload_texture_data(Renderer* r, RDUploadContext* upload_context, RDTexture texture, void* data);
+
+// Staging memory for one level of a texture, to be written before the upload context is submitted. It holds row_count
+// rows of row_size bytes, row_pitch apart. Block compressed levels have a row per row of blocks.
+struct RDUploadRegion {
+    u8* ptr;
+    u32 row_pitch;
+    u32 row_size;
+    u32 row_count;
+};
+
+// Lets texels be decoded or converted straight into upload memory, rather than into a buffer of their own that
+// rd_upload_texture_data would copy over.
+RDUploadRegion rd_reserve_texture_upload(Renderer* r, RDUploadContext* upload_context, RDTexture texture, u32 level);
+// Queues a request per level, finest first, so a large texture is spread over frames. data has to stay around until
+// callback is called.
+void rd_upload_texture_data_async(Renderer* r, RDTexture texture, void* data, u32 priority, RDUploadCallback callback, void* user_data);
 void rd_free_texture(Renderer* r, RDTexture texture);
 
+// A resource texture whose finer levels come and go with how large the instances using it are on screen. Only the
+// small levels are queued now at RD_UPLOAD_PRIORITY_HIGH, and callback is called once they've landed. The rest are
+// streamed in from data at RD_UPLOAD_PRIORITY_STREAMING as they're wanted, and dropped again when streamed textures run
+// out of memory. data is laid out as for rd_upload_texture_data and has to stay around until the texture is freed.
+RDTexture rd_create_streamed_texture(Renderer* r, u32 width, u32 height, u32 mip_levels, RDFormat format, void* data, RDUploadCallback callback, void* user_data);
+
 RDTexture rd_get_white_texture(Renderer* r);
 
 struct RDMaterial {
@@ -86,4 +183,48 @@ struct RDRenderInfo {
     RDMeshInstance* instances;
 };
 
-void rd_render(Renderer* r, RDRenderInfo* render_info);
\ No newline at end of file
+void rd_render(Renderer* r, RDRenderInfo* render_info);
+
+#define RD_MAX_PASS_STATS 32
+
+struct RDTimingStats {
+    f32 average;
+    f32 p50;
+    f32 p95;
+    f32 p99;
+    f32 maximum;
+};
+
+struct RDPassCounters {
+    u32 draws;
+    u32 dispatches;
+    u32 barriers;
+    u32 root_constant_sets;
+    u32 constant_buffers;
+    u64 upload_bytes;
+};
+
+struct RDPassStats {
+    const char* name;
+    RDTimingStats cpu_ms; // Recording time, summed over every thread that recorded part of the pass.
+    RDTimingStats gpu_ms;
+    RDPassCounters counters; // From the most recent frame that ran the pass.
+};
+
+// Timings cover a rolling window of recent frames. GPU times lag the CPU by the frames in flight.
+struct RDFrameStats {
+    RDTimingStats cpu_frame_ms;
+    u32 num_passes;
+    RDPassStats passes[RD_MAX_PASS_STATS];
+
+    // Levels of streamed textures resident or on their way, and the loads and evictions since startup.
+    u64 streamed_texture_bytes;
+    u32 streamed_texture_loads;
+    u32 streamed_texture_evictions;
+
+    // Async uploads waiting for the budgets, and staging memory taken by the ones the copy queue hasn't finished.
+    u64 queued_upload_bytes;
+    u64 staging_upload_bytes;
+};
+
+void rd_get_frame_stats(Renderer* r, RDFrameStats* stats);
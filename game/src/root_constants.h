@@ -0,0 +1,54 @@
+// Generated from the shaders' root constant buffers by running the game with -gen_root_constants. Don't edit it,
+// run that again when a root constant buffer changes, rd_init checks the layouts below against the shaders.
+
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+struct GbufferRootConstants {
+    u32 camera_addr;
+    u32 vbuffer_addr;
+    u32 instance_addr;
+    u32 material_addr;
+};
+
+constexpr u32 GBUFFER_ROOT_CAMERA_ADDR = 0;
+constexpr u32 GBUFFER_ROOT_VBUFFER_ADDR = 1;
+constexpr u32 GBUFFER_ROOT_INSTANCE_ADDR = 2;
+constexpr u32 GBUFFER_ROOT_MATERIAL_ADDR = 3;
+constexpr u32 GBUFFER_ROOT_CONSTANTS_SIZE = 4;
+constexpr u64 GBUFFER_ROOT_LAYOUT = 0xb5fe135ddcd7209bull;
+
+static_assert(offsetof(GbufferRootConstants, camera_addr) == GBUFFER_ROOT_CAMERA_ADDR * sizeof(u32), "GbufferRootConstants is not packed like the shader");
+static_assert(offsetof(GbufferRootConstants, vbuffer_addr) == GBUFFER_ROOT_VBUFFER_ADDR * sizeof(u32), "GbufferRootConstants is not packed like the shader");
+static_assert(offsetof(GbufferRootConstants, instance_addr) == GBUFFER_ROOT_INSTANCE_ADDR * sizeof(u32), "GbufferRootConstants is not packed like the shader");
+static_assert(offsetof(GbufferRootConstants, material_addr) == GBUFFER_ROOT_MATERIAL_ADDR * sizeof(u32), "GbufferRootConstants is not packed like the shader");
+static_assert(sizeof(GbufferRootConstants) == GBUFFER_ROOT_CONSTANTS_SIZE * sizeof(u32), "GbufferRootConstants is not packed like the shader");
+
+struct LightingRootConstants {
+    u32 albedo_texture_addr;
+    u32 normal_texture_addr;
+    u32 depth_texture_addr;
+    u32 target_texture_addr;
+    u32 lights_info_addr;
+    u32 inverse_view_projection_addr;
+};
+
+constexpr u32 LIGHTING_ROOT_ALBEDO_TEXTURE_ADDR = 0;
+constexpr u32 LIGHTING_ROOT_NORMAL_TEXTURE_ADDR = 1;
+constexpr u32 LIGHTING_ROOT_DEPTH_TEXTURE_ADDR = 2;
+constexpr u32 LIGHTING_ROOT_TARGET_TEXTURE_ADDR = 3;
+constexpr u32 LIGHTING_ROOT_LIGHTS_INFO_ADDR = 4;
+constexpr u32 LIGHTING_ROOT_INVERSE_VIEW_PROJECTION_ADDR = 5;
+constexpr u32 LIGHTING_ROOT_CONSTANTS_SIZE = 6;
+constexpr u64 LIGHTING_ROOT_LAYOUT = 0x95d73a17fd04e49cull;
+
+static_assert(offsetof(LightingRootConstants, albedo_texture_addr) == LIGHTING_ROOT_ALBEDO_TEXTURE_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(offsetof(LightingRootConstants, normal_texture_addr) == LIGHTING_ROOT_NORMAL_TEXTURE_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(offsetof(LightingRootConstants, depth_texture_addr) == LIGHTING_ROOT_DEPTH_TEXTURE_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(offsetof(LightingRootConstants, target_texture_addr) == LIGHTING_ROOT_TARGET_TEXTURE_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(offsetof(LightingRootConstants, lights_info_addr) == LIGHTING_ROOT_LIGHTS_INFO_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(offsetof(LightingRootConstants, inverse_view_projection_addr) == LIGHTING_ROOT_INVERSE_VIEW_PROJECTION_ADDR * sizeof(u32), "LightingRootConstants is not packed like the shader");
+static_assert(sizeof(LightingRootConstants) == LIGHTING_ROOT_CONSTANTS_SIZE * sizeof(u32), "LightingRootConstants is not packed like the shader");
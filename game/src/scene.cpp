@@ -0,0 +1,334 @@
+#include <string.h>
+
+#include "scene.h"
+#include "block_compression.h"
+#include "mipmaps.h"
+#include "profiler.h"
+
+static RDMeshInstance create_instance(SceneInstance* instance, RDMesh* meshes, RDMaterial* materials) {
+    RDMeshInstance result;
+    result.mesh = meshes[instance->mesh];
+    result.material = materials[instance->material];
+    result.transform = XMLoadFloat4x4(&instance->transform);
+    return result;
+}
+
+static void upload_finished(void* user_data) {
+    u32* pending_uploads = (u32*)user_data;
+    (*pending_uploads)--;
+}
+
+Scene scene_create(Arena* arena, Renderer* renderer, SceneData* data) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(arena);
+
+    Scene scene = {};
+    scene.pending_uploads = arena->push_type<u32>();
+
+    scene.num_textures = data->num_textures;
+    scene.textures = arena->push_array<RDTexture>(data->num_textures);
+
+    for (u32 i = 0; i < data->num_textures; ++i) {
+        SceneTexture* texture = &data->textures[i];
+        scene.textures[i] = rd_create_streamed_texture(renderer, texture->width, texture->height, texture->mip_levels, texture->format, texture->data, upload_finished, scene.pending_uploads);
+        (*scene.pending_uploads)++;
+    }
+
+    scene.num_meshes = data->num_meshes;
+    scene.meshes = arena->push_array<RDMesh>(data->num_meshes);
+
+    for (u32 i = 0; i < data->num_meshes; ++i) {
+        SceneMesh* mesh = &data->meshes[i];
+        scene.meshes[i] = rd_create_mesh_async(renderer, mesh->vertices, mesh->vertex_count, &mesh->quantization, mesh->indices, mesh->index_count, mesh->lod_count, mesh->lods, RD_UPLOAD_PRIORITY_NORMAL, upload_finished, scene.pending_uploads);
+        (*scene.pending_uploads)++;
+    }
+
+    RDMaterial* materials = scratch->push_array<RDMaterial>(data->num_materials);
+
+    for (u32 i = 0; i < data->num_materials; ++i) {
+        SceneMaterial* material = &data->materials[i];
+        materials[i].albedo_texture = material->albedo_texture == SCENE_NO_TEXTURE ? rd_get_white_texture(renderer) : scene.textures[material->albedo_texture];
+        materials[i].albedo_factor = material->albedo_factor;
+    }
+
+    scene.num_instances = data->num_instances;
+    scene.instances = arena->push_array<RDMeshInstance>(data->num_instances);
+
+    for (u32 i = 0; i < data->num_instances; ++i) {
+        scene.instances[i] = create_instance(&data->instances[i], scene.meshes, materials);
+    }
+
+    scene.num_batched_instances = data->num_batched_instances;
+    scene.batched_instances = arena->push_array<RDMeshInstance>(data->num_batched_instances);
+
+    for (u32 i = 0; i < data->num_batched_instances; ++i) {
+        scene.batched_instances[i] = create_instance(&data->batched_instances[i], scene.meshes, materials);
+    }
+
+    return scene;
+}
+
+// Offsets are from the start of the file. Materials and instances are stored as they are in SceneData, as they hold no pointers.
+
+struct CookedHeader {
+    u32 magic;
+    u32 version;
+    u64 file_size;
+    SceneCookInfo info;
+
+    u32 num_meshes;
+    u32 num_textures;
+    u32 num_materials;
+    u32 num_instances;
+    u32 num_batched_instances;
+    u32 padding;
+
+    u64 meshes;
+    u64 textures;
+    u64 materials;
+    u64 instances;
+    u64 batched_instances;
+};
+
+struct CookedMesh {
+    u32 vertex_count;
+    u32 index_count;
+    u32 lod_count;
+    RDMeshQuantization quantization;
+    RDMeshLod lods[RD_MAX_MESH_LODS];
+    u64 vertices;
+    u64 indices;
+};
+
+struct CookedTexture {
+    u32 width;
+    u32 height;
+    u32 mip_levels;
+    u32 format;
+    u64 size;
+    u64 data;
+};
+
+static u64 cooked_reserve(u64* file_size, u64 size) {
+    u64 offset = (*file_size + SCENE_COOKED_ALIGNMENT - 1) & ~(u64)(SCENE_COOKED_ALIGNMENT - 1);
+    *file_size = offset + size;
+    return offset;
+}
+
+bool scene_write_cooked(SceneData* data, SceneCookInfo* info, const char* path) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    // Everything is placed first, so the file is written from one buffer of the final size.
+    CookedHeader header = {};
+    header.magic = SCENE_COOKED_MAGIC;
+    header.version = SCENE_COOKED_VERSION;
+    header.info = *info;
+    header.num_meshes = data->num_meshes;
+    header.num_textures = data->num_textures;
+    header.num_materials = data->num_materials;
+    header.num_instances = data->num_instances;
+    header.num_batched_instances = data->num_batched_instances;
+
+    u64 file_size = sizeof(CookedHeader);
+
+    header.meshes = cooked_reserve(&file_size, data->num_meshes * sizeof(CookedMesh));
+    header.textures = cooked_reserve(&file_size, data->num_textures * sizeof(CookedTexture));
+    header.materials = cooked_reserve(&file_size, data->num_materials * sizeof(SceneMaterial));
+    header.instances = cooked_reserve(&file_size, data->num_instances * sizeof(SceneInstance));
+    header.batched_instances = cooked_reserve(&file_size, data->num_batched_instances * sizeof(SceneInstance));
+
+    CookedMesh* meshes = scratch->push_array<CookedMesh>(data->num_meshes);
+
+    for (u32 i = 0; i < data->num_meshes; ++i) {
+        SceneMesh* mesh = &data->meshes[i];
+        CookedMesh* cooked = &meshes[i];
+
+        cooked->vertex_count = mesh->vertex_count;
+        cooked->index_count = mesh->index_count;
+        cooked->lod_count = mesh->lod_count;
+        cooked->quantization = mesh->quantization;
+        memcpy(cooked->lods, mesh->lods, sizeof(cooked->lods));
+        cooked->vertices = cooked_reserve(&file_size, mesh->vertex_count * sizeof(RDPackedVertex));
+        cooked->indices = cooked_reserve(&file_size, mesh->index_count * sizeof(u32));
+    }
+
+    CookedTexture* textures = scratch->push_array<CookedTexture>(data->num_textures);
+
+    for (u32 i = 0; i < data->num_textures; ++i) {
+        SceneTexture* texture = &data->textures[i];
+        CookedTexture* cooked = &textures[i];
+
+        cooked->width = texture->width;
+        cooked->height = texture->height;
+        cooked->mip_levels = texture->mip_levels;
+        cooked->format = texture->format;
+        cooked->size = texture->size;
+        cooked->data = cooked_reserve(&file_size, texture->size);
+    }
+
+    header.file_size = file_size;
+
+    u8* file = (u8*)scratch->push_zero(file_size);
+
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + header.meshes, meshes, data->num_meshes * sizeof(CookedMesh));
+    memcpy(file + header.textures, textures, data->num_textures * sizeof(CookedTexture));
+    memcpy(file + header.materials, data->materials, data->num_materials * sizeof(SceneMaterial));
+    memcpy(file + header.instances, data->instances, data->num_instances * sizeof(SceneInstance));
+    memcpy(file + header.batched_instances, data->batched_instances, data->num_batched_instances * sizeof(SceneInstance));
+
+    for (u32 i = 0; i < data->num_meshes; ++i) {
+        memcpy(file + meshes[i].vertices, data->meshes[i].vertices, meshes[i].vertex_count * sizeof(RDPackedVertex));
+        memcpy(file + meshes[i].indices, data->meshes[i].indices, meshes[i].index_count * sizeof(u32));
+    }
+
+    for (u32 i = 0; i < data->num_textures; ++i) {
+        memcpy(file + textures[i].data, data->textures[i].data, textures[i].size);
+    }
+
+    return pf_write_file(path, file, file_size);
+}
+
+static bool cooked_in_bounds(FileContents file, u64 offset, u64 size) {
+    return offset % SCENE_COOKED_ALIGNMENT == 0 && offset <= file.size && size <= file.size - offset;
+}
+
+static bool cooked_instances_valid(SceneData* data, u32 count, SceneInstance* instances) {
+    for (u32 i = 0; i < count; ++i) {
+        if (instances[i].mesh >= data->num_meshes || instances[i].material >= data->num_materials) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Textures are cooked as RGBA8 or block compressed chains, with every level tightly packed.
+static bool cooked_texture_valid(CookedTexture* texture) {
+    bool rgba = texture->format == RD_FORMAT_RGBA8_UNORM;
+    bool compressed = texture->format >= RD_FORMAT_BC1_UNORM && texture->format <= RD_FORMAT_BC7_UNORM;
+
+    if (!(rgba || compressed) || texture->width == 0 || texture->height == 0 ||
+        texture->mip_levels < 1 || texture->mip_levels > mip_level_count(texture->width, texture->height))
+    {
+        return false;
+    }
+
+    if (compressed) {
+        return texture->width % 4 == 0 && texture->height % 4 == 0 &&
+            texture->size == bc_chain_size((RDFormat)texture->format, texture->width, texture->height, texture->mip_levels);
+    }
+
+    return texture->size == mip_chain_size(texture->width, texture->height, texture->mip_levels);
+}
+
+static bool cooked_header_valid(FileContents file) {
+    CookedHeader* header = (CookedHeader*)file.memory;
+    return file.size >= sizeof(CookedHeader) && header->magic == SCENE_COOKED_MAGIC && header->version == SCENE_COOKED_VERSION && header->file_size == file.size;
+}
+
+bool scene_read_cooked_info(FileContents file, SceneCookInfo* info) {
+    if (!cooked_header_valid(file)) {
+        return false;
+    }
+
+    *info = ((CookedHeader*)file.memory)->info;
+    return true;
+}
+
+bool scene_read_cooked(Arena* arena, FileContents file, SceneData* data) {
+    PROFILE_FUNCTION();
+
+    if (!cooked_header_valid(file)) {
+        return false;
+    }
+
+    u8* base = (u8*)file.memory;
+    CookedHeader* header = (CookedHeader*)base;
+
+    if (!cooked_in_bounds(file, header->meshes, (u64)header->num_meshes * sizeof(CookedMesh)) ||
+        !cooked_in_bounds(file, header->textures, (u64)header->num_textures * sizeof(CookedTexture)) ||
+        !cooked_in_bounds(file, header->materials, (u64)header->num_materials * sizeof(SceneMaterial)) ||
+        !cooked_in_bounds(file, header->instances, (u64)header->num_instances * sizeof(SceneInstance)) ||
+        !cooked_in_bounds(file, header->batched_instances, (u64)header->num_batched_instances * sizeof(SceneInstance)))
+    {
+        return false;
+    }
+
+    CookedMesh* cooked_meshes = (CookedMesh*)(base + header->meshes);
+    CookedTexture* cooked_textures = (CookedTexture*)(base + header->textures);
+
+    SceneData result = {};
+    result.num_meshes = header->num_meshes;
+    result.meshes = arena->push_array<SceneMesh>(header->num_meshes);
+    result.num_textures = header->num_textures;
+    result.textures = arena->push_array<SceneTexture>(header->num_textures);
+    result.num_materials = header->num_materials;
+    result.materials = (SceneMaterial*)(base + header->materials);
+    result.num_instances = header->num_instances;
+    result.instances = (SceneInstance*)(base + header->instances);
+    result.num_batched_instances = header->num_batched_instances;
+    result.batched_instances = (SceneInstance*)(base + header->batched_instances);
+
+    for (u32 i = 0; i < result.num_meshes; ++i) {
+        CookedMesh* cooked = &cooked_meshes[i];
+        SceneMesh* mesh = &result.meshes[i];
+
+        if (cooked->lod_count < 1 || cooked->lod_count > RD_MAX_MESH_LODS ||
+            !cooked_in_bounds(file, cooked->vertices, (u64)cooked->vertex_count * sizeof(RDPackedVertex)) ||
+            !cooked_in_bounds(file, cooked->indices, (u64)cooked->index_count * sizeof(u32)))
+        {
+            return false;
+        }
+
+        for (u32 l = 0; l < cooked->lod_count; ++l) {
+            if ((u64)cooked->lods[l].index_offset + cooked->lods[l].index_count > cooked->index_count) {
+                return false;
+            }
+        }
+
+        mesh->vertex_count = cooked->vertex_count;
+        mesh->index_count = cooked->index_count;
+        mesh->lod_count = cooked->lod_count;
+        mesh->quantization = cooked->quantization;
+        memcpy(mesh->lods, cooked->lods, sizeof(mesh->lods));
+        mesh->vertices = (RDPackedVertex*)(base + cooked->vertices);
+        mesh->indices = (u32*)(base + cooked->indices);
+    }
+
+    for (u32 i = 0; i < result.num_textures; ++i) {
+        CookedTexture* cooked = &cooked_textures[i];
+        SceneTexture* texture = &result.textures[i];
+
+        if (!cooked_texture_valid(cooked) || !cooked_in_bounds(file, cooked->data, cooked->size)) {
+            return false;
+        }
+
+        texture->width = cooked->width;
+        texture->height = cooked->height;
+        texture->mip_levels = cooked->mip_levels;
+        texture->format = (RDFormat)cooked->format;
+        texture->size = cooked->size;
+        texture->data = base + cooked->data;
+    }
+
+    for (u32 i = 0; i < result.num_materials; ++i) {
+        u32 texture = result.materials[i].albedo_texture;
+
+        if (texture != SCENE_NO_TEXTURE && texture >= result.num_textures) {
+            return false;
+        }
+    }
+
+    if (!cooked_instances_valid(&result, result.num_instances, result.instances) ||
+        !cooked_instances_valid(&result, result.num_batched_instances, result.batched_instances))
+    {
+        return false;
+    }
+
+    *data = result;
+    return true;
+}
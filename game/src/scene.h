@@ -0,0 +1,102 @@
+#pragma once
+
+#include "renderer.h"
+#include "platform.h"
+
+// A scene with everything finished on the CPU: final vertices and indices with their levels of detail, whole texture
+// chains, materials and the flattened instance tables. Imported from glTF, or mapped straight out of a cooked file.
+
+struct SceneMesh {
+    u32 vertex_count;
+    // Of every level together.
+    u32 index_count;
+    u32 lod_count;
+    RDMeshQuantization quantization;
+    RDMeshLod lods[RD_MAX_MESH_LODS];
+    RDPackedVertex* vertices;
+    u32* indices;
+};
+
+struct SceneTexture {
+    u32 width;
+    u32 height;
+    u32 mip_levels;
+    RDFormat format;
+    // Every level tightly packed, as rd_upload_texture_data takes it.
+    u64 size;
+    u8* data;
+};
+
+#define SCENE_NO_TEXTURE 0xffffffff
+
+struct SceneMaterial {
+    // SCENE_NO_TEXTURE samples the white texture.
+    u32 albedo_texture;
+    XMFLOAT3 albedo_factor;
+};
+
+struct SceneInstance {
+    u32 mesh;
+    u32 material;
+    XMFLOAT4X4 transform;
+};
+
+struct SceneData {
+    u32 num_meshes;
+    SceneMesh* meshes;
+    u32 num_textures;
+    SceneTexture* textures;
+    u32 num_materials;
+    SceneMaterial* materials;
+    u32 num_instances;
+    SceneInstance* instances;
+    // The same scene with small static instances merged by material and cell. Empty unless imported with batching.
+    u32 num_batched_instances;
+    SceneInstance* batched_instances;
+};
+
+struct Scene {
+    u32 num_instances;
+    RDMeshInstance* instances;
+    u32 num_batched_instances;
+    RDMeshInstance* batched_instances;
+    u32 num_meshes;
+    RDMesh* meshes;
+    u32 num_textures;
+    RDTexture* textures;
+
+    // Uploads not landed yet. The scene shouldn't be drawn until it's 0.
+    u32* pending_uploads;
+};
+
+// Creates every mesh and texture and queues their uploads. Vertices and indices have to stay around until they've
+// landed, and texture chains until the textures are freed, as they're streamed. The rest of the data can go as soon as
+// this returns.
+Scene scene_create(Arena* arena, Renderer* renderer, SceneData* data);
+
+// Cooked scenes start with this and the version. Files of any other version are turned away, so bump it whenever the
+// layout or the meaning of any payload changes, including RDPackedVertex and the block compressed formats.
+#define SCENE_COOKED_MAGIC 0x454e4353 // "SCNE"
+#define SCENE_COOKED_VERSION 2
+
+// Every section and payload starts on this, so mapped payloads can be copied with aligned loads.
+#define SCENE_COOKED_ALIGNMENT 64
+
+// Kept in the header, to tell whether the file is up to date without reading the rest of it.
+struct SceneCookInfo {
+    // What the scene was made from, like gltf_source_key.
+    u64 source_key;
+    u64 cook_microseconds;
+};
+
+// Writes the scene as one file of a header followed by sections that refer to each other by offset from the start of
+// the file, so it can be mapped anywhere and used in place.
+bool scene_write_cooked(SceneData* data, SceneCookInfo* info, const char* path);
+
+// Returns false when the file is not a cooked scene of this version.
+bool scene_read_cooked_info(FileContents file, SceneCookInfo* info);
+
+// Fills data with pointers into a cooked file's contents, normally from pf_map_file, which have to stay around as long
+// as data is used. Only the tables of meshes and textures are made in arena. Returns false when the file is not a
+// cooked scene of this version, any offset falls outside it, or a texture's size doesn't match its format and levels.
+bool scene_read_cooked(Arena* arena, FileContents file, SceneData* data);
@@ -1,69 +1,352 @@
-#include <atlbase.h>
 #include <dxc/dxcapi.h>
-#include <wrl/client.h>
+#include <dxc/d3d12shader.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
 
 #include "shader.h"
 #include "platform.h"
+#include "derived_data.h"
+#include "jobs.h"
+#include "profiler.h"
 
-Shader compile_shader(Arena* arena, const char* path, const char* entry_point, const char* target) {
-    using namespace Microsoft::WRL;
+// Part of every key. Bump it when the compiler is updated or the reflection kept changes, the compiler's own version is
+// left out so that hits never have to load it.
+#define SHADER_CACHE_VERSION 2
 
-    ComPtr<IDxcUtils> utils;
-    ComPtr<IDxcCompiler> compiler;
-    DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&utils));
-    DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&compiler));
+#define SHADER_MAX_INCLUDE_DEPTH 16
 
-    ComPtr<IDxcIncludeHandler> include_handler;
-    utils->CreateDefaultIncludeHandler(&include_handler);
+static const wchar_t* compile_args[] = {
+    L"-Zs", // Generate debug information
+};
 
+struct Compiler {
+    IDxcUtils* utils;
+    IDxcCompiler* compiler;
+    IDxcIncludeHandler* include_handler;
+};
+
+// DXC instances aren't safe to share, so every thread makes its own the first time it misses and keeps it.
+static Compiler thread_compilers[MAX_JOB_THREADS];
+
+static Compiler* get_compiler() {
+    Compiler* c = &thread_compilers[jobs_thread_index()];
+
+    if (!c->compiler) {
+        DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&c->utils));
+        DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&c->compiler));
+        c->utils->CreateDefaultIncludeHandler(&c->include_handler);
+    }
+
+    return c;
+}
+
+static void widen(const char* str, wchar_t* wide, u32 wide_len) {
+    u32 i = 0;
+
+    for (; str[i] && i < wide_len - 1; ++i) {
+        wide[i] = (wchar_t)str[i];
+    }
+
+    wide[i] = 0;
+}
+
+// Chains every file the source includes into key, found by looking for #include "..." lines. Includes inside inactive
+// #if blocks are hashed as well, which at worst recompiles a shader that didn't need it.
+static u64 hash_includes(u64 key, const char* path, const char* source, u64 size, u32 depth) {
+    if (depth > SHADER_MAX_INCLUDE_DEPTH) {
+        return key;
+    }
+
+    u32 directory_len = 0;
+
+    for (u32 i = 0; path[i]; ++i) {
+        if (path[i] == '/' || path[i] == '\\') {
+            directory_len = i + 1;
+        }
+    }
+
+    const char* end = source + size;
+    const char* line = source;
+
+    while (line < end) {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+
+        if (!line_end) {
+            line_end = end;
+        }
+
+        const char* c = line;
+
+        while (c < line_end && (*c == ' ' || *c == '\t')) {
+            c++;
+        }
+
+        if (line_end - c > 8 && memcmp(c, "#include", 8) == 0) {
+            const char* open = (const char*)memchr(c, '"', line_end - c);
+            const char* close = open ? (const char*)memchr(open + 1, '"', line_end - open - 1) : 0;
+
+            if (close) {
+                key = hash64(open + 1, close - open - 1, key);
+
+                // A path too long to open is left at its name, the compiler will fail on it anyway.
+                char include_path[512];
+                int len = snprintf(include_path, sizeof(include_path), "%.*s%.*s", (int)directory_len, path, (int)(close - open - 1), open + 1);
+
+                if (len > 0 && len < (int)sizeof(include_path)) {
+                    FileContents file = pf_map_file(include_path);
+
+                    if (file.memory) {
+                        key = hash64(file.memory, file.size, key);
+                        key = hash_includes(key, include_path, (char*)file.memory, file.size, depth + 1);
+                    }
+
+                    pf_unmap_file(file);
+                }
+            }
+        }
+
+        line = line_end + 1;
+    }
+
+    return key;
+}
+
+static void reflect(Compiler* c, IDxcBlob* dxil, ShaderReflection* reflection) {
+    DxcBuffer shader_buf = {};
+    shader_buf.Ptr = dxil->GetBufferPointer();
+    shader_buf.Size = dxil->GetBufferSize();
+
+    ID3D12ShaderReflection* shader_reflection;
+    c->utils->CreateReflection(&shader_buf, IID_PPV_ARGS(&shader_reflection));
+
+    shader_reflection->GetThreadGroupSize(&reflection->group_size_x, &reflection->group_size_y, &reflection->group_size_z);
+
+    ID3D12ShaderReflectionConstantBuffer* cbuffer = shader_reflection->GetConstantBufferByIndex(0);
+
+    D3D12_SHADER_BUFFER_DESC cbuffer_desc;
+
+    if (SUCCEEDED(cbuffer->GetDesc(&cbuffer_desc))) {
+        assert(cbuffer_desc.Variables <= SHADER_MAX_BINDINGS);
+
+        for (u32 i = 0; i < cbuffer_desc.Variables; ++i) {
+            ID3D12ShaderReflectionVariable* var = cbuffer->GetVariableByIndex(i);
+            D3D12_SHADER_VARIABLE_DESC var_desc;
+            var->GetDesc(&var_desc);
+
+            ShaderBinding* binding = &reflection->bindings[reflection->num_bindings++];
+            u32 name_len = (u32)strlen(var_desc.Name);
+            assert(name_len < sizeof(binding->name));
+            name_len = min(name_len, (u32)sizeof(binding->name) - 1);
+            memcpy(binding->name, var_desc.Name, name_len);
+            binding->name[name_len] = 0;
+            binding->offset = var_desc.StartOffset / sizeof(u32);
+
+            // The buffer's own size is padded out to 16 bytes.
+            reflection->constants_size = max(reflection->constants_size, (var_desc.StartOffset + var_desc.Size) / (u32)sizeof(u32));
+
+            D3D12_SHADER_TYPE_DESC type_desc;
+            var->GetType()->GetDesc(&type_desc);
+
+            if (type_desc.Class == D3D_SVC_SCALAR && type_desc.Elements == 0) {
+                switch (type_desc.Type) {
+                    case D3D_SVT_UINT:
+                        binding->type = SHADER_BINDING_UINT;
+                        break;
+                    case D3D_SVT_INT:
+                        binding->type = SHADER_BINDING_INT;
+                        break;
+                    case D3D_SVT_FLOAT:
+                        binding->type = SHADER_BINDING_FLOAT;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    }
+
+    shader_reflection->Release();
+}
+
+static IDxcBlob* compile(Compiler* c, ShaderDesc* desc, FileContents source) {
     wchar_t wide_path[512];
     wchar_t wide_entry[512];
     wchar_t wide_target[512];
-    
-    swprintf_s(wide_path, 512, L"%hs", path);
-    swprintf_s(wide_entry, 512, L"%hs", entry_point);
-    swprintf_s(wide_target, 512, L"%hs", target);
 
-    ComPtr<IDxcBlobEncoding> source_blob;
-    utils->LoadFile(wide_path, 0, &source_blob);
+    widen(desc->path, wide_path, ARRAY_LEN(wide_path));
+    widen(desc->entry_point, wide_entry, ARRAY_LEN(wide_entry));
+    widen(desc->target, wide_target, ARRAY_LEN(wide_target));
 
-    if (!source_blob) {
-        pf_debug_log("Failed to load shader: %s\n", path);
-        return {};
-    }
+    IDxcBlobEncoding* source_blob;
+    c->utils->CreateBlobFromPinned(source.memory, (u32)source.size, DXC_CP_UTF8, &source_blob);
 
-    LPCWSTR args[] = {
-        L"-Zs", // Generate debug information
-    };
+    wchar_t wide_features[SHADER_MAX_FEATURES][64];
+    DxcDefine defines[SHADER_MAX_FEATURES];
 
-    ComPtr<IDxcOperationResult> result;
-    compiler->Compile(source_blob.Get(), wide_path, wide_entry, wide_target, args, ARRAY_LEN(args), 0, 0, include_handler.Get(), &result);
+    for (u32 i = 0; i < desc->num_features; ++i) {
+        widen(desc->features[i], wide_features[i], ARRAY_LEN(wide_features[i]));
+        defines[i].Name = wide_features[i];
+        defines[i].Value = desc->variant & (1 << i) ? L"1" : L"0";
+    }
 
-    ComPtr<IDxcBlobEncoding> errors;
+    IDxcOperationResult* result;
+    c->compiler->Compile(source_blob, wide_path, wide_entry, wide_target, compile_args, ARRAY_LEN(compile_args), defines, desc->num_features, c->include_handler, &result);
+    source_blob->Release();
+
+    IDxcBlobEncoding* errors;
     result->GetErrorBuffer(&errors);
 
     if (errors && errors->GetBufferSize() != 0) {
-        ComPtr<IDxcBlobUtf8> errors_u8;
+        IDxcBlobUtf8* errors_u8;
         errors->QueryInterface(IID_PPV_ARGS(&errors_u8));
         pf_debug_log("Errors in shader compilation:\n%s\n", (char*)errors_u8->GetStringPointer());
+        errors_u8->Release();
+    }
+
+    if (errors) {
+        errors->Release();
     }
 
     HRESULT status;
     result->GetStatus(&status);
 
+    IDxcBlob* dxil = 0;
+
     if (FAILED(status)) {
         pf_debug_log("Failed shader compilation.\n");
-        return {};
     }
+    else {
+        result->GetResult(&dxil);
+        assert(dxil);
+    }
+
+    result->Release();
+
+    return dxil;
+}
+
+// As kept in the cache, followed by the DXIL.
+struct CachedShader {
+    ShaderReflection reflection;
+    u64 len;
+};
+
+struct ShaderBuild {
+    DDCEntry entry;
+    // In entry on a hit, otherwise made with malloc. Null when the shader failed.
+    CachedShader* result;
+};
+
+static void build_shader(DerivedDataCache* ddc, ShaderDesc* desc, ShaderBuild* build) {
+    PROFILE_FUNCTION();
+
+    FileContents source = pf_map_file(desc->path);
+
+    if (!source.memory) {
+        pf_debug_log("Failed to load shader: %s\n", desc->path);
+        return;
+    }
+
+    u32 version = SHADER_CACHE_VERSION;
+    u64 key = hash64("shader", strlen("shader"), 0);
+    key = hash64(&version, sizeof(version), key);
+    key = hash64(desc->entry_point, strlen(desc->entry_point), key);
+    key = hash64(desc->target, strlen(desc->target), key);
+
+    for (u32 i = 0; i < ARRAY_LEN(compile_args); ++i) {
+        key = hash64(compile_args[i], wcslen(compile_args[i]) * sizeof(wchar_t), key);
+    }
+
+    assert(desc->num_features <= SHADER_MAX_FEATURES);
+
+    for (u32 i = 0; i < desc->num_features; ++i) {
+        key = hash64(desc->features[i], strlen(desc->features[i]), key);
+    }
+
+    key = hash64(&desc->variant, sizeof(desc->variant), key);
 
-    ComPtr<IDxcBlob> shader_blob;
-    result->GetResult(&shader_blob);
-    assert(shader_blob);
+    key = hash64(source.memory, source.size, key);
+    key = hash_includes(key, desc->path, (char*)source.memory, source.size, 0);
 
-    Shader shader = {};
-    shader.len = shader_blob->GetBufferSize();
-    shader.memory = arena->push(shader.len);
-    memcpy(shader.memory, shader_blob->GetBufferPointer(), shader.len);
+    if (ddc_get(ddc, key, &build->entry)) {
+        CachedShader* cached = (CachedShader*)build->entry.data;
+
+        if (build->entry.size >= sizeof(CachedShader) && build->entry.size - sizeof(CachedShader) == cached->len) {
+            build->result = cached;
+            pf_unmap_file(source);
+            return;
+        }
+
+        ddc_release(&build->entry);
+    }
+
+    u64 start = pf_ticks();
+
+    Compiler* c = get_compiler();
+    IDxcBlob* dxil = compile(c, desc, source);
+
+    pf_unmap_file(source);
+
+    if (!dxil) {
+        return;
+    }
+
+    u64 len = dxil->GetBufferSize();
+
+    CachedShader* result = (CachedShader*)calloc(1, sizeof(CachedShader) + len);
+    result->len = len;
+    reflect(c, dxil, &result->reflection);
+    memcpy(result + 1, dxil->GetBufferPointer(), len);
+
+    dxil->Release();
+
+    ddc_put(ddc, key, result, sizeof(CachedShader) + len, pf_ticks() - start);
+
+    build->result = result;
+}
+
+void compile_shaders(Arena* arena, DerivedDataCache* ddc, u32 count, ShaderDesc* descs, Shader* shaders) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(arena);
+
+    u64 start = pf_ticks();
+
+    ShaderBuild* builds = scratch->push_array<ShaderBuild>(count);
+
+    parallel_for(count, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i) {
+            build_shader(ddc, &descs[i], &builds[i]);
+        }
+    });
+
+    u32 cached_shaders = 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        ShaderBuild* build = &builds[i];
+        Shader* shader = &shaders[i];
+
+        *shader = {};
+
+        if (!build->result) {
+            continue;
+        }
+
+        shader->len = build->result->len;
+        shader->memory = arena->push(shader->len);
+        shader->reflection = build->result->reflection;
+        memcpy(shader->memory, build->result + 1, shader->len);
+
+        if (build->entry.data) {
+            cached_shaders++;
+            ddc_release(&build->entry);
+        }
+        else {
+            ::free(build->result);
+        }
+    }
 
-    return shader;
+    pf_debug_log("compiled %u shaders in %.2fms, %u from the cache\n", count,
+        (f64)(pf_ticks() - start) / (f64)pf_ticks_per_second() * 1000.0, cached_shaders);
 }
@@ -2,9 +2,57 @@
 
 #include "common.h"
 
+struct DerivedDataCache;
+
+#define SHADER_MAX_BINDINGS 32
+#define SHADER_MAX_BINDING_NAME 48
+
+// Root constants are 32 bit values, anything else can't be laid out for them.
+enum ShaderBindingType {
+    SHADER_BINDING_UNSUPPORTED,
+    SHADER_BINDING_UINT,
+    SHADER_BINDING_INT,
+    SHADER_BINDING_FLOAT,
+};
+
+// A variable of the root constant buffer, offset in 32 bit values.
+struct ShaderBinding {
+    char name[SHADER_MAX_BINDING_NAME];
+    u32 offset;
+    ShaderBindingType type;
+};
+
+// What the renderer needs from reflection, taken when the shader is compiled so cached shaders need no reflection.
+struct ShaderReflection {
+    u32 group_size_x;
+    u32 group_size_y;
+    u32 group_size_z;
+    // Of the root constant buffer, in 32 bit values.
+    u32 constants_size;
+    u32 num_bindings;
+    ShaderBinding bindings[SHADER_MAX_BINDINGS];
+};
+
 struct Shader {
     u64 len;
     void* memory;
+    ShaderReflection reflection;
+};
+
+#define SHADER_MAX_FEATURES 4
+
+// A permutation of a shader. Every feature is defined to 1 when its bit is set in variant and to 0 otherwise, so the
+// shader can #if on it instead of branching.
+struct ShaderDesc {
+    const char* path;
+    const char* entry_point;
+    const char* target;
+    u32 num_features;
+    const char* const* features;
+    u32 variant;
 };
 
-Shader compile_shader(Arena* arena, const char* path, const char* entry_point, const char* target);
+// Compiles every shader across the job threads into arena, or fetches it from the cache when neither the source, the
+// files it includes, the entry point, the target, the defines nor the arguments changed. Each thread keeps its own compiler.
+// Shaders that fail to compile come back with a len of zero.
+void compile_shaders(Arena* arena, DerivedDataCache* ddc, u32 count, ShaderDesc* descs, Shader* shaders);
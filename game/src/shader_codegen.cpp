@@ -0,0 +1,133 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "shader_codegen.h"
+#include "derived_data.h"
+#include "platform.h"
+
+u64 root_constants_layout(ShaderReflection* reflection) {
+    u64 h = hash64(&reflection->constants_size, sizeof(reflection->constants_size), 0);
+
+    for (u32 i = 0; i < reflection->num_bindings; ++i) {
+        ShaderBinding* binding = &reflection->bindings[i];
+        h = hash64(binding->name, strlen(binding->name), h);
+        h = hash64(&binding->offset, sizeof(binding->offset), h);
+        h = hash64(&binding->type, sizeof(binding->type), h);
+    }
+
+    return h;
+}
+
+struct HeaderWriter {
+    char* mem;
+    u64 cap;
+    u64 len;
+
+    void print(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        len += vsnprintf(mem + len, cap - len, fmt, args);
+        va_end(args);
+        assert(len < cap && "root constants header too long");
+    }
+};
+
+static void to_upper(const char* str, char* upper, u32 upper_size) {
+    u32 i = 0;
+
+    for (; str[i] && i < upper_size - 1; ++i) {
+        upper[i] = (char)toupper(str[i]);
+    }
+
+    upper[i] = 0;
+}
+
+static const char* binding_type_name(ShaderBindingType type) {
+    switch (type) {
+        case SHADER_BINDING_UINT:
+            return "u32";
+        case SHADER_BINDING_INT:
+            return "i32";
+        case SHADER_BINDING_FLOAT:
+            return "f32";
+        default:
+            return 0;
+    }
+}
+
+bool write_root_constants_header(const char* path, u32 count, const char* const* names, ShaderReflection* reflections) {
+    Scratch scratch = get_scratch(0);
+
+    HeaderWriter w = {};
+    w.cap = 1024 * 1024;
+    w.mem = (char*)scratch->push(w.cap);
+
+    w.print("// Generated from the shaders' root constant buffers by running the game with -gen_root_constants. Don't edit it,\n");
+    w.print("// run that again when a root constant buffer changes, rd_init checks the layouts below against the shaders.\n\n");
+    w.print("#pragma once\n\n");
+    w.print("#include <stddef.h>\n\n");
+    w.print("#include \"common.h\"\n");
+
+    for (u32 i = 0; i < count; ++i) {
+        ShaderReflection* reflection = &reflections[i];
+
+        char type_name[64];
+        char prefix[64];
+
+        strcpy_s(type_name, sizeof(type_name), names[i]);
+        type_name[0] = (char)toupper(type_name[0]);
+
+        to_upper(names[i], prefix, sizeof(prefix));
+
+        w.print("\nstruct %sRootConstants {\n", type_name);
+
+        u32 offset = 0;
+
+        for (u32 b = 0; b < reflection->num_bindings; ++b) {
+            ShaderBinding* binding = &reflection->bindings[b];
+            const char* binding_type = binding_type_name(binding->type);
+
+            if (!binding_type) {
+                pf_debug_log("%s: root constant %s is not a 32 bit scalar\n", names[i], binding->name);
+                return false;
+            }
+
+            for (; offset < binding->offset; ++offset) {
+                w.print("    u32 padding%u;\n", offset);
+            }
+
+            w.print("    %s %s;\n", binding_type, binding->name);
+            offset++;
+        }
+
+        w.print("};\n\n");
+
+        for (u32 b = 0; b < reflection->num_bindings; ++b) {
+            ShaderBinding* binding = &reflection->bindings[b];
+
+            char binding_name[SHADER_MAX_BINDING_NAME];
+            to_upper(binding->name, binding_name, sizeof(binding_name));
+
+            w.print("constexpr u32 %s_ROOT_%s = %u;\n", prefix, binding_name, binding->offset);
+        }
+
+        w.print("constexpr u32 %s_ROOT_CONSTANTS_SIZE = %u;\n", prefix, reflection->constants_size);
+        w.print("constexpr u64 %s_ROOT_LAYOUT = 0x%016llxull;\n\n", prefix, (unsigned long long)root_constants_layout(reflection));
+
+        for (u32 b = 0; b < reflection->num_bindings; ++b) {
+            ShaderBinding* binding = &reflection->bindings[b];
+
+            char binding_name[SHADER_MAX_BINDING_NAME];
+            to_upper(binding->name, binding_name, sizeof(binding_name));
+
+            w.print("static_assert(offsetof(%sRootConstants, %s) == %s_ROOT_%s * sizeof(u32), \"%sRootConstants is not packed like the shader\");\n",
+                type_name, binding->name, prefix, binding_name, type_name);
+        }
+
+        w.print("static_assert(sizeof(%sRootConstants) == %s_ROOT_CONSTANTS_SIZE * sizeof(u32), \"%sRootConstants is not packed like the shader\");\n",
+            type_name, prefix, type_name);
+    }
+
+    return pf_write_file(path, w.mem, w.len);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "shader.h"
+
+// Hash of the names, offsets and types of a shader's root constants. The generated header keeps it for every pipeline,
+// so the renderer can tell when a shader's constants no longer match the header.
+u64 root_constants_layout(ShaderReflection* reflection);
+
+// Writes a header with a packed struct of root constants per pipeline, like GbufferRootConstants for "gbuffer", with
+// constexpr offsets in 32 bit values, the layout it was made from and static_asserts that the struct packs like the
+// offsets. Returns false when a constant isn't a 32 bit scalar or the file can't be written.
+bool write_root_constants_header(const char* path, u32 count, const char* const* names, ShaderReflection* reflections);
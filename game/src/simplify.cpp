@@ -0,0 +1,717 @@
+#include <math.h>
+#include <float.h>
+
+#include "simplify.h"
+#include "mesh_optimizer.h"
+#include "vertex_format.h"
+#include "maps.h"
+#include "platform.h"
+#include "profiler.h"
+
+// How a vertex may move. Borders and seams are open edge loops, in attribute space: a seam is a pair of vertices
+// that share a position and whose open edges run alongside each other.
+enum VertexKind {
+    VERTEX_MANIFOLD,
+    VERTEX_BORDER,
+    VERTEX_SEAM,
+    VERTEX_LOCKED,
+    VERTEX_KIND_COUNT,
+};
+
+// Whether a vertex of the row kind may collapse onto one of the column kind.
+static const bool can_collapse[VERTEX_KIND_COUNT][VERTEX_KIND_COUNT] = {
+    { true,  true,  true,  true  },
+    { false, true,  false, false },
+    { false, false, true,  false },
+    { false, false, false, false },
+};
+
+// Whether an edge between the two kinds shows up as two half edges, one of which can be skipped.
+static const bool has_opposite[VERTEX_KIND_COUNT][VERTEX_KIND_COUNT] = {
+    { true, true,  true, true  },
+    { true, false, true, false },
+    { true, true,  true, true  },
+    { true, false, true, false },
+};
+
+struct Quadric {
+    f32 a00, a11, a22;
+    f32 a01, a02, a12;
+    f32 b0, b1, b2;
+    f32 c;
+    f32 weight;
+
+    void add_plane(XMFLOAT3 n, f32 d, f32 w) {
+        a00 += w * n.x * n.x;
+        a11 += w * n.y * n.y;
+        a22 += w * n.z * n.z;
+        a01 += w * n.x * n.y;
+        a02 += w * n.x * n.z;
+        a12 += w * n.y * n.z;
+        b0 += w * n.x * d;
+        b1 += w * n.y * d;
+        b2 += w * n.z * d;
+        c += w * d * d;
+        weight += w;
+    }
+
+    void add(Quadric* q) {
+        a00 += q->a00; a11 += q->a11; a22 += q->a22;
+        a01 += q->a01; a02 += q->a02; a12 += q->a12;
+        b0 += q->b0; b1 += q->b1; b2 += q->b2;
+        c += q->c;
+        weight += q->weight;
+    }
+
+    // Area weighted mean of the squared distances to the planes.
+    f32 error(XMFLOAT3 p) {
+        f32 rx = a00 * p.x + a01 * p.y + a02 * p.z + b0;
+        f32 ry = a01 * p.x + a11 * p.y + a12 * p.z + b1;
+        f32 rz = a02 * p.x + a12 * p.y + a22 * p.z + b2;
+
+        f32 e = p.x * rx + p.y * ry + p.z * rz + b0 * p.x + b1 * p.y + b2 * p.z + c;
+        return weight > 0.0f ? fabsf(e) / weight : 0.0f;
+    }
+};
+
+static XMFLOAT3 sub(XMFLOAT3 a, XMFLOAT3 b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+static XMFLOAT3 cross(XMFLOAT3 a, XMFLOAT3 b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+static f32 dot(XMFLOAT3 a, XMFLOAT3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+static XMFLOAT3 normalize(XMFLOAT3 v, f32* length) {
+    *length = sqrtf(dot(v, v));
+    f32 inv = *length > 0.0f ? 1.0f / *length : 0.0f;
+    return { v.x * inv, v.y * inv, v.z * inv };
+}
+
+// Outgoing half edges of each vertex, optionally with vertices merged through remap. Lookups scan a vertex's few
+// neighbours, which stays in cache far better than hashing every edge.
+struct EdgeAdjacency {
+    u32* offsets;
+    u32* targets;
+
+    void init(Arena* arena, u32* indices, u32 index_count, u32 vertex_count, u32* remap) {
+        offsets = arena->push_array<u32>(vertex_count + 1);
+        targets = arena->push_array<u32>(index_count);
+
+        auto id = [&](u32 v) { return remap ? remap[v] : v; };
+
+        for (u32 i = 0; i < index_count; ++i) {
+            offsets[id(indices[i]) + 1]++;
+        }
+
+        for (u32 v = 0; v < vertex_count; ++v) {
+            offsets[v + 1] += offsets[v];
+        }
+
+        u32* cursors = arena->push_array<u32>(vertex_count);
+        memcpy(cursors, offsets, vertex_count * sizeof(u32));
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            for (u32 k = 0; k < 3; ++k) {
+                u32 a = id(indices[i + k]);
+                targets[cursors[a]++] = id(indices[i + (k + 1) % 3]);
+            }
+        }
+    }
+
+    bool has(u32 a, u32 b) {
+        for (u32 e = offsets[a]; e < offsets[a + 1]; ++e) {
+            if (targets[e] == b) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Vertices with bitwise equal packed positions are one point: remap[] gives the first of them and wedge[] links them in
+// a cycle.
+static void build_position_remap(RDPackedVertex* vertices, u32 vertex_count, u32* remap, u32* wedge) {
+    Scratch scratch = get_scratch(0);
+
+    u32 cap = 1;
+    while (cap < vertex_count * 2) {
+        cap *= 2;
+    }
+
+    u32* table = scratch->push_array<u32>(cap);
+    memset(table, 0xff, cap * sizeof(u32));
+
+    for (u32 v = 0; v < vertex_count; ++v) {
+        u32 slot = (u32)fn1va_hash_bytes(vertices[v].position, sizeof(vertices[v].position)) & (cap - 1);
+
+        while (table[slot] != UINT32_MAX && memcmp(vertices[table[slot]].position, vertices[v].position, sizeof(vertices[v].position)) != 0) {
+            slot = (slot + 1) & (cap - 1);
+        }
+
+        if (table[slot] == UINT32_MAX) {
+            table[slot] = v;
+            remap[v] = v;
+            wedge[v] = v;
+        }
+        else {
+            u32 r = table[slot];
+            remap[v] = r;
+            wedge[v] = wedge[r];
+            wedge[r] = v;
+        }
+    }
+}
+
+struct Collapse {
+    u32 v0;
+    u32 v1;
+    f32 error;
+};
+
+// Errors are never negative, so their bits sort like they do. Bucketing on the exponent and the top three bits of the
+// mantissa orders collapses to within 12.5%, which is all the greedy pass needs, in one counting sort.
+#define COLLAPSE_SORT_BUCKETS 2048
+
+static void sort_collapses(Collapse* collapses, u32 count, Collapse* sorted) {
+    u32 offsets[COLLAPSE_SORT_BUCKETS] = {};
+
+    auto bucket = [](f32 error) {
+        u32 bits;
+        memcpy(&bits, &error, sizeof(bits));
+        return (bits >> 20) & (COLLAPSE_SORT_BUCKETS - 1);
+    };
+
+    for (u32 i = 0; i < count; ++i) {
+        offsets[bucket(collapses[i].error)]++;
+    }
+
+    u32 sum = 0;
+
+    for (u32 b = 0; b < COLLAPSE_SORT_BUCKETS; ++b) {
+        u32 n = offsets[b];
+        offsets[b] = sum;
+        sum += n;
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        sorted[offsets[bucket(collapses[i].error)]++] = collapses[i];
+    }
+}
+
+// Whether moving position r0 to p1 turns any of its triangles over. Triangles that also touch r1 vanish instead.
+static bool has_triangle_flips(XMFLOAT3* positions, u32* remap, u32* indices, u32* adjacency_offsets, u32* adjacency, u32 r0, u32 r1, XMFLOAT3 p1) {
+    for (u32 a = adjacency_offsets[r0]; a < adjacency_offsets[r0 + 1]; ++a) {
+        u32* tri = &indices[adjacency[a] * 3];
+        u32 r[3] = { remap[tri[0]], remap[tri[1]], remap[tri[2]] };
+
+        if (r[0] == r1 || r[1] == r1 || r[2] == r1) {
+            continue;
+        }
+
+        XMFLOAT3 p[3] = { positions[tri[0]], positions[tri[1]], positions[tri[2]] };
+        XMFLOAT3 before = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+        for (u32 k = 0; k < 3; ++k) {
+            if (r[k] == r0) {
+                p[k] = p1;
+            }
+        }
+
+        XMFLOAT3 after = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+        if (dot(before, after) <= 0.0f) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Follows open edge loops through collapsed vertices.
+static void remap_edge_loop(u32* loop, u32 vertex_count, u32* collapse_remap) {
+    for (u32 i = 0; i < vertex_count; ++i) {
+        if (loop[i] == UINT32_MAX) {
+            continue;
+        }
+
+        u32 l = loop[i];
+        u32 r = collapse_remap[l];
+
+        // The edge itself collapsed towards i, so the loop carries on from where l went.
+        if (r == i) {
+            loop[i] = loop[l] != UINT32_MAX ? collapse_remap[loop[l]] : UINT32_MAX;
+        }
+        else {
+            loop[i] = r;
+        }
+    }
+}
+
+u32 simplify_mesh(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, u32 target_index_count, f32 max_error, u32* out_indices, f32* error) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    index_count -= index_count % 3;
+    memcpy(out_indices, indices, index_count * sizeof(u32));
+    indices = out_indices;
+
+    *error = 0.0f;
+
+    // Work in the unit cube so that errors and the flip test don't depend on the mesh's scale.
+    XMFLOAT3 extent = {
+        quantization->position_scale.x * 65535.0f,
+        quantization->position_scale.y * 65535.0f,
+        quantization->position_scale.z * 65535.0f,
+    };
+    f32 scale = max(max(extent.x, extent.y), max(extent.z, FLT_MIN));
+
+    XMFLOAT3* positions = scratch->push_array<XMFLOAT3>(vertex_count);
+
+    for (u32 i = 0; i < vertex_count; ++i) {
+        XMFLOAT3 p = unpack_position(&vertices[i], quantization);
+        positions[i] = sub(p, quantization->position_offset);
+        positions[i] = { positions[i].x / scale, positions[i].y / scale, positions[i].z / scale };
+    }
+
+    u32* remap = scratch->push_array<u32>(vertex_count);
+    u32* wedge = scratch->push_array<u32>(vertex_count);
+    build_position_remap(vertices, vertex_count, remap, wedge);
+
+    // Triangles that are already degenerate would leave open edges that look like borders.
+    {
+        u32 write = 0;
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            u32 a = indices[i + 0];
+            u32 b = indices[i + 1];
+            u32 c = indices[i + 2];
+
+            if (remap[a] != remap[b] && remap[b] != remap[c] && remap[a] != remap[c]) {
+                indices[write++] = a;
+                indices[write++] = b;
+                indices[write++] = c;
+            }
+        }
+
+        index_count = write;
+    }
+
+    // Open edges have no twin going the other way. open_out and open_in hold the single open neighbour of each vertex,
+    // the vertex itself when there are several, or UINT32_MAX when there are none.
+    u32* open_out = scratch->push_array<u32>(vertex_count);
+    u32* open_in = scratch->push_array<u32>(vertex_count);
+    u8* kinds = scratch->push_array<u8>(vertex_count);
+
+    // Quadrics live on the first vertex at each position.
+    Quadric* quadrics = scratch->push_array<Quadric>(vertex_count);
+
+    // Edges are only needed until the quadrics are built, so they go in the other scratch arena.
+    {
+        Scratch edge_scratch = get_scratch(scratch.arena);
+
+        EdgeAdjacency edges;
+        edges.init(edge_scratch.arena, indices, index_count, vertex_count, 0);
+
+        memset(open_out, 0xff, vertex_count * sizeof(u32));
+        memset(open_in, 0xff, vertex_count * sizeof(u32));
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            for (u32 k = 0; k < 3; ++k) {
+                u32 a = indices[i + k];
+                u32 b = indices[i + (k + 1) % 3];
+
+                if (!edges.has(b, a)) {
+                    open_out[a] = open_out[a] == UINT32_MAX ? b : a;
+                    open_in[b] = open_in[b] == UINT32_MAX ? a : b;
+                }
+            }
+        }
+
+        for (u32 v = 0; v < vertex_count; ++v) {
+            if (remap[v] != v) {
+                continue;
+            }
+
+            u8 kind = VERTEX_LOCKED;
+
+            if (wedge[v] == v) {
+                if (open_in[v] == UINT32_MAX && open_out[v] == UINT32_MAX) {
+                    kind = VERTEX_MANIFOLD;
+                }
+                else if (open_in[v] != UINT32_MAX && open_out[v] != UINT32_MAX && open_in[v] != v && open_out[v] != v) {
+                    kind = VERTEX_BORDER;
+                }
+            }
+            else if (wedge[wedge[v]] == v) {
+                u32 w = wedge[v];
+
+                bool single_loops = open_in[v] != UINT32_MAX && open_in[v] != v && open_out[v] != UINT32_MAX && open_out[v] != v &&
+                                    open_in[w] != UINT32_MAX && open_in[w] != w && open_out[w] != UINT32_MAX && open_out[w] != w;
+
+                // Both sides of a seam leave and arrive at the same points, in opposite directions.
+                if (single_loops && remap[open_in[v]] == remap[open_out[w]] && remap[open_out[v]] == remap[open_in[w]] && remap[open_in[v]] != remap[open_out[v]]) {
+                    kind = VERTEX_SEAM;
+                }
+            }
+
+            kinds[v] = kind;
+        }
+
+        for (u32 v = 0; v < vertex_count; ++v) {
+            kinds[v] = kinds[remap[v]];
+        }
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            u32 v[3] = { indices[i + 0], indices[i + 1], indices[i + 2] };
+            XMFLOAT3 p0 = positions[v[0]];
+
+            f32 area;
+            XMFLOAT3 n = normalize(cross(sub(positions[v[1]], p0), sub(positions[v[2]], p0)), &area);
+
+            for (u32 k = 0; k < 3; ++k) {
+                quadrics[remap[v[k]]].add_plane(n, -dot(n, p0), area * 0.5f);
+            }
+
+            // Open edges next to a border or seam get a plane through them, perpendicular to the triangle, so sliding
+            // off the line costs.
+            for (u32 k = 0; k < 3; ++k) {
+                u32 a = v[k];
+                u32 b = v[(k + 1) % 3];
+
+                bool boundary = kinds[a] == VERTEX_BORDER || kinds[a] == VERTEX_SEAM || kinds[b] == VERTEX_BORDER || kinds[b] == VERTEX_SEAM;
+
+                if (!boundary || edges.has(b, a)) {
+                    continue;
+                }
+
+                XMFLOAT3 edge = sub(positions[b], positions[a]);
+                f32 length;
+                XMFLOAT3 edge_n = normalize(cross(edge, n), &length);
+                (void)length;
+
+                f32 weight = dot(edge, edge) * SIMPLIFY_BOUNDARY_WEIGHT;
+                quadrics[remap[a]].add_plane(edge_n, -dot(edge_n, positions[a]), weight);
+                quadrics[remap[b]].add_plane(edge_n, -dot(edge_n, positions[a]), weight);
+            }
+        }
+    }
+
+    u32* collapse_remap = scratch->push_array<u32>(vertex_count);
+    bool* collapse_locked = scratch->push_array<bool>(vertex_count);
+    Collapse* collapses = scratch->push_array<Collapse>(index_count);
+    Collapse* sorted_collapses = scratch->push_array<Collapse>(index_count);
+    u32* adjacency_offsets = scratch->push_array<u32>(vertex_count + 1);
+    u32* adjacency = scratch->push_array<u32>(index_count);
+
+    f32 max_error_sq = max_error < FLT_MAX ? (max_error / scale) * (max_error / scale) : FLT_MAX;
+    f32 result_error_sq = 0.0f;
+
+    while (index_count > target_index_count) {
+        // Every candidate edge once, in whichever direction is cheaper.
+        u32 collapse_count = 0;
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            for (u32 k = 0; k < 3; ++k) {
+                u32 i0 = indices[i + k];
+                u32 i1 = indices[i + (k + 1) % 3];
+
+                if (remap[i0] == remap[i1]) {
+                    continue;
+                }
+
+                u8 k0 = kinds[i0];
+                u8 k1 = kinds[i1];
+
+                if (!can_collapse[k0][k1] && !can_collapse[k1][k0]) {
+                    continue;
+                }
+
+                if (has_opposite[k0][k1] && remap[i1] > remap[i0]) {
+                    continue;
+                }
+
+                // Two border or seam vertices that aren't neighbours on the same loop.
+                if (k0 == k1 && (k0 == VERTEX_BORDER || k0 == VERTEX_SEAM) && open_out[i0] != i1) {
+                    continue;
+                }
+
+                f32 e01 = can_collapse[k0][k1] ? quadrics[remap[i0]].error(positions[i1]) : FLT_MAX;
+                f32 e10 = can_collapse[k1][k0] ? quadrics[remap[i1]].error(positions[i0]) : FLT_MAX;
+
+                Collapse* c = &collapses[collapse_count++];
+                c->v0 = e01 <= e10 ? i0 : i1;
+                c->v1 = e01 <= e10 ? i1 : i0;
+                c->error = min(e01, e10);
+            }
+        }
+
+        if (collapse_count == 0) {
+            break;
+        }
+
+        sort_collapses(collapses, collapse_count, sorted_collapses);
+
+        // Triangles around each position, for the flip test.
+        memset(adjacency_offsets, 0, (vertex_count + 1) * sizeof(u32));
+
+        for (u32 i = 0; i < index_count; ++i) {
+            adjacency_offsets[remap[indices[i]] + 1]++;
+        }
+
+        for (u32 v = 0; v < vertex_count; ++v) {
+            adjacency_offsets[v + 1] += adjacency_offsets[v];
+        }
+
+        for (u32 i = 0; i < index_count; ++i) {
+            adjacency[adjacency_offsets[remap[indices[i]]]++] = i / 3;
+        }
+
+        for (u32 v = vertex_count; v > 0; --v) {
+            adjacency_offsets[v] = adjacency_offsets[v - 1];
+        }
+        adjacency_offsets[0] = 0;
+
+        for (u32 v = 0; v < vertex_count; ++v) {
+            collapse_remap[v] = v;
+        }
+        memset(collapse_locked, 0, vertex_count * sizeof(bool));
+
+        // Each collapse takes two triangles with it, or one along a border.
+        u32 triangle_goal = (index_count - target_index_count + 2) / 3;
+        u32 triangles_removed = 0;
+        u32 collapses_done = 0;
+
+        for (u32 c = 0; c < collapse_count && triangles_removed < triangle_goal; ++c) {
+            Collapse collapse = sorted_collapses[c];
+
+            if (collapse.error > max_error_sq) {
+                break;
+            }
+
+            u32 i0 = collapse.v0;
+            u32 i1 = collapse.v1;
+            u32 r0 = remap[i0];
+            u32 r1 = remap[i1];
+
+            // Each position moves or is moved onto at most once per pass, so quadrics and flip tests stay valid.
+            if (collapse_locked[r0] || collapse_locked[r1]) {
+                continue;
+            }
+
+            if (has_triangle_flips(positions, remap, indices, adjacency_offsets, adjacency, r0, r1, positions[i1])) {
+                continue;
+            }
+
+            if (kinds[i0] == VERTEX_SEAM) {
+                // The other side of the seam follows along its own open edge.
+                u32 s0 = wedge[i0];
+                u32 s1 = open_out[i0] == i1 ? open_in[s0] : open_out[s0];
+
+                assert(s0 != i0 && remap[s1] == r1);
+
+                collapse_remap[i0] = i1;
+                collapse_remap[s0] = s1;
+            }
+            else {
+                collapse_remap[i0] = i1;
+            }
+
+            quadrics[r1].add(&quadrics[r0]);
+
+            collapse_locked[r0] = true;
+            collapse_locked[r1] = true;
+
+            triangles_removed += kinds[i0] == VERTEX_BORDER ? 1 : 2;
+            collapses_done++;
+            result_error_sq = max(result_error_sq, collapse.error);
+        }
+
+        if (collapses_done == 0) {
+            break;
+        }
+
+        // Vertices that moved off a position no longer share it.
+        for (u32 v = 0; v < vertex_count; ++v) {
+            if (collapse_remap[v] != v) {
+                remap[v] = remap[collapse_remap[v]];
+            }
+        }
+
+        remap_edge_loop(open_out, vertex_count, collapse_remap);
+        remap_edge_loop(open_in, vertex_count, collapse_remap);
+
+        u32 write = 0;
+
+        for (u32 i = 0; i < index_count; i += 3) {
+            u32 a = collapse_remap[indices[i + 0]];
+            u32 b = collapse_remap[indices[i + 1]];
+            u32 c = collapse_remap[indices[i + 2]];
+
+            if (remap[a] == remap[b] || remap[b] == remap[c] || remap[a] == remap[c]) {
+                continue;
+            }
+
+            indices[write++] = a;
+            indices[write++] = b;
+            indices[write++] = c;
+        }
+
+        index_count = write;
+    }
+
+    *error = sqrtf(result_error_sq) * scale;
+    return index_count;
+}
+
+u32 build_mesh_lods(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, u32* lod_indices, RDMeshLod* lods) {
+    PROFILE_FUNCTION();
+
+    memcpy(lod_indices, indices, index_count * sizeof(u32));
+
+    lods[0].index_offset = 0;
+    lods[0].index_count = index_count;
+    lods[0].error = 0.0f;
+
+    u32 lod_count = 1;
+    u32 offset = index_count;
+
+    while (lod_count < RD_MAX_MESH_LODS) {
+        RDMeshLod* previous = &lods[lod_count - 1];
+
+        u32 target_index_count = (u32)((f32)(previous->index_count / 3) * MESH_LOD_REDUCTION) * 3;
+
+        if (target_index_count / 3 < MESH_LOD_MIN_TRIANGLES) {
+            break;
+        }
+
+        f32 error;
+        u32 lod_index_count = simplify_mesh(vertices, vertex_count, quantization, lod_indices + previous->index_offset, previous->index_count,
+            target_index_count, FLT_MAX, lod_indices + offset, &error);
+
+        if ((f32)lod_index_count > (f32)previous->index_count * MESH_LOD_MIN_REDUCTION) {
+            break;
+        }
+
+        optimize_vertex_cache(lod_indices + offset, lod_index_count, vertex_count);
+
+        // Each level is measured against the one it came from, so the distances add up along the chain.
+        RDMeshLod* lod = &lods[lod_count++];
+        lod->index_offset = offset;
+        lod->index_count = lod_index_count;
+        lod->error = previous->error + error;
+
+        offset += lod_index_count;
+    }
+
+    return lod_count;
+}
+
+void simplify_benchmark(u32 segments) {
+    Scratch scratch = get_scratch(0);
+
+    // UV sphere of radius 10. The last column repeats the first with u = 1, so there is a seam down one side.
+    u32 rings = segments / 2;
+    u32 vertex_count = (segments + 1) * (rings + 1);
+    u32 index_count = segments * rings * 6;
+
+    f32* floats = scratch->push_array<f32>(vertex_count * 8);
+
+    for (u32 y = 0; y <= rings; ++y) {
+        for (u32 x = 0; x <= segments; ++x) {
+            f32 theta = (f32)y / (f32)rings * XM_PI;
+            f32 phi = (f32)(x % segments) / (f32)segments * 2.0f * XM_PI;
+
+            // Exactly zero at the poles, so their vertices quantize to one point.
+            f32 ring = y == 0 || y == rings ? 0.0f : sinf(theta);
+            XMFLOAT3 n = { ring * cosf(phi), cosf(theta), -ring * sinf(phi) };
+
+            f32* v = &floats[(y * (segments + 1) + x) * 8];
+            v[0] = n.x * 10.0f;
+            v[1] = n.y * 10.0f;
+            v[2] = n.z * 10.0f;
+            v[3] = n.x;
+            v[4] = n.y;
+            v[5] = n.z;
+            v[6] = (f32)x / (f32)segments;
+            v[7] = (f32)y / (f32)rings;
+        }
+    }
+
+    RDPackedVertex* vertices = scratch->push_array<RDPackedVertex>(vertex_count);
+    RDMeshQuantization quantization = quantization_from_bounds({ -10.0f, -10.0f, -10.0f }, { 10.0f, 10.0f, 10.0f });
+
+    pack_positions(vertices, vertex_count, floats, 8 * sizeof(f32), &quantization);
+    pack_normals(vertices, vertex_count, floats + 3, 8 * sizeof(f32));
+    pack_uvs(vertices, vertex_count, floats + 6, 8 * sizeof(f32));
+
+    u32* indices = scratch->push_array<u32>(index_count);
+    u32 written = 0;
+
+    for (u32 y = 0; y < rings; ++y) {
+        for (u32 x = 0; x < segments; ++x) {
+            u32 a = y * (segments + 1) + x;
+            u32 b = a + segments + 1;
+
+            // The rows at the poles collapse to a point, so each of their quads is a single triangle.
+            if (y > 0) {
+                u32 tri[3] = { a, b, a + 1 };
+                memcpy(indices + written, tri, sizeof(tri));
+                written += 3;
+            }
+
+            if (y < rings - 1) {
+                u32 tri[3] = { a + 1, b, b + 1 };
+                memcpy(indices + written, tri, sizeof(tri));
+                written += 3;
+            }
+        }
+    }
+
+    index_count = written;
+
+    MeshOptimizeStats optimize_stats;
+    vertex_count = optimize_mesh(vertices, vertex_count, &quantization, indices, index_count, &optimize_stats);
+
+    u32* lod_indices = scratch->push_array<u32>(index_count * 4);
+    RDMeshLod lods[RD_MAX_MESH_LODS];
+
+    u64 start = pf_ticks();
+    u32 lod_count = build_mesh_lods(vertices, vertex_count, &quantization, indices, index_count, lod_indices, lods);
+    u64 ticks = pf_ticks() - start;
+
+    // A closed sphere stays closed: every edge, by position, has exactly one twin going the other way. A seam that
+    // tore open would leave edges without one.
+    u32* remap = scratch->push_array<u32>(vertex_count);
+    u32* wedge = scratch->push_array<u32>(vertex_count);
+    build_position_remap(vertices, vertex_count, remap, wedge);
+
+    bool closed = true;
+    bool monotonic = true;
+
+    for (u32 l = 0; l < lod_count; ++l) {
+        u32* lod = lod_indices + lods[l].index_offset;
+
+        EdgeAdjacency edges;
+        edges.init(scratch.arena, lod, lods[l].index_count, vertex_count, remap);
+
+        for (u32 i = 0; i < lods[l].index_count; i += 3) {
+            for (u32 k = 0; k < 3; ++k) {
+                closed &= edges.has(remap[lod[i + (k + 1) % 3]], remap[lod[i + k]]);
+            }
+        }
+
+        if (l > 0) {
+            monotonic &= lods[l].error >= lods[l - 1].error;
+        }
+    }
+
+    assert(closed && "simplification tore the mesh open");
+    assert(monotonic && "lod errors should grow with each level");
+
+    f64 ms_per_tick = 1000.0 / (f64)pf_ticks_per_second();
+
+    pf_debug_log("simplify: %u triangles into %u levels in %.3fms, %s, %s\n", index_count / 3, lod_count, (f64)ticks * ms_per_tick,
+        closed ? "closed" : "TORN", monotonic ? "errors grow" : "ERRORS SHRINK");
+
+    for (u32 l = 0; l < lod_count; ++l) {
+        pf_debug_log("    lod %u: %u triangles, error %.4f\n", l, lods[l].index_count / 3, lods[l].error);
+    }
+}
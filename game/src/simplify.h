@@ -0,0 +1,33 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "renderer.h"
+
+// Each level aims for this fraction of the triangles of the one before it.
+#define MESH_LOD_REDUCTION 0.5f
+
+// The chain ends before a level would drop under this many triangles, or when a level can't get below
+// MESH_LOD_MIN_REDUCTION of the one before it.
+#define MESH_LOD_MIN_TRIANGLES 64
+#define MESH_LOD_MIN_REDUCTION 0.75f
+
+// Boundary and seam edges resist sliding off their line this many times more than the surface resists moving.
+#define SIMPLIFY_BOUNDARY_WEIGHT 10.0f
+
+// Collapses edges (Garland and Heckbert 1997) until at most target_index_count indices remain, or until the next
+// collapse would move the surface further than max_error. Only indices change, so every level can share one vertex
+// buffer. Vertices on UV or normal seams and on open boundaries only collapse along them, and vertices where those meet
+// stay put. Writes to out_indices, which needs room for index_count, and returns how many were written. error is set to
+// how far the surface moved, in local units.
+u32 simplify_mesh(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, u32 target_index_count, f32 max_error, u32* out_indices, f32* error);
+
+// Level 0 is indices as they are. Each further level simplifies the one before and is cache optimized on its own.
+// lod_indices gets every level back to back and needs room for 4 * index_count. Returns the number of levels.
+u32 build_mesh_lods(RDPackedVertex* vertices, u32 vertex_count, RDMeshQuantization* quantization, u32* indices, u32 index_count, u32* lod_indices, RDMeshLod* lods);
+
+// Simplifies a dense sphere with a UV seam, checks that the seam stays closed and errors grow with each level, and logs
+// timings.
+void simplify_benchmark(u32 segments);
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "staging_ring.h"
+#include "platform.h"
+#include "profiler.h"
+
+void StagingRing::init(u64 size) {
+    *this = {};
+    capacity = size;
+}
+
+bool StagingRing::alloc(u64 size, u64 alignment, u64 owner, u64* offset) {
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+
+    if (used == 0) {
+        head = 0;
+        tail = 0;
+    }
+    else if (head == tail) {
+        return false;
+    }
+
+    u64 start = (head + alignment - 1) & ~(alignment - 1);
+    u64 end = 0;
+    u64 taken = 0;
+
+    if (used == 0 || head > tail) {
+        // Free from head to the end and from the start to tail.
+        if (start + size <= capacity) {
+            end = start + size;
+            taken = end - head;
+        }
+        else if (size <= tail) {
+            start = 0;
+            end = size;
+            taken = capacity - head + size;
+            wraps++;
+        }
+        else {
+            return false;
+        }
+    }
+    else {
+        if (start + size > tail) {
+            return false;
+        }
+
+        end = start + size;
+        taken = end - head;
+    }
+
+    head = end == capacity ? 0 : end;
+    used += taken;
+    peak_used = max(peak_used, used);
+
+    StagingBlock* last = blocks.empty() ? 0 : &blocks[blocks.len-1];
+
+    if (last && last->owner == owner && last->fence == 0) {
+        last->end = head;
+        last->size += taken;
+    }
+    else {
+        StagingBlock block = {};
+        block.end = head;
+        block.size = taken;
+        block.owner = owner;
+        blocks.push(block);
+    }
+
+    *offset = start;
+    return true;
+}
+
+void StagingRing::submit(u64 owner, u64 fence) {
+    for (u32 i = 0; i < blocks.len; ++i) {
+        if (blocks[i].owner == owner && blocks[i].fence == 0) {
+            blocks[i].fence = fence;
+        }
+    }
+}
+
+void StagingRing::retire(u64 completed) {
+    u32 retired = 0;
+
+    for (; retired < blocks.len; ++retired) {
+        StagingBlock* block = &blocks[retired];
+
+        if (block->fence == 0 || block->fence > completed) {
+            break;
+        }
+
+        tail = block->end;
+        used -= block->size;
+    }
+
+    memmove(blocks.mem, blocks.mem + retired, (blocks.len - retired) * sizeof(StagingBlock));
+    blocks.len -= retired;
+}
+
+u64 StagingRing::oldest_fence() {
+    return blocks.empty() ? 0 : blocks[0].fence;
+}
+
+void StagingRing::free() {
+    blocks.free();
+    *this = {};
+}
+
+bool staging_ring_test() {
+    StagingRing ring;
+    ring.init(1024);
+
+    auto cleanup = [&]() { ring.free(); };
+
+    u64 a, b, c, d;
+
+    // A list submitted early can't free space behind one still recording.
+    TEST_CHECK(ring.alloc(300, 16, 1, &a) && a == 0, "first allocation not at the start");
+    TEST_CHECK(ring.alloc(300, 16, 2, &b) && b == 304, "second allocation not aligned after the first");
+    ring.submit(2, 1);
+    ring.retire(1);
+    TEST_CHECK(ring.used == 604 && ring.oldest_fence() == 0, "retired past a list that wasn't submitted");
+
+    ring.submit(1, 2);
+    ring.retire(1);
+    TEST_CHECK(ring.used == 604 && ring.oldest_fence() == 2, "retired before the fence was reached");
+    ring.retire(2);
+    TEST_CHECK(ring.used == 0 && ring.blocks.empty(), "reached fences left space behind");
+
+    // Wrapping skips the end when it's too small, and waits for the front to retire when the start is.
+    TEST_CHECK(ring.alloc(600, 16, 3, &a) && a == 0, "empty ring didn't start over");
+    ring.submit(3, 3);
+    TEST_CHECK(ring.alloc(300, 16, 4, &b) && b == 608, "allocation after the first misplaced");
+    ring.submit(4, 4);
+    ring.retire(3);
+    TEST_CHECK(ring.alloc(400, 16, 5, &c) && c == 0 && ring.wraps == 1, "didn't wrap to the start");
+    TEST_CHECK(!ring.alloc(300, 16, 5, &d), "wrapped allocation ran into live data");
+    TEST_CHECK(ring.oldest_fence() == 4, "wrong fence to wait on");
+    ring.retire(4);
+    TEST_CHECK(ring.alloc(300, 16, 5, &d) && d == 400, "retired space not reused after wrapping");
+    TEST_CHECK(ring.used == 1024 - 908 + 700, "skipped end not counted");
+
+    ring.submit(5, 5);
+    ring.retire(5);
+    TEST_CHECK(ring.used == 0, "wrapped blocks didn't retire");
+
+    TEST_CHECK(!ring.alloc(1025, 16, 6, &a), "allocation larger than the ring succeeded");
+    TEST_CHECK(ring.alloc(8, 512, 6, &a) && ring.alloc(8, 512, 6, &b) && a % 512 == 0 && b % 512 == 0 && b > a, "texture placement alignment ignored");
+    ring.submit(6, 6);
+    ring.retire(6);
+
+    ring.free();
+
+    // Random sizes from lists submitted out of order, finishing three submissions later. Every byte remembers the list
+    // holding it, so handing out space before its list finished shows up.
+    u64 capacity = 64 * 1024;
+    ring.init(capacity);
+
+    u64* byte_owners = (u64*)calloc(capacity, sizeof(u64));
+    u64* owner_fences = (u64*)calloc(4096, sizeof(u64));
+
+    u32 seed = 0x9e3779b9;
+    auto random_u32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+
+    u64 next_fence = 1;
+    u64 completed = 0;
+    bool failed = false;
+
+    auto complete = [&](u64 fence) {
+        completed = max(completed, fence);
+        ring.retire(completed);
+
+        for (u64 b = 0; b < capacity; ++b) {
+            if (byte_owners[b] && owner_fences[byte_owners[b]] && owner_fences[byte_owners[b]] <= completed) {
+                byte_owners[b] = 0;
+            }
+        }
+    };
+
+    for (u64 owner = 1; owner + 1 < 4096 && !failed; owner += 2) {
+        // Two lists recording at once, the second submitted first half the time.
+        for (u32 i = 0; i < 6 && !failed; ++i) {
+            u64 list = owner + (random_u32() & 1);
+            u64 size = 1 + random_u32() % 4096;
+            u64 alignment = (random_u32() & 1) ? 512 : 16;
+            u64 offset;
+
+            while (!ring.alloc(size, alignment, list, &offset)) {
+                u64 fence = ring.oldest_fence();
+
+                if (fence == 0) {
+                    pf_debug_log("staging ring test failed: ran out of space with nothing to wait on\n");
+                    failed = true;
+                    break;
+                }
+
+                complete(fence);
+            }
+
+            if (failed) {
+                break;
+            }
+
+            if (offset % alignment != 0 || offset + size > capacity) {
+                pf_debug_log("staging ring test failed: allocation misplaced\n");
+                failed = true;
+            }
+
+            for (u64 b = offset; b < offset + size && !failed; ++b) {
+                if (byte_owners[b]) {
+                    pf_debug_log("staging ring test failed: gave out space still in use\n");
+                    failed = true;
+                }
+
+                byte_owners[b] = list;
+            }
+
+            if (ring.used > capacity) {
+                pf_debug_log("staging ring test failed: more used than there is\n");
+                failed = true;
+            }
+        }
+
+        u64 first = (random_u32() & 1) ? owner : owner + 1;
+        u64 second = first == owner ? owner + 1 : owner;
+
+        owner_fences[first] = next_fence;
+        ring.submit(first, next_fence++);
+        owner_fences[second] = next_fence;
+        ring.submit(second, next_fence++);
+
+        if (next_fence > 4) {
+            complete(next_fence - 4);
+        }
+    }
+
+    if (!failed) {
+        ring.retire(next_fence);
+
+        if (ring.used != 0 || ring.wraps == 0) {
+            pf_debug_log("staging ring test failed: %llu bytes left after everything finished, %u wraps\n", ring.used, ring.wraps);
+            failed = true;
+        }
+        else {
+            pf_debug_log("staging ring test passed: %u wraps, peak %llu of %llu bytes\n", ring.wraps, ring.peak_used, capacity);
+        }
+    }
+
+    ::free(byte_owners);
+    ::free(owner_fences);
+    ring.free();
+
+    return !failed;
+}
+
+void staging_ring_benchmark(u64 capacity) {
+    StagingRing ring;
+    ring.init(capacity);
+
+    u8* memory = (u8*)malloc(capacity);
+    u64 source_size = 4 * 1024 * 1024;
+    u8* source = (u8*)malloc(source_size);
+    memset(source, 0xab, source_size);
+
+    u32 seed = 0x2545f491;
+    auto random_u32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+
+    u32 frame_count = 1000;
+    // The GPU finishes a frame this many frames after it's submitted.
+    u64 frames_in_flight = 2;
+
+    u64 bytes = 0;
+    u64 allocations = 0;
+    u32 stalls = 0;
+    u64 alloc_ticks = 0;
+
+    u64 start = pf_ticks();
+
+    for (u64 frame = 1; frame <= frame_count; ++frame) {
+        if (frame > frames_in_flight) {
+            ring.retire(frame - frames_in_flight);
+        }
+
+        // Constants and small buffers, a few texture levels and now and then a whole mesh.
+        u32 count = 200 + 8 + (frame % 16 == 0);
+
+        for (u32 i = 0; i < count; ++i) {
+            u64 size, alignment;
+
+            if (i < 200) {
+                size = 256 + random_u32() % (4 * 1024);
+                alignment = 16;
+            }
+            else if (i < 208) {
+                size = 64 * 1024 + random_u32() % (1024 * 1024);
+                alignment = 512;
+            }
+            else {
+                size = source_size;
+                alignment = 16;
+            }
+
+            u64 alloc_start = pf_ticks();
+            u64 offset;
+
+            while (!ring.alloc(size, alignment, frame, &offset)) {
+                // Stands in for waiting on the fence.
+                u64 fence = ring.oldest_fence();
+                assert(fence && "staging ring benchmark ran out of space within a frame");
+                ring.retire(fence);
+                stalls++;
+            }
+
+            alloc_ticks += pf_ticks() - alloc_start;
+
+            memcpy(memory + offset, source, size);
+            bytes += size;
+            allocations++;
+        }
+
+        ring.submit(frame, frame);
+    }
+
+    f64 seconds = (f64)(pf_ticks() - start) / (f64)pf_ticks_per_second();
+
+    pf_debug_log("staging ring: %.0f MB ring, %.2f GB/s copied in over %llu allocations, %.1fns per allocation, "
+        "%u stalls, peak %.2f MB used, %u wraps\n",
+        (f64)capacity / (1024.0 * 1024.0), (f64)bytes / seconds / (1024.0 * 1024.0 * 1024.0), allocations,
+        (f64)alloc_ticks / (f64)pf_ticks_per_second() * 1e9 / (f64)allocations, stalls,
+        (f64)ring.peak_used / (1024.0 * 1024.0), ring.wraps);
+
+    ::free(memory);
+    ::free(source);
+    ring.free();
+}
+
+void staging_ring_frame_benchmark(const char* name, u64 capacity, u32 frames_in_flight, u32 upload_count, u64* upload_sizes) {
+    StagingRing ring;
+    ring.init(capacity);
+
+    u64 source_size = 0;
+
+    for (u32 i = 0; i < upload_count; ++i) {
+        source_size = max(source_size, upload_sizes[i]);
+    }
+
+    u8* memory = (u8*)malloc(capacity);
+    u8* source = (u8*)malloc(source_size);
+    memset(source, 0xab, source_size);
+
+    u32 frame_count = 500;
+    u64 bytes = 0;
+    u32 stalls = 0;
+    u64 alloc_ticks = 0;
+
+    u64 start = pf_ticks();
+
+    for (u64 frame = 1; frame <= frame_count; ++frame) {
+        if (frame > frames_in_flight) {
+            ring.retire(frame - frames_in_flight);
+        }
+
+        for (u32 i = 0; i < upload_count; ++i) {
+            u64 alloc_start = pf_ticks();
+            u64 offset;
+
+            while (!ring.alloc(upload_sizes[i], 16, frame, &offset)) {
+                u64 fence = ring.oldest_fence();
+                assert(fence && "staging ring benchmark ran out of space within a frame");
+                ring.retire(fence);
+                stalls++;
+            }
+
+            alloc_ticks += pf_ticks() - alloc_start;
+
+            memcpy(memory + offset, source, upload_sizes[i]);
+            bytes += upload_sizes[i];
+        }
+
+        ring.submit(frame, frame);
+    }
+
+    f64 seconds = (f64)(pf_ticks() - start) / (f64)pf_ticks_per_second();
+
+    pf_debug_log("staging ring, %s: %.2f MB ring, %.2f MB a frame, %.2f GB/s copied in, %.1fns per allocation, "
+        "%u stalls, peak %.2f MB used\n",
+        name, (f64)capacity / (1024.0 * 1024.0), (f64)bytes / (f64)frame_count / (1024.0 * 1024.0),
+        (f64)bytes / seconds / (1024.0 * 1024.0 * 1024.0),
+        (f64)alloc_ticks / (f64)pf_ticks_per_second() * 1e9 / (f64)(frame_count * upload_count), stalls,
+        (f64)ring.peak_used / (1024.0 * 1024.0));
+
+    assert(stalls == 0 && "staging ring too small for what the queue uploads each frame");
+
+    ::free(memory);
+    ::free(source);
+    ring.free();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+
+// Hands out offsets into a fixed block of upload memory, oldest first. Space is owned by whichever command list
+// allocated it, and comes back once the queue's fence passes the value that list was submitted with. Knows nothing of
+// the GPU: the renderer maps the memory and reports submissions and fence values.
+//
+// Lists on one queue can be recorded at the same time and submitted in any order, so space is only reclaimed up to the
+// oldest allocation whose list hasn't finished.
+
+struct StagingBlock {
+    // Offset one past the block's last byte, and the bytes it holds including any padding and the end skipped to wrap.
+    u64 end;
+    u64 size;
+    u64 owner;
+    // 0 until the owner is submitted.
+    u64 fence;
+};
+
+struct StagingRing {
+    u64 capacity;
+    u64 head;
+    u64 tail;
+    u64 used;
+    // In the order allocated.
+    Vec<StagingBlock> blocks;
+
+    u64 peak_used;
+    u32 wraps;
+
+    void init(u64 size);
+
+    // Places size bytes at a multiple of alignment, a power of two, and writes where to offset. Fails when there's no
+    // room until older blocks retire, or ever.
+    bool alloc(u64 size, u64 alignment, u64 owner, u64* offset);
+
+    // Everything owner allocated comes back once the fence reaches fence.
+    void submit(u64 owner, u64 fence);
+
+    // Takes back the blocks at the front whose fences are at most completed.
+    void retire(u64 completed);
+
+    // The fence to wait on for the oldest block to retire, 0 when it isn't submitted yet or there are none.
+    u64 oldest_fence();
+
+    void free();
+};
+
+// Allocates, submits and retires as a queue three frames behind would, and checks wraparound and retirement along the
+// way. Returns false and logs what went wrong on a failure.
+bool staging_ring_test();
+
+// Measures how fast uploads of a typical mix of sizes go through a ring, copying the data in as the renderer would.
+void staging_ring_benchmark(u64 capacity);
+
+// Measures a queue that uploads the same buffers every frame, of upload_sizes bytes, with the GPU frames_in_flight frames
+// behind. Checks the ring never has to wait for it.
+void staging_ring_frame_benchmark(const char* name, u64 capacity, u32 frames_in_flight, u32 upload_count, u64* upload_sizes);
@@ -0,0 +1,396 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "texture_streaming.h"
+#include "platform.h"
+#include "profiler.h"
+
+u32 TextureStreamer::add(u32 size, u32 mip_levels, u32 tail_mip, u64* mip_sizes) {
+    assert(mip_levels <= STREAMING_MAX_MIPS && tail_mip < mip_levels);
+
+    StreamingTexture texture = {};
+    texture.size = size;
+    texture.mip_levels = mip_levels;
+    texture.tail_mip = tail_mip;
+    texture.resident_mip = tail_mip;
+    texture.target_mip = tail_mip;
+    texture.wanted_mip = mip_levels;
+    texture.last_wanted_frame = frame;
+    texture.alive = true;
+
+    for (u32 i = 0; i < mip_levels; ++i) {
+        texture.mip_sizes[i] = mip_sizes[i];
+
+        if (i >= tail_mip) {
+            resident_bytes += mip_sizes[i];
+        }
+    }
+
+    if (!free_textures.empty()) {
+        u32 index = free_textures.pop();
+        textures[index] = texture;
+        return index;
+    }
+
+    textures.push(texture);
+    return textures.len - 1;
+}
+
+void TextureStreamer::remove(u32 texture) {
+    StreamingTexture* t = &textures[texture];
+    assert(t->alive);
+
+    // Loads and evictions are accounted for when they're scheduled, so target_mip is what's counted.
+    for (u32 i = t->target_mip; i < t->mip_levels; ++i) {
+        resident_bytes -= t->mip_sizes[i];
+    }
+
+    t->alive = false;
+    free_textures.push(texture);
+}
+
+void TextureStreamer::begin_frame() {
+    frame++;
+
+    for (u32 i = 0; i < textures.len; ++i) {
+        textures[i].wanted_mip = textures[i].mip_levels;
+    }
+}
+
+void TextureStreamer::want(u32 texture, u32 mip) {
+    StreamingTexture* t = &textures[texture];
+
+    if (mip < t->wanted_mip) {
+        t->wanted_mip = mip;
+        t->last_wanted_frame = frame;
+    }
+}
+
+struct LoadCandidate {
+    u32 texture;
+    u32 gap;
+};
+
+static int compare_load_candidates(const void* a, const void* b) {
+    LoadCandidate* x = (LoadCandidate*)a;
+    LoadCandidate* y = (LoadCandidate*)b;
+
+    if (x->gap != y->gap) {
+        return x->gap > y->gap ? -1 : 1;
+    }
+
+    return x->texture < y->texture ? -1 : x->texture > y->texture;
+}
+
+struct EvictionCandidate {
+    u32 texture;
+    u64 last_wanted_frame;
+};
+
+static int compare_eviction_candidates(const void* a, const void* b) {
+    EvictionCandidate* x = (EvictionCandidate*)a;
+    EvictionCandidate* y = (EvictionCandidate*)b;
+
+    if (x->last_wanted_frame != y->last_wanted_frame) {
+        return x->last_wanted_frame < y->last_wanted_frame ? -1 : 1;
+    }
+
+    return x->texture < y->texture ? -1 : x->texture > y->texture;
+}
+
+u32 TextureStreamer::schedule(StreamingBudget* budget, StreamingOp* ops) {
+    PROFILE_FUNCTION();
+
+    Scratch scratch = get_scratch(0);
+
+    LoadCandidate* loads_wanted = scratch->push_array<LoadCandidate>(textures.len);
+    EvictionCandidate* victims = scratch->push_array<EvictionCandidate>(textures.len);
+    u32 load_count = 0;
+    u32 victim_count = 0;
+
+    for (u32 i = 0; i < textures.len; ++i) {
+        StreamingTexture* t = &textures[i];
+
+        if (!t->alive || t->target_mip != t->resident_mip) {
+            continue;
+        }
+
+        if (t->wanted_mip < t->resident_mip) {
+            loads_wanted[load_count++] = { i, t->resident_mip - t->wanted_mip };
+        }
+        else if (t->wanted_mip > t->resident_mip && t->resident_mip < t->tail_mip) {
+            victims[victim_count++] = { i, t->last_wanted_frame };
+        }
+    }
+
+    qsort(loads_wanted, load_count, sizeof(LoadCandidate), compare_load_candidates);
+    qsort(victims, victim_count, sizeof(EvictionCandidate), compare_eviction_candidates);
+
+    u32 op_count = 0;
+    u32 next_victim = 0;
+    u64 frame_bytes = 0;
+
+    for (u32 i = 0; i < load_count; ++i) {
+        StreamingTexture* t = &textures[loads_wanted[i].texture];
+        u32 mip = t->resident_mip - 1;
+        u64 size = t->mip_sizes[mip];
+
+        if (frame_bytes > 0 && frame_bytes + size > budget->bytes_per_frame) {
+            break;
+        }
+
+        while (resident_bytes + size > budget->memory_bytes && next_victim < victim_count) {
+            u32 victim = victims[next_victim++].texture;
+            StreamingTexture* v = &textures[victim];
+
+            resident_bytes -= v->mip_sizes[v->resident_mip];
+            v->target_mip = v->resident_mip + 1;
+            evictions++;
+
+            ops[op_count++] = { STREAMING_OP_EVICT, victim, v->target_mip };
+        }
+
+        if (resident_bytes + size > budget->memory_bytes) {
+            break;
+        }
+
+        resident_bytes += size;
+        frame_bytes += size;
+        t->target_mip = mip;
+        loads++;
+        loaded_bytes += size;
+
+        ops[op_count++] = { STREAMING_OP_LOAD, loads_wanted[i].texture, mip };
+    }
+
+    return op_count;
+}
+
+void TextureStreamer::finish(u32 texture) {
+    StreamingTexture* t = &textures[texture];
+    assert(t->target_mip != t->resident_mip);
+    t->resident_mip = t->target_mip;
+}
+
+void TextureStreamer::free() {
+    textures.free();
+    free_textures.free();
+    *this = {};
+}
+
+// screen_scale is the pixels a unit covers at a distance of one.
+static u32 wanted_mip(f32 screen_scale, XMFLOAT3 position, StreamingInstance* instance, u32 size, u32 mip_levels) {
+    f32 dx = instance->center.x - position.x;
+    f32 dy = instance->center.y - position.y;
+    f32 dz = instance->center.z - position.z;
+    f32 distance = sqrtf(dx * dx + dy * dy + dz * dz) - instance->radius;
+
+    if (distance <= 0.0f) {
+        return 0;
+    }
+
+    f32 texels_per_pixel = instance->uv_density * (f32)size * distance / screen_scale;
+
+    if (texels_per_pixel <= 1.0f) {
+        return 0;
+    }
+
+    // Rounded down, so a texel never covers more than a pixel.
+    u32 mip = (u32)log2f(texels_per_pixel);
+    return min(mip, mip_levels - 1);
+}
+
+static f32 screen_scale(StreamingView* view) {
+    return view->screen_height / (2.0f * tanf(view->vertical_fov * 0.5f));
+}
+
+u32 streaming_wanted_mip(StreamingView* view, StreamingInstance* instance, u32 size, u32 mip_levels) {
+    return wanted_mip(screen_scale(view), view->position, instance, size, mip_levels);
+}
+
+void streaming_compute_demand(TextureStreamer* streamer, StreamingView* view, u32 instance_count, StreamingInstance* instances) {
+    PROFILE_FUNCTION();
+
+    f32 scale = screen_scale(view);
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        StreamingInstance* instance = &instances[i];
+        StreamingTexture* t = &streamer->textures[instance->texture];
+        streamer->want(instance->texture, wanted_mip(scale, view->position, instance, t->size, t->mip_levels));
+    }
+}
+
+// Benchmark
+
+// BC7 sizes, a byte per texel in 4x4 blocks.
+static u64 benchmark_mip_size(u32 size, u32 mip) {
+    u32 blocks = max((size >> mip) / 4, 1u);
+    return (u64)blocks * blocks * 16;
+}
+
+struct BenchmarkRun {
+    f64 ms_per_frame;
+    u32 max_ops;
+    u64 loaded_bytes;
+    u32 evictions;
+    u32 starved;
+};
+
+static BenchmarkRun run_streaming_benchmark(u32 texture_count, u32 instance_count, StreamingInstance* instances, StreamingBudget* budget) {
+    Scratch scratch = get_scratch(0);
+
+    const u32 size = 2048;
+    const u32 mip_levels = 12;
+    // Levels of 64x64 and under are always resident.
+    const u32 tail_mip = 5;
+
+    // Ops land this many frames after they're scheduled.
+    const u32 latency = 3;
+    const u32 fly_frames = 600;
+    const u32 settle_frames = 300;
+
+    u64 mip_sizes[mip_levels];
+
+    for (u32 i = 0; i < mip_levels; ++i) {
+        mip_sizes[i] = benchmark_mip_size(size, i);
+    }
+
+    TextureStreamer streamer = {};
+
+    for (u32 i = 0; i < texture_count; ++i) {
+        streamer.add(size, mip_levels, tail_mip, mip_sizes);
+    }
+
+    u64 tail_bytes = streamer.resident_bytes;
+
+    StreamingOp* in_flight[latency];
+    u32 in_flight_counts[latency] = {};
+
+    for (u32 i = 0; i < latency; ++i) {
+        in_flight[i] = scratch->push_array<StreamingOp>(texture_count);
+    }
+
+    BenchmarkRun run = {};
+    u64 ticks = 0;
+
+    for (u32 frame = 0; frame < fly_frames + settle_frames; ++frame) {
+        u32 slot = frame % latency;
+
+        for (u32 i = 0; i < in_flight_counts[slot]; ++i) {
+            streamer.finish(in_flight[slot][i].texture);
+        }
+
+        // Low over the grid along its diagonal, then hovering at the end.
+        f32 t = (f32)min(frame, fly_frames) / (f32)fly_frames;
+
+        StreamingView view = {};
+        view.position = { t * 200.0f, 3.0f, t * 200.0f };
+        view.vertical_fov = PI32 * 0.5f;
+        view.screen_height = 1080.0f;
+
+        u64 start = pf_ticks();
+
+        streamer.begin_frame();
+        streaming_compute_demand(&streamer, &view, instance_count, instances);
+        in_flight_counts[slot] = streamer.schedule(budget, in_flight[slot]);
+
+        ticks += pf_ticks() - start;
+
+        u64 frame_bytes = 0;
+        u32 frame_loads = 0;
+
+        for (u32 i = 0; i < in_flight_counts[slot]; ++i) {
+            StreamingOp* op = &in_flight[slot][i];
+
+            if (op->kind == STREAMING_OP_LOAD) {
+                frame_bytes += mip_sizes[op->mip];
+                frame_loads++;
+            }
+        }
+
+        run.max_ops = max(run.max_ops, in_flight_counts[slot]);
+
+        assert((frame_loads <= 1 || frame_bytes <= budget->bytes_per_frame) && "streaming went over the per frame budget");
+        assert(streamer.resident_bytes <= max(budget->memory_bytes, tail_bytes) && "streaming went over the memory budget");
+
+        u64 counted = 0;
+
+        for (u32 i = 0; i < texture_count; ++i) {
+            StreamingTexture* texture = &streamer.textures[i];
+
+            for (u32 m = texture->target_mip; m < mip_levels; ++m) {
+                counted += mip_sizes[m];
+            }
+        }
+
+        assert(counted == streamer.resident_bytes && "streaming lost track of resident bytes");
+        (void)counted;
+    }
+
+    // With the camera still, everything wanted should be in unless memory ran out.
+    u64 wanted_bytes = 0;
+
+    for (u32 i = 0; i < texture_count; ++i) {
+        StreamingTexture* texture = &streamer.textures[i];
+
+        for (u32 m = min(texture->wanted_mip, tail_mip); m < mip_levels; ++m) {
+            wanted_bytes += mip_sizes[m];
+        }
+
+        if (texture->wanted_mip < texture->resident_mip) {
+            run.starved++;
+        }
+    }
+
+    assert((wanted_bytes > budget->memory_bytes || run.starved == 0) && "streaming never loaded what was wanted");
+    (void)wanted_bytes;
+
+    run.ms_per_frame = (f64)ticks / (f64)pf_ticks_per_second() * 1000.0 / (f64)(fly_frames + settle_frames);
+    run.loaded_bytes = streamer.loaded_bytes;
+    run.evictions = streamer.evictions;
+
+    streamer.free();
+
+    return run;
+}
+
+void streaming_benchmark(u32 texture_count, u32 instance_count) {
+    Scratch scratch = get_scratch(0);
+
+    u32 seed = 0x2545f491;
+    auto random_u32 = [&]() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    };
+
+    // A square grid 200 units across, each instance using a random texture.
+    u32 grid = (u32)ceilf(sqrtf((f32)instance_count));
+    StreamingInstance* instances = scratch->push_array<StreamingInstance>(instance_count);
+
+    for (u32 i = 0; i < instance_count; ++i) {
+        instances[i].texture = random_u32() % texture_count;
+        instances[i].center = { (f32)(i % grid) / (f32)grid * 200.0f, 0.0f, (f32)(i / grid) / (f32)grid * 200.0f };
+        instances[i].radius = 1.0f;
+        instances[i].uv_density = 0.05f;
+    }
+
+    StreamingBudget roomy = {};
+    roomy.bytes_per_frame = 8 * 1024 * 1024;
+    roomy.memory_bytes = (u64)texture_count * 8 * 1024 * 1024;
+
+    StreamingBudget tight = {};
+    tight.bytes_per_frame = 2 * 1024 * 1024;
+    tight.memory_bytes = (u64)texture_count * 256 * 1024;
+
+    BenchmarkRun roomy_run = run_streaming_benchmark(texture_count, instance_count, instances, &roomy);
+    BenchmarkRun tight_run = run_streaming_benchmark(texture_count, instance_count, instances, &tight);
+
+    pf_debug_log("streaming: %u textures, %u instances: %.3fms per frame, roomy budget loaded %.2f MB with %u evictions, "
+        "tight budget loaded %.2f MB with %u evictions and left %u textures short, at most %u ops a frame\n",
+        texture_count, instance_count, (roomy_run.ms_per_frame + tight_run.ms_per_frame) * 0.5,
+        (f64)roomy_run.loaded_bytes / (1024.0 * 1024.0), roomy_run.evictions,
+        (f64)tight_run.loaded_bytes / (1024.0 * 1024.0), tight_run.evictions, tight_run.starved,
+        max(roomy_run.max_ops, tight_run.max_ops));
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+
+// Decides which mip levels of each streamed texture should be in video memory, from how large the instances using it
+// are on screen. Knows nothing of the GPU: the renderer carries out the loads and evictions it schedules, and tells it
+// when each one has landed.
+//
+// A texture's resident levels are always a contiguous tail of its chain, from resident_mip down to the last level. The
+// levels from tail_mip on are uploaded with the texture and never evicted.
+
+#define STREAMING_MAX_MIPS 16
+#define STREAMING_NONE 0xffffffff
+
+struct StreamingTexture {
+    // Larger side of level 0, in texels.
+    u32 size;
+    u32 mip_levels;
+    u32 tail_mip;
+    u64 mip_sizes[STREAMING_MAX_MIPS];
+
+    // Finest level the GPU can sample. target_mip differs while a load or eviction is in flight.
+    u32 resident_mip;
+    u32 target_mip;
+
+    // Finest level any instance wanted this frame, mip_levels when none did.
+    u32 wanted_mip;
+    u64 last_wanted_frame;
+
+    bool alive;
+};
+
+struct StreamingBudget {
+    // Bytes of loads started per frame. The first load of a frame is let through even when larger, so no level starves.
+    u64 bytes_per_frame;
+    // Bytes of every resident and loading level together. Tails are counted but never evicted, so they can overrun it.
+    u64 memory_bytes;
+};
+
+enum StreamingOpKind {
+    // Adds target_mip, one level finer than the texture's resident_mip.
+    STREAMING_OP_LOAD,
+    // Drops resident_mip, leaving target_mip one level coarser.
+    STREAMING_OP_EVICT,
+};
+
+struct StreamingOp {
+    StreamingOpKind kind;
+    u32 texture;
+    u32 mip;
+};
+
+// Where an instance using a streamed texture is, with uv_density in uv units per world unit along its surface.
+struct StreamingInstance {
+    u32 texture;
+    XMFLOAT3 center;
+    f32 radius;
+    f32 uv_density;
+};
+
+struct StreamingView {
+    XMFLOAT3 position;
+    f32 vertical_fov;
+    f32 screen_height;
+};
+
+struct TextureStreamer {
+    Vec<StreamingTexture> textures;
+    Vec<u32> free_textures;
+    u64 frame;
+    u64 resident_bytes;
+
+    u64 loaded_bytes;
+    u32 loads;
+    u32 evictions;
+
+    // mip_sizes holds the bytes of each level. Returns the texture's index, with the levels from tail_mip on resident.
+    u32 add(u32 size, u32 mip_levels, u32 tail_mip, u64* mip_sizes);
+    void remove(u32 texture);
+
+    // Forgets last frame's demand.
+    void begin_frame();
+
+    // Asks for texture to have mip resident.
+    void want(u32 texture, u32 mip);
+
+    // Writes the loads and evictions to carry out this frame to ops and returns how many there are. A texture has at
+    // most one op in flight, so ops needs room for textures.len. Loads go to the textures furthest from what they want
+    // first. Evictions only happen to make room for a load, and take the finest level of textures that have more than
+    // they want, least recently wanted first.
+    u32 schedule(StreamingBudget* budget, StreamingOp* ops);
+
+    // The op in flight for texture has landed.
+    void finish(u32 texture);
+
+    void free();
+};
+
+// The level at which one texel covers about one pixel on the nearest point of the instance's bounding sphere.
+u32 streaming_wanted_mip(StreamingView* view, StreamingInstance* instance, u32 size, u32 mip_levels);
+
+// Calls want for every instance. Instances off screen count as well, so turning the camera doesn't pop.
+void streaming_compute_demand(TextureStreamer* streamer, StreamingView* view, u32 instance_count, StreamingInstance* instances);
+
+// Flies a camera over a grid of textured instances, applying each frame's ops a few frames later as the copy queue would.
+// Checks the budgets hold and that everything wanted ends up resident once the camera stops, and logs timings.
+void streaming_benchmark(u32 texture_count, u32 instance_count);
@@ -0,0 +1,214 @@
+#include <math.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define F16C_TARGET
+#else
+#include <cpuid.h>
+#define F16C_TARGET __attribute__((target("f16c")))
+#endif
+
+#include "vertex_format.h"
+
+// Rounds to nearest even, like the hardware conversion. Overflow goes to infinity and NaNs stay NaN.
+u16 float_to_half(f32 f) {
+    u32 x;
+    memcpy(&x, &f, sizeof(x));
+
+    u32 sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    u32 h;
+
+    if (x >= 0x47800000) {
+        h = x > 0x7f800000 ? 0x7e00 : 0x7c00;
+    }
+    else if (x < 0x38800000) {
+        // Subnormal: adding 0.5 lines the mantissa up so the float adder does the rounding.
+        f32 a;
+        memcpy(&a, &x, sizeof(a));
+        a += 0.5f;
+        u32 ai;
+        memcpy(&ai, &a, sizeof(ai));
+        h = ai - 0x3f000000;
+    }
+    else {
+        u32 mantissa_odd = (x >> 13) & 1;
+        x += 0xc8000fff + mantissa_odd;
+        h = x >> 13;
+    }
+
+    return (u16)(h | sign);
+}
+
+f32 half_to_float(u16 h) {
+    u32 sign = (u32)(h & 0x8000) << 16;
+    u32 exponent = (h >> 10) & 0x1f;
+    u32 mantissa = h & 0x3ff;
+
+    u32 x;
+
+    if (exponent == 0) {
+        f32 f = (f32)mantissa * (1.0f / 16777216.0f);
+        memcpy(&x, &f, sizeof(x));
+        x |= sign;
+    }
+    else if (exponent == 31) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    f32 f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static bool cpu_has_f16c() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 29)) != 0;
+#else
+    u32 a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 29)) != 0;
+#endif
+}
+
+RDMeshQuantization quantization_from_bounds(XMFLOAT3 aabb_min, XMFLOAT3 aabb_max) {
+    RDMeshQuantization q;
+    q.position_offset = aabb_min;
+    q.position_scale = {
+        (aabb_max.x - aabb_min.x) / 65535.0f,
+        (aabb_max.y - aabb_min.y) / 65535.0f,
+        (aabb_max.z - aabb_min.z) / 65535.0f,
+    };
+    return q;
+}
+
+static f32* element(void* base, u32 stride, u32 i) {
+    return (f32*)((u8*)base + (u64)i * stride);
+}
+
+void pack_positions(RDPackedVertex* out, u32 count, void* positions, u32 stride, RDMeshQuantization* quantization) {
+    XMFLOAT3 s = quantization->position_scale;
+
+    __m128 offset = _mm_set_ps(0.0f, quantization->position_offset.z, quantization->position_offset.y, quantization->position_offset.x);
+    __m128 inv_scale = _mm_set_ps(0.0f, s.z > 0.0f ? 1.0f / s.z : 0.0f, s.y > 0.0f ? 1.0f / s.y : 0.0f, s.x > 0.0f ? 1.0f / s.x : 0.0f);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 lo = _mm_setzero_ps();
+    __m128 hi = _mm_set1_ps(65535.0f);
+
+    for (u32 i = 0; i < count; ++i) {
+        f32* p = element(positions, stride, i);
+
+        __m128 v = _mm_set_ps(0.0f, p[2], p[1], p[0]);
+        v = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(v, offset), inv_scale), half);
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+
+        alignas(16) i32 q[4];
+        _mm_store_si128((__m128i*)q, _mm_cvttps_epi32(v));
+
+        out[i].position[0] = (u16)q[0];
+        out[i].position[1] = (u16)q[1];
+        out[i].position[2] = (u16)q[2];
+        out[i].padding = 0;
+    }
+}
+
+void pack_normal(RDPackedVertex* out, XMFLOAT3 n) {
+    // Project onto the octahedron, then fold the lower half over the diagonals.
+    f32 l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    f32 inv_l1 = l1 > 0.0f ? 1.0f / l1 : 0.0f;
+
+    f32 x = n.x * inv_l1;
+    f32 y = n.y * inv_l1;
+
+    if (n.z < 0.0f) {
+        f32 folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        f32 folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    out->normal[0] = (i16)roundf(min(max(x, -1.0f), 1.0f) * 32767.0f);
+    out->normal[1] = (i16)roundf(min(max(y, -1.0f), 1.0f) * 32767.0f);
+}
+
+void pack_normals(RDPackedVertex* out, u32 count, void* normals, u32 stride) {
+    for (u32 i = 0; i < count; ++i) {
+        f32* n = element(normals, stride, i);
+        pack_normal(&out[i], { n[0], n[1], n[2] });
+    }
+}
+
+F16C_TARGET static void pack_uvs_f16c(RDPackedVertex* out, u32 count, void* uvs, u32 stride) {
+    u32 i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        f32* a = element(uvs, stride, i + 0);
+        f32* b = element(uvs, stride, i + 1);
+        f32* c = element(uvs, stride, i + 2);
+        f32* d = element(uvs, stride, i + 3);
+
+        __m128i ab = _mm_cvtps_ph(_mm_set_ps(b[1], b[0], a[1], a[0]), _MM_FROUND_TO_NEAREST_INT);
+        __m128i cd = _mm_cvtps_ph(_mm_set_ps(d[1], d[0], c[1], c[0]), _MM_FROUND_TO_NEAREST_INT);
+
+        alignas(16) u32 halves[4];
+        _mm_store_si128((__m128i*)halves, _mm_unpacklo_epi64(ab, cd));
+
+        for (u32 k = 0; k < 4; ++k) {
+            memcpy(out[i + k].uv, &halves[k], sizeof(u32));
+        }
+    }
+
+    for (; i < count; ++i) {
+        f32* uv = element(uvs, stride, i);
+        out[i].uv[0] = float_to_half(uv[0]);
+        out[i].uv[1] = float_to_half(uv[1]);
+    }
+}
+
+void pack_uvs(RDPackedVertex* out, u32 count, void* uvs, u32 stride) {
+    static bool has_f16c = cpu_has_f16c();
+
+    if (has_f16c) {
+        pack_uvs_f16c(out, count, uvs, stride);
+        return;
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        f32* uv = element(uvs, stride, i);
+        out[i].uv[0] = float_to_half(uv[0]);
+        out[i].uv[1] = float_to_half(uv[1]);
+    }
+}
+
+XMFLOAT3 unpack_position(RDPackedVertex* v, RDMeshQuantization* q) {
+    return {
+        q->position_offset.x + q->position_scale.x * (f32)v->position[0],
+        q->position_offset.y + q->position_scale.y * (f32)v->position[1],
+        q->position_offset.z + q->position_scale.z * (f32)v->position[2],
+    };
+}
+
+XMFLOAT3 unpack_normal(RDPackedVertex* v) {
+    f32 x = max((f32)v->normal[0] / 32767.0f, -1.0f);
+    f32 y = max((f32)v->normal[1] / 32767.0f, -1.0f);
+    f32 z = 1.0f - fabsf(x) - fabsf(y);
+
+    if (z < 0.0f) {
+        f32 t = -z;
+        x += x >= 0.0f ? -t : t;
+        y += y >= 0.0f ? -t : t;
+    }
+
+    f32 inv_length = 1.0f / sqrtf(x * x + y * y + z * z);
+    return { x * inv_length, y * inv_length, z * inv_length };
+}
+
+XMFLOAT2 unpack_uv(RDPackedVertex* v) {
+    return { half_to_float(v->uv[0]), half_to_float(v->uv[1]) };
+}
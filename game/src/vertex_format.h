@@ -0,0 +1,24 @@
+#pragma once
+
+#include <DirectXMath.h>
+using namespace DirectX;
+
+#include "common.h"
+#include "renderer.h"
+
+u16 float_to_half(f32 f);
+f32 half_to_float(u16 h);
+
+// Maps the box onto the full unorm16 range on each axis.
+RDMeshQuantization quantization_from_bounds(XMFLOAT3 aabb_min, XMFLOAT3 aabb_max);
+
+// Each source is count elements of floats, stride bytes apart. Only the matching fields of out are written.
+void pack_positions(RDPackedVertex* out, u32 count, void* positions, u32 stride, RDMeshQuantization* quantization);
+void pack_normals(RDPackedVertex* out, u32 count, void* normals, u32 stride);
+void pack_uvs(RDPackedVertex* out, u32 count, void* uvs, u32 stride);
+
+void pack_normal(RDPackedVertex* out, XMFLOAT3 normal);
+
+XMFLOAT3 unpack_position(RDPackedVertex* v, RDMeshQuantization* quantization);
+XMFLOAT3 unpack_normal(RDPackedVertex* v);
+XMFLOAT2 unpack_uv(RDPackedVertex* v);
@@ -2,12 +2,41 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#pragma warning(push, 0)
+#include <stb_image.h>
+#pragma warning(pop)
+
 #include "platform.h"
 #include "renderer.h"
 #include "gltf.h"
+#include "scene.h"
+#include "cook.h"
 #include "maps.h"
-
-static Arena scratch_arenas[2];
+#include "jobs.h"
+#include "profiler.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "bvh.h"
+#include "light_culling.h"
+#include "meshlets.h"
+#include "simplify.h"
+#include "mipmaps.h"
+#include "block_compression.h"
+#include "texture_streaming.h"
+#include "staging_ring.h"
+#include "render_stats.h"
+
+// The cooked scene is loaded when there is one, otherwise the glTF is imported. Run with -cook to make it.
+#define SCENE_GLTF_PATH "models/test_scene/scene.gltf"
+#define SCENE_COOKED_PATH "models/test_scene/scene.cooked"
+
+// Relative to the data directory the game runs in.
+#define ROOT_CONSTANTS_HEADER_PATH "../game/src/root_constants.h"
+
+static thread_local Arena scratch_arenas[2];
+
+// For command line modes run by the build, which shows what they print but not the debugger output.
+static bool log_to_stdout;
 
 static i64 counter_start;
 static i64 counter_freq;
@@ -33,6 +62,20 @@ void pf_msg_box(const char* fmt, ...) {
     va_end(ap);
 }
 
+void pf_fatal(const char* fmt, ...) {
+    Scratch scratch = get_scratch(0);
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    char* buf = format_buf(scratch.arena, fmt, ap);
+    OutputDebugStringA(buf);
+    MessageBoxA(0, buf, "Game", 0);
+
+    va_end(ap);
+    ExitProcess(1);
+}
+
 void pf_debug_log(const char* fmt, ...) {
     Scratch scratch = get_scratch(0);
 
@@ -42,17 +85,96 @@ void pf_debug_log(const char* fmt, ...) {
     char* buf = format_buf(scratch.arena, fmt, ap);
     OutputDebugStringA(buf);
 
+    if (log_to_stdout) {
+        fputs(buf, stdout);
+        fflush(stdout);
+    }
+
     va_end(ap);
 }
 
 f32 pf_time() {
+    i64 delta = (i64)pf_ticks() - counter_start;
+    f64 time = (f64)delta/(f64)counter_freq;
+
+    return (f32)time;
+}
+
+u64 pf_ticks() {
     LARGE_INTEGER now;
     QueryPerformanceCounter(&now);
+    return (u64)now.QuadPart;
+}
 
-    i64 delta = now.QuadPart - counter_start;
-    f64 time = (f64)delta/(f64)counter_freq;
+u64 pf_ticks_per_second() {
+    return (u64)counter_freq;
+}
 
-    return (f32)time;
+u32 pf_processor_count() {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return system_info.dwNumberOfProcessors;
+}
+
+// Scratch may be gone or full here, so no pf_msg_box.
+static void out_of_memory(const char* what) {
+    MessageBoxA(0, what, "Game", 0);
+    ExitProcess(1);
+}
+
+static void commit_scratch(void* mem, u64 size) {
+    if (!VirtualAlloc(mem, size, MEM_COMMIT, PAGE_READWRITE)) {
+        out_of_memory("Out of memory committing scratch memory");
+    }
+}
+
+// Every thread reserves the whole size but only commits what it pushes, so idle workers cost address space alone.
+void pf_init_thread_scratch(u64 size) {
+    for (int i = 0; i < ARRAY_LEN(scratch_arenas); ++i) {
+        void* mem = VirtualAlloc(0, size, MEM_RESERVE, PAGE_READWRITE);
+
+        if (!mem) {
+            out_of_memory("Out of address space reserving scratch memory");
+        }
+
+        scratch_arenas[i] = arena_init_reserved(mem, size, commit_scratch);
+    }
+}
+
+struct ThreadStart {
+    void (*proc)(void* data);
+    void* data;
+};
+
+static DWORD WINAPI thread_start_proc(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+
+    start.proc(start.data);
+
+    return 0;
+}
+
+void pf_create_thread(void (*proc)(void* data), void* data) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    start->proc = proc;
+    start->data = data;
+
+    HANDLE thread = CreateThread(0, 0, thread_start_proc, start, 0, 0);
+    assert(thread);
+    CloseHandle(thread);
+}
+
+void* pf_create_semaphore(u32 initial_count, u32 max_count) {
+    return CreateSemaphoreA(0, initial_count, max_count, 0);
+}
+
+void pf_semaphore_wait(void* semaphore) {
+    WaitForSingleObject((HANDLE)semaphore, INFINITE);
+}
+
+void pf_semaphore_signal(void* semaphore, u32 count) {
+    ReleaseSemaphore((HANDLE)semaphore, count, 0);
 }
 
 FileContents pf_load_file(Arena* arena, const char* path) {
@@ -77,6 +199,58 @@ FileContents pf_load_file(Arena* arena, const char* path) {
     return result;
 }
 
+bool pf_write_file(const char* path, void* data, u64 size) {
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    DWORD bytes_written = 0;
+    WriteFile(file, data, (DWORD)size, &bytes_written, 0);
+
+    CloseHandle(file);
+
+    return bytes_written == size;
+}
+
+FileContents pf_map_file(const char* path) {
+    FileContents result = {};
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return result;
+    }
+
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+
+    // An empty file can't be mapped.
+    HANDLE mapping = file_size.QuadPart ? CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0) : 0;
+
+    if (mapping) {
+        // The view keeps the mapping and the file open by itself.
+        result.memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        result.size = result.memory ? file_size.QuadPart : 0;
+        CloseHandle(mapping);
+    }
+
+    CloseHandle(file);
+
+    return result;
+}
+
+void pf_unmap_file(FileContents file) {
+    if (file.memory) {
+        UnmapViewOfFile(file.memory);
+    }
+}
+
+bool pf_create_directory(const char* path) {
+    return CreateDirectoryA(path, 0) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
 Scratch get_scratch(Arena* conflict) {
     Arena* arena = 0;
 
@@ -164,7 +338,20 @@ static bool key_down(int key) {
     return GetKeyState(key) & (1 << 16);
 }
 
-int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
+// World bounds of each instance, for picking.
+static void build_instance_bvh(BVH* bvh, Renderer* renderer, u32 num_instances, RDMeshInstance* instances) {
+    Scratch scratch = get_scratch(0);
+    AABB* instance_bounds = scratch->push_array<AABB>(num_instances);
+
+    for (u32 i = 0; i < num_instances; ++i) {
+        RDMeshBounds mesh_bounds = rd_get_mesh_bounds(renderer, instances[i].mesh);
+        instance_bounds[i] = aabb_transform(mesh_bounds.aabb_min, mesh_bounds.aabb_max, instances[i].transform);
+    }
+
+    bvh->build(num_instances, instance_bounds);
+}
+
+int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR command_line, int) {
     LARGE_INTEGER counter_start_result;
     QueryPerformanceCounter(&counter_start_result);
     counter_start = counter_start_result.QuadPart;
@@ -175,12 +362,131 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
 
     u64 main_mem_size = 1024 * 1024 * 1024;
     void* main_mem = VirtualAlloc(0, main_mem_size, MEM_COMMIT, PAGE_READWRITE);
+
+    if (!main_mem) {
+        out_of_memory("Out of memory allocating the main arena");
+    }
+
     Arena arena = arena_init(main_mem, main_mem_size);
 
-    for (int i = 0; i < ARRAY_LEN(scratch_arenas); ++i) {
-        u64 scratch_mem_size = 1024 * 1024 * 1024;
-        void* mem = VirtualAlloc(0, scratch_mem_size, MEM_COMMIT, PAGE_READWRITE);
-        scratch_arenas[i] = arena_init(mem, scratch_mem_size);
+    pf_init_thread_scratch(1024 * 1024 * 1024);
+    profiler_set_thread_name("main");
+
+    jobs_init(pf_processor_count() - 1);
+
+    if (strstr(command_line, "-bench_culling")) {
+        frustum_cull_benchmark(1000000);
+        occlusion_benchmark();
+        light_culling_benchmark(1024);
+        light_culling_benchmark(16384);
+        meshlet_benchmark(256);
+        meshlet_benchmark(1024);
+        return 0;
+    }
+
+    if (strstr(command_line, "-bench_bvh")) {
+        bvh_benchmark(100000);
+        bvh_benchmark(1000000);
+        return 0;
+    }
+
+    if (strstr(command_line, "-bench_textures")) {
+        mip_benchmark(1024);
+        mip_benchmark(4096);
+
+        int width, height;
+        u8* image = stbi_load("spongebob.jpg", &width, &height, 0, 4);
+
+        if (image) {
+            bc_benchmark("spongebob.jpg", image, width, height);
+            stbi_image_free(image);
+        }
+
+        bc_benchmark("synthetic", 0, 4096, 4096);
+        return 0;
+    }
+
+    if (strstr(command_line, "-bench_streaming")) {
+        streaming_benchmark(64, 4096);
+        streaming_benchmark(1024, 65536);
+        return 0;
+    }
+
+    if (strstr(command_line, "-bench_staging")) {
+        staging_ring_benchmark(16 * 1024 * 1024);
+        staging_ring_benchmark(96 * 1024 * 1024);
+        rd_staging_benchmark();
+        return 0;
+    }
+
+    if (strstr(command_line, "-test_staging")) {
+        return staging_ring_test() ? 0 : 1;
+    }
+
+    if (strstr(command_line, "-bench_recording")) {
+        rd_recording_benchmark(100000);
+        return 0;
+    }
+
+    if (strstr(command_line, "-test_render_stats")) {
+        return render_stats_test() ? 0 : 1;
+    }
+
+    if (strstr(command_line, "-test_render_graph")) {
+        return rd_test_render_graph() ? 0 : 1;
+    }
+
+    if (strstr(command_line, "-bench_lods")) {
+        simplify_benchmark(256);
+        simplify_benchmark(2048);
+        return 0;
+    }
+
+    // -gen_root_constants regenerates the header of root constant structs the renderer is built with, exiting with 1
+    // when it was stale and 2 when a shader failed to compile. Runs after every build, so the log goes to the build's
+    // output.
+    if (strstr(command_line, "-gen_root_constants")) {
+        log_to_stdout = true;
+        return (int)rd_generate_root_constants(ROOT_CONSTANTS_HEADER_PATH);
+    }
+
+    // -cook [source cooked]... imports each .gltf or .glb whose sources changed since it was last cooked and writes it
+    // out cooked, by default the scene that is loaded below. Images and meshes that did not change come from the cache.
+    if (char* cook_args = strstr(command_line, "-cook")) {
+        Scratch scratch = get_scratch(&arena);
+
+        Vec<char*> paths = {};
+        char* cursor = cook_args + strlen("-cook");
+
+        for (;;) {
+            char* path = (char*)scratch->push(512);
+            int length = 0;
+
+            if (sscanf_s(cursor, "%511s%n", path, 512, &length) != 1 || path[0] == '-') {
+                break;
+            }
+
+            paths.push(path);
+            cursor += length;
+        }
+
+        if (paths.len % 2 != 0) {
+            pf_msg_box("-cook takes pairs of a source and a cooked path, or none.");
+            return 1;
+        }
+
+        if (paths.empty()) {
+            paths.push((char*)SCENE_GLTF_PATH);
+            paths.push((char*)SCENE_COOKED_PATH);
+        }
+
+        DerivedDataCache ddc;
+        ddc_init(&ddc, DDC_DIRECTORY);
+
+        bool cooked = cook_scenes(&ddc, paths.len, paths.mem);
+        paths.free();
+
+        return cooked ? 0 : 1;
     }
 
     HashMap<int, int> hash_map = {};
@@ -227,16 +533,61 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
     SetWindowLongPtrA(window, GWLP_USERDATA, (LONG_PTR)&input);
 
     Renderer* renderer = rd_init(&arena, window);
-    RDUploadContext* upload_context = rd_open_upload_context(renderer);
 
-    GLTFResult gltf_result = gltf_load(&arena, renderer, upload_context, "models/test_scene/scene.gltf");
+    Scene scene;
+
+    // Uploads are queued straight from the scene data, and textures stream their finer levels from it for as long as
+    // they're around, so it's kept until exit.
+    FileContents cooked;
+
+    {
+        PROFILE_ZONE("load_scene");
 
-    for (u32 i = 0; i < gltf_result.num_instances; ++i) {
-        RDMeshInstance* instance = gltf_result.instances + i;
+        u64 load_start = pf_ticks();
+
+        // Cooked payloads go from the mapping straight into upload memory.
+        cooked = pf_map_file(SCENE_COOKED_PATH);
+        SceneData scene_data;
+        bool from_cooked = scene_read_cooked(&arena, cooked, &scene_data);
+
+        if (!from_cooked) {
+            if (cooked.memory) {
+                pf_debug_log("%s: not a cooked scene of version %u, importing %s instead\n", SCENE_COOKED_PATH, SCENE_COOKED_VERSION, SCENE_GLTF_PATH);
+            }
+
+            DerivedDataCache ddc;
+            ddc_init(&ddc, DDC_DIRECTORY);
+
+            scene_data = gltf_import(&arena, &ddc, SCENE_GLTF_PATH, true);
+        }
+
+        scene = scene_create(&arena, renderer, &scene_data);
+
+        pf_debug_log("loaded %s in %.2fms\n", from_cooked ? SCENE_COOKED_PATH : SCENE_GLTF_PATH,
+            (f64)(pf_ticks() - load_start) / (f64)pf_ticks_per_second() * 1000.0);
+    }
+
+    for (u32 i = 0; i < scene.num_instances; ++i) {
+        RDMeshInstance* instance = scene.instances + i;
+        instance->transform = instance->transform * XMMatrixScaling(0.5f, 0.5f, 0.5f);
+    }
+
+    for (u32 i = 0; i < scene.num_batched_instances; ++i) {
+        RDMeshInstance* instance = scene.batched_instances + i;
         instance->transform = instance->transform * XMMatrixScaling(0.5f, 0.5f, 0.5f);
     }
 
-    RDUploadStatus* upload_status = rd_submit_upload_context(renderer, upload_context);
+    // The scene is static, so the instance bvhs are built once and used for picking.
+    BVH instance_bvh = {};
+    BVH batched_instance_bvh = {};
+    build_instance_bvh(&instance_bvh, renderer, scene.num_instances, scene.instances);
+    build_instance_bvh(&batched_instance_bvh, renderer, scene.num_batched_instances, scene.batched_instances);
+
+    // F3 switches between the batched and unbatched scene, to compare their draw counts and frame times.
+    bool draw_batched = true;
+
+    u32 picked_instance = BVH_NONE;
+    XMFLOAT3 picked_albedo_factor = {};
 
     Arena frame_arena = arena.sub_arena(1024 * 1024 * 10);
 
@@ -245,23 +596,48 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
     XMVECTOR camera_position = {-3.0f, 2.0f, 5.0f};
     XMVECTOR camera_velocity = {};
 
-    f32 last_time = pf_time();
+    // Frame timing is kept in ticks; converting to f32 seconds only for the delta avoids losing precision over long sessions.
+    u64 ticks_per_second = pf_ticks_per_second();
+    u64 start_ticks = pf_ticks();
+    u64 last_ticks = start_ticks;
 
-    f32 accumulator = 0.0f;
+    u64 accumulator = 0;
     int faccumulator = 0;
 
     while (true) {
-        f32 now = pf_time();
-        f32 delta_time = now - last_time;
-        last_time = now;
+        PROFILE_ZONE("frame");
+
+        u64 now_ticks = pf_ticks();
+        u64 delta_ticks = now_ticks - last_ticks;
+        last_ticks = now_ticks;
+
+        f32 delta_time = (f32)((f64)delta_ticks/(f64)ticks_per_second);
+        f32 now = (f32)((f64)(now_ticks - start_ticks)/(f64)ticks_per_second);
 
-        accumulator += delta_time;
+        PROFILE_PLOT("frame_ms", delta_time * 1000.0f);
+
+        accumulator += delta_ticks;
         faccumulator++;
 
-        if (accumulator > 2.0f) {
-            f32 dt = accumulator/(f32)faccumulator;
-            pf_debug_log("FPS: %f\n", 1.0f/dt);
-            accumulator = 0.0f;
+        if (accumulator > 2 * ticks_per_second) {
+            f64 dt = (f64)accumulator/(f64)ticks_per_second/(f64)faccumulator;
+            pf_debug_log("FPS: %f\n", 1.0/dt);
+
+            RDFrameStats frame_stats;
+            rd_get_frame_stats(renderer, &frame_stats);
+
+            for (u32 i = 0; i < frame_stats.num_passes; ++i) {
+                RDPassStats* pass = &frame_stats.passes[i];
+                pf_debug_log("  %-10s cpu %.3fms (p95 %.3fms)  gpu %.3fms (p95 %.3fms)  %u draws, %u dispatches, %u barriers\n",
+                    pass->name, pass->cpu_ms.average, pass->cpu_ms.p95, pass->gpu_ms.average, pass->gpu_ms.p95,
+                    pass->counters.draws, pass->counters.dispatches, pass->counters.barriers);
+            }
+
+            pf_debug_log("  streamed textures %.2f MB, %u loads and %u evictions so far\n",
+                (f64)frame_stats.streamed_texture_bytes / (1024.0 * 1024.0), frame_stats.streamed_texture_loads, frame_stats.streamed_texture_evictions);
+            pf_debug_log("  uploads %.2f MB queued, %.2f MB in staging\n",
+                (f64)frame_stats.queued_upload_bytes / (1024.0 * 1024.0), (f64)frame_stats.staging_upload_bytes / (1024.0 * 1024.0));
+            accumulator = 0;
             faccumulator = 0;
         }
 
@@ -278,6 +654,12 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
             break;
         }
 
+        if (input.keys_pressed[VK_F2]) {
+            if (profiler_export_chrome_trace("profile.json")) {
+                pf_debug_log("Wrote profile.json\n");
+            }
+        }
+
         if (input.keys_pressed[VK_RBUTTON]) {
             ShowCursor(false);
 
@@ -293,6 +675,24 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
             ClipCursor(0);
         }
 
+        u32 num_instances = draw_batched ? scene.num_batched_instances : scene.num_instances;
+        RDMeshInstance* instances = draw_batched ? scene.batched_instances : scene.instances;
+        BVH* bvh = draw_batched ? &batched_instance_bvh : &instance_bvh;
+
+        if (input.keys_pressed[VK_F3]) {
+            if (picked_instance != BVH_NONE) {
+                instances[picked_instance].material.albedo_factor = picked_albedo_factor;
+                picked_instance = BVH_NONE;
+            }
+
+            draw_batched = !draw_batched;
+            pf_debug_log("Drawing %s instances\n", draw_batched ? "batched" : "unbatched");
+
+            num_instances = draw_batched ? scene.num_batched_instances : scene.num_instances;
+            instances = draw_batched ? scene.batched_instances : scene.instances;
+            bvh = draw_batched ? &batched_instance_bvh : &instance_bvh;
+        }
+
         bool camera_controlled = key_down(VK_RBUTTON);
 
         if (camera_controlled) {
@@ -358,6 +758,42 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
         camera.transform = camera_rotation * camera_translation;
         camera.vertical_fov = PI32 * 0.5f;
 
+        if (input.keys_pressed[VK_LBUTTON] && !camera_controlled) {
+            POINT cursor;
+            GetCursorPos(&cursor);
+            ScreenToClient(window, &cursor);
+
+            RECT client_rect;
+            GetClientRect(window, &client_rect);
+            f32 width = (f32)max(client_rect.right - client_rect.left, 1L);
+            f32 height = (f32)max(client_rect.bottom - client_rect.top, 1L);
+
+            f32 ndc_x = ((f32)cursor.x + 0.5f) / width * 2.0f - 1.0f;
+            f32 ndc_y = 1.0f - ((f32)cursor.y + 0.5f) / height * 2.0f;
+            f32 tan_half_fov = tanf(camera.vertical_fov * 0.5f);
+
+            XMVECTOR view_direction = XMVectorSet(ndc_x * tan_half_fov * width / height, ndc_y * tan_half_fov, -1.0f, 0.0f);
+            XMVECTOR direction = XMVector3Normalize(XMVector3TransformNormal(view_direction, camera.transform));
+
+            if (picked_instance != BVH_NONE) {
+                instances[picked_instance].material.albedo_factor = picked_albedo_factor;
+                picked_instance = BVH_NONE;
+            }
+
+            u32 hit_instance;
+            f32 hit_t;
+
+            if (bvh->raycast(camera_position, direction, 1000.0f, &hit_instance, &hit_t)) {
+                RDMaterial* material = &instances[hit_instance].material;
+
+                picked_instance = hit_instance;
+                picked_albedo_factor = material->albedo_factor;
+                material->albedo_factor = { 1.0f, 0.2f, 0.2f };
+
+                pf_debug_log("Picked instance %u at distance %.2f\n", hit_instance, hit_t);
+            }
+        }
+
         RDPointLight point_lights[] = {
             {{cosf(now), 0.4f, sinf(now) + 5.0f}, {0.1f, 0.1f, 1.0f}},
             {{cosf(now + PI32), 0.4f, sinf(now + PI32) + 5.0f}, {1.0f, 0.1f, 0.1f}}
@@ -374,9 +810,9 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
         render_info.point_lights = point_lights;
         render_info.directional_lights = directional_lights;
 
-        if (rd_upload_status_finished(renderer, upload_status)) {
-            render_info.num_instances = gltf_result.num_instances;
-            render_info.instances = gltf_result.instances;
+        if (*scene.pending_uploads == 0) {
+            render_info.num_instances = num_instances;
+            render_info.instances = instances;
         }
 
         rd_render(renderer, &render_info);
@@ -384,15 +820,19 @@ int CALLBACK WinMain(HINSTANCE h_instance, HINSTANCE, LPSTR, int) {
 
     #if _DEBUG 
     {
-        for (u32 i = 0; i < gltf_result.num_textures; ++i) {
-            rd_free_texture(renderer, gltf_result.textures[i]);
+        for (u32 i = 0; i < scene.num_textures; ++i) {
+            rd_free_texture(renderer, scene.textures[i]);
         }
 
-        for (u32 i = 0; i < gltf_result.num_meshes; ++i) {
-            rd_free_mesh(renderer, gltf_result.meshes[i]);
+        for (u32 i = 0; i < scene.num_meshes; ++i) {
+            rd_free_mesh(renderer, scene.meshes[i]);
         }
 
+        instance_bvh.free();
+        batched_instance_bvh.free();
         rd_free(renderer);
+
+        pf_unmap_file(cooked);
     }
     #endif
 